@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libftdi1/ftdi.h>
+
+#include "../lib/ftdi_interface.h"
+#include "../lib/ftdi_spi.h"
+#include "../lib/flash_spi.h"
+
+#include "ftdi_sim.h"
+
+/**
+   @defgroup BENCH_GRP Benchmark defaults
+   @{
+*/
+#define BENCH_MIN_CHUNK      1                 /**< smallest transfer size */
+#define BENCH_MAX_CHUNK      MAX_SPI_BUF_LENGTH   /**< largest transfer size */
+#define BENCH_BYTES          (4 * 1024 * 1024) /**< bytes moved for every point, limited by BENCH_MIN_ITERATIONS and BENCH_MAX_ITERATIONS */
+#define BENCH_MIN_ITERATIONS 16                /**< minimum number of transactions per point */
+#define BENCH_MAX_ITERATIONS 2000              /**< maximum number of transactions per point */
+#define BENCH_SPI_MODES      4                 /**< SPI modes 0 to 3 (CPOL, CPHA) */
+#define BENCH_RING_LENGTH    (2 * BENCH_MAX_CHUNK)   /**< ring buffer of spi_read_stream, also holds spi_transfer tx and rx */
+#define BENCH_MAPPED_FILE    "bench_mapped.bin"  /**< file written by spi_read_to_mapped_file, removed at exit */
+#define BENCH_PAGE_SIZE      256               /**< page size of the flash memory emulated by the slave */
+#define BENCH_PAGE_TIME      0.7e-3            /**< page program time of the flash memory emulated by the slave, in seconds */
+#define BENCH_POLL_TIMEOUT   1.0               /**< spi_poll_status timeout, in seconds */
+/**@} */
+   
+/**
+   Operations measured by the benchmark.
+*/
+enum bench_op
+{
+   BENCH_WRITE,           /**< spi_write */
+   BENCH_READ,            /**< spi_read */
+   BENCH_READ_TO_FILE,    /**< spi_read_to_file, data is discarded by the file system */
+   BENCH_QUEUED,          /**< spi_read through the deferred command queue (spi_queue_begin, spi_queue_end) */
+   BENCH_TRANSFER,        /**< spi_transfer */
+   BENCH_READ_STREAM,     /**< spi_read_stream, data is discarded by the callback */
+   BENCH_READ_MAPPED,     /**< spi_read_to_mapped_file */
+   BENCH_POLL,            /**< spi_poll_status, chunk is the number of status bytes read while busy */
+   BENCH_PROGRAM,         /**< flash_program_pages (pipelined page program), chunk is the number of bytes programmed */
+   BENCH_OPS
+};
+
+/**
+   Results of one benchmark point (operation, SPI mode and chunk size).
+*/
+struct bench_result
+{
+   int iterations;            /**< number of SPI transactions (CS# low to CS# high) */
+   double elapsed;            /**< simulated time, in seconds */
+   double bytes_per_s;        /**< payload throughput */
+   double transactions_per_s; /**< SPI transactions per second */
+   double usb_per_op;         /**< USB bulk transactions per SPI transaction */
+   double p50, p90, p99, max; /**< per-transaction latency percentiles, in seconds */
+   double cpu_per_op;         /**< host time spent in the library per SPI transaction, in seconds */
+};
+
+/**
+   SPI slave used by the benchmark: ignores MOSI and shifts out an incrementing byte. It also answers
+   RDSR and PP as a flash memory would, for spi_poll_status and flash_program_pages.
+*/
+struct bench_slave
+{
+   byte counter;                 /**< next MISO byte */
+   long selects;                 /**< number of CS# assertions */
+   
+   struct ftdi_sim_slave *sim;   /**< simulator side of the slave, tells the time of every exchange */
+   int position;                 /**< bytes exchanged since CS# went low */
+   byte command;                 /**< first byte received since CS# went low */
+   int busy;                     /**< status bytes still to be read as busy (BENCH_POLL) */
+   double busy_until;            /**< end of the page program in progress (BENCH_PROGRAM) */
+};
+
+
+unsigned char bench_exchange (void *user, unsigned char mosi);
+void bench_select (void *user, int selected);
+
+int bench_run (struct ftdi_context *ftdi, struct spi_context *spi, struct bench_slave *slave, struct flash_info *info, FILE *sink,
+               enum bench_op op, int chunk, int iterations, byte *buffer, double *samples, struct bench_result *result);
+int bench_transaction (struct ftdi_context *ftdi, struct spi_context *spi, struct bench_slave *slave, struct flash_info *info,
+                       FILE *sink, enum bench_op op, int chunk, byte *buffer);
+int bench_discard (byte *data, int size, void *user);
+int bench_compare (const void *a, const void *b);
+double bench_percentile (double *sorted, int count, double percentile);
+int bench_iterations (int chunk);
+void bench_print_header (void);
+void bench_print_result (enum bench_op op, int mode, int chunk, struct bench_result *result);
+
+
+int main (int argc, char *argv[])
+{
+   struct ftdi_sim_timing timing = { SIM_USB_LATENCY, SIM_USB_RATE, SIM_USB_PACKET_SIZE, SIM_USB_JITTER };
+   struct ftdi_sim_slave slave;
+   struct bench_slave bench_slave;
+   struct ftdi_context *ftdi;
+   struct spi_context *spi;
+   struct bench_result result;
+   struct flash_info info;
+   
+   FILE *sink;
+   byte *buffer;
+   double *samples;
+   
+   int opt, op, mode, chunk, failures = 0;
+   int max_chunk = BENCH_MAX_CHUNK;
+   int mode_first = 0, mode_last = BENCH_SPI_MODES - 1;
+   word divisor = 0;
+   
+   while ((opt = getopt (argc, argv, "l:j:r:d:c:m:")) != -1)
+   {
+      switch (opt)
+      {
+         case 'l':
+            timing.usb_latency = atof (optarg) * 1e-6;
+            break;
+         case 'j':
+            timing.usb_jitter = atof (optarg) * 1e-6;
+            break;
+         case 'r':
+            timing.usb_rate = atof (optarg) * 1e6;
+            break;
+         case 'd':
+            divisor = (word)strtol (optarg, NULL, 0);
+            break;
+         case 'c':
+            max_chunk = atoi (optarg);
+            break;
+         case 'm':
+            mode_first = mode_last = atoi (optarg) & 3;
+            break;
+         default:
+            fprintf (stderr, "    Usage: bench_spi [-l usb_latency_us] [-j usb_jitter_us] [-r usb_rate_MBps] [-d clock_divisor] [-c max_chunk] [-m spi_mode]\n");
+            return EXIT_FAILURE;
+      }
+   }
+   
+   if (max_chunk < BENCH_MIN_CHUNK || max_chunk > BENCH_MAX_CHUNK)
+   {
+      fprintf (stderr, "ERROR: Chunk size must be between %d and %d bytes\n", BENCH_MIN_CHUNK, BENCH_MAX_CHUNK);
+      return EXIT_FAILURE;
+   }
+   
+   /* simulated FT2232H with the benchmark slave on channel A */
+   ftdi_sim_set_timing (&timing);
+   slave.exchange = bench_exchange;
+   slave.select = bench_select;
+   slave.wait = NULL;
+   slave.user = &bench_slave;
+   memset (&bench_slave, 0, sizeof (struct bench_slave));
+   bench_slave.sim = &slave;
+   ftdi_sim_attach (ftdi_sim_add_device ("FTBENCH", 1, 2, "1"), 0, &slave);
+   
+   ftdi = ftdi_open ();
+   
+   if ((spi = spi_init (ftdi, 0, 0, divisor, 0, 0, 0, 0, 0)) == NULL)
+   {
+      ftdi_close (ftdi);
+      return EXIT_FAILURE;
+   }
+   
+   /* flash memory emulated by the slave, 3-byte addresses */
+   memset (&info, 0, sizeof (struct flash_info));
+   info.page_size = BENCH_PAGE_SIZE;
+   info.address_bytes = 3;
+   info.program_opcode = PP;
+   info.page_time = BENCH_PAGE_TIME;
+   
+   buffer = (byte *)malloc (BENCH_RING_LENGTH);
+   samples = (double *)malloc (BENCH_MAX_ITERATIONS * sizeof (double));
+   sink = fopen ("/dev/null", "wb");
+   if (buffer == NULL || samples == NULL || sink == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate benchmark buffers!\n");
+      return EXIT_FAILURE;
+   }
+   memset (buffer, 0xA5, BENCH_RING_LENGTH);
+   
+   printf ("INFO: USB latency %.1f us (+%.1f us mean jitter), USB rate %.1f MB/s, SCLK %.3f MHz\n",
+           timing.usb_latency * 1e6, timing.usb_jitter * 1e6, timing.usb_rate / 1e6, spi_frequency (spi) / 1e6);
+   bench_print_header ();
+   
+   for (mode = mode_first; mode <= mode_last; mode++)
+   {
+      /* only CPOL and CPHA change between modes, the rest of the configuration is kept */
+      if (spi_reconfigure (ftdi, spi, mode >> 1, mode & 1, divisor, 0, 0, 0, 0, 0) < 0)
+      {
+         fprintf (stderr, "ERROR: Unable to select SPI mode %d\n", mode);
+         failures++;
+         continue;
+      }
+   
+      for (op = 0; op < BENCH_OPS; op++)
+      {
+         for (chunk = BENCH_MIN_CHUNK; chunk <= max_chunk; chunk *= 4)
+         {
+            if (bench_run (ftdi, spi, &bench_slave, &info, sink, op, chunk, bench_iterations (chunk), buffer, samples, &result) < 0)
+            {
+               fprintf (stderr, "ERROR: %s\n", ftdi_get_error_string (ftdi));
+               failures++;
+               spi_recover (ftdi, spi);
+               continue;
+            }
+            bench_print_result (op, mode, chunk, &result);
+         }
+      }
+   }
+   
+   fclose (sink);
+   remove (BENCH_MAPPED_FILE);
+   free (samples);
+   free (buffer);
+   spi_free (spi);
+   ftdi_close (ftdi);
+   
+   return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/**
+   Auxiliary function used by the simulator: shifts one byte of the benchmark slave.
+   
+   @param user pointer to struct bench_slave
+   @param mosi byte received from master (ignored)
+   
+   @return byte shifted out on MISO
+*/
+unsigned char bench_exchange (void *user, unsigned char mosi)
+{
+   struct bench_slave *slave = (struct bench_slave *)user;
+   
+   if (slave->position++ == 0)
+      slave->command = mosi;
+   else if (slave->command == RDSR)
+   {
+      if (slave->busy > 0)
+      {
+         slave->busy--;
+         return WIP;
+      }
+      return (slave->sim->now < slave->busy_until) ? WIP : 0x00;
+   }
+   
+   return slave->counter++;
+}
+
+/**
+   Auxiliary function used by the simulator: counts CS# assertions of the benchmark slave.
+   
+   @param user pointer to struct bench_slave
+   @param selected 1 if CS# went low, 0 if it went high
+*/
+void bench_select (void *user, int selected)
+{
+   struct bench_slave *slave = (struct bench_slave *)user;
+   
+   if (selected)
+      slave->selects++;
+   /* page program starts when CS# goes high after instruction, address and data */
+   else if (slave->command == PP && slave->position > 4)
+      slave->busy_until = slave->sim->now + BENCH_PAGE_TIME;
+   
+   slave->position = 0;
+}
+
+/**
+   Runs one benchmark point: iterations SPI transactions of chunk bytes each, see bench_transaction.
+   <br>Latency and throughput are measured on the simulated USB timeline, so results only depend on
+   the library and on the timing model. Throughput includes the time the MPSSE engine needs to clock 
+   out what it has accepted, latency only what the host waits for. Host CPU time is reported separately.
+   
+   @param ftdi pointer to ftdi_context
+   @param spi pointer to spi_context
+   @param slave benchmark slave
+   @param info flash memory emulated by the slave
+   @param sink file used by spi_read_to_file
+   @param op operation to be measured
+   @param chunk transfer size, in bytes
+   @param iterations number of SPI transactions
+   @param buffer data buffer, at least chunk bytes long
+   @param samples latency samples, at least iterations long
+   @param result results of the benchmark point
+   
+   @retval 1 on success
+   @retval <0 if a transaction failed
+*/
+int bench_run (struct ftdi_context *ftdi, struct spi_context *spi, struct bench_slave *slave, struct flash_info *info, FILE *sink,
+               enum bench_op op, int chunk, int iterations, byte *buffer, double *samples, struct bench_result *result)
+{
+   double start, t, cpu;
+   long usb;
+   int i, ret;
+   
+   /* untimed transaction, so that the first one of this point is not charged for setup left by the previous point */
+   if ((ret = bench_transaction (ftdi, spi, slave, info, sink, op, chunk, buffer)) < 0)
+      return ret;
+   
+   ftdi_sim_drain (ftdi);
+   usb = ftdi_sim_transactions (ftdi);
+   start = ftdi_sim_time (ftdi);
+   cpu = ftdi_monotonic_time ();
+   
+   for (i = 0; i < iterations; i++)
+   {
+      t = ftdi_sim_time (ftdi);
+   
+      if ((ret = bench_transaction (ftdi, spi, slave, info, sink, op, chunk, buffer)) < 0)
+         return ret;
+   
+      samples[i] = ftdi_sim_time (ftdi) - t;
+   }
+   
+   result->cpu_per_op = (ftdi_monotonic_time () - cpu) / iterations;
+   ftdi_sim_drain (ftdi);
+   result->iterations = iterations;
+   result->elapsed = ftdi_sim_time (ftdi) - start;
+   result->bytes_per_s = (double)chunk * iterations / result->elapsed;
+   result->transactions_per_s = iterations / result->elapsed;
+   result->usb_per_op = (double)(ftdi_sim_transactions (ftdi) - usb) / iterations;
+   
+   qsort (samples, iterations, sizeof (double), bench_compare);
+   result->p50 = bench_percentile (samples, iterations, 50);
+   result->p90 = bench_percentile (samples, iterations, 90);
+   result->p99 = bench_percentile (samples, iterations, 99);
+   result->max = samples[iterations - 1];
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by bench_run: runs a single SPI transaction. Operations which do not handle
+   CS# themselves (spi_poll_status, flash_program_pages, the queued transaction) are framed by spi_open
+   and spi_close.
+   
+   @param ftdi pointer to ftdi_context
+   @param spi pointer to spi_context
+   @param slave benchmark slave
+   @param info flash memory emulated by the slave
+   @param sink file used by spi_read_to_file
+   @param op operation to be measured
+   @param chunk transfer size, in bytes
+   @param buffer data buffer, at least BENCH_RING_LENGTH bytes long
+   
+   @retval 1 on success
+   @retval <0 on error
+*/
+int bench_transaction (struct ftdi_context *ftdi, struct spi_context *spi, struct bench_slave *slave, struct flash_info *info,
+                       FILE *sink, enum bench_op op, int chunk, byte *buffer)
+{
+   struct flash_program_report report;
+   int ret;
+   
+   switch (op)
+   {
+      case BENCH_QUEUED:
+         spi_queue_begin (spi);
+         spi_open (ftdi, spi);
+         spi_read (ftdi, spi, buffer, chunk);
+         spi_close (ftdi, spi);
+         return spi_queue_end (ftdi, spi);
+      case BENCH_POLL:
+         slave->busy = chunk;
+         return spi_poll_status (ftdi, spi, RDSR, WIP, 0, BENCH_POLL_TIMEOUT, NULL);
+      case BENCH_PROGRAM:
+         memset (&report, 0, sizeof (struct flash_program_report));
+         return flash_program_pages (ftdi, spi, info, 0, buffer, NULL, chunk, &report);
+      default:
+         break;
+   }
+   
+   if ((ret = spi_open (ftdi, spi)) < 0)
+      return ret;
+   
+   switch (op)
+   {
+      case BENCH_WRITE:
+         ret = spi_write (ftdi, spi, buffer, chunk);
+         break;
+      case BENCH_READ:
+         ret = spi_read (ftdi, spi, buffer, chunk);
+         break;
+      case BENCH_TRANSFER:
+         ret = spi_transfer (ftdi, spi, buffer, buffer + BENCH_MAX_CHUNK, chunk);
+         break;
+      case BENCH_READ_STREAM:
+         ret = spi_read_stream (ftdi, spi, buffer, BENCH_RING_LENGTH, chunk, bench_discard, NULL);
+         break;
+      case BENCH_READ_MAPPED:
+         ret = spi_read_to_mapped_file (ftdi, spi, BENCH_MAPPED_FILE, chunk);
+         break;
+      default:
+         ret = spi_read_to_file (ftdi, spi, sink, chunk);
+         break;
+   }
+   if (ret < 0)
+      return ret;
+   
+   return spi_close (ftdi, spi);
+}
+
+/**
+   Auxiliary function used by bench_transaction: spi_read_stream callback which drops data.
+   
+   @retval 0 to continue streaming
+*/
+int bench_discard (byte *data, int size, void *user)
+{
+   (void)data;
+   (void)size;
+   (void)user;
+   
+   return 0;
+}
+
+/**
+   Auxiliary function used by bench_run to sort latency samples.
+*/
+int bench_compare (const void *a, const void *b)
+{
+   double x = *(const double *)a, y = *(const double *)b;
+   
+   return (x > y) - (x < y);
+}
+
+/**
+   Nearest-rank percentile of sorted samples.
+   
+   @param sorted samples in ascending order
+   @param count number of samples
+   @param percentile percentile (0 to 100)
+   
+   @return selected sample
+*/
+double bench_percentile (double *sorted, int count, double percentile)
+{
+   int rank = (int)(percentile / 100.0 * count + 0.999999);
+   
+   if (rank < 1)
+      rank = 1;
+   if (rank > count)
+      rank = count;
+   
+   return sorted[rank - 1];
+}
+
+/**
+   Number of transactions measured for a chunk size: enough to move BENCH_BYTES, bounded so that
+   small chunks do not take forever and large chunks still give meaningful percentiles.
+   
+   @param chunk transfer size, in bytes
+   
+   @return number of iterations
+*/
+int bench_iterations (int chunk)
+{
+   int iterations = BENCH_BYTES / chunk;
+   
+   if (iterations < BENCH_MIN_ITERATIONS)
+      iterations = BENCH_MIN_ITERATIONS;
+   if (iterations > BENCH_MAX_ITERATIONS)
+      iterations = BENCH_MAX_ITERATIONS;
+   
+   return iterations;
+}
+
+/**
+   Prints the column titles of the results table.
+*/
+void bench_print_header (void)
+{
+   printf ("%-13s %4s %6s %6s %10s %10s %7s %9s %9s %9s %9s %9s\n",
+           "op", "mode", "chunk", "iters", "MB/s", "trans/s", "usb/op", "p50(us)", "p90(us)", "p99(us)", "max(us)", "cpu(us)");
+}
+
+/**
+   Prints a row of the results table.
+   
+   @param op measured operation
+   @param mode SPI mode
+   @param chunk transfer size, in bytes
+   @param result results of the benchmark point
+*/
+void bench_print_result (enum bench_op op, int mode, int chunk, struct bench_result *result)
+{
+   static const char *names[BENCH_OPS] = { "spi_write", "spi_read", "spi_read_file", "spi_queue", "spi_transfer",
+                                           "spi_stream", "spi_mapped", "spi_poll", "flash_program" };
+   
+   printf ("%-13s %4d %6d %6d %10.3f %10.0f %7.2f %9.1f %9.1f %9.1f %9.1f %9.2f\n",
+           names[op], mode, chunk, result->iterations, result->bytes_per_s / 1e6, result->transactions_per_s, result->usb_per_op,
+           result->p50 * 1e6, result->p90 * 1e6, result->p99 * 1e6, result->max * 1e6, result->cpu_per_op * 1e6);
+}
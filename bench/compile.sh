@@ -0,0 +1,11 @@
+#!/bin/sh
+# Builds the SPI benchmark against the libftdi1 stand-in in bench/libftdi1,
+# so neither libftdi1 nor FTDI hardware are needed (e.g. on CI machines).
+cd "$(dirname "$0")/.."
+
+gccargs="-O2 -Wall -Wextra -Ibench bench/ftdi_sim.c lib/*.c -lpthread -lm"
+
+echo "Compiling bench_spi.c"
+echo "Arguments: $gccargs"
+
+gcc -o bench/bench_spi bench/bench_spi.c $gccargs
@@ -0,0 +1,1163 @@
+/*
+   Software stand-in for libftdi1 modelling an FT2232H in MPSSE mode.
+
+   Every USB transaction advances a virtual clock by a configurable latency (plus a random
+   delay drawn from a fixed seed, so that runs repeat exactly) and the payload time, and every byte clocked by the MPSSE engine advances the device timeline
+   by 8 SCLK periods, so the library hot paths can be benchmarked without hardware.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <libftdi1/ftdi.h>
+
+#include "ftdi_sim.h"
+
+struct sim_segment
+{
+   unsigned char *data;
+   int size;
+   int offset;
+   double ready;                    /* device time at which the last byte is available */
+   struct sim_segment *next;
+};
+
+struct sim_channel
+{
+   int mpsse;
+   int stalled;
+   
+   unsigned char cmd[SIM_CMD_LENGTH];
+   int cmd_length;
+   
+   unsigned char low_level, low_io;
+   unsigned char high_level, high_io;
+   int divisor, div5, three_phase, loopback;
+   
+   struct sim_segment *out_head, *out_tail;
+   int out_count;
+   
+   double device_time;
+   
+   struct ftdi_sim_slave *slave;
+   int selected;
+};
+
+struct ftdi_sim_device
+{
+   char serial[64];
+   int bus, address;
+   unsigned char ports[7];
+   int port_count;
+   struct sim_channel channel[2];
+};
+
+struct sim_transfer
+{
+   int is_read;
+   double complete;
+};
+
+static struct ftdi_sim_device sim_devices[SIM_MAX_DEVICES];
+static int sim_device_count = 0;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ftdi_sim_timing sim_timing = { SIM_USB_LATENCY, SIM_USB_RATE, SIM_USB_PACKET_SIZE, SIM_USB_JITTER };
+static unsigned int sim_seed = 1;
+
+/* per-context bookkeeping kept in a side table (real ftdi_context has no spare fields) */
+struct sim_host
+{
+   struct ftdi_context *ftdi;
+   double host_time;
+   double pipe_time;
+   long transactions;
+};
+
+static struct sim_host sim_hosts[SIM_MAX_HOSTS];
+
+static struct sim_host *sim_host (struct ftdi_context *ftdi)
+{
+   int i, free_slot = -1;
+   
+   pthread_mutex_lock (&sim_lock);
+   for (i = 0; i < SIM_MAX_HOSTS; i++)
+   {
+      if (sim_hosts[i].ftdi == ftdi)
+      {
+         pthread_mutex_unlock (&sim_lock);
+         return &sim_hosts[i];
+      }
+      if (sim_hosts[i].ftdi == NULL && free_slot < 0)
+         free_slot = i;
+   }
+   memset (&sim_hosts[free_slot], 0, sizeof (struct sim_host));
+   sim_hosts[free_slot].ftdi = ftdi;
+   pthread_mutex_unlock (&sim_lock);
+   
+   return &sim_hosts[free_slot];
+}
+
+static struct sim_channel *sim_channel (struct ftdi_context *ftdi)
+{
+   if (ftdi->sim == NULL)
+      return NULL;
+   
+   return &ftdi->sim->channel[ftdi->interface == INTERFACE_B ? 1 : 0];
+}
+
+/* ---------------------------------------------------------------------------------------- */
+/* device model                                                                             */
+/* ---------------------------------------------------------------------------------------- */
+
+static double sim_sclk (struct sim_channel *ch)
+{
+   double f = (ch->div5 ? 12e6 : 60e6) / ((1.0 + ch->divisor) * 2);
+   
+   if (ch->three_phase)
+      f = f * 2.0 / 3.0;
+   
+   return f;
+}
+
+static void sim_out_push (struct sim_channel *ch, unsigned char *data, int size)
+{
+   struct sim_segment *seg;
+   
+   if (size <= 0)
+      return;
+   
+   seg = malloc (sizeof (struct sim_segment));
+   seg->data = malloc (size);
+   memcpy (seg->data, data, size);
+   seg->size = size;
+   seg->offset = 0;
+   seg->ready = ch->device_time;
+   seg->next = NULL;
+   
+   if (ch->out_tail)
+      ch->out_tail->next = seg;
+   else
+      ch->out_head = seg;
+   ch->out_tail = seg;
+   ch->out_count += size;
+}
+
+/* pops at most size bytes that are ready at time now */
+static int sim_out_pop (struct sim_channel *ch, unsigned char *data, int size, double now)
+{
+   int n = 0, len;
+   struct sim_segment *seg;
+   
+   while (n < size && (seg = ch->out_head) != NULL && seg->ready <= now)
+   {
+      len = seg->size - seg->offset;
+      if (len > size - n)
+         len = size - n;
+   
+      if (data)
+         memcpy (data + n, seg->data + seg->offset, len);
+      seg->offset += len;
+      n += len;
+   
+      if (seg->offset == seg->size)
+      {
+         ch->out_head = seg->next;
+         if (ch->out_head == NULL)
+            ch->out_tail = NULL;
+         free (seg->data);
+         free (seg);
+      }
+   }
+   ch->out_count -= n;
+   
+   return n;
+}
+
+/* time at which the n-th pending output byte becomes available (<0 if not produced yet) */
+static double sim_out_ready (struct sim_channel *ch, int n)
+{
+   struct sim_segment *seg;
+   
+   for (seg = ch->out_head; seg != NULL; seg = seg->next)
+   {
+      n -= seg->size - seg->offset;
+      if (n <= 0)
+         return seg->ready;
+   }
+   
+   return -1;
+}
+
+static void sim_out_clear (struct sim_channel *ch)
+{
+   sim_out_pop (ch, NULL, ch->out_count, 1e300);
+}
+
+static void sim_update_select (struct sim_channel *ch)
+{
+   int selected = !(ch->low_level & 0x08);
+   
+   if (selected != ch->selected)
+   {
+      ch->selected = selected;
+      if (ch->slave && ch->slave->select)
+      {
+         ch->slave->now = ch->device_time;
+         ch->slave->select (ch->slave->user, selected);
+      }
+   }
+}
+
+static unsigned char sim_exchange (struct sim_channel *ch, unsigned char mosi)
+{
+   unsigned char miso = 0xFF;
+   
+   if (ch->selected && ch->slave && ch->slave->exchange)
+   {
+      ch->slave->now = ch->device_time;
+      miso = ch->slave->exchange (ch->slave->user, mosi);
+   }
+   
+   if (ch->loopback)
+      miso = mosi;
+   
+   return miso;
+}
+
+/* returns the length of the command starting at cmd[0], or 0 if more bytes are needed */
+static int sim_command_length (unsigned char *cmd, int avail)
+{
+   unsigned char op = cmd[0];
+   int length;
+   
+   if (op < 0x80)
+   {
+      /* shifting command */
+      if (op & MPSSE_BITMODE)
+         length = (op & MPSSE_DO_WRITE) ? 3 : 2;
+      else
+      {
+         if (avail < 3)
+            return 0;
+         length = 3 + ((op & MPSSE_DO_WRITE) ? (cmd[1] | cmd[2] << 8) + 1 : 0);
+      }
+      return avail >= length ? length : 0;
+   }
+   
+   switch (op)
+   {
+      case SET_BITS_LOW:
+      case SET_BITS_HIGH:
+      case TCK_DIVISOR:
+      case CLK_BYTES:
+      case CLK_BYTES_OR_HIGH:
+      case CLK_BYTES_OR_LOW:
+         length = 3;
+         break;
+      case CLK_BITS:
+         length = 2;
+         break;
+      default:
+         length = 1;
+         break;
+   }
+   
+   return avail >= length ? length : 0;
+}
+
+/* executes a complete command, returns 0 if the engine stalls on it */
+static int sim_execute (struct sim_channel *ch, unsigned char *cmd, int length)
+{
+   unsigned char op = cmd[0];
+   unsigned char *reply;
+   double bit_time = 1.0 / sim_sclk (ch), wait;
+   int i, count;
+   
+   (void)length;
+   
+   if (op < 0x80)
+   {
+      if (op & MPSSE_BITMODE)
+      {
+         /* bit-mode shifting: treated as a single byte exchange */
+         unsigned char miso = sim_exchange (ch, (op & MPSSE_DO_WRITE) ? cmd[2] : 0xFF);
+         ch->device_time += (cmd[1] + 1) * bit_time;
+         if (op & MPSSE_DO_READ)
+            sim_out_push (ch, &miso, 1);
+         return 1;
+      }
+   
+      count = (cmd[1] | cmd[2] << 8) + 1;
+      reply = (op & MPSSE_DO_READ) ? malloc (count) : NULL;
+   
+      for (i = 0; i < count; i++)
+      {
+         unsigned char mosi = (op & MPSSE_DO_WRITE) ? cmd[3 + i] : ((ch->low_level & 0x02) ? 0xFF : 0x00);
+         unsigned char miso = sim_exchange (ch, mosi);
+   
+         if (reply)
+            reply[i] = miso;
+   
+         /* slave sees time pass byte by byte */
+         ch->device_time += 8 * bit_time;
+      }
+   
+      if (reply)
+      {
+         sim_out_push (ch, reply, count);
+         free (reply);
+      }
+      return 1;
+   }
+   
+   switch (op)
+   {
+      case SET_BITS_LOW:
+         ch->low_level = cmd[1];
+         ch->low_io = cmd[2];
+         ch->device_time += 1e-7;
+         sim_update_select (ch);
+         break;
+      case SET_BITS_HIGH:
+         ch->high_level = cmd[1];
+         ch->high_io = cmd[2];
+         ch->device_time += 1e-7;
+         break;
+      case GET_BITS_LOW:
+         sim_out_push (ch, &ch->low_level, 1);
+         break;
+      case GET_BITS_HIGH:
+         sim_out_push (ch, &ch->high_level, 1);
+         break;
+      case LOOPBACK_START:
+         ch->loopback = 1;
+         break;
+      case LOOPBACK_END:
+         ch->loopback = 0;
+         break;
+      case TCK_DIVISOR:
+         ch->divisor = cmd[1] | cmd[2] << 8;
+         break;
+      case DIS_DIV_5:
+         ch->div5 = 0;
+         break;
+      case EN_DIV_5:
+         ch->div5 = 1;
+         break;
+      case EN_3_PHASE:
+         ch->three_phase = 1;
+         break;
+      case DIS_3_PHASE:
+         ch->three_phase = 0;
+         break;
+      case EN_ADAPTIVE:
+      case DIS_ADAPTIVE:
+      case SEND_IMMEDIATE:
+         break;
+      case CLK_BITS:
+         ch->device_time += (cmd[1] + 1) * bit_time;
+         break;
+      case CLK_BYTES:
+         count = (cmd[1] | cmd[2] << 8) + 1;
+         for (i = 0; i < count; i++)
+            sim_exchange (ch, (ch->low_level & 0x02) ? 0xFF : 0x00);
+         ch->device_time += count * 8 * bit_time;
+         break;
+      case WAIT_ON_HIGH:
+      case WAIT_ON_LOW:
+      case CLK_WAIT_HIGH:
+      case CLK_WAIT_LOW:
+         wait = 0;
+         if (ch->slave && ch->slave->wait)
+            wait = ch->slave->wait (ch->slave->user, ch->device_time, (op == WAIT_ON_HIGH || op == CLK_WAIT_HIGH));
+         if (wait < 0)
+            return 0;
+         ch->device_time += wait;
+         break;
+      default:
+      {
+         unsigned char bad[2] = { 0xFA, op };
+         sim_out_push (ch, bad, 2);
+         break;
+      }
+   }
+   
+   return 1;
+}
+
+/* bytes accepted earlier that the engine has not worked off yet at time now */
+static int sim_outstanding (struct sim_channel *ch, double now)
+{
+   if (ch->device_time <= now)
+      return 0;
+   
+   return (int)((ch->device_time - now) * sim_sclk (ch) / 8);
+}
+
+/* feeds data to the MPSSE engine, returns the time at which the last byte was accepted: the
+   host can hand it over only once everything but the last SIM_RX_BUFFER_LENGTH bytes was consumed,
+   including the work of earlier writes still being clocked out */
+static double sim_process (struct sim_channel *ch, const unsigned char *data, int size, double now)
+{
+   int length, pos, backlog;
+   double accept = now, wait;
+   
+   if (ch->device_time < now)
+      ch->device_time = now;
+   
+   while (size > 0)
+   {
+      int space = SIM_CMD_LENGTH - ch->cmd_length;
+      int n = size < space ? size : space;
+   
+      memcpy (ch->cmd + ch->cmd_length, data, n);
+      ch->cmd_length += n;
+      data += n;
+      size -= n;
+   
+      if (!ch->mpsse)
+      {
+         ch->cmd_length = 0;
+         continue;
+      }
+   
+      pos = 0;
+      while (!ch->stalled && pos < ch->cmd_length && (length = sim_command_length (ch->cmd + pos, ch->cmd_length - pos)) > 0)
+      {
+         /* bytes not executed yet, beyond what the receive buffer holds */
+         backlog = ch->cmd_length - pos + size - SIM_RX_BUFFER_LENGTH;
+         if (backlog > 0)
+         {
+            wait = ch->device_time;
+   
+            /* data of a shifting command is consumed while it is clocked out */
+            if (ch->cmd[pos] < 0x80 && !(ch->cmd[pos] & MPSSE_BITMODE) && (ch->cmd[pos] & MPSSE_DO_WRITE))
+               wait += (backlog < length - 3 ? backlog : length - 3) * 8 / sim_sclk (ch);
+         }
+         else
+         {
+            /* the free space left is taken up by the engine's outstanding work */
+            wait = ch->device_time + backlog * 8 / sim_sclk (ch);
+         }
+         if (accept < wait)
+            accept = wait;
+   
+         if (!sim_execute (ch, ch->cmd + pos, length))
+         {
+            ch->stalled = 1;
+            break;
+         }
+         pos += length;
+      }
+   
+      memmove (ch->cmd, ch->cmd + pos, ch->cmd_length - pos);
+      ch->cmd_length -= pos;
+   }
+   
+   return accept;
+}
+
+/* ---------------------------------------------------------------------------------------- */
+/* simulator control                                                                        */
+/* ---------------------------------------------------------------------------------------- */
+
+struct ftdi_sim_device *ftdi_sim_add_device (const char *serial, int bus, int address, const char *port_path)
+{
+   struct ftdi_sim_device *dev;
+   const char *p;
+   
+   pthread_mutex_lock (&sim_lock);
+   dev = &sim_devices[sim_device_count++];
+   pthread_mutex_unlock (&sim_lock);
+   
+   memset (dev, 0, sizeof (struct ftdi_sim_device));
+   snprintf (dev->serial, sizeof (dev->serial), "%s", serial ? serial : "");
+   dev->bus = bus;
+   dev->address = address;
+   
+   /* port path is given as "1.4.2" */
+   for (p = port_path; p && *p && dev->port_count < 7; )
+   {
+      dev->ports[dev->port_count++] = (unsigned char)strtol (p, (char **)&p, 10);
+      if (*p == '.')
+         p++;
+   }
+   
+   return dev;
+}
+
+void ftdi_sim_attach (struct ftdi_sim_device *dev, int channel, struct ftdi_sim_slave *slave)
+{
+   dev->channel[channel & 1].slave = slave;
+}
+
+void ftdi_sim_set_timing (struct ftdi_sim_timing *timing)
+{
+   sim_timing = *timing;
+   sim_seed = 1;
+}
+
+void ftdi_sim_reset (void)
+{
+   int i, j;
+   
+   for (i = 0; i < sim_device_count; i++)
+      for (j = 0; j < 2; j++)
+         sim_out_clear (&sim_devices[i].channel[j]);
+   
+   sim_device_count = 0;
+   memset (sim_hosts, 0, sizeof (sim_hosts));
+   sim_seed = 1;
+}
+
+double ftdi_sim_time (struct ftdi_context *ftdi)
+{
+   return sim_host (ftdi)->host_time;
+}
+
+/* lets the host wait until the MPSSE engine has clocked out every command it accepted */
+void ftdi_sim_drain (struct ftdi_context *ftdi)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   
+   if (ch != NULL && host->host_time < ch->device_time)
+      host->host_time = ch->device_time;
+}
+
+long ftdi_sim_transactions (struct ftdi_context *ftdi)
+{
+   return sim_host (ftdi)->transactions;
+}
+
+/* ---------------------------------------------------------------------------------------- */
+/* libftdi1 API                                                                             */
+/* ---------------------------------------------------------------------------------------- */
+
+/* cost of a single USB transaction: fixed latency plus an exponentially distributed delay */
+static double sim_latency (void)
+{
+   double r;
+   
+   if (sim_timing.usb_jitter <= 0)
+      return sim_timing.usb_latency;
+   
+   pthread_mutex_lock (&sim_lock);
+   sim_seed = sim_seed * 1103515245u + 12345u;
+   r = ((sim_seed >> 8) + 0.5) / 16777216.0;
+   pthread_mutex_unlock (&sim_lock);
+   
+   return sim_timing.usb_latency - sim_timing.usb_jitter * log (r);
+}
+
+static int sim_error (struct ftdi_context *ftdi, int code, const char *str)
+{
+   ftdi->error_str = str;
+   return code;
+}
+
+struct ftdi_context *ftdi_new (void)
+{
+   struct ftdi_context *ftdi = calloc (1, sizeof (struct ftdi_context));
+   
+   if (ftdi)
+      ftdi_init (ftdi);
+   
+   return ftdi;
+}
+
+int ftdi_init (struct ftdi_context *ftdi)
+{
+   memset (ftdi, 0, sizeof (struct ftdi_context));
+   ftdi->usb_read_timeout = 5000;
+   ftdi->usb_write_timeout = 5000;
+   ftdi->type = TYPE_2232H;
+   ftdi->readbuffer_chunksize = 4096;
+   ftdi->writebuffer_chunksize = 4096;
+   ftdi->max_packet_size = 512;
+   ftdi->interface = INTERFACE_A;
+   ftdi->error_str = "";
+   
+   /* like libftdi, reads land in readbuffer first */
+   if ((ftdi->readbuffer = malloc (ftdi->readbuffer_chunksize)) == NULL)
+      return sim_error (ftdi, -1, "out of memory for readbuffer");
+   
+   return 0;
+}
+
+void ftdi_deinit (struct ftdi_context *ftdi)
+{
+   free (ftdi->readbuffer);
+   ftdi->readbuffer = NULL;
+}
+
+void ftdi_free (struct ftdi_context *ftdi)
+{
+   int i;
+   
+   pthread_mutex_lock (&sim_lock);
+   for (i = 0; i < SIM_MAX_HOSTS; i++)
+      if (sim_hosts[i].ftdi == ftdi)
+         sim_hosts[i].ftdi = NULL;
+   pthread_mutex_unlock (&sim_lock);
+   
+   ftdi_deinit (ftdi);
+   free (ftdi);
+}
+
+struct ftdi_version_info ftdi_get_library_version (void)
+{
+   struct ftdi_version_info info = { 1, 5, 0, "1.5-sim", "sim" };
+   
+   return info;
+}
+
+const char *ftdi_get_error_string (struct ftdi_context *ftdi)
+{
+   return ftdi ? ftdi->error_str : "";
+}
+
+int ftdi_set_interface (struct ftdi_context *ftdi, enum ftdi_interface interface)
+{
+   if (ftdi->sim != NULL)
+      return sim_error (ftdi, -3, "Interface can not be changed on an already open device");
+   
+   ftdi->interface = (interface == INTERFACE_ANY) ? INTERFACE_A : interface;
+   
+   return 0;
+}
+
+static void sim_default_device (void)
+{
+   if (sim_device_count == 0)
+      ftdi_sim_add_device ("FTSIM0", 1, 2, "1");
+}
+
+int ftdi_usb_find_all (struct ftdi_context *ftdi, struct ftdi_device_list **devlist, int vendor, int product)
+{
+   struct ftdi_device_list **next = devlist;
+   int i;
+   
+   (void)ftdi;
+   (void)vendor;
+   (void)product;
+   
+   sim_default_device ();
+   
+   *devlist = NULL;
+   for (i = 0; i < sim_device_count; i++)
+   {
+      *next = malloc (sizeof (struct ftdi_device_list));
+      (*next)->dev = (struct libusb_device *)&sim_devices[i];
+      (*next)->next = NULL;
+      next = &(*next)->next;
+   }
+   
+   return sim_device_count;
+}
+
+void ftdi_list_free (struct ftdi_device_list **devlist)
+{
+   struct ftdi_device_list *curr, *next;
+   
+   for (curr = *devlist; curr != NULL; curr = next)
+   {
+      next = curr->next;
+      free (curr);
+   }
+   *devlist = NULL;
+}
+
+int ftdi_usb_get_strings (struct ftdi_context *ftdi, struct libusb_device *dev,
+                          char *manufacturer, int mnf_len, char *description, int desc_len, char *serial, int serial_len)
+{
+   struct ftdi_sim_device *sim = (struct ftdi_sim_device *)dev;
+   
+   (void)ftdi;
+   
+   if (manufacturer)
+      snprintf (manufacturer, mnf_len, "FTDI");
+   if (description)
+      snprintf (description, desc_len, "Dual RS232-HS");
+   if (serial)
+      snprintf (serial, serial_len, "%s", sim->serial);
+   
+   return 0;
+}
+
+uint8_t libusb_get_bus_number (struct libusb_device *dev)
+{
+   return ((struct ftdi_sim_device *)dev)->bus;
+}
+
+uint8_t libusb_get_device_address (struct libusb_device *dev)
+{
+   return ((struct ftdi_sim_device *)dev)->address;
+}
+
+int libusb_get_port_numbers (struct libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+   struct ftdi_sim_device *sim = (struct ftdi_sim_device *)dev;
+   int n = sim->port_count < port_numbers_len ? sim->port_count : port_numbers_len;
+   
+   memcpy (port_numbers, sim->ports, n);
+   
+   return n;
+}
+
+int ftdi_usb_open_dev (struct ftdi_context *ftdi, struct libusb_device *dev)
+{
+   struct sim_channel *ch;
+   
+   ftdi->sim = (struct ftdi_sim_device *)dev;
+   ftdi->usb_dev = (struct libusb_device_handle *)dev;
+   
+   ch = sim_channel (ftdi);
+   ch->mpsse = 0;
+   ch->stalled = 0;
+   ch->cmd_length = 0;
+   sim_out_clear (ch);
+   sim_host (ftdi);
+   
+   return 0;
+}
+
+int ftdi_usb_open (struct ftdi_context *ftdi, int vendor, int product)
+{
+   return ftdi_usb_open_desc_index (ftdi, vendor, product, NULL, NULL, 0);
+}
+
+int ftdi_usb_open_desc_index (struct ftdi_context *ftdi, int vendor, int product,
+                              const char *description, const char *serial, unsigned int index)
+{
+   int i;
+   
+   (void)vendor;
+   (void)product;
+   (void)description;
+   
+   sim_default_device ();
+   
+   for (i = 0; i < sim_device_count; i++)
+   {
+      if (serial && strcmp (serial, sim_devices[i].serial))
+         continue;
+      if (index-- > 0)
+         continue;
+      return ftdi_usb_open_dev (ftdi, (struct libusb_device *)&sim_devices[i]);
+   }
+   
+   return sim_error (ftdi, -3, "device not found");
+}
+
+int ftdi_usb_open_string (struct ftdi_context *ftdi, const char *description)
+{
+   int i, bus, address;
+   
+   sim_default_device ();
+   
+   if (sscanf (description, "d:%d/%d", &bus, &address) == 2)
+   {
+      for (i = 0; i < sim_device_count; i++)
+         if (sim_devices[i].bus == bus && sim_devices[i].address == address)
+            return ftdi_usb_open_dev (ftdi, (struct libusb_device *)&sim_devices[i]);
+      return sim_error (ftdi, -3, "device not found");
+   }
+   if (!strncmp (description, "s:", 2))
+   {
+      const char *serial = strrchr (description, ':') + 1;
+      return ftdi_usb_open_desc_index (ftdi, 0, 0, NULL, serial, 0);
+   }
+   
+   return sim_error (ftdi, -11, "illegal description format");
+}
+
+int ftdi_usb_close (struct ftdi_context *ftdi)
+{
+   if (ftdi->sim == NULL)
+      return sim_error (ftdi, -3, "USB device unavailable");
+   
+   ftdi->sim = NULL;
+   ftdi->usb_dev = NULL;
+   
+   return 0;
+}
+
+int ftdi_usb_reset (struct ftdi_context *ftdi)
+{
+   struct sim_host *host = sim_host (ftdi);
+   
+   if (ftdi->sim == NULL)
+      return sim_error (ftdi, -2, "USB device unavailable");
+   
+   host->host_time += 10e-3;
+   host->transactions++;
+   
+   return 0;
+}
+
+int ftdi_usb_purge_buffers (struct ftdi_context *ftdi)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   
+   if (ch == NULL)
+      return sim_error (ftdi, -3, "USB device unavailable");
+   
+   sim_out_clear (ch);
+   ch->cmd_length = 0;
+   ftdi->readbuffer_remaining = 0;
+   host->host_time += sim_latency () + sim_latency ();
+   host->transactions += 2;
+   
+   return 0;
+}
+
+int ftdi_usb_purge_rx_buffer (struct ftdi_context *ftdi)
+{
+   return ftdi_usb_purge_buffers (ftdi);
+}
+
+int ftdi_usb_purge_tx_buffer (struct ftdi_context *ftdi)
+{
+   return ftdi_usb_purge_buffers (ftdi);
+}
+
+int ftdi_set_latency_timer (struct ftdi_context *ftdi, unsigned char latency)
+{
+   if (ftdi->sim == NULL)
+      return sim_error (ftdi, -3, "USB device unavailable");
+   if (latency < 1)
+      return sim_error (ftdi, -1, "latency out of range. Only valid for 1-255");
+   
+   sim_host (ftdi)->transactions++;
+   
+   return 0;
+}
+
+int ftdi_get_latency_timer (struct ftdi_context *ftdi, unsigned char *latency)
+{
+   *latency = 1;
+   (void)ftdi;
+   
+   return 0;
+}
+
+int ftdi_set_bitmode (struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   
+   (void)bitmask;
+   
+   if (ch == NULL)
+      return sim_error (ftdi, -2, "USB device unavailable");
+   
+   ch->mpsse = (mode == BITMODE_MPSSE);
+   ch->stalled = 0;
+   ch->cmd_length = 0;
+   sim_host (ftdi)->transactions++;
+   sim_host (ftdi)->host_time += sim_latency ();
+   
+   return 0;
+}
+
+int ftdi_poll_modem_status (struct ftdi_context *ftdi, unsigned short *status)
+{
+   if (ftdi->sim == NULL)
+      return sim_error (ftdi, -2, "USB device unavailable");
+   
+   *status = 0x0060;    /* THRE | TEMT */
+   sim_host (ftdi)->transactions++;
+   sim_host (ftdi)->host_time += sim_latency ();
+   
+   return 0;
+}
+
+int ftdi_read_data_set_chunksize (struct ftdi_context *ftdi, unsigned int chunksize)
+{
+   unsigned char *buffer;
+   
+   if ((buffer = realloc (ftdi->readbuffer, chunksize)) == NULL)
+      return sim_error (ftdi, -1, "out of memory for readbuffer");
+   
+   ftdi->readbuffer = buffer;
+   ftdi->readbuffer_chunksize = chunksize;
+   return 0;
+}
+
+int ftdi_read_data_get_chunksize (struct ftdi_context *ftdi, unsigned int *chunksize)
+{
+   *chunksize = ftdi->readbuffer_chunksize;
+   return 0;
+}
+
+int ftdi_write_data_set_chunksize (struct ftdi_context *ftdi, unsigned int chunksize)
+{
+   ftdi->writebuffer_chunksize = chunksize;
+   return 0;
+}
+
+int ftdi_write_data_get_chunksize (struct ftdi_context *ftdi, unsigned int *chunksize)
+{
+   *chunksize = ftdi->writebuffer_chunksize;
+   return 0;
+}
+
+/* time to move size payload bytes over the bus, modem status bytes of reads included */
+static double sim_payload_time (int size, int is_read)
+{
+   double payload = size;
+   
+   if (is_read)
+      payload += 2.0 * ((size + sim_timing.usb_packet_size - 3) / (sim_timing.usb_packet_size - 2));
+   
+   return payload / sim_timing.usb_rate;
+}
+
+/* time to move size payload bytes over the bus, split in chunks of chunk bytes */
+static double sim_bus_time (int size, unsigned int chunk, int is_read)
+{
+   int transfers = (size + chunk - 1) / chunk;
+   double time = sim_payload_time (size, is_read);
+   
+   if (transfers < 1)
+      transfers = 1;
+   for (; transfers > 0; transfers--)
+      time += sim_latency ();
+   
+   return time;
+}
+
+int ftdi_write_data (struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   double accept;
+   
+   if (ch == NULL)
+      return sim_error (ftdi, -666, "USB device unavailable");
+   
+   /* a stalled engine stops accepting data once its receive buffer fills up */
+   if (ch->stalled && ch->cmd_length + sim_outstanding (ch, host->host_time) + size > SIM_RX_BUFFER_LENGTH)
+   {
+      host->host_time += ftdi->usb_write_timeout / 1000.0;
+      return sim_error (ftdi, -1, "usb bulk write failed");
+   }
+   
+   host->host_time += sim_bus_time (size, ftdi->writebuffer_chunksize, 0);
+   host->transactions += (size + ftdi->writebuffer_chunksize - 1) / ftdi->writebuffer_chunksize;
+   accept = sim_process (ch, buf, size, host->host_time);
+   if (host->host_time < accept)
+      host->host_time = accept;
+   
+   return size;
+}
+
+int ftdi_read_data (struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   int i, n;
+   
+   if (ch == NULL)
+      return sim_error (ftdi, -666, "USB device unavailable");
+   
+   host->transactions++;
+   host->host_time += sim_latency ();
+   
+   n = sim_out_pop (ch, buf, size, host->host_time);
+   host->host_time += sim_payload_time (n, 1);
+   
+   /* the latency of the first transfer has been charged already */
+   for (i = (n - 1) / (int)ftdi->readbuffer_chunksize; i > 0; i--)
+      host->host_time += sim_latency ();
+   
+   /* nothing ready: jump ahead to the moment the next byte shows up */
+   if (n == 0)
+   {
+      double ready = sim_out_ready (ch, 1);
+      if (ready > host->host_time)
+         host->host_time = ready;
+   }
+   
+   return n;
+}
+
+struct ftdi_transfer_control *ftdi_write_data_submit (struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   struct ftdi_transfer_control *tc;
+   struct sim_transfer *st;
+   double accept, latency;
+   
+   if (ch == NULL)
+      return NULL;
+   
+   tc = calloc (1, sizeof (struct ftdi_transfer_control));
+   st = calloc (1, sizeof (struct sim_transfer));
+   tc->ftdi = ftdi;
+   tc->buf = buf;
+   tc->size = size;
+   tc->transfer = st;
+   
+   /* bulk OUT transfers on the same endpoint are serialised on the bus, latency overlaps */
+   if (host->pipe_time < host->host_time)
+      host->pipe_time = host->host_time;
+   host->pipe_time += size / sim_timing.usb_rate;
+   latency = sim_latency ();
+   st->complete = host->pipe_time + latency;
+   host->transactions += (size + ftdi->writebuffer_chunksize - 1) / ftdi->writebuffer_chunksize;
+   
+   if (ch->stalled && ch->cmd_length + sim_outstanding (ch, host->pipe_time) + size > SIM_RX_BUFFER_LENGTH)
+   {
+      tc->offset = -1;
+      return tc;
+   }
+   
+   /* a full receive buffer holds back the transfer, and the ones queued behind it */
+   accept = sim_process (ch, buf, size, host->pipe_time);
+   if (host->pipe_time < accept)
+   {
+      host->pipe_time = accept;
+      st->complete = accept + latency;
+   }
+   tc->offset = size;
+   
+   return tc;
+}
+
+struct ftdi_transfer_control *ftdi_read_data_submit (struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   struct ftdi_transfer_control *tc;
+   struct sim_transfer *st;
+   
+   if (ch == NULL)
+      return NULL;
+   
+   tc = calloc (1, sizeof (struct ftdi_transfer_control));
+   st = calloc (1, sizeof (struct sim_transfer));
+   tc->ftdi = ftdi;
+   tc->buf = buf;
+   tc->size = size;
+   tc->transfer = st;
+   st->is_read = 1;
+   st->complete = host->host_time;
+   
+   return tc;
+}
+
+static int sim_fail_countdown = 0;
+
+void ftdi_sim_inject_error (int transfers)
+{
+   sim_fail_countdown = transfers;
+}
+
+/* payload of a full read chunk: every USB packet starts with 2 modem status bytes */
+static int sim_chunk_payload (struct ftdi_context *ftdi)
+{
+   int packets = (ftdi->readbuffer_chunksize + sim_timing.usb_packet_size - 1) / sim_timing.usb_packet_size;
+   int payload = ftdi->readbuffer_chunksize - 2 * packets;
+   
+   return payload > 0 ? payload : 1;
+}
+
+/* receives up to size bytes in readbuffer, framed in packets as on the bus, then copies their payload 
+   to buf as libftdi's transfer callback does; returns the number of bytes received */
+static int sim_read_chunk (struct ftdi_context *ftdi, struct sim_channel *ch, unsigned char *buf, int size)
+{
+   int payload = sim_timing.usb_packet_size - 2;
+   int length = 0, received = 0, copied = 0;
+   int n, len, offset;
+   
+   while (received < size)
+   {
+      len = (size - received > payload) ? payload : size - received;
+   
+      ftdi->readbuffer[length] = 0x32;        /* modem status */
+      ftdi->readbuffer[length + 1] = 0x60;    /* line status */
+      n = sim_out_pop (ch, ftdi->readbuffer + length + 2, len, 1e300);
+      length += 2 + n;
+      received += n;
+   
+      if (n < len)
+         break;
+   }
+   
+   /* status bytes are skipped, payload is copied */
+   for (offset = 0; offset < length; offset += sim_timing.usb_packet_size)
+   {
+      len = (length - offset - 2 > payload) ? payload : length - offset - 2;
+      memcpy (buf + copied, ftdi->readbuffer + offset + 2, len);
+      copied += len;
+   }
+   
+   return received;
+}
+
+int ftdi_transfer_data_done (struct ftdi_transfer_control *tc)
+{
+   struct ftdi_context *ftdi = tc->ftdi;
+   struct sim_channel *ch = sim_channel (ftdi);
+   struct sim_host *host = sim_host (ftdi);
+   struct sim_transfer *st = tc->transfer;
+   double ready;
+   int ret, n;
+   
+   if (st->is_read)
+   {
+      /* like libftdi, one libusb transfer of readbuffer_chunksize bytes at a time is received in 
+         readbuffer, and the next one is submitted only when the previous one completes */
+      ret = tc->size;
+      while (tc->offset < tc->size)
+      {
+         n = sim_chunk_payload (ftdi);
+         if (n > tc->size - tc->offset)
+            n = tc->size - tc->offset;
+   
+         host->transactions++;
+   
+         /* chunk completes once the device has produced all of its bytes */
+         ready = sim_out_ready (ch, n);
+         if (ready < 0)
+         {
+            host->host_time += ftdi->usb_read_timeout / 1000.0;
+            tc->offset += sim_read_chunk (ftdi, ch, tc->buf + tc->offset, n);
+            ret = tc->offset;
+            break;
+         }
+   
+         if (ready < st->complete)
+            ready = st->complete;
+         tc->offset += sim_read_chunk (ftdi, ch, tc->buf + tc->offset, n);
+         st->complete = ready + sim_bus_time (n, ftdi->readbuffer_chunksize, 1);
+      }
+   }
+   else
+      ret = tc->offset;
+   
+   if (host->host_time < st->complete)
+      host->host_time = st->complete;
+   
+   free (st);
+   free (tc);
+   
+   if (sim_fail_countdown > 0 && --sim_fail_countdown == 0)
+      return -1;
+   
+   return ret;
+}
+
+void ftdi_transfer_data_cancel (struct ftdi_transfer_control *tc, struct timeval *to)
+{
+   (void)to;
+   
+   free (tc->transfer);
+   free (tc);
+}
@@ -0,0 +1,48 @@
+#include <libftdi1/ftdi.h>
+
+/**
+   @defgroup SIM_GRP Simulator defaults
+   @{
+*/
+#define SIM_MAX_DEVICES      16               /**< maximum number of simulated FT2232H devices */
+#define SIM_MAX_HOSTS        64               /**< maximum number of ftdi contexts tracked at the same time */
+#define SIM_CMD_LENGTH       (65536 + 3)      /**< longest MPSSE command (64 KiB shifting command plus header) */
+#define SIM_RX_BUFFER_LENGTH 4096             /**< MPSSE receive buffer, a stalled engine accepts no more than this */
+#define SIM_USB_LATENCY      125e-6           /**< default cost of a single USB bulk transaction (one microframe) */
+#define SIM_USB_JITTER       25e-6            /**< default mean of the random delay added to every USB transaction */
+#define SIM_USB_RATE         40e6             /**< default USB payload rate, in bytes per second */
+#define SIM_USB_PACKET_SIZE  512              /**< high speed bulk packet size */
+/**@} */
+
+/**
+   Behaviour of the SPI slave wired to one simulated MPSSE channel.
+*/
+struct ftdi_sim_slave
+{
+   unsigned char (*exchange) (void *user, unsigned char mosi);    /**< shifts one byte while CS# is low, returns MISO byte */
+   void (*select) (void *user, int selected);                    /**< called on every CS# edge (1 = asserted) */
+   double (*wait) (void *user, double now, int level);            /**< seconds until GPIOL1 reaches level, <0 if never */
+   void *user;                                                    /**< user data passed to callbacks */
+   double now;                                                    /**< simulated time of the current callback, set by the simulator */
+};
+
+/**
+   Simulator timing model.
+*/
+struct ftdi_sim_timing
+{
+   double usb_latency;              /**< fixed cost of a single USB bulk transaction (seconds) */
+   double usb_rate;                 /**< USB payload rate (bytes per second) */
+   int usb_packet_size;             /**< bulk packet size, each packet carries 2 status bytes on reads */
+   double usb_jitter;               /**< mean of the exponentially distributed delay added to every USB transaction (seconds), 0 for none */
+};
+
+struct ftdi_sim_device *ftdi_sim_add_device (const char *serial, int bus, int address, const char *port_path);
+void ftdi_sim_attach (struct ftdi_sim_device *dev, int channel, struct ftdi_sim_slave *slave);
+void ftdi_sim_set_timing (struct ftdi_sim_timing *timing);
+void ftdi_sim_reset (void);
+
+double ftdi_sim_time (struct ftdi_context *ftdi);
+void ftdi_sim_drain (struct ftdi_context *ftdi);
+long ftdi_sim_transactions (struct ftdi_context *ftdi);
+void ftdi_sim_inject_error (int transfers);
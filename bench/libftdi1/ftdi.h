@@ -0,0 +1,163 @@
+/*
+   Software stand-in for the subset of libftdi1 used by ft2232h-lib.
+
+   Declarations mirror libftdi1's ftdi.h so that the library sources compile unchanged
+   when this directory is placed first in the include path.
+*/
+#ifndef FTDI_SIM_H
+#define FTDI_SIM_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* MPSSE shifting commands */
+#define MPSSE_WRITE_NEG   0x01
+#define MPSSE_BITMODE     0x02
+#define MPSSE_READ_NEG    0x04
+#define MPSSE_LSB         0x08
+#define MPSSE_DO_WRITE    0x10
+#define MPSSE_DO_READ     0x20
+#define MPSSE_WRITE_TMS   0x40
+
+/* MPSSE commands */
+#define SET_BITS_LOW      0x80
+#define SET_BITS_HIGH     0x82
+#define GET_BITS_LOW      0x81
+#define GET_BITS_HIGH     0x83
+#define LOOPBACK_START    0x84
+#define LOOPBACK_END      0x85
+#define TCK_DIVISOR       0x86
+#define DIS_DIV_5         0x8a
+#define EN_DIV_5          0x8b
+#define EN_3_PHASE        0x8c
+#define DIS_3_PHASE       0x8d
+#define CLK_BITS          0x8e
+#define CLK_BYTES         0x8f
+#define CLK_WAIT_HIGH     0x94
+#define CLK_WAIT_LOW      0x95
+#define EN_ADAPTIVE       0x96
+#define DIS_ADAPTIVE      0x97
+#define CLK_BYTES_OR_HIGH 0x9c
+#define CLK_BYTES_OR_LOW  0x9d
+#define SEND_IMMEDIATE    0x87
+#define WAIT_ON_HIGH      0x88
+#define WAIT_ON_LOW       0x89
+
+enum ftdi_chip_type { TYPE_AM = 0, TYPE_BM = 1, TYPE_2232C = 2, TYPE_R = 3, TYPE_2232H = 4, TYPE_4232H = 5, TYPE_232H = 6, TYPE_230X = 7 };
+enum ftdi_interface { INTERFACE_ANY = 0, INTERFACE_A = 1, INTERFACE_B = 2, INTERFACE_C = 3, INTERFACE_D = 4 };
+enum ftdi_mpsse_mode
+{
+   BITMODE_RESET  = 0x00,
+   BITMODE_BITBANG= 0x01,
+   BITMODE_MPSSE  = 0x02,
+   BITMODE_SYNCBB = 0x04,
+   BITMODE_MCU    = 0x08,
+   BITMODE_OPTO   = 0x10,
+   BITMODE_CBUS   = 0x20,
+   BITMODE_SYNCFF = 0x40,
+   BITMODE_FT1284 = 0x80
+};
+
+struct libusb_context;
+struct libusb_device;
+struct libusb_device_handle;
+
+struct ftdi_sim_device;
+
+/* libusb device queries exposed through libftdi's libusb.h include */
+uint8_t libusb_get_bus_number (struct libusb_device *dev);
+uint8_t libusb_get_device_address (struct libusb_device *dev);
+int libusb_get_port_numbers (struct libusb_device *dev, uint8_t *port_numbers, int port_numbers_len);
+
+struct ftdi_context
+{
+   struct libusb_context *usb_ctx;
+   struct libusb_device_handle *usb_dev;
+   int usb_read_timeout;
+   int usb_write_timeout;
+   enum ftdi_chip_type type;
+   int baudrate;
+   unsigned char bitbang_enabled;
+   unsigned char *readbuffer;
+   unsigned int readbuffer_offset;
+   unsigned int readbuffer_remaining;
+   unsigned int readbuffer_chunksize;
+   unsigned int writebuffer_chunksize;
+   unsigned int max_packet_size;
+   int interface;
+   int index;
+   int in_ep;
+   int out_ep;
+   unsigned char bitbang_mode;
+   const char *error_str;
+
+   /* simulator state */
+   struct ftdi_sim_device *sim;
+};
+
+struct ftdi_device_list
+{
+   struct ftdi_device_list *next;
+   struct libusb_device *dev;
+};
+
+struct ftdi_transfer_control
+{
+   int completed;
+   unsigned char *buf;
+   int size;
+   int offset;
+   struct ftdi_context *ftdi;
+   void *transfer;
+};
+
+struct ftdi_version_info
+{
+   int major;
+   int minor;
+   int micro;
+   const char *version_str;
+   const char *snapshot_str;
+};
+
+struct ftdi_context *ftdi_new (void);
+int ftdi_init (struct ftdi_context *ftdi);
+void ftdi_deinit (struct ftdi_context *ftdi);
+void ftdi_free (struct ftdi_context *ftdi);
+struct ftdi_version_info ftdi_get_library_version (void);
+const char *ftdi_get_error_string (struct ftdi_context *ftdi);
+
+int ftdi_set_interface (struct ftdi_context *ftdi, enum ftdi_interface interface);
+int ftdi_usb_find_all (struct ftdi_context *ftdi, struct ftdi_device_list **devlist, int vendor, int product);
+void ftdi_list_free (struct ftdi_device_list **devlist);
+int ftdi_usb_get_strings (struct ftdi_context *ftdi, struct libusb_device *dev,
+                          char *manufacturer, int mnf_len, char *description, int desc_len, char *serial, int serial_len);
+int ftdi_usb_open (struct ftdi_context *ftdi, int vendor, int product);
+int ftdi_usb_open_desc_index (struct ftdi_context *ftdi, int vendor, int product,
+                              const char *description, const char *serial, unsigned int index);
+int ftdi_usb_open_dev (struct ftdi_context *ftdi, struct libusb_device *dev);
+int ftdi_usb_open_string (struct ftdi_context *ftdi, const char *description);
+int ftdi_usb_close (struct ftdi_context *ftdi);
+int ftdi_usb_reset (struct ftdi_context *ftdi);
+int ftdi_usb_purge_buffers (struct ftdi_context *ftdi);
+int ftdi_usb_purge_rx_buffer (struct ftdi_context *ftdi);
+int ftdi_usb_purge_tx_buffer (struct ftdi_context *ftdi);
+
+int ftdi_set_latency_timer (struct ftdi_context *ftdi, unsigned char latency);
+int ftdi_get_latency_timer (struct ftdi_context *ftdi, unsigned char *latency);
+int ftdi_set_bitmode (struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode);
+int ftdi_poll_modem_status (struct ftdi_context *ftdi, unsigned short *status);
+
+int ftdi_read_data (struct ftdi_context *ftdi, unsigned char *buf, int size);
+int ftdi_write_data (struct ftdi_context *ftdi, const unsigned char *buf, int size);
+int ftdi_read_data_set_chunksize (struct ftdi_context *ftdi, unsigned int chunksize);
+int ftdi_read_data_get_chunksize (struct ftdi_context *ftdi, unsigned int *chunksize);
+int ftdi_write_data_set_chunksize (struct ftdi_context *ftdi, unsigned int chunksize);
+int ftdi_write_data_get_chunksize (struct ftdi_context *ftdi, unsigned int *chunksize);
+
+struct ftdi_transfer_control *ftdi_write_data_submit (struct ftdi_context *ftdi, unsigned char *buf, int size);
+struct ftdi_transfer_control *ftdi_read_data_submit (struct ftdi_context *ftdi, unsigned char *buf, int size);
+int ftdi_transfer_data_done (struct ftdi_transfer_control *tc);
+void ftdi_transfer_data_cancel (struct ftdi_transfer_control *tc, struct timeval *to);
+
+#endif
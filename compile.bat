@@ -3,7 +3,7 @@ set "concat="
 for /f "delims=" %%a in ('dir lib\*.c /B') do (
 	call set concat=%%concat%%lib\%%a 
 )
-set gccargs=-Wall -Wextra %concat% -llibftdi1
+set gccargs=-Wall -Wextra %concat% -llibftdi1 -lusb-1.0 -lpthread -lm
 
 echo Compiling %~n1.c
 echo Arguments: %gccargs%
@@ -1,80 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <libftdi1\ftdi.h>
+#include <libftdi1/ftdi.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
-#include "..\lib\ftdi_interface.h"
-#include "..\lib\ftdi_spi.h"
+#include "../lib/ftdi_interface.h"
+#include "../lib/ftdi_spi.h"
+#include "../lib/flash_spi.h"
 
-#include "flash_spi.h"
+int flash_write (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword *size, int incremental);
+int flash_verify (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword size);
+void flash_close (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
 
-#define GETBIT(field, bit)        (((field) & (1 << (bit))) >> (bit))
+byte *image_open (const char *path, qword size);
+void image_close (byte *image, qword size);
 
-#define BYTE_TO_BINARY_PATTERN "%5d%5d%5d%5d%5d%5d%5d%5d"
-#define BYTE_TO_BINARY(byte)  \
-  GETBIT(byte, 7), \
-  GETBIT(byte, 6), \
-  GETBIT(byte, 5), \
-  GETBIT(byte, 4), \
-  GETBIT(byte, 3), \
-  GETBIT(byte, 2), \
-  GETBIT(byte, 1), \
-  GETBIT(byte, 0) 
-
-  
-dword read_eeprom_size (char *str);
-
-void flash_read (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size);
-int flash_write (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size);
-int flash_verify (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size);
-void flash_erase (struct ftdi_context *ftdi, struct spi_context *spi);
-
-void flash_print_info (byte *eeprom_id);
-void flash_id_manufacturer (byte id, char *man);
-void flash_read_id (struct ftdi_context *ftdi, struct spi_context *spi, byte *id);
-
-byte flash_read_status (struct ftdi_context *ftdi, struct spi_context *spi);
-int flash_reset_status (struct ftdi_context *ftdi, struct spi_context *spi);
-void flash_wait_if_busy (struct ftdi_context *ftdi, struct spi_context *spi);
-void flash_write_enable (struct ftdi_context *ftdi, struct spi_context *spi);
-
-time_t time_sync (void);
+qword read_eeprom_size (char *str);
 
 
 int main (int argc, char *argv[])
 {
    struct ftdi_context *ftdi;
    struct spi_context *spi;
+   struct flash_info info;
    
-   FILE *fp_read, *fp_write;
+   qword EEPROM_SIZE = 0;
+   int incremental = 0;
+   int opt;
    
-   byte eeprom_id[3];
-   dword EEPROM_SIZE;
-   
-   if (argc < 2)
+   while ((opt = getopt (argc, argv, "s:i")) != -1)
    {
-      fprintf (stderr, "ERROR: Missing arguments\n");
-      fprintf (stderr, "    Usage: flash_spi_rw flash_size [write_file]\n");
-      return EXIT_FAILURE;
-   }
-   
-   if ((EEPROM_SIZE = read_eeprom_size (argv[1])) == 0)
-   {
-      fprintf (stderr, "ERROR: Invalid EEPROM size!\n");
-      return EXIT_FAILURE;
+      if (opt == 'i')
+         incremental = 1;
+      else if (opt != 's' || (EEPROM_SIZE = read_eeprom_size (optarg)) == 0)
+      {
+         fprintf (stderr, "ERROR: Invalid arguments\n");
+         fprintf (stderr, "    Usage: flash_spi_rw [-s flash_size] [-i] [write_file]\n");
+         fprintf (stderr, "           -i: only erase and program sectors that differ from write_file\n");
+         return EXIT_FAILURE;
+      }
    }
    
    /* init ftdi communication (usb paramters) */
    ftdi = ftdi_open ();
    
    /* init spi communication: spi mode 0, maximum divider, divide by 5 off, MSB first */
-   spi = spi_init (ftdi, 0, 0, 0x0000, 0, 0, 0, 0, 0);
+   if ((spi = spi_init (ftdi, 0, 0, 0x0000, 0, 0, 0, 0, 0)) == NULL)
+   {
+      ftdi_close (ftdi);
+      return EXIT_FAILURE;
+   }
    
    /* From Macronix datasheet, device operation:
    1. Before issuing any command, check the status register to ensure device is ready
       for the intended operation.
-   2. When an incorrect command is inputted to the chip, it goes in standby mode. The 
+   2. When an incorrect command is inputted to the chip, it goes in standby mode. The
       chip is released from standby at the next CS# falling edge.
    3. When a correct command is inputted to the chip, it goes in active mode. The active
       mode is kept until the next CS# rising edge.
@@ -87,90 +74,77 @@ int main (int argc, char *argv[])
    6. During the operation of WRSR, PP, SE, BE, CE, the access to the memory array is ignored and
       does not affect the current operation. */
    
-   /* read eeprom id and print information */
-   flash_read_id (ftdi, spi, eeprom_id);
-   flash_print_info (eeprom_id);
-
-   /* read entire chip and save it in a file */
-   if ((fp_read = fopen ("EEPROM_backup.bin", "wb")) == NULL) 
+   /* read eeprom id, sfdp tables and print information */
+   if (flash_probe (ftdi, spi, &info) < 0)
    {
-      fprintf (stderr, "ERROR: File not found or not accessible!\n");
       spi_free (spi);
       ftdi_close (ftdi);
       return EXIT_FAILURE;
    }
+   flash_print_info (&info);
+   
+   /* size given on command line overrides the detected one */
+   if (EEPROM_SIZE == 0 || EEPROM_SIZE > info.size)
+      EEPROM_SIZE = info.size;
    
+   /* read entire chip and save it in a file */
    printf ("INFO: Reading EEPROM...\n");
-   flash_read (ftdi, spi, fp_read, EEPROM_SIZE);
+   if (flash_read_to_file (ftdi, spi, &info, "EEPROM_backup.bin", EEPROM_SIZE) < 0)
+   {
+      fprintf (stderr, "ERROR: File not found or not accessible!\n");
+      flash_close (ftdi, spi, &info);
+      return EXIT_FAILURE;
+   }
    printf ("INFO: EEPROM dumped in \'EEPROM_backup.bin\'\n");
    
-   fclose (fp_read);
-   
-   if (argc < 3)
+   if (optind >= argc)
    {
-      spi_free (spi);
-      ftdi_close (ftdi);
+      flash_close (ftdi, spi, &info);
       return EXIT_SUCCESS;
    }
-
+   
    /* reset status register */
    if (flash_reset_status (ftdi, spi) < 0)
    {
       fprintf (stderr, "ERROR: Could not write status, check WP# pin!\n");
-      return EXIT_FAILURE;
-   }   
-   
-   /* erase chip before writing */
-   printf ("INFO: Erasing EEPROM...\n");
-   flash_erase (ftdi, spi);
-   printf ("INFO: EEPROM erased.\n");
-   
-   /* write entire chip from file */
-   if ((fp_write = fopen (argv[2], "rb")) == NULL) 
-   {
-      fprintf (stderr, "ERROR: File not found or not accessible!\n");
-      spi_free (spi);
-      ftdi_close (ftdi);
+      flash_close (ftdi, spi, &info);
       return EXIT_FAILURE;
    }
    
+   /* write chip from file (erasing it first, or only where needed) */
    printf ("INFO: Writing EEPROM...\n");
-   if (flash_write (ftdi, spi, fp_write, EEPROM_SIZE) <= 0)
+   if (flash_write (ftdi, spi, &info, argv[optind], &EEPROM_SIZE, incremental) <= 0)
    {
       fprintf (stderr, "ERROR: Unable to write EEPROM!\n");
-      fclose (fp_write);
-      spi_free (spi);
-      ftdi_close (ftdi);
+      flash_close (ftdi, spi, &info);
       return EXIT_FAILURE;
    }
-   printf ("INFO: Wrote EEPROM from file \'%s\'\n", argv[2]);
+   printf ("INFO: Wrote EEPROM from file \'%s\'\n", argv[optind]);
    
    /* verify eeprom */
-   rewind (fp_write);
    printf ("INFO: Verifying EEPROM...\n");
-   if (flash_verify (ftdi, spi, fp_write, EEPROM_SIZE) <= 0)
+   if (flash_verify (ftdi, spi, &info, argv[optind], EEPROM_SIZE) <= 0)
    {
       fprintf (stderr, "ERROR: Unable to verify EEPROM!\n");
-      fclose (fp_write);
-      spi_free (spi);
-      ftdi_close (ftdi);
+      flash_close (ftdi, spi, &info);
       return EXIT_FAILURE;
    }
    printf ("INFO: EEPROM verified.\n");
    
-   fclose (fp_write);
-   spi_free (spi);
-   ftdi_close (ftdi);
-   return EXIT_FAILURE;
+   /* USB traffic of the whole session: tells whether time went into USB round trips, SPI clock or disk */
+   ftdi_stats_print (&spi->stats, stdout);
+   
+   flash_close (ftdi, spi, &info);
+   return EXIT_SUCCESS;
 }
 
 
-dword read_eeprom_size (char *str)
+qword read_eeprom_size (char *str)
 {
-   char mult;
-   dword size;
+   char mult = 0;
+   unsigned long long size = 0;
    
-   sscanf (str, "%d%c", &size, &mult);
+   sscanf (str, "%llu%c", &size, &mult);
    
    switch (tolower (mult))
    {
@@ -186,341 +160,130 @@ dword read_eeprom_size (char *str)
 }
 
 
-void flash_read (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size)
+int flash_write (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword *size, int incremental)
 {
-   byte buf[4] = { READ, 0x00, 0x00, 0x00 };
-   
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, buf, 4);
-   spi_read_to_file (ftdi, spi, fp, size);
-   spi_close (ftdi, spi);
+   struct flash_program_report report;
+   struct stat st;
+   byte *image;
+   int ret;
    
-   return;
-}
-
-int flash_write (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size)
-{
-   byte buf[4] = { PP, 0x00, 0x00, 0x00 };
-   byte file_buf[256];
-   
-   unsigned int file_buf_size;
-   unsigned int addr, rem_size;
-
-   time_t start, end;
-   
-   addr = 0x000000;
-   rem_size = size;
-   
-   /* ensure BUSY bit is cleared before starting */
-   flash_wait_if_busy (ftdi, spi);
-   
-   start = time_sync ();
-   
-   if (rem_size > 256)
-      file_buf_size = 256;
-   else
-      file_buf_size = rem_size;
-   
-   while (addr < size && fread (file_buf, sizeof (byte), file_buf_size, fp) == file_buf_size)
-   {
-      /* load address */
-      buf[1] = GETBYTE (addr, 2);
-      buf[2] = GETBYTE (addr, 1);
-      buf[3] = GETBYTE (addr, 0);
-
-      /* ensure WEL bit is set */
-      flash_write_enable (ftdi, spi);
-
-      spi_open (ftdi, spi);
-      /* send write request */
-      spi_write (ftdi, spi, buf, 4);
-      /* send data to write out */
-      spi_write (ftdi, spi, file_buf, file_buf_size);     
-      spi_close (ftdi, spi);
-      
-      /* ensure BUSY bit is cleared */
-      flash_wait_if_busy (ftdi, spi);
-      
-      addr += file_buf_size;
-      rem_size -= file_buf_size;
-      
-      if (rem_size > 256)
-         file_buf_size = 256;
-      else
-         file_buf_size = rem_size;
-      
-      time (&end);
-      if (difftime (end, start) == 1 || addr == size)
-      {
-         printf ("INFO: %.1f%% (%d bytes written)\n", 100.0 * addr / size, addr);
-         time (&start);
-      }
-   }
-   
-   /* if not all data has been written, because an EOF has occurred */
-   if (addr < size && fread (file_buf, sizeof (byte), file_buf_size, fp) != 1)
+   if (stat (path, &st) < 0 || st.st_size == 0)
    {
-      printf ("WARNING: Cannot read file, end-of-file reached at address 0x%.6X\n", addr);
+      fprintf (stderr, "ERROR: File not found or not accessible!\n");
       return -1;
    }
    
-   /* if all data has been written but there is still data in file, print warning */
-   if (addr >= size && fread (file_buf, sizeof (byte), file_buf_size, fp) == 1)
+   /* if file is shorter than flash memory, only program the file */
+   if ((qword)st.st_size < *size)
    {
-      printf ("WARNING: There is still data in file over 0x%.6X\n", addr);
+      printf ("WARNING: End-of-file reached at address 0x%.6llX, the rest of the EEPROM is left as is\n", (unsigned long long)st.st_size);
+      *size = st.st_size;
    }
-   
-   return 1;
-}
-
-int flash_verify (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, dword size)
-{
-   FILE *fp_temp;
-   byte byte1, byte2;
-   dword addr;
-   
-   /* open temporary file in write/update mode (both read and write) */
-   if ((fp_temp = fopen ("temp.bin", "w+b")) == NULL)
+   /* if file is longer than flash memory, print warning */
+   else if ((qword)st.st_size > *size)
    {
-      fprintf (stderr, "ERROR: Cannot create file!");
-      return -1;
+      printf ("WARNING: There is still data in file over 0x%.6llX\n", (unsigned long long)*size);
    }
-   /* read flash memory once again */
-   flash_read (ftdi, spi, fp_temp, size);
    
-   /* go back to the beginning of temporary */
-   rewind (fp_temp);
-   
-   addr = 0x000000;
-   /* compare the two files */
-   while (addr < size && fread (&byte1, sizeof (byte), 1, fp) == 1)
-   {  
-      fread (&byte2, sizeof (byte), 1, fp_temp); 
-
-      if (byte1 != byte2)
-      {
-         fprintf (stderr, "ERROR: Data mismatch at address 0x%.6X\n", addr);
-         return 0;
-      }
-
-      addr++;
-   }
-   
-   fclose (fp_temp);
-   /* delete temporary file */
-   if (remove ("temp.bin") != 0)
-   {
-      fprintf (stderr, "ERROR: Unable to delete temp file!\n");
+   if ((image = image_open (path, *size)) == NULL)
       return -1;
-   }
    
-   /* if not all data has been verified, because an EOF has occurred */
-   if (addr < size && fread (&byte1, sizeof (byte), 1, fp) != 1)
-   {
-      printf ("WARNING: Cannot read file, end-of-file reached at address 0x%.6X\n", addr);
-      return -1;
-   }
+   ret = flash_program_image (ftdi, spi, info, image, *size, incremental, &report);
+   flash_print_report (&report);
    
-   /* if all data has been verified but there is still data in file, print warning */
-   if (addr >= size && fread (&byte1, sizeof (byte), 1, fp) == 1)
-   {
-      printf ("WARNING: There is still data in file over 0x%.6X\n", addr);
-   }
-
-   return 1;
-}
-
-void flash_erase (struct ftdi_context *ftdi, struct spi_context *spi)
-{
-   byte buf = CE;
-   
-   /* ensure BUSY bit is cleared before starting */
-   flash_wait_if_busy (ftdi, spi);
-   /* ensure WEL bit is set */
-   flash_write_enable (ftdi, spi);
-   /* erase */
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, &buf, 1);
-   spi_close (ftdi, spi);
-   /* ensure BUSY bit is cleared */
-   flash_wait_if_busy (ftdi, spi);
+   image_close (image, *size);
    
-   return;
+   return ret;
 }
 
-
-void flash_print_info (byte *eeprom_id)
+int flash_verify (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword size)
 {
-   char manufacturer[64];
+   struct flash_verify_report report;
+   byte *image;
+   int ret;
    
-   flash_id_manufacturer (eeprom_id[0], manufacturer);
+   /* size was already clipped to the file size by flash_write */
+   if ((image = image_open (path, size)) == NULL)
+      return -1;
    
-   printf ("INFO: EEPROM Identification data:\n");
-   printf ("   Manufacturer ID: 0x%.2X (%s)\n", eeprom_id[0], manufacturer);
-   printf ("       Memory type: 0x%.2X\n", eeprom_id[1]);
-   printf ("    Memory density: 0x%.2X\n", eeprom_id[2]);
+   /* flash memory is read back and compared in memory, no temporary file */
+   ret = flash_verify_image (ftdi, spi, info, image, size, &report);
+   flash_print_verify_report (&report);
+   flash_free_verify_report (&report);
    
-   return;
-}
-
-void flash_id_manufacturer (byte id, char *man)
-{
-   const struct flash_manufacturer flash_list[] = {
-      {0x01,"AMD/Cypress/Spansion"},
-      {0x04,"Fujitsu"},
-      {0x1C,"EON"},
-      {0x1F,"Atmel"},
-      {0x20,"ST/SGS/Micron"},
-      {0x31,"Catalyst"},
-      {0x37,"AMIC"},
-      {0x40,"SyncMOS"},
-      {0x4A,"ESI"},
-      {0x52,"Alliance Semiconductor"},
-      {0x5E,"Tenx"},
-      {0x62,"ON Semiconductor"},
-      {0x62,"Sanyo"},
-      {0x8C,"ESMT"},
-      {0x89,"Intel"},
-      {0x97,"Texas Instruments"},
-      {0x9D,"PMC"},
-      {0xAD,"Bright/Hyundai"},
-      {0xB0,"Sharp"},
-      {0xBF,"SST"},
-      {0xC2,"Macronix"},
-      {0xC8,"ELM"},
-      {0xC8,"GigaDevice"},
-      {0xDA,"Winbond"},
-      {0xD5,"ISSI"},
-      {0xD5,"Nantronics"},
-      {0xEF,"Winbond"},
-      {0xF8,"Fidelix"},
-   };
-   const int dim = sizeof (flash_list) / sizeof (struct flash_manufacturer);
-
-   int i;
+   image_close (image, size);
    
-   for (i = 0; i < dim; i++)
-   {
-      if (flash_list[i].id == id)
-      {
-         strcpy (man, flash_list[i].man);
-         break;
-      }
-   }
-   
-   if (i >= dim)
-      strcpy (man, "Unknown");
-   
-   return;
+   return ret;
 }
 
-void flash_read_id (struct ftdi_context *ftdi, struct spi_context *spi, byte *id)
+void flash_close (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
 {
-   byte buf = RDID;
-
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, &buf, 1);
-   spi_read (ftdi, spi, id, 3);
-   spi_close (ftdi, spi);
+   /* leave 4-byte address mode, if entered by flash_probe */
+   flash_restore_address_mode (ftdi, spi, info);
+   
+   spi_free (spi);
+   ftdi_close (ftdi);
    
    return;
 }
 
-
-byte flash_read_status (struct ftdi_context *ftdi, struct spi_context *spi)
+/* Image is mapped where mmap is available (it is read in order, sector by sector), 
+   otherwise it is read into memory */
+byte *image_open (const char *path, qword size)
 {
-   byte buf = RDSR;
-   byte flash_status;
+   byte *image;
+#ifdef _WIN32
+   FILE *fp;
    
-   /* read status register and print debug info */
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, &buf, 1);
-   spi_read (ftdi, spi, &flash_status, 1);
-   spi_close (ftdi, spi);
+   if ((image = (byte *)malloc (size)) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate memory for file!\n");
+      return NULL;
+   }
    
-   DEBUG_PRINT ("DEBUG: EEPROM status register:\n"
-                 "    SRWD SEC  TB   BP[2:0]        WEL  BUSY\n"
-                 BYTE_TO_BINARY_PATTERN"\n", 
-                 BYTE_TO_BINARY (flash_status));
+   if ((fp = fopen (path, "rb")) == NULL || fread (image, sizeof (byte), size, fp) != size)
+   {
+      fprintf (stderr, "ERROR: File not found or not accessible!\n");
+      if (fp != NULL)
+         fclose (fp);
+      free (image);
+      return NULL;
+   }
    
-   return flash_status;
-}
-
-int flash_reset_status (struct ftdi_context *ftdi, struct spi_context *spi)
-{
-   byte buf = WRSR;
-   byte flash_status;
-   byte new_status = 0x00;
+   fclose (fp);
+#else
+   int fd;
    
-   time_t start, end;
+   if ((fd = open (path, O_RDONLY)) < 0)
+   {
+      fprintf (stderr, "ERROR: File not found or not accessible!\n");
+      return NULL;
+   }
    
-   flash_status = flash_read_status (ftdi, spi);
-
-   /* if no BP bits is set, return */
-   if (!(flash_read_status (ftdi, spi) & 0x1C))
-      return 1;
+   /* mapping stays valid once the file is closed */
+   image = (byte *)mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close (fd);
    
-   /* else, at least one BP bit is set, and status register must be zeroed */
-   start = time_sync ();
-   do
+   if (image == MAP_FAILED)
    {
-      /* ensure WEL bit is set */
-      flash_write_enable (ftdi, spi);
-      /* write new status */
-      spi_open (ftdi, spi);
-      spi_write (ftdi, spi, &buf, 1);
-      spi_write (ftdi, spi, &new_status, 1);
-      spi_close (ftdi, spi);
-      
-      time (&end);
-   } while (difftime (end, start) < 10 && flash_status != new_status);
-   
-   if (flash_status != new_status)
-      return -1;
-   
-   return 1;
-}
-
-void flash_write_enable (struct ftdi_context *ftdi, struct spi_context *spi)
-{
-   byte buf = WREN;
+      fprintf (stderr, "ERROR: Unable to map file!\n");
+      return NULL;
+   }
    
-   /* set WEL bit = 1 */
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, &buf, 1);
-   spi_close (ftdi, spi);
+   madvise (image, size, MADV_SEQUENTIAL);
+#endif
    
-   return;
+   return image;
 }
 
-void flash_wait_if_busy (struct ftdi_context *ftdi, struct spi_context *spi)
+void image_close (byte *image, qword size)
 {
-   byte buf = RDSR;
-   byte flash_status;
-   
-   spi_open (ftdi, spi);
-   spi_write (ftdi, spi, &buf, 1);
-   do
-      spi_read (ftdi, spi, &flash_status, 1);   /* status register is continously output until CS# is not high */
-   while (flash_status & WIP);
-   spi_close (ftdi, spi);
+#ifdef _WIN32
+   (void)size;
+   free (image);
+#else
+   munmap (image, size);
+#endif
    
    return;
 }
-
-
-// time_t time_sync (void)
-// {
-   // time_t t1, t2;
-   
-   // do
-   // {
-      // time (&t1);
-      // do
-      // {
-         // time (&t2);
-      // } while (difftime (t2, t1) < 1);    /* exit if *at least* 1 sec has passed */
-   // } while (difftime (t2, t1) > 1);       /* exit if *no more than* 1 sec has passed */
-   
-   // return t2;
-// }
\ No newline at end of file
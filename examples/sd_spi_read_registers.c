@@ -1,12 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <libftdi1\ftdi.h>
+#include <libftdi1/ftdi.h>
 #include <ctype.h>
 
-#include "..\lib\ftdi_interface.h"
-#include "..\lib\ftdi_spi.h"
-#include "..\lib\sd_spi.h"
+#include "../lib/ftdi_interface.h"
+#include "../lib/ftdi_spi.h"
+#include "../lib/sd_spi.h"
 
 int main (int argc, char *argv[])
 {
@@ -22,7 +22,11 @@ int main (int argc, char *argv[])
    ftdi = ftdi_open ();
    
    /* init spi communication: spi mode 1, 14 divider (=400 kHz), divide by 5 on, MSB first */
-   spi = spi_init (ftdi, 1, 1, 14, 1, 1, 0, 0, 0);
+   if ((spi = spi_init (ftdi, 1, 1, 14, 1, 1, 0, 0, 0)) == NULL)
+   {
+      ftdi_close (ftdi);
+      return EXIT_FAILURE;
+   }
 
    /* initialise sd card */
    sd_init (ftdi, spi);
@@ -30,11 +34,21 @@ int main (int argc, char *argv[])
    
    spi_open (ftdi, spi);
    
-   /* soft reset card */
-   sd_reset (ftdi, spi);
+   /* soft reset card (1 second timeout) */
+   if (sd_reset (ftdi, spi, 1) <= 0)
+   {
+      spi_free (spi);
+      ftdi_close (ftdi);
+      return EXIT_FAILURE;
+   }
       
    /* recognize sd card */
-   sd_version = sd_recognize (ftdi, spi); 
+   if ((sd_version = sd_recognize (ftdi, spi, 1)) < 0)
+   {
+      spi_free (spi);
+      ftdi_close (ftdi);
+      return EXIT_FAILURE;
+   }
    
    printf ("INFO: SD card version: ");
    switch (sd_version)
@@ -59,7 +73,12 @@ int main (int argc, char *argv[])
    
    /* get contents of cid register */
    if (sd_get_csd (ftdi, spi, &csd) > 0)
+   {
       sd_print_csd_info (csd);
+      
+      /* card is initialised: leave 400 kHz identification clock */
+      sd_set_transfer_speed (ftdi, spi, &csd);
+   }
    
    spi_close (ftdi, spi);
    
@@ -0,0 +1,2000 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <libftdi1/ftdi.h>
+
+#include "ftdi_interface.h"
+#include "ftdi_spi.h"
+#include "flash_spi.h"
+
+/**
+   Identifies the SPI NOR flash memory and learns its geometry, instructions and busy times.
+   <br>SFDP tables (JESD216) are read first. If the chip has none, the JEDEC ID is looked up in the built-in
+   part database and, failing that, the size is derived from the density byte of the ID, with 4 kB sectors
+   and 64 kB blocks assumed.
+   <br>Chips larger than 16 MB are switched to 4-byte addressing, see flash_set_address_mode: call
+   flash_restore_address_mode when done, so that the chip is left as it was found.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info to fill in
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if no flash memory answers, or if its size is unknown
+   @retval >0 on success
+*/
+int flash_probe (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
+{
+   int ret;
+   
+   memset (info, 0, sizeof (struct flash_info));
+   
+   if (flash_read_id (ftdi, spi, info->id) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   /* MISO floating or stuck */
+   if ((info->id[0] == 0x00 && info->id[1] == 0x00 && info->id[2] == 0x00) ||
+       (info->id[0] == 0xFF && info->id[1] == 0xFF && info->id[2] == 0xFF))
+   {
+      fprintf (stderr, "ERROR: No SPI flash memory detected (ID: %.2X %.2X %.2X)\n", info->id[0], info->id[1], info->id[2]);
+      return -1;
+   }
+   
+   flash_id_manufacturer (info->id[0], info->manufacturer);
+   strcpy (info->name, "Unknown");
+   
+   info->page_size = FLASH_DEFAULT_PAGE;
+   info->address_bytes = 3;
+   info->address_mode = FLASH_ADDR_3BYTE;
+   info->read_opcode = READ;
+   info->program_opcode = PP;
+   
+   if ((ret = flash_parse_sfdp (ftdi, spi, info)) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   if (ret > 0)
+      info->source = FLASH_SOURCE_SFDP;
+   else if (flash_lookup_part (info) > 0)
+      info->source = FLASH_SOURCE_DATABASE;
+   else if (flash_default_geometry (info) > 0)
+      info->source = FLASH_SOURCE_DEFAULT;
+   else
+   {
+      fprintf (stderr, "ERROR: Unknown SPI flash memory size (ID: %.2X %.2X %.2X)\n", info->id[0], info->id[1], info->id[2]);
+      return -1;
+   }
+   
+   return flash_set_address_mode (ftdi, spi, info);
+}
+
+/**
+   Reads JEDEC identification data of the flash memory (single USB transaction).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param id byte array to store manufacturer ID, memory type and memory density in (3 bytes)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_read_id (struct ftdi_context *ftdi, struct spi_context *spi, byte *id)
+{
+   byte buf = RDID;
+   
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, &buf, 1);
+   spi_read (ftdi, spi, id, 3);
+   spi_close (ftdi, spi);
+   
+   return spi_queue_end (ftdi, spi);
+}
+
+/**
+   Reads SFDP data of the flash memory (single USB transaction).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param address SFDP address to start reading from (24 bit, regardless of the address mode)
+   @param data byte array to store data in
+   @param size size of data to read (up to MAX_INTERNAL_BUF_LENGTH)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_read_sfdp (struct ftdi_context *ftdi, struct spi_context *spi, dword address, byte *data, int size)
+{
+   byte buf[5];
+   
+   buf[0] = RDSFDP;
+   buf[1] = GETBYTE (address, 2);
+   buf[2] = GETBYTE (address, 1);
+   buf[3] = GETBYTE (address, 0);
+   buf[4] = 0x00;                   /* dummy byte */
+   
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, 5);
+   spi_read (ftdi, spi, data, size);
+   spi_close (ftdi, spi);
+   
+   return spi_queue_end (ftdi, spi);
+}
+
+/**
+   Reads the SFDP header and the parameter tables info understands: the Basic Flash Parameter Table
+   (size, page size, erase types, busy times) and the 4-byte Address Instruction Table.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info to fill in
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if the chip has no (valid) SFDP tables
+   @retval >0 on success
+*/
+int flash_parse_sfdp (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
+{
+   byte header[8], headers[SFDP_MAX_HEADERS][8];
+   byte raw[SFDP_MAX_DWORDS * 4];
+   dword bfpt[SFDP_MAX_DWORDS], table[SFDP_MAX_DWORDS];
+   dword signature, pointer;
+   int i, j, count, bfpt_count, length;
+   word id;
+   
+   if (flash_read_sfdp (ftdi, spi, 0, header, 8) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   signature = header[0] | (header[1] << 8) | (header[2] << 16) | ((dword)header[3] << 24);
+   if (signature != SFDP_SIGNATURE)
+   {
+      DEBUG_PRINT ("DEBUG: [FLASH] No SFDP signature (0x%.8X)\n", signature);
+      return -1;
+   }
+   
+   /* number of parameter headers is 0-based */
+   count = header[6] + 1;
+   if (count > SFDP_MAX_HEADERS)
+      count = SFDP_MAX_HEADERS;
+   
+   if (flash_read_sfdp (ftdi, spi, 8, headers[0], count * 8) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   bfpt_count = 0;
+   
+   /* first header is always the BFPT, a later one (newer revision) may extend it */
+   for (i = 0; i < count; i++)
+   {
+      id = headers[i][0] | (headers[i][7] << 8);
+      length = headers[i][3];
+      pointer = headers[i][4] | (headers[i][5] << 8) | (headers[i][6] << 16);
+   
+      if (length > SFDP_MAX_DWORDS)
+         length = SFDP_MAX_DWORDS;
+      if (length == 0 || (id != SFDP_BFPT_ID && id != SFDP_4BAIT_ID) || (id == SFDP_BFPT_ID && length <= bfpt_count))
+         continue;
+   
+      if (flash_read_sfdp (ftdi, spi, pointer, raw, length * 4) == SPI_USB_ERROR)
+         return SPI_USB_ERROR;
+   
+      DEBUG_PRINT ("DEBUG: [FLASH] SFDP table 0x%.4X rev. %d.%d, %d dwords at 0x%.6X\n", id, headers[i][2], headers[i][1], length, pointer);
+   
+      for (j = 0; j < length; j++)
+      {
+         table[j] = raw[4 * j] | (raw[4 * j + 1] << 8) | (raw[4 * j + 2] << 16) | ((dword)raw[4 * j + 3] << 24);
+         if (id == SFDP_BFPT_ID)
+            bfpt[j] = table[j];
+      }
+   
+      if (id == SFDP_BFPT_ID)
+      {
+         bfpt_count = length;
+         if (flash_parse_bfpt (info, bfpt, bfpt_count) < 0)
+            return -1;
+      }
+      else if (bfpt_count > 0)
+         flash_parse_4bait (info, bfpt, bfpt_count, table, length);
+   }
+   
+   return (bfpt_count > 0) ? 1 : -1;
+}
+
+/**
+   Auxiliary function used by flash_parse_sfdp: decodes the Basic Flash Parameter Table.
+   <br>Busy times are only described from JESD216A on (16 dwords): older tables leave them at 0,
+   so that flash_wait_ready polls right away.
+   
+   @param info pointer to struct flash_info to fill in
+   @param bfpt BFPT dwords
+   @param count number of dwords in bfpt (at least 9)
+   
+   @retval <0 if the table is not valid
+   @retval >0 on success
+*/
+int flash_parse_bfpt (struct flash_info *info, dword *bfpt, int count)
+{
+   const double erase_units[4] = { 1e-3, 16e-3, 128e-3, 1.0 };
+   const double chip_units[4] = { 16e-3, 256e-3, 4.0, 64.0 };
+   dword density, field;
+   double typical, multiplier;
+   int i, shift;
+   
+   if (count < 9)
+      return -1;
+   
+   density = flash_sfdp_field (bfpt, count, BFPT_DENSITY);
+   if (density & 0x80000000)
+   {
+      shift = density & 0x7FFFFFFF;
+      if (shift < 3 || shift > 63)
+         return -1;
+      info->size = (qword)1 << (shift - 3);
+   }
+   else
+      info->size = ((qword)density + 1) / 8;
+   
+   if (flash_sfdp_field (bfpt, count, BFPT_ADDRESS_BYTES) == 2)
+      info->enter_4byte = BFPT_4BYTE_ALWAYS;
+   if (count >= 16)
+      info->enter_4byte |= flash_sfdp_field (bfpt, count, BFPT_4BYTE_ENTRY);
+   
+   /* erase times (dword 10): per type 5-bit count and 2-bit units from bit 4 on, multiplier in bits 3:0 */
+   multiplier = 2.0 * (flash_sfdp_field (bfpt, count, BFPT_ERASE_TIMES, 0, 4) + 1);
+   
+   for (i = 0; i < FLASH_ERASE_TYPES; i++)
+   {
+      shift = flash_sfdp_field (bfpt, count, BFPT_ERASE_TYPES + i / 2, (i % 2) * 16, 8);
+      if (shift == 0 || shift > 31)
+         continue;
+   
+      typical = 0.0;
+      if (count >= BFPT_ERASE_TIMES)
+      {
+         field = flash_sfdp_field (bfpt, count, BFPT_ERASE_TIMES, 4 + 7 * i, 7);
+         typical = ((field & 0x1F) + 1) * erase_units[field >> 5];
+      }
+   
+      flash_add_erase_type (info, (dword)1 << shift, flash_sfdp_field (bfpt, count, BFPT_ERASE_TYPES + i / 2, (i % 2) * 16 + 8, 8),
+                            typical, typical * multiplier);
+   }
+   
+   if (count >= BFPT_PROGRAM_TIMES)
+   {
+      /* dword 11: multiplier in bits 3:0, log2 of page size in bits 7:4, page program time in bits 13:8
+         (5-bit count, 8 or 64 us units), chip erase time in bits 30:24 (5-bit count, 2-bit units) */
+      multiplier = 2.0 * (flash_sfdp_field (bfpt, count, BFPT_PROGRAM_TIMES, 0, 4) + 1);
+      info->page_size = (dword)1 << flash_sfdp_field (bfpt, count, BFPT_PROGRAM_TIMES, 4, 4);
+   
+      field = flash_sfdp_field (bfpt, count, BFPT_PROGRAM_TIMES, 8, 6);
+      info->page_time = ((field & 0x1F) + 1) * ((field & 0x20) ? 64e-6 : 8e-6);
+      info->page_max_time = info->page_time * multiplier;
+   
+      field = flash_sfdp_field (bfpt, count, BFPT_PROGRAM_TIMES, 24, 7);
+      info->chip_erase_time = ((field & 0x1F) + 1) * chip_units[field >> 5];
+      info->chip_erase_max_time = info->chip_erase_time * multiplier;
+   }
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by flash_parse_sfdp: decodes the 4-byte Address Instruction Table, which lists
+   the instructions taking a 4-byte address regardless of the address mode.
+   
+   @param info pointer to struct flash_info to fill in
+   @param bfpt BFPT dwords (erase types are numbered as in BFPT)
+   @param bfpt_count number of dwords in bfpt
+   @param table 4BAIT dwords
+   @param count number of dwords in table
+   
+   @retval <0 if the table is not valid
+   @retval >0 on success
+*/
+int flash_parse_4bait (struct flash_info *info, dword *bfpt, int bfpt_count, dword *table, int count)
+{
+   dword supported, size;
+   int i, j;
+   
+   if (count < SFDP_4BAIT_OPCODES)
+      return -1;
+   
+   supported = table[0];
+   
+   if ((supported & SFDP_4BAIT_READ) && (supported & SFDP_4BAIT_PP))
+      info->enter_4byte |= BFPT_4BYTE_OPCODES;
+   else
+      info->enter_4byte &= ~BFPT_4BYTE_OPCODES;
+   
+   for (i = 0; i < FLASH_ERASE_TYPES; i++)
+   {
+      size = flash_sfdp_field (bfpt, bfpt_count, BFPT_ERASE_TYPES + i / 2, (i % 2) * 16, 8);
+      if (size == 0 || size > 31)
+         continue;
+   
+      for (j = 0; j < info->erase_count; j++)
+         if (info->erase[j].size == ((dword)1 << size))
+            info->erase[j].opcode_4byte = (supported & (SFDP_4BAIT_ERASE_1 << i)) ?
+                                          flash_sfdp_field (table, count, SFDP_4BAIT_OPCODES, 8 * i, 8) : 0;
+   }
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by flash_parse_bfpt: extracts a bit field from a SFDP parameter table.
+   
+   @param table table dwords
+   @param count number of dwords in table
+   @param dword_index dword holding the field (1-based, as in JESD216)
+   @param start_bit least significant bit of the field
+   @param length length of the field in bits
+   
+   @return value of the field, 0 if table is too short to hold it
+*/
+dword flash_sfdp_field (dword *table, int count, int dword_index, int start_bit, int length)
+{
+   dword value;
+   
+   if (dword_index < 1 || dword_index > count)
+      return 0;
+   
+   value = table[dword_index - 1] >> start_bit;
+   if (length < 32)
+      value &= ((dword)1 << length) - 1;
+   
+   return value;
+}
+
+/**
+   Looks up the JEDEC ID of the flash memory in the built-in part database, for chips without SFDP tables.
+   <br>Times are typical datasheet values, maximum times are taken as 4 times as long (chip erase: 2 times).
+   
+   @param info pointer to struct flash_info with JEDEC ID
+   
+   @retval 0 if the part is unknown
+   @retval >0 on success
+*/
+int flash_lookup_part (struct flash_info *info)
+{
+   const struct flash_part part_list[] = {
+      /* id                name           size (kB) 4k  32k 64k  page  4k  32k   64k  chip  4-byte address */
+      {{0xC2,0x20,0x15}, "MX25L1606E",     2048,   4,  32, 64,  0.6, 40, 200,  400,  14,  0},
+      {{0xC2,0x20,0x16}, "MX25L3206E",     4096,   4,  32, 64,  0.6, 40, 200,  400,  25,  0},
+      {{0xC2,0x20,0x17}, "MX25L6406E",     8192,   4,  32, 64,  0.6, 40, 200,  400,  50,  0},
+      {{0xC2,0x20,0x18}, "MX25L12835F",   16384,   4,  32, 64,  0.33, 30, 150, 280,  50,  0},
+      {{0xC2,0x20,0x19}, "MX25L25635F",   32768,   4,  32, 64,  0.33, 30, 150, 280,  80,  BFPT_4BYTE_EN4B | BFPT_4BYTE_OPCODES},
+      {{0xC2,0x20,0x1A}, "MX66L51235F",   65536,   4,  32, 64,  0.33, 30, 150, 280,  150, BFPT_4BYTE_EN4B | BFPT_4BYTE_OPCODES},
+      {{0xEF,0x40,0x15}, "W25Q16",         2048,   4,  32, 64,  0.7, 45, 120,  150,  5,   0},
+      {{0xEF,0x40,0x16}, "W25Q32",         4096,   4,  32, 64,  0.7, 45, 120,  150,  10,  0},
+      {{0xEF,0x40,0x17}, "W25Q64",         8192,   4,  32, 64,  0.7, 45, 120,  150,  20,  0},
+      {{0xEF,0x40,0x18}, "W25Q128",       16384,   4,  32, 64,  0.7, 45, 120,  150,  40,  0},
+      {{0xEF,0x40,0x19}, "W25Q256",       32768,   4,  32, 64,  0.7, 45, 120,  150,  80,  BFPT_4BYTE_EN4B | BFPT_4BYTE_OPCODES},
+      {{0xC8,0x40,0x16}, "GD25Q32",        4096,   4,  32, 64,  0.6, 50, 150,  250,  15,  0},
+      {{0xC8,0x40,0x17}, "GD25Q64",        8192,   4,  32, 64,  0.6, 50, 150,  250,  30,  0},
+      {{0xC8,0x40,0x18}, "GD25Q128",      16384,   4,  32, 64,  0.6, 50, 150,  250,  60,  0},
+      {{0x20,0xBA,0x18}, "N25Q128",       16384,   4,  0,  64,  0.5, 250, 0,   700,  170, 0},
+      {{0x20,0xBA,0x19}, "N25Q256",       32768,   4,  0,  64,  0.5, 250, 0,   700,  240, BFPT_4BYTE_WREN_EN4B},
+      {{0x9D,0x60,0x17}, "IS25LP064",      8192,   4,  32, 64,  0.2, 70, 100,  150,  30,  0},
+      {{0x9D,0x60,0x18}, "IS25LP128",     16384,   4,  32, 64,  0.2, 70, 100,  150,  45,  0},
+   };
+   const int dim = sizeof (part_list) / sizeof (struct flash_part);
+   const struct flash_part *part;
+   int i;
+   
+   for (i = 0; i < dim; i++)
+   {
+      part = &part_list[i];
+      if (memcmp (part->id, info->id, 3) != 0)
+         continue;
+   
+      strcpy (info->name, part->name);
+      info->size = (qword)part->size_kb * 1024;
+      info->enter_4byte = part->enter_4byte;
+   
+      if (part->sector_kb > 0)
+         flash_add_erase_type (info, part->sector_kb * 1024, SE, part->sector_ms * 1e-3, 4 * part->sector_ms * 1e-3);
+      if (part->block32_kb > 0)
+         flash_add_erase_type (info, part->block32_kb * 1024, BE, part->block32_ms * 1e-3, 4 * part->block32_ms * 1e-3);
+      if (part->block64_kb > 0)
+         flash_add_erase_type (info, part->block64_kb * 1024, BE64, part->block64_ms * 1e-3, 4 * part->block64_ms * 1e-3);
+   
+      info->page_time = part->page_ms * 1e-3;
+      info->page_max_time = 4 * info->page_time;
+      info->chip_erase_time = part->chip_s;
+      info->chip_erase_max_time = 2 * part->chip_s;
+   
+      return 1;
+   }
+   
+   return 0;
+}
+
+/**
+   Guesses the geometry of an unknown flash memory without SFDP tables from the density byte of its
+   JEDEC ID (log2 of size for most manufacturers), assuming 4 kB sectors, 64 kB blocks, and the usual
+   EN4B instruction above 16 MB. Busy times are unknown, so busy bit is polled right away.
+   
+   @param info pointer to struct flash_info with JEDEC ID
+   
+   @retval 0 if density byte is not meaningful
+   @retval >0 on success
+*/
+int flash_default_geometry (struct flash_info *info)
+{
+   byte density = info->id[2];
+   
+   if (density >= 0x10 && density <= 0x1F)
+      info->size = (qword)1 << density;
+   else if (density >= 0x20 && density <= 0x22)      /* 64 MB and above (Micron, Macronix) */
+      info->size = (qword)1 << (density - 6);
+   else
+      return 0;
+   
+   info->enter_4byte = BFPT_4BYTE_EN4B;
+   flash_add_erase_type (info, 4 * 1024, SE, 0.0, 0.0);
+   flash_add_erase_type (info, 64 * 1024, BE64, 0.0, 0.0);
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by flash_parse_bfpt, flash_lookup_part and flash_default_geometry: adds an erase
+   type to info, keeping erase types sorted by size (smallest first). The 4-byte address opcode is the
+   usual one, see flash_opcode_4byte, until flash_parse_4bait overrides it.
+   
+   @param info pointer to struct flash_info
+   @param size erased bytes
+   @param opcode erase instruction (3-byte address)
+   @param typical_time typical busy time, in seconds (0 if unknown)
+   @param max_time maximum busy time, in seconds (0 if unknown)
+*/
+void flash_add_erase_type (struct flash_info *info, dword size, byte opcode, double typical_time, double max_time)
+{
+   int i;
+   
+   if (info->erase_count >= FLASH_ERASE_TYPES)
+      return;
+   
+   for (i = info->erase_count; i > 0 && info->erase[i - 1].size >= size; i--)
+   {
+      /* a single instruction per size */
+      if (info->erase[i - 1].size == size)
+         return;
+   }
+   
+   memmove (&info->erase[i + 1], &info->erase[i], (info->erase_count - i) * sizeof (struct flash_erase_type));
+   
+   info->erase[i].size = size;
+   info->erase[i].opcode = opcode;
+   info->erase[i].opcode_4byte = flash_opcode_4byte (opcode);
+   info->erase[i].typical_time = typical_time;
+   info->erase[i].max_time = max_time;
+   info->erase_count++;
+   
+   return;
+}
+
+/**
+   Returns the instruction taking a 4-byte address that matches a 3-byte address one, as defined by
+   most manufacturers.
+   
+   @param opcode instruction (3-byte address)
+   
+   @return 4-byte address instruction, 0 if none
+*/
+byte flash_opcode_4byte (byte opcode)
+{
+   switch (opcode)
+   {
+      case READ:  return READ4;
+      case PP:    return PP4;
+      case SE:    return SE4;
+      case BE:    return BE4;
+      case BE64:  return BE64_4;
+   }
+   
+   return 0;
+}
+
+/**
+   Selects how addresses are sent, according to size of the flash memory: 3-byte addresses up to 16 MB,
+   otherwise dedicated 4-byte address instructions (READ4, PP4...) if available, as they do not change
+   the state of the chip, or EN4B.
+   <br>If 4-byte addresses cannot be used, only the first 16 MB are accessed.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_set_address_mode (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
+{
+   byte buf;
+   int i;
+   
+   if (info->size <= FLASH_3BYTE_LIMIT && !(info->enter_4byte & BFPT_4BYTE_ALWAYS))
+      return 1;
+   
+   info->address_bytes = 4;
+   
+   if (info->enter_4byte & BFPT_4BYTE_ALWAYS)
+   {
+      info->address_mode = FLASH_ADDR_4BYTE_MODE;
+      return 1;
+   }
+   
+   if (info->enter_4byte & BFPT_4BYTE_OPCODES)
+   {
+      info->address_mode = FLASH_ADDR_4BYTE_OPCODES;
+      info->read_opcode = READ4;
+      info->program_opcode = PP4;
+   
+      /* erase types without a 4-byte address instruction cannot be used */
+      for (i = 0; i < info->erase_count; i++)
+      {
+         if (info->erase[i].opcode_4byte == 0)
+         {
+            memmove (&info->erase[i], &info->erase[i + 1], (info->erase_count - i - 1) * sizeof (struct flash_erase_type));
+            info->erase_count--;
+            i--;
+         }
+         else
+            info->erase[i].opcode = info->erase[i].opcode_4byte;
+      }
+   
+      return 1;
+   }
+   
+   if (info->enter_4byte & (BFPT_4BYTE_EN4B | BFPT_4BYTE_WREN_EN4B))
+   {
+      info->address_mode = FLASH_ADDR_4BYTE_MODE;
+   
+      buf = EN4B;
+      spi_queue_begin (spi);
+      if (info->enter_4byte & BFPT_4BYTE_WREN_EN4B)
+         flash_write_enable (ftdi, spi);
+      spi_open (ftdi, spi);
+      spi_write (ftdi, spi, &buf, 1);
+      spi_close (ftdi, spi);
+   
+      return spi_queue_end (ftdi, spi);
+   }
+   
+   fprintf (stderr, "WARNING: 4-byte addresses not supported, only the first 16 MB are accessible\n");
+   info->address_bytes = 3;
+   info->size = FLASH_3BYTE_LIMIT;
+   
+   return 1;
+}
+
+/**
+   Leaves 4-byte address mode if flash_set_address_mode entered it, since boot loaders usually expect
+   3-byte addresses.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_restore_address_mode (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
+{
+   byte buf = EX4B;
+   
+   if (info->address_mode != FLASH_ADDR_4BYTE_MODE || (info->enter_4byte & BFPT_4BYTE_ALWAYS))
+      return 1;
+   
+   spi_queue_begin (spi);
+   if (info->enter_4byte & BFPT_4BYTE_WREN_EN4B)
+      flash_write_enable (ftdi, spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, &buf, 1);
+   spi_close (ftdi, spi);
+   
+   return spi_queue_end (ftdi, spi);
+}
+
+/**
+   Prints identification data, geometry and busy times of the flash memory.
+   
+   @param info pointer to struct flash_info
+*/
+void flash_print_info (struct flash_info *info)
+{
+   const char *sources[] = { "JEDEC ID density", "part database", "SFDP" };
+   const char *modes[] = { "3-byte", "4-byte instructions", "4-byte mode" };
+   int i;
+   
+   printf ("INFO: EEPROM Identification data:\n");
+   printf ("   Manufacturer ID: 0x%.2X (%s)\n", info->id[0], info->manufacturer);
+   printf ("       Memory type: 0x%.2X\n", info->id[1]);
+   printf ("    Memory density: 0x%.2X\n", info->id[2]);
+   printf ("              Part: %s\n", info->name);
+   printf ("INFO: EEPROM geometry (from %s):\n", sources[info->source]);
+   printf ("              Size: %llu bytes\n", (unsigned long long)info->size);
+   printf ("         Page size: %u bytes (program %.3f ms typ, %.3f ms max)\n", info->page_size, info->page_time * 1e3, info->page_max_time * 1e3);
+   printf ("         Addresses: %s\n", modes[info->address_mode]);
+   
+   for (i = 0; i < info->erase_count; i++)
+      printf ("             Erase: %u kB, opcode 0x%.2X (%.0f ms typ, %.0f ms max)\n", info->erase[i].size / 1024,
+              info->erase[i].opcode, info->erase[i].typical_time * 1e3, info->erase[i].max_time * 1e3);
+   
+   printf ("        Chip erase: %.1f s typ, %.1f s max\n", info->chip_erase_time, info->chip_erase_max_time);
+   
+   return;
+}
+
+void flash_id_manufacturer (byte id, char *man)
+{
+   const struct flash_manufacturer flash_list[] = {
+      {0x01,"AMD/Cypress/Spansion"},
+      {0x04,"Fujitsu"},
+      {0x1C,"EON"},
+      {0x1F,"Atmel"},
+      {0x20,"ST/SGS/Micron"},
+      {0x31,"Catalyst"},
+      {0x37,"AMIC"},
+      {0x40,"SyncMOS"},
+      {0x4A,"ESI"},
+      {0x52,"Alliance Semiconductor"},
+      {0x5E,"Tenx"},
+      {0x62,"ON Semiconductor"},
+      {0x62,"Sanyo"},
+      {0x8C,"ESMT"},
+      {0x89,"Intel"},
+      {0x97,"Texas Instruments"},
+      {0x9D,"PMC"},
+      {0xAD,"Bright/Hyundai"},
+      {0xB0,"Sharp"},
+      {0xBF,"SST"},
+      {0xC2,"Macronix"},
+      {0xC8,"ELM"},
+      {0xC8,"GigaDevice"},
+      {0xDA,"Winbond"},
+      {0xD5,"ISSI"},
+      {0xD5,"Nantronics"},
+      {0xEF,"Winbond"},
+      {0xF8,"Fidelix"},
+   };
+   const int dim = sizeof (flash_list) / sizeof (struct flash_manufacturer);
+   
+   int i;
+   
+   for (i = 0; i < dim; i++)
+   {
+      if (flash_list[i].id == id)
+      {
+         strcpy (man, flash_list[i].man);
+         break;
+      }
+   }
+   
+   if (i >= dim)
+      strcpy (man, "Unknown");
+   
+   return;
+}
+
+
+/**
+   Builds an instruction followed by an address, as long as the address mode in use requires.
+   
+   @param info pointer to struct flash_info
+   @param opcode instruction
+   @param address memory address
+   @param buf byte array to store the instruction in (at least 5 bytes)
+   
+   @return length of the instruction
+*/
+int flash_command (struct flash_info *info, byte opcode, qword address, byte *buf)
+{
+   int i, length;
+   
+   length = 1 + info->address_bytes;
+   
+   buf[0] = opcode;
+   for (i = 1; i < length; i++)
+      buf[i] = (byte)(address >> (8 * (length - 1 - i)));
+   
+   return length;
+}
+
+/**
+   Reads the status register of the flash memory (single USB transaction).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >=0 status register
+*/
+int flash_read_status (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   byte buf = RDSR;
+   byte flash_status;
+   
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, &buf, 1);
+   spi_read (ftdi, spi, &flash_status, 1);
+   spi_close (ftdi, spi);
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   DEBUG_PRINT ("DEBUG: [FLASH] Status register: 0x%.2X\n", flash_status);
+   
+   return flash_status;
+}
+
+/**
+   Clears the status register, so that no block is write-protected.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if status register cannot be written (e.g. WP# pin is low)
+   @retval >0 on success
+*/
+int flash_reset_status (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   byte buf[2] = { WRSR, 0x00 };
+   int flash_status;
+   
+   time_t start, end;
+   
+   if ((flash_status = flash_read_status (ftdi, spi)) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   /* if no BP bits is set, return */
+   if (!(flash_status & (BP2|BP1|BP0)))
+      return 1;
+   
+   /* else, at least one BP bit is set, and status register must be zeroed */
+   time (&start);
+   do
+   {
+      /* ensure WEL bit is set, then write new status */
+      spi_queue_begin (spi);
+      flash_write_enable (ftdi, spi);
+      spi_open (ftdi, spi);
+      spi_write (ftdi, spi, buf, 2);
+      spi_close (ftdi, spi);
+      if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR || flash_wait_ready (ftdi, spi, 0.0, 0.0) == SPI_USB_ERROR)
+         return SPI_USB_ERROR;
+   
+      if ((flash_status = flash_read_status (ftdi, spi)) == SPI_USB_ERROR)
+         return SPI_USB_ERROR;
+   
+      time (&end);
+   } while (difftime (end, start) < 10 && (flash_status & (BP2|BP1|BP0)));
+   
+   if (flash_status & (BP2|BP1|BP0))
+      return -1;
+   
+   return 1;
+}
+
+/**
+   Sets the write enable latch. Queued commands are not flushed, so that write enable and the following
+   instruction can be sent in a single USB transaction.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_write_enable (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   byte buf = WREN;
+   
+   /* set WEL bit = 1 */
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, &buf, 1);
+   
+   return spi_close (ftdi, spi);
+}
+
+/**
+   Waits for the flash memory to complete a program or erase operation.
+   <br>Polling the status register keeps SCLK and USB busy, so when the operation is expected to last
+   long, the host sleeps for FLASH_POLL_EARLY of its typical time before polling starts. The operation
+   is given up after FLASH_TIMEOUT_MARGIN times its maximum time (FLASH_BUSY_TIMEOUT if unknown).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param typical_time typical busy time, in seconds (0 to poll right away)
+   @param max_time maximum busy time, in seconds (0 if unknown)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout
+   @retval >0 on success
+*/
+int flash_wait_ready (struct ftdi_context *ftdi, struct spi_context *spi, double typical_time, double max_time)
+{
+   byte flash_status;
+   double timeout;
+   int ret;
+   
+   /* operation starts when its commands are written out */
+   if (spi_queue_flush (ftdi, spi) < 0)
+      return SPI_USB_ERROR;
+   
+   if (typical_time >= FLASH_POLL_SLEEP_MIN)
+      usleep ((useconds_t)(typical_time * FLASH_POLL_EARLY * 1e6));
+   
+   timeout = (max_time > 0) ? max_time * FLASH_TIMEOUT_MARGIN : FLASH_BUSY_TIMEOUT;
+   
+   /* status register is continously output until CS# is not high */
+   if ((ret = spi_poll_status (ftdi, spi, RDSR, WIP, 0, timeout, &flash_status)) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   if (ret < 0)
+      fprintf (stderr, "WARNING: EEPROM still busy after %.3f s (status: 0x%.2X)\n", timeout, flash_status);
+   
+   return ret;
+}
+
+
+/**
+   Reads data from the flash memory.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param address memory address to start reading from
+   @param data byte array to store data in
+   @param size size of data to read
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_read (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size)
+{
+   byte buf[5];
+   int length;
+   
+   length = flash_command (info, info->read_opcode, address, buf);
+   
+   /* CS# and read instruction in a single USB transaction, data is then read in chunks */
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, length);
+   spi_queue_end (ftdi, spi);
+   
+   spi_read (ftdi, spi, data, size);
+   
+   return spi_close (ftdi, spi);
+}
+
+/**
+   Reads data from the flash memory into a file, see spi_read_to_mapped_file.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param path path of the file to create
+   @param size size of data to read, from address 0
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on file error
+   @retval >0 on success
+*/
+int flash_read_to_file (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword size)
+{
+   byte buf[5];
+   int length, ret;
+   
+   length = flash_command (info, info->read_opcode, 0, buf);
+   
+   /* read command is flushed together with the first read request */
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, length);
+   ret = spi_read_to_mapped_file (ftdi, spi, path, size);
+   spi_close (ftdi, spi);
+   
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   return ret;
+}
+
+/**
+   Programs (part of) a page of the flash memory, then waits for the operation to complete. Data must not
+   cross a page boundary, or it wraps around to the start of the page.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param address memory address to start programming from
+   @param data byte array with data to program
+   @param size size of data (up to page size)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout
+   @retval >0 on success
+*/
+int flash_program_page (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size)
+{
+   byte buf[5];
+   int length;
+   
+   length = flash_command (info, info->program_opcode, address, buf);
+   
+   /* queue write enable and page program, so that they cost a single USB transaction */
+   spi_queue_begin (spi);
+   flash_write_enable (ftdi, spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, length);
+   spi_write (ftdi, spi, data, size);
+   spi_close (ftdi, spi);
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   return flash_wait_ready (ftdi, spi, info->page_time, info->page_max_time);
+}
+
+/**
+   Erases a sector or block of the flash memory, then waits for the operation to complete.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param type index of the erase type in info->erase
+   @param address memory address inside the sector or block
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout, or if type is not valid
+   @retval >0 on success
+*/
+int flash_erase (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, int type, qword address)
+{
+   struct flash_erase_type *erase;
+   byte buf[5];
+   int length;
+   
+   if (type < 0 || type >= info->erase_count)
+      return -1;
+   erase = &info->erase[type];
+   
+   length = flash_command (info, erase->opcode, address & ~(qword)(erase->size - 1), buf);
+   
+   spi_queue_begin (spi);
+   flash_write_enable (ftdi, spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, length);
+   spi_close (ftdi, spi);
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   return flash_wait_ready (ftdi, spi, erase->typical_time, erase->max_time);
+}
+
+/**
+   Erases the whole flash memory, then waits for the operation to complete.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout
+   @retval >0 on success
+*/
+int flash_erase_chip (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info)
+{
+   byte buf = CE;
+   
+   spi_queue_begin (spi);
+   flash_write_enable (ftdi, spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, &buf, 1);
+   spi_close (ftdi, spi);
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   return flash_wait_ready (ftdi, spi, info->chip_erase_time, info->chip_erase_max_time);
+}
+
+
+/**
+   Programs an image into the flash memory, from address 0.
+   <br>In incremental mode, the flash memory is read back FLASH_COMPARE_LENGTH bytes at a time and compared
+   with the image sector by sector (smallest erase type), see flash_compare_image: sectors already holding
+   the image are left alone and sectors where bits only need to go from 1 to 0 are programmed without
+   erasing. Data of the last sector beyond the end of the image is preserved.
+   <br>Otherwise every sector of the image is to be erased, while the rest of the chip may be erased too.
+   <br>Erases are then planned by flash_plan_erase (largest blocks or chip erase where cheaper) and issued
+   back-to-back. In both modes, pages that are already up to date or blank in the image are not programmed.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param image byte array with the image
+   @param size size of the image (up to info->size)
+   @param incremental non-zero to erase and program only the sectors that differ from the image
+   @param report pointer to struct flash_program_report to fill in
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout or memory allocation error
+   @retval >0 on success
+*/
+int flash_program_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                         int incremental, struct flash_program_report *report)
+{
+   struct flash_erase_plan plan;
+   byte *current, *state, *tail, *data;
+   double *sectors;
+   qword addr, length, count, window, i, j, first, last;
+   dword sector;
+   int ret;
+   double start;
+   
+   memset (report, 0, sizeof (struct flash_program_report));
+   report->size = size;
+   start = ftdi_monotonic_time ();
+   
+   /* ensure BUSY bit is cleared before starting */
+   if ((ret = flash_wait_ready (ftdi, spi, 0.0, 0.0)) < 0)
+      return ret;
+   
+   /* without erase types, the only choice is chip erase */
+   if (info->erase_count == 0)
+   {
+      incremental = 0;
+      sector = info->page_size;
+   }
+   else
+      sector = info->erase[0].size;
+   
+   count = (info->size + sector - 1) / sector;
+   window = (sector > FLASH_COMPARE_LENGTH) ? sector : FLASH_COMPARE_LENGTH;
+   
+   sectors = (double *)malloc (count * sizeof (double));
+   state = (byte *)malloc (count);
+   current = (byte *)malloc (window);
+   tail = (byte *)malloc (sector);
+   if (sectors == NULL || state == NULL || current == NULL || tail == NULL)
+   {
+      free (sectors);
+      free (state);
+      free (current);
+      free (tail);
+      return -1;
+   }
+   
+   if (incremental)
+      ret = flash_compare_image (ftdi, spi, info, image, size, current, window, state, sectors, tail);
+   else
+   {
+      /* sectors beyond the image do not matter */
+      for (i = 0; i < count; i++)
+      {
+         state[i] = (i * sector < size) ? FLASH_SECTOR_ERASE : FLASH_SECTOR_EQUAL;
+         sectors[i] = (i * sector < size) ? FLASH_SECTOR_DIRTY : 0.0;
+      }
+   }
+   
+   if (ret > 0 && (ret = flash_plan_erase (info, sectors, count, &plan)) > 0)
+   {
+      flash_print_plan (info, &plan);
+      ret = flash_run_plan (ftdi, spi, info, &plan);
+      report->erased = plan.erased;
+   
+      /* everything erased is to be programmed back */
+      for (i = 0; i < (qword)plan.count; i++)
+      {
+         first = plan.ops[i].address / sector;
+         last = first + ((plan.ops[i].type == FLASH_ERASE_CHIP) ? count : info->erase[plan.ops[i].type].size / sector);
+         for (j = first; j < last && j < count; j++)
+            state[j] = FLASH_SECTOR_ERASE;
+      }
+   
+      flash_free_plan (&plan);
+   }
+   
+   for (i = 0; i < count && i * sector < size && ret > 0; i++)
+   {
+      addr = i * sector;
+      length = size - addr;
+      data = image + addr;
+   
+      /* last sector of the image, completed with current data by flash_compare_image */
+      if (length < sector && incremental)
+      {
+         length = sector;
+         data = tail;
+      }
+      else if (length > sector)
+         length = sector;
+   
+      switch (state[i])
+      {
+         case FLASH_SECTOR_EQUAL:
+            report->unchanged += length;
+            break;
+         case FLASH_SECTOR_PROGRAM:
+            if ((ret = flash_read (ftdi, spi, info, addr, current, (int)length)) > 0)
+               ret = flash_program_pages (ftdi, spi, info, addr, data, current, length, report);
+            break;
+         case FLASH_SECTOR_ERASE:
+            /* following erased sectors are programmed in one go, so that pages are pipelined across them */
+            while (i + 1 < count && state[i + 1] == FLASH_SECTOR_ERASE && addr + length + sector <= size)
+            {
+               length += sector;
+               i++;
+            }
+            ret = flash_program_pages (ftdi, spi, info, addr, data, NULL, length, report);
+            break;
+      }
+   }
+   
+   free (sectors);
+   free (state);
+   free (current);
+   free (tail);
+   
+   report->time = ftdi_monotonic_time () - start;
+   
+   return ret;
+}
+
+/**
+   Auxiliary function used by flash_program_image: reads back the flash memory and compares it with the
+   image, sector by sector (smallest erase type). For flash_plan_erase, sectors that cannot be programmed
+   without erasing are dirty, the others cost the time needed to program back their pages that are not
+   blank and already hold the image, and sectors beyond the image must be kept.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param image byte array with the image
+   @param size size of the image
+   @param current byte array to read the flash memory in
+   @param window size of current (multiple of sector size)
+   @param state byte array to store FLASH_SECTOR_* state of every sector in
+   @param sectors array to store erase planner cost of every sector in
+   @param tail byte array to store the last sector of the image in, completed with current data (sector size)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
+*/
+int flash_compare_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                         byte *current, qword window, byte *state, double *sectors, byte *tail)
+{
+   qword addr, offset, length, count, i, page;
+   dword sector;
+   byte *target;
+   int ret;
+   time_t last, now;
+   
+   sector = info->erase[0].size;
+   count = (info->size + sector - 1) / sector;
+   
+   /* contents beyond the image are not read */
+   for (i = 0; i < count; i++)
+   {
+      state[i] = FLASH_SECTOR_EQUAL;
+      sectors[i] = FLASH_SECTOR_KEEP;
+   }
+   
+   time (&last);
+   
+   for (addr = 0; addr < size; addr += window)
+   {
+      /* windows and sectors are aligned, the last one may extend beyond the image */
+      if ((ret = flash_read (ftdi, spi, info, addr, current, (int)window)) < 0)
+         return ret;
+   
+      for (offset = 0; offset < window && addr + offset < size; offset += sector)
+      {
+         i = (addr + offset) / sector;
+         length = size - (addr + offset);
+         target = image + addr + offset;
+   
+         /* keep data beyond the end of the image */
+         if (length < sector)
+         {
+            memcpy (tail, target, length);
+            memcpy (tail + length, current + offset + length, sector - length);
+            target = tail;
+         }
+   
+         state[i] = flash_compare_sector (current + offset, target, sector);
+   
+         if (state[i] == FLASH_SECTOR_ERASE)
+         {
+            sectors[i] = FLASH_SECTOR_DIRTY;
+            continue;
+         }
+   
+         /* pages that would be skipped, unless the sector is erased with its neighbours */
+         sectors[i] = 0.0;
+         for (page = 0; page < sector; page += info->page_size)
+         {
+            if (!flash_is_blank (target + page, info->page_size) && memcmp (current + offset + page, target + page, info->page_size) == 0)
+               sectors[i] += flash_page_time (info);
+         }
+      }
+   
+      time (&now);
+      if (difftime (now, last) >= 1)
+      {
+         printf ("INFO: %.1f%% (%llu bytes checked)\n", 100.0 * (addr + offset) / size, (unsigned long long)(addr + offset));
+         last = now;
+      }
+   }
+   
+   return 1;
+}
+
+/**
+   Plans the cheapest set of erase operations covering all dirty sectors.
+   <br>Each block of every erase type (sizes must be multiples of each other) is either erased at once, or
+   split into the blocks of the next smaller type, whichever is cheaper according to typical erase times.
+   Erasing a block also costs the time needed to program back its clean sectors, so that a large block is
+   used only when most of it is dirty. Chip erase is chosen if it beats the best cover.
+   
+   @param info pointer to struct flash_info
+   @param sectors erase cost of every sector of the smallest erase type: FLASH_SECTOR_DIRTY if it must be
+                  erased, otherwise the time (in seconds) needed to program it back if it is erased anyway,
+                  FLASH_SECTOR_KEEP if it must not be erased
+   @param count number of sectors (whole chip)
+   @param plan pointer to struct flash_erase_plan to fill in, see flash_free_plan
+   
+   @retval <0 on memory allocation error
+   @retval >0 on success
+*/
+int flash_plan_erase (struct flash_info *info, double *sectors, qword count, struct flash_erase_plan *plan)
+{
+   double *cost[FLASH_ERASE_TYPES], *keep[FLASH_ERASE_TYPES];
+   byte *choice[FLASH_ERASE_TYPES];
+   int levels[FLASH_ERASE_TYPES];
+   int depth, i, j, k, dirty, ret;
+   qword b, blocks[FLASH_ERASE_TYPES], top, ratio, child, first, last;
+   dword sector;
+   double split, erase, total, chip;
+   
+   memset (plan, 0, sizeof (struct flash_erase_plan));
+   memset (cost, 0, sizeof (cost));
+   memset (keep, 0, sizeof (keep));
+   memset (choice, 0, sizeof (choice));
+   
+   if ((plan->ops = (struct flash_erase_op *)malloc ((count + 1) * sizeof (struct flash_erase_op))) == NULL)
+      return -1;
+   
+   dirty = 0;
+   for (b = 0; b < count && !dirty; b++)
+      dirty = (sectors[b] < 0);
+   
+   if (!dirty)
+      return 1;
+   
+   /* erase types forming a hierarchy of aligned blocks */
+   depth = 0;
+   for (i = 0; i < info->erase_count; i++)
+   {
+      if (depth == 0 || info->erase[i].size % info->erase[levels[depth - 1]].size == 0)
+         levels[depth++] = i;
+   }
+   
+   sector = (depth > 0) ? info->erase[levels[0]].size : 0;
+   top = (depth > 0) ? (count * sector + info->erase[levels[depth - 1]].size - 1) / info->erase[levels[depth - 1]].size : 0;
+   ret = 1;
+   
+   for (j = 0; j < depth && ret > 0; j++)
+   {
+      /* arrays are padded to whole top-level blocks */
+      blocks[j] = top * (info->erase[levels[depth - 1]].size / info->erase[levels[j]].size);
+      ratio = (j > 0) ? info->erase[levels[j]].size / info->erase[levels[j - 1]].size : 1;
+   
+      cost[j] = (double *)malloc (blocks[j] * sizeof (double));
+      keep[j] = (double *)malloc (blocks[j] * sizeof (double));
+      choice[j] = (byte *)calloc (blocks[j], 1);
+      if (cost[j] == NULL || keep[j] == NULL || choice[j] == NULL)
+      {
+         ret = -1;
+         break;
+      }
+   
+      for (b = 0; b < blocks[j]; b++)
+      {
+         if (j == 0)
+         {
+            /* dirty sectors must be erased, sectors beyond the chip cannot be */
+            split = (b < count && sectors[b] < 0) ? INFINITY : 0.0;
+            if (b >= count)
+               keep[j][b] = FLASH_SECTOR_KEEP;
+            else
+               keep[j][b] = (sectors[b] < 0) ? 0.0 : sectors[b];
+         }
+         else
+         {
+            split = 0.0;
+            keep[j][b] = 0.0;
+            for (child = b * ratio; child < (b + 1) * ratio; child++)
+            {
+               split += cost[j - 1][child];
+               keep[j][b] += keep[j - 1][child];
+            }
+         }
+   
+         erase = flash_erase_time (info, levels[j]) + keep[j][b];
+         choice[j][b] = (erase < split);
+         cost[j][b] = choice[j][b] ? erase : split;
+      }
+   }
+   
+   if (ret > 0)
+   {
+      total = INFINITY;
+      chip = flash_erase_time (info, FLASH_ERASE_CHIP);
+   
+      if (depth > 0)
+      {
+         total = 0.0;
+         for (b = 0; b < top; b++)
+         {
+            total += cost[depth - 1][b];
+            chip += keep[depth - 1][b];
+         }
+      }
+      else
+      {
+         for (b = 0; b < count; b++)
+            chip += (sectors[b] < 0) ? 0.0 : sectors[b];
+      }
+   
+      if (chip < total)
+      {
+         plan->ops[0].address = 0;
+         plan->ops[0].type = FLASH_ERASE_CHIP;
+         plan->count = 1;
+         plan->time = flash_erase_time (info, FLASH_ERASE_CHIP);
+         plan->erased = info->size;
+      }
+      else
+      {
+         for (b = 0; b < top; b++)
+            flash_plan_emit (info, plan, choice, levels, depth - 1, b);
+      }
+   
+      /* clean sectors erased anyway */
+      for (k = 0; k < plan->count; k++)
+      {
+         first = (plan->ops[k].type == FLASH_ERASE_CHIP) ? 0 : plan->ops[k].address / sector;
+         last = (plan->ops[k].type == FLASH_ERASE_CHIP) ? count : first + info->erase[plan->ops[k].type].size / sector;
+         for (b = first; b < last && b < count; b++)
+         {
+            if (sectors[b] > 0)
+               plan->restore_time += sectors[b];
+         }
+      }
+   }
+   
+   for (j = 0; j < depth; j++)
+   {
+      free (cost[j]);
+      free (keep[j]);
+      free (choice[j]);
+   }
+   
+   if (ret < 0)
+      flash_free_plan (plan);
+   
+   return ret;
+}
+
+/**
+   Auxiliary function used by flash_plan_erase: appends the erase operations chosen for a block to plan,
+   in address order.
+   
+   @param info pointer to struct flash_info
+   @param plan pointer to struct flash_erase_plan
+   @param choice for every level of the hierarchy, 1 for blocks erased at once
+   @param levels index in info->erase of every level of the hierarchy
+   @param level level of block
+   @param block index of block in its level
+*/
+void flash_plan_emit (struct flash_info *info, struct flash_erase_plan *plan, byte **choice, int *levels, int level, qword block)
+{
+   struct flash_erase_type *erase = &info->erase[levels[level]];
+   qword ratio, child;
+   
+   if (choice[level][block])
+   {
+      plan->ops[plan->count].address = block * erase->size;
+      plan->ops[plan->count].type = levels[level];
+      plan->count++;
+      plan->time += flash_erase_time (info, levels[level]);
+      plan->erased += erase->size;
+      return;
+   }
+   
+   if (level == 0)
+      return;
+   
+   ratio = erase->size / info->erase[levels[level - 1]].size;
+   for (child = block * ratio; child < (block + 1) * ratio; child++)
+      flash_plan_emit (info, plan, choice, levels, level - 1, child);
+   
+   return;
+}
+
+/**
+   Issues the erase operations of a plan back-to-back, each one followed by busy polling.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param plan pointer to struct flash_erase_plan
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout
+   @retval >0 on success
+*/
+int flash_run_plan (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, struct flash_erase_plan *plan)
+{
+   int i, ret;
+   
+   for (i = 0; i < plan->count; i++)
+   {
+      if (plan->ops[i].type == FLASH_ERASE_CHIP)
+         ret = flash_erase_chip (ftdi, spi, info);
+      else
+         ret = flash_erase (ftdi, spi, info, plan->ops[i].type, plan->ops[i].address);
+   
+      if (ret < 0)
+         return ret;
+   }
+   
+   return 1;
+}
+
+/**
+   Prints the erase operations of a plan and its predicted time.
+   
+   @param info pointer to struct flash_info
+   @param plan pointer to struct flash_erase_plan
+*/
+void flash_print_plan (struct flash_info *info, struct flash_erase_plan *plan)
+{
+   int counts[FLASH_ERASE_TYPES] = { 0 };
+   int i;
+   
+   if (plan->count == 1 && plan->ops[0].type == FLASH_ERASE_CHIP)
+   {
+      printf ("INFO: Erase plan: chip erase, predicted %.1f s\n", plan->time);
+      return;
+   }
+   
+   for (i = 0; i < plan->count; i++)
+      counts[plan->ops[i].type]++;
+   
+   printf ("INFO: Erase plan:");
+   for (i = info->erase_count - 1; i >= 0; i--)
+   {
+      if (counts[i] > 0)
+         printf (" %d x %u kB", counts[i], info->erase[i].size / 1024);
+   }
+   printf ("%s (%llu kB), predicted %.2f s (+%.2f s to program back clean sectors)\n", (plan->count == 0) ? " nothing" : "",
+           (unsigned long long)plan->erased / 1024, plan->time, plan->restore_time);
+   
+   return;
+}
+
+/**
+   Frees the erase operations of a plan.
+   
+   @param plan pointer to struct flash_erase_plan
+*/
+void flash_free_plan (struct flash_erase_plan *plan)
+{
+   free (plan->ops);
+   plan->ops = NULL;
+   plan->count = 0;
+   
+   return;
+}
+
+/**
+   Returns the typical time of an erase type, estimated from its size if unknown.
+   
+   @param info pointer to struct flash_info
+   @param type index of the erase type in info->erase, FLASH_ERASE_CHIP for chip erase
+   
+   @return typical erase time, in seconds
+*/
+double flash_erase_time (struct flash_info *info, int type)
+{
+   if (type == FLASH_ERASE_CHIP)
+      return (info->chip_erase_time > 0) ? info->chip_erase_time : FLASH_ERASE_SETUP_TIME + info->size / FLASH_ERASE_RATE;
+   
+   if (info->erase[type].typical_time > 0)
+      return info->erase[type].typical_time;
+   
+   return FLASH_ERASE_SETUP_TIME + info->erase[type].size / FLASH_ERASE_RATE;
+}
+
+/**
+   Returns the typical page program time, estimated if unknown.
+   
+   @param info pointer to struct flash_info
+   
+   @return typical page program time, in seconds
+*/
+double flash_page_time (struct flash_info *info)
+{
+   return (info->page_time > 0) ? info->page_time : FLASH_PAGE_TIME_ESTIMATE;
+}
+
+/**
+   Auxiliary function used by flash_program_image: programs data page by page, skipping pages that already
+   hold it and pages of data that are blank.
+   <br>Pages are pipelined: every page is a single MPSSE command stream (see flash_pipe_page) which also
+   waits for the page to be programmed, by clocking out idle bytes, then reads a burst of status bytes.
+   The stream of the next page is already queued in FTDI device while the status of a page is checked,
+   so SCLK never waits for the host and programming is bound by page program time rather than by USB
+   round trips. The idle time is tuned after every page, from where in its burst the page got ready.
+   If a page is still busy at the end of its burst, the next page (sent while busy, hence ignored) is
+   sent again once polling reports the flash memory ready.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param address memory address to start programming from (page-aligned)
+   @param data byte array with data to program
+   @param current byte array with current contents of the flash memory, NULL if erased
+   @param size size of data
+   @param report pointer to struct flash_program_report to update
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout or memory allocation error
+   @retval >0 on success
+*/
+int flash_program_pages (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data,
+                         byte *current, qword size, struct flash_program_report *report)
+{
+   struct ftdi_async async;
+   struct flash_pipe_entry pages[2];
+   byte status[2][SPI_POLL_MAX_BURST_LENGTH];
+   byte *streams, *stream;
+   qword offset;
+   int length, stream_size, burst, delay, ready, queued, n, ret, result;
+   double rate;
+   
+   /* SCLK bytes per second, and per page */
+   rate = spi_frequency (spi) / 8;
+   
+   burst = (int)(rate * flash_page_time (info) * FLASH_PIPE_BURST);
+   if (burst < FLASH_PIPE_MIN_BURST)
+      burst = FLASH_PIPE_MIN_BURST;
+   if (burst > SPI_POLL_MAX_BURST_LENGTH)
+      burst = SPI_POLL_MAX_BURST_LENGTH;
+   
+   /* first guess: the typical page time ends 1/FLASH_PIPE_TARGET into the status burst */
+   delay = (int)(rate * flash_page_time (info)) - burst / FLASH_PIPE_TARGET;
+   if (delay < 0)
+      delay = 0;
+   
+   /* streams of transfers still in flight must not be overwritten */
+   stream_size = info->page_size + FLASH_PIPE_OVERHEAD + 3 * FLASH_PIPE_MAX_DELAY;
+   if ((streams = (byte *)malloc ((FTDI_ASYNC_DEPTH + 1) * stream_size)) == NULL)
+      return -1;
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   offset = 0;
+   queued = 0;
+   n = 0;
+   ret = 1;
+   
+   while (ret > 0)
+   {
+      /* next page to program */
+      for (; offset < size; offset += length)
+      {
+         length = (size - offset > info->page_size) ? (int)info->page_size : (int)(size - offset);
+   
+         if (current != NULL && memcmp (current + offset, data + offset, length) == 0)
+            report->unchanged += length;
+         else if (flash_is_blank (data + offset, length))
+            report->blank += length;
+         else
+            break;
+      }
+   
+      if (offset < size)
+      {
+         stream = streams + (n++ % (FTDI_ASYNC_DEPTH + 1)) * stream_size;
+         if ((ret = flash_pipe_page (ftdi, spi, info, address + offset, data + offset, length, delay, burst,
+                                     stream, stream_size)) < 0)
+            break;
+   
+         if ((ret = ftdi_async_write (&async, stream, ret)) < 0)
+            break;
+   
+         pages[queued].offset = offset;
+         pages[queued].length = length;
+         pages[queued].delay = delay;
+         offset += length;
+   
+         /* status of the first page is read back right away, the others once the previous one is checked */
+         if (queued++ == 0)
+         {
+            ret = ftdi_async_read (&async, status[0], burst);
+            continue;
+         }
+      }
+      else if (queued == 0)
+         break;
+   
+      /* check the oldest page, while the newest one (if any) is being programmed */
+      if ((ret = ftdi_async_wait_read (&async)) < 0)
+         break;
+   
+      if (!(status[0][burst - 1] & WIP))
+      {
+         for (ready = 0; status[0][ready] & WIP; ready++);
+   
+         /* move the first ready status towards 1/FLASH_PIPE_TARGET of the burst: quickly when it was late,
+            slowly when early, since a page still busy at the end of its burst costs a round trip */
+         ready -= burst / FLASH_PIPE_TARGET;
+         delay = pages[0].delay + ((ready > 0) ? ready : ready / FLASH_PIPE_DECAY);
+         report->programmed += pages[0].length;
+      }
+      else
+      {
+         /* the newest page was sent while busy: drain its status, wait, then send it again */
+         if (queued > 1)
+         {
+            ftdi_async_read (&async, status[1], burst);
+            offset = pages[1].offset;
+         }
+   
+         if ((ret = ftdi_async_end (&async)) < 0)
+            break;
+   
+         if ((ret = flash_wait_ready (ftdi, spi, 0.0, info->page_max_time)) < 0)
+            break;
+   
+         report->programmed += pages[0].length;
+         delay = pages[0].delay + burst;
+         queued = 1;
+         ftdi_async_begin (&async, ftdi, &spi->stats);
+      }
+   
+      if (delay < 0)
+         delay = 0;
+      if (delay > 65536 * FLASH_PIPE_MAX_DELAY)
+         delay = 65536 * FLASH_PIPE_MAX_DELAY;
+   
+      if (--queued > 0)
+      {
+         pages[0] = pages[1];
+         ret = ftdi_async_read (&async, status[0], burst);
+      }
+   }
+   
+   /* buffers of transfers still in flight are freed only once they complete */
+   result = ftdi_async_end (&async);
+   free (streams);
+   
+   if (result < 0)
+      return spi_error (ftdi, spi, "Unable to program pages", result);
+   
+   return (ret < 0) ? ret : 1;
+}
+
+/**
+   Auxiliary function used by flash_program_pages: builds the MPSSE commands programming a page on their
+   own, without writing them out. Write enable and page program are followed by delay idle bytes clocked
+   out while CS# is high, then by a status register read lasting burst bytes.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param address memory address to start programming from
+   @param data byte array with data to program
+   @param size size of data (up to page size)
+   @param delay number of idle bytes (up to 65536 * FLASH_PIPE_MAX_DELAY)
+   @param burst number of status bytes to read back (up to SPI_POLL_MAX_BURST_LENGTH)
+   @param buf byte array to store commands in
+   @param buf_size size of buf (at least size + FLASH_PIPE_OVERHEAD + 3 * FLASH_PIPE_MAX_DELAY)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if commands do not fit in buf
+   @retval >0 length of commands
+*/
+int flash_pipe_page (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size,
+                     int delay, int burst, byte *buf, int buf_size)
+{
+   byte cmd[5];
+   int length, count, read_length;
+   
+   length = flash_command (info, info->program_opcode, address, cmd);
+   
+   spi_queue_begin (spi);
+   flash_write_enable (ftdi, spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, cmd, length);
+   spi_write (ftdi, spi, data, size);
+   spi_close (ftdi, spi);
+   
+   /* CS# is high: SCLK only lets time pass */
+   for (; delay > 0; delay -= count)
+   {
+      count = (delay > 65536) ? 65536 : delay;
+      cmd[0] = CLK_BYTES;
+      cmd[1] = GETBYTE (count - 1, 0);
+      cmd[2] = GETBYTE (count - 1, 1);
+      spi_queue_write (ftdi, spi, cmd, 3);
+   }
+   
+   /* status register is continously output until CS# is not high, read-back is left to the caller */
+   cmd[0] = RDSR;
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, cmd, 1);
+   spi_read (ftdi, spi, NULL, burst);
+   spi_close (ftdi, spi);
+   
+   length = spi_queue_detach (spi, buf, buf_size, &read_length);
+   
+   /* queue is empty, nothing is written out */
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
+   
+   return length;
+}
+
+/**
+   Compares the current contents of a sector with the data it should hold. Programming can only clear
+   bits, so the sector must be erased if any bit of target is set where current is not.
+   
+   @param current byte array with current contents of the sector
+   @param target byte array with data the sector should hold
+   @param size sector size
+   
+   @retval FLASH_SECTOR_EQUAL if sector already holds target
+   @retval FLASH_SECTOR_PROGRAM if target can be programmed over current
+   @retval FLASH_SECTOR_ERASE if sector must be erased first
+*/
+int flash_compare_sector (byte *current, byte *target, int size)
+{
+   int i;
+   
+   if (memcmp (current, target, size) == 0)
+      return FLASH_SECTOR_EQUAL;
+   
+   for (i = 0; i < size; i++)
+   {
+      if ((current[i] & target[i]) != target[i])
+         return FLASH_SECTOR_ERASE;
+   }
+   
+   return FLASH_SECTOR_PROGRAM;
+}
+
+/**
+   Checks whether data is blank, i.e. it is what an erased flash memory holds.
+   
+   @param data byte array
+   @param size size of data
+   
+   @retval 0 if data holds at least a byte other than 0xFF
+   @retval 1 if data is blank
+*/
+int flash_is_blank (byte *data, int size)
+{
+   /* data[0] == 0xFF and every byte equals the following one */
+   return size == 0 || (data[0] == 0xFF && memcmp (data, data + 1, size - 1) == 0);
+}
+
+/**
+   Prints what flash_program_image did.
+   
+   @param report pointer to struct flash_program_report
+*/
+void flash_print_report (struct flash_program_report *report)
+{
+   printf ("INFO: %llu bytes programmed, %llu bytes skipped (%llu unchanged, %llu blank), %llu bytes erased in %.1f s\n",
+           (unsigned long long)report->programmed, (unsigned long long)(report->unchanged + report->blank),
+           (unsigned long long)report->unchanged, (unsigned long long)report->blank, (unsigned long long)report->erased,
+           report->time);
+   
+   return;
+}
+
+
+/**
+   Verifies that the flash memory holds an image, without any temporary file: the flash memory is read
+   with spi_read_stream, and every segment is compared with the image while the next one is being read,
+   so verification runs at SPI read speed. Every mismatching range is recorded, not just the first one.
+   <br>report->ranges is allocated, see flash_free_verify_report.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param info pointer to struct flash_info
+   @param image byte array with the image (e.g. a file mapping)
+   @param size size of the image, from address 0
+   @param report pointer to struct flash_verify_report to fill in
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on memory allocation error
+   @retval 0 if the flash memory does not hold the image
+   @retval >0 if the flash memory holds the image
+*/
+int flash_verify_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                        struct flash_verify_report *report)
+{
+   byte buf[5];
+   byte *ring;
+   int length, ret;
+   double start;
+   
+   memset (report, 0, sizeof (struct flash_verify_report));
+   report->image = image;
+   report->size = size;
+   start = ftdi_monotonic_time ();
+   
+   if ((ring = (byte *)malloc (SPI_STREAM_RING_LENGTH)) == NULL)
+      return -1;
+   
+   length = flash_command (info, info->read_opcode, 0, buf);
+   
+   /* read command is flushed together with the first read request */
+   spi_queue_begin (spi);
+   spi_open (ftdi, spi);
+   spi_write (ftdi, spi, buf, length);
+   ret = spi_read_stream (ftdi, spi, ring, SPI_STREAM_RING_LENGTH, size, flash_verify_cb, report);
+   spi_close (ftdi, spi);
+   
+   if (spi_queue_end (ftdi, spi) == SPI_USB_ERROR)
+      ret = SPI_USB_ERROR;
+   
+   free (ring);
+   
+   report->time = ftdi_monotonic_time () - start;
+   
+   if (ret < 0)
+      return ret;
+   
+   /* stream is stopped only when ranges cannot be allocated */
+   if (ret == 0)
+      return -1;
+   
+   return (report->count == 0) ? 1 : 0;
+}
+
+/**
+   Auxiliary function used by flash_verify_image: compares a segment read back with the image. Equal
+   segments, by far the most common case, cost a single memcmp; the others are scanned byte by byte only
+   in FLASH_VERIFY_BLOCK blocks which differ.
+   
+   @param data segment data
+   @param size segment size
+   @param user pointer to struct flash_verify_report
+   
+   @retval 0 to continue streaming
+   @retval 1 to stop streaming (memory allocation error)
+*/
+int flash_verify_cb (byte *data, int size, void *user)
+{
+   struct flash_verify_report *report = (struct flash_verify_report *)user;
+   byte *image;
+   int i, j, block;
+   
+   image = report->image + report->verified;
+   
+   if (memcmp (data, image, size) != 0)
+   {
+      for (i = 0; i < size; i += block)
+      {
+         block = (size - i > FLASH_VERIFY_BLOCK) ? FLASH_VERIFY_BLOCK : size - i;
+   
+         if (memcmp (data + i, image + i, block) == 0)
+            continue;
+   
+         for (j = i; j < i + block; j++)
+         {
+            if (data[j] != image[j] && flash_add_mismatch (report, report->verified + j) < 0)
+               return 1;
+         }
+      }
+   }
+   
+   report->verified += size;
+   
+   return 0;
+}
+
+/**
+   Auxiliary function used by flash_verify_cb: records a mismatching byte, extending the last range if
+   it is adjacent to it (also across segments).
+   
+   @param report pointer to struct flash_verify_report
+   @param address address of the mismatching byte
+   
+   @retval <0 on memory allocation error
+   @retval >0 on success
+*/
+int flash_add_mismatch (struct flash_verify_report *report, qword address)
+{
+   struct flash_mismatch *ranges;
+   
+   report->mismatched++;
+   
+   if (report->count > 0)
+   {
+      ranges = &report->ranges[report->count - 1];
+      if (ranges->address + ranges->length == address)
+      {
+         ranges->length++;
+         return 1;
+      }
+   }
+   
+   if (report->count == report->allocated)
+   {
+      if ((ranges = (struct flash_mismatch *)realloc (report->ranges, 2 * (report->allocated + 8) * sizeof (struct flash_mismatch))) == NULL)
+         return -1;
+   
+      report->ranges = ranges;
+      report->allocated = 2 * (report->allocated + 8);
+   }
+   
+   report->ranges[report->count].address = address;
+   report->ranges[report->count].length = 1;
+   report->count++;
+   
+   return 1;
+}
+
+/**
+   Prints what flash_verify_image found: the first FLASH_VERIFY_PRINT mismatching ranges, then totals.
+   
+   @param report pointer to struct flash_verify_report
+*/
+void flash_print_verify_report (struct flash_verify_report *report)
+{
+   int i;
+   
+   for (i = 0; i < report->count && i < FLASH_VERIFY_PRINT; i++)
+   {
+      fprintf (stderr, "ERROR: Data mismatch at address 0x%.6llX-0x%.6llX (%llu bytes)\n",
+               (unsigned long long)report->ranges[i].address,
+               (unsigned long long)(report->ranges[i].address + report->ranges[i].length - 1),
+               (unsigned long long)report->ranges[i].length);
+   }
+   
+   if (report->count > FLASH_VERIFY_PRINT)
+      fprintf (stderr, "ERROR: ...and %d more mismatching ranges\n", report->count - FLASH_VERIFY_PRINT);
+   
+   printf ("INFO: %llu bytes verified, %llu bytes mismatching in %d range(s) in %.1f s\n",
+           (unsigned long long)report->verified, (unsigned long long)report->mismatched, report->count, report->time);
+   
+   return;
+}
+
+/**
+   Frees the mismatching ranges of a report.
+   
+   @param report pointer to struct flash_verify_report
+*/
+void flash_free_verify_report (struct flash_verify_report *report)
+{
+   free (report->ranges);
+   report->ranges = NULL;
+   report->count = 0;
+   report->allocated = 0;
+   
+   return;
+}
@@ -0,0 +1,357 @@
+/**
+   @defgroup DEF_FLASH_CMD Commands definition
+   @{
+*/
+#define WREN   0x06     /* Write enable */
+/* Sets the write enable latch bit (WEL) */
+#define WRDI   0x04     /* Write disable */
+/* Resets the write enable latch bit (WEL) */
+
+#define RDSR   0x05     /* Read status register */
+/* Reads out the status register */
+#define WRSR   0x01     /* Write status register */
+/* Writes new values to the status register */
+
+#define READ   0x03     /* Read data */
+/* Requires AD[1:3] as argument (24 bit Address Data) */
+/* Reads out n bytes until CS# goes high, the address is automatically increased to the next one */
+#define FREAD  0x0B     /* Fast read data */
+/* Requires AD[1:3] as argument (24 bit Address Data) */
+/* Reads out n bytes until CS# goes high, the address is automatically increased to the next one */
+
+#define PP     0x02     /* Page program */
+/* Requires AD[1:3] as argument (24 bit Address Data) and at least one data byte (up to 256) */
+/* If the eight least significan address bits are not all 0, the transmitted data that goes
+   beyond the current page will be programmed from the start address of the same page!
+
+   If more than 256 data bytes are sent to the device, only the last 256 data bytes will be
+   accepted and the previous data bytes will be diregarded!
+
+   If 256 data bytes are going to be programmed, set LSB of Address Data to 0 */
+/* Writes up to 256 bytes to the memory array */
+
+#define SE     0x20     /* Sector erase */
+/* Requires AS[1:3] as argument (24 bit Address Sector) */
+/* Erases data of the chosen sector (sets to 0xFF) */
+#define BE     0x52     /* or 0xD8, Block erase */
+/* Requires AB[1:3] as argument (24 bit Address Block) */
+/* Erases data of the chosen block (sets to 0xFF) */
+#define BE64   0xD8     /* 64 kB block erase */
+#define CE     0xC7     /* Chip erase */
+/* Erases data of the whole chip (sets to 0xFF) */
+
+#define DP     0xB9     /* Deep power-down */
+/* Enters deep power-down mode to minimize power consumption */
+#define RDP    0xAB     /* Release from deep power-down */
+/* Requires three dummy bytes as arguments */
+/* Releases the chip from deep power-down mode */
+
+#define RDID   0x9F     /* Read identification */
+/* Outputs the manufacturer ID and 2-byte device ID (24 bit total) */
+/* ID structure: 8-bit manufacturer ID, 8-bit memory type, 8-bit memory density */
+#define RES    0xAB     /* Read electronic ID */
+/* Reads out the old style of 8-bit Electronic Signature */
+/* ID structure: 8-bit electronic ID in a 24-bit structure */
+#define REMS   0x90     /* Read electronic manufacturer and device ID */
+/* Requires two dummy bytes and ADD as third argument (ADD = 0: output manufacturer ID first, ADD = 1: output device ID first) */
+/* Outputs the manufacturer ID and device ID */
+
+#define RDSFDP 0x5A     /* Read Serial Flash Discoverable Parameters */
+/* Requires AD[1:3] as argument (24 bit Address Data) and one dummy byte */
+/* Reads out the SFDP tables (JESD216), see flash_parse_sfdp */
+
+#define EN4B   0xB7     /* Enter 4-byte address mode */
+/* Every command taking an address requires AD[1:4] from now on */
+#define EX4B   0xE9     /* Exit 4-byte address mode */
+
+#define READ4  0x13     /* Read data with 4-byte address */
+#define PP4    0x12     /* Page program with 4-byte address */
+#define SE4    0x21     /* Sector erase with 4-byte address */
+#define BE4    0x5C     /* 32 kB block erase with 4-byte address */
+#define BE64_4 0xDC     /* 64 kB block erase with 4-byte address */
+/* Require AD[1:4] as argument, regardless of the address mode */
+/**@} */
+
+/* Status register structure:
+
+bits: 7     6     5     4     3     2     1     0
+      SRWD  0     0     BP2   BP1   BP0   WEL   WIP
+
+SRWD     = Status Register Write Protect,    0: SR can be written
+                                             1: SR cannot be written
+
+BP[2:0]  = Block Protection bits,            000: none
+                                             001: block 15
+                                             010: block 14-15
+                                             011: block 12-15
+                                             100: block 8-15
+                                             101 and over: all
+
+WEL      = Write Enable Latch,               0: Memory array cannot be written
+                                             1: Memory array can be written
+
+WIP      = Write In Progress,                0: Chip is in write operation
+                                             1: Chip is not in write operation
+*/
+#define SRWD 0x80
+#define BP2  0x10
+#define BP1  0x08
+#define BP0  0x04
+#define WEL  0x02
+#define WIP  0x01
+
+/**
+   @defgroup DEF_FLASH_SFDP SFDP tables (JESD216)
+   @{
+*/
+#define SFDP_SIGNATURE       0x50444653   /* "SFDP", first dword of the SFDP header */
+#define SFDP_BFPT_ID         0xFF00       /* JEDEC Basic Flash Parameter Table */
+#define SFDP_4BAIT_ID        0xFF84       /* JEDEC 4-byte Address Instruction Table */
+#define SFDP_MAX_HEADERS     16           /* parameter headers read by flash_parse_sfdp */
+#define SFDP_MAX_DWORDS      64           /* longest parameter table read by flash_parse_sfdp */
+
+/* BFPT fields: dword (1-based, as in JESD216), start bit, length */
+#define BFPT_ADDRESS_BYTES   1, 17, 2     /* 0: 3-byte only, 1: 3 or 4-byte, 2: 4-byte only */
+#define BFPT_DENSITY         2, 0, 32     /* bit 31 = 0: size in bits - 1, bit 31 = 1: log2 of size in bits */
+#define BFPT_4BYTE_ENTRY     16, 24, 8    /* ways of entering 4-byte address mode (JESD216B) */
+
+/* BFPT dwords holding several fields, see flash_parse_bfpt */
+#define BFPT_ERASE_TYPES     8            /* dwords 8-9: log2 of size (0 if not supported) and opcode of erase types 1 to 4 */
+#define BFPT_ERASE_TIMES     10           /* typical times of erase types 1 to 4, maximum time multiplier */
+#define BFPT_PROGRAM_TIMES   11           /* page size, typical page program and chip erase times, maximum time multiplier */
+
+#define BFPT_4BYTE_EN4B      0x01         /* issue EN4B */
+#define BFPT_4BYTE_WREN_EN4B 0x02         /* issue WREN, then EN4B */
+#define BFPT_4BYTE_OPCODES   0x20         /* dedicated 4-byte address instruction set */
+#define BFPT_4BYTE_ALWAYS    0x40         /* always operates in 4-byte address mode */
+
+/* 4BAIT, dword 1: instructions supported */
+#define SFDP_4BAIT_READ      0x0001       /* READ4 */
+#define SFDP_4BAIT_PP        0x0040       /* PP4 */
+#define SFDP_4BAIT_ERASE_1   0x0200       /* erase type 1 with 4-byte address (next bits: types 2 to 4) */
+#define SFDP_4BAIT_OPCODES   2            /* dword holding the 4-byte address opcodes of erase types 1 to 4 */
+/**@} */
+
+/**
+   @defgroup DEF_FLASH_INFO Flash geometry and timings
+   @{
+*/
+#define FLASH_NAME_LENGTH        64           /* maximum length of manufacturer and part names */
+#define FLASH_ERASE_TYPES        4            /* erase granularities described by SFDP */
+#define FLASH_3BYTE_LIMIT        (1 << 24)    /* first address that cannot be reached with a 3-byte address */
+#define FLASH_DEFAULT_PAGE       256          /* page size assumed if not detected */
+
+#define FLASH_ADDR_3BYTE         0            /* 3-byte addresses only */
+#define FLASH_ADDR_4BYTE_OPCODES 1            /* dedicated 4-byte address instructions (READ4, PP4, SE4...) */
+#define FLASH_ADDR_4BYTE_MODE    2            /* EN4B entered, usual instructions take a 4-byte address */
+
+#define FLASH_SOURCE_DEFAULT     0            /* geometry guessed from JEDEC ID density byte */
+#define FLASH_SOURCE_DATABASE    1            /* geometry from built-in part database */
+#define FLASH_SOURCE_SFDP        2            /* geometry read from the chip */
+
+#define FLASH_BUSY_TIMEOUT       300          /* Maximum time spent waiting for WIP to clear (chip erase), in seconds */
+#define FLASH_POLL_EARLY         0.8          /* fraction of typical busy time slept before polling starts */
+#define FLASH_POLL_SLEEP_MIN     2e-3         /* shorter typical busy times are polled right away, in seconds */
+#define FLASH_TIMEOUT_MARGIN     2.0          /* busy timeout as a multiple of the maximum busy time */
+/**@} */
+
+/**
+   @defgroup DEF_FLASH_PROGRAM Image programming
+   @{
+*/
+#define FLASH_COMPARE_LENGTH     65536        /* flash memory read at once when comparing it with an image */
+
+#define FLASH_SECTOR_EQUAL       0            /* sector already holds the image */
+#define FLASH_SECTOR_PROGRAM     1            /* image can be programmed without erasing (bits only go from 1 to 0) */
+#define FLASH_SECTOR_ERASE       2            /* sector must be erased first */
+
+#define FLASH_SECTOR_DIRTY       (-1.0)       /* erase planner: sector must be erased */
+#define FLASH_SECTOR_KEEP        1e30         /* erase planner: sector must not be erased (contents unknown) */
+#define FLASH_ERASE_CHIP         (-1)         /* erase type of a chip erase in a plan */
+
+#define FLASH_ERASE_SETUP_TIME   30e-3        /* unknown erase times are estimated as setup time... */
+#define FLASH_ERASE_RATE         1e6          /* ...plus erased bytes at this rate, in bytes per second */
+#define FLASH_PAGE_TIME_ESTIMATE 0.7e-3       /* estimate of unknown page program time, in seconds */
+
+#define FLASH_PIPE_BURST         0.1          /* pipelined programming: status burst, as a fraction of page program time */
+#define FLASH_PIPE_MIN_BURST     16           /* shortest status burst, in bytes */
+#define FLASH_PIPE_TARGET        4            /* idle clocks are tuned for the page to be ready within 1/4 of the burst... */
+#define FLASH_PIPE_DECAY         8            /* ...and shortened by 1/8 of the excess after every page */
+#define FLASH_PIPE_MAX_DELAY     16           /* most idle clock commands (65536 bytes each) per page */
+#define FLASH_PIPE_OVERHEAD      64           /* longest MPSSE commands around page data and idle clocks, in bytes */
+/**@} */
+
+/**
+   @defgroup DEF_FLASH_VERIFY Image verification
+   @{
+*/
+#define FLASH_VERIFY_BLOCK       64           /* a mismatching segment is scanned byte by byte only in blocks that differ */
+#define FLASH_VERIFY_PRINT       32           /* mismatching ranges printed by flash_print_verify_report */
+/**@} */
+
+/* Erase instruction of a given granularity */
+struct flash_erase_type
+{
+   dword size;                         /* erased bytes (aligned to size) */
+   byte opcode;                        /* instruction, for the address mode in use */
+   byte opcode_4byte;                  /* same instruction taking a 4-byte address (0 if none) */
+   double typical_time;                /* typical busy time, in seconds */
+   double max_time;                    /* maximum busy time, in seconds */
+};
+
+/* Geometry, instructions and timings of a SPI NOR flash, see flash_probe */
+struct flash_info
+{
+   byte id[3];                                       /* JEDEC ID: manufacturer, memory type, density */
+   char manufacturer[FLASH_NAME_LENGTH];
+   char name[FLASH_NAME_LENGTH];                     /* part name, if known */
+   int source;                                       /* FLASH_SOURCE_* */
+
+   qword size;                                       /* memory size, in bytes */
+   dword page_size;                                  /* largest program granularity, in bytes */
+
+   int address_mode;                                 /* FLASH_ADDR_* */
+   int address_bytes;                                /* 3 or 4 */
+   int enter_4byte;                                  /* BFPT_4BYTE_* ways of reaching 4-byte addresses */
+   byte read_opcode;                                 /* READ or READ4 */
+   byte program_opcode;                              /* PP or PP4 */
+
+   struct flash_erase_type erase[FLASH_ERASE_TYPES]; /* sorted by size, smallest first */
+   int erase_count;
+
+   double page_time;                                 /* typical page program time, in seconds */
+   double page_max_time;
+   double chip_erase_time;                           /* typical chip erase time, in seconds */
+   double chip_erase_max_time;
+};
+
+/* Outcome of flash_program_image, in bytes */
+struct flash_program_report
+{
+   qword size;                         /* image size */
+   qword unchanged;                    /* pages already holding the image */
+   qword blank;                        /* blank (0xFF) pages of the image, not programmed */
+   qword programmed;                   /* pages programmed */
+   qword erased;                       /* sectors erased */
+   double time;                        /* elapsed time, in seconds */
+};
+
+/* Page written out by flash_program_pages, whose status burst has not been checked yet */
+struct flash_pipe_entry
+{
+   qword offset;                       /* offset of the page in data */
+   int length;                         /* length of the page */
+   int delay;                          /* idle bytes clocked out before its status burst */
+};
+
+/* Range of the flash memory which does not hold the image */
+struct flash_mismatch
+{
+   qword address;                      /* first mismatching byte */
+   qword length;                       /* number of consecutive mismatching bytes */
+};
+
+/* Outcome of flash_verify_image, also state of its read stream */
+struct flash_verify_report
+{
+   byte *image;                        /* image being verified */
+   qword size;                         /* image size */
+   qword verified;                     /* bytes read back and compared */
+   qword mismatched;                   /* bytes not holding the image */
+   
+   struct flash_mismatch *ranges;      /* every mismatching range, in address order */
+   int count;                          /* number of ranges */
+   int allocated;                      /* capacity of ranges */
+   
+   double time;                        /* elapsed time, in seconds */
+};
+
+/* Single erase operation of a plan */
+struct flash_erase_op
+{
+   qword address;                      /* first erased byte */
+   int type;                           /* index in flash_info.erase, FLASH_ERASE_CHIP for chip erase */
+};
+
+/* Erase operations covering a set of dirty sectors, see flash_plan_erase */
+struct flash_erase_plan
+{
+   struct flash_erase_op *ops;         /* in address order */
+   int count;
+   qword erased;                       /* erased bytes */
+   double time;                        /* predicted erase time (typical), in seconds */
+   double restore_time;                /* predicted time spent programming back clean sectors erased with dirty ones */
+};
+
+/* Entry of the built-in part database, used when SFDP is not available */
+struct flash_part
+{
+   byte id[3];
+   const char *name;
+   dword size_kb;                      /* memory size, in kB */
+   dword sector_kb, block32_kb, block64_kb;  /* erase sizes (0 if not supported) */
+   double page_ms, sector_ms, block32_ms, block64_ms;   /* typical busy times */
+   double chip_s;
+   int enter_4byte;                    /* BFPT_4BYTE_* ways of reaching 4-byte addresses */
+};
+
+struct flash_manufacturer
+{
+   byte id;
+   char man[64];
+};
+
+
+int flash_probe (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
+int flash_read_id (struct ftdi_context *ftdi, struct spi_context *spi, byte *id);
+int flash_read_sfdp (struct ftdi_context *ftdi, struct spi_context *spi, dword address, byte *data, int size);
+int flash_parse_sfdp (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
+int flash_parse_bfpt (struct flash_info *info, dword *bfpt, int count);
+int flash_parse_4bait (struct flash_info *info, dword *bfpt, int bfpt_count, dword *table, int count);
+dword flash_sfdp_field (dword *table, int count, int dword_index, int start_bit, int length);
+int flash_lookup_part (struct flash_info *info);
+int flash_default_geometry (struct flash_info *info);
+void flash_add_erase_type (struct flash_info *info, dword size, byte opcode, double typical_time, double max_time);
+byte flash_opcode_4byte (byte opcode);
+int flash_set_address_mode (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
+int flash_restore_address_mode (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
+void flash_print_info (struct flash_info *info);
+void flash_id_manufacturer (byte id, char *man);
+
+int flash_command (struct flash_info *info, byte opcode, qword address, byte *buf);
+int flash_read_status (struct ftdi_context *ftdi, struct spi_context *spi);
+int flash_reset_status (struct ftdi_context *ftdi, struct spi_context *spi);
+int flash_write_enable (struct ftdi_context *ftdi, struct spi_context *spi);
+int flash_wait_ready (struct ftdi_context *ftdi, struct spi_context *spi, double typical_time, double max_time);
+
+int flash_read (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size);
+int flash_read_to_file (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, const char *path, qword size);
+int flash_program_page (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size);
+int flash_erase (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, int type, qword address);
+int flash_erase_chip (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info);
+
+int flash_program_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                         int incremental, struct flash_program_report *report);
+int flash_compare_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                         byte *current, qword window, byte *state, double *sectors, byte *tail);
+int flash_plan_erase (struct flash_info *info, double *sectors, qword count, struct flash_erase_plan *plan);
+void flash_plan_emit (struct flash_info *info, struct flash_erase_plan *plan, byte **choice, int *levels, int level, qword block);
+int flash_run_plan (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, struct flash_erase_plan *plan);
+void flash_print_plan (struct flash_info *info, struct flash_erase_plan *plan);
+void flash_free_plan (struct flash_erase_plan *plan);
+double flash_erase_time (struct flash_info *info, int type);
+double flash_page_time (struct flash_info *info);
+int flash_program_pages (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data,
+                         byte *current, qword size, struct flash_program_report *report);
+int flash_pipe_page (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, qword address, byte *data, int size,
+                     int delay, int burst, byte *buf, int buf_size);
+int flash_compare_sector (byte *current, byte *target, int size);
+int flash_is_blank (byte *data, int size);
+void flash_print_report (struct flash_program_report *report);
+
+int flash_verify_image (struct ftdi_context *ftdi, struct spi_context *spi, struct flash_info *info, byte *image, qword size,
+                        struct flash_verify_report *report);
+int flash_verify_cb (byte *data, int size, void *user);
+int flash_add_mismatch (struct flash_verify_report *report, qword address);
+void flash_print_verify_report (struct flash_verify_report *report);
+void flash_free_verify_report (struct flash_verify_report *report);
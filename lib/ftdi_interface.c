@@ -1,22 +1,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <libftdi1/ftdi.h>
 
 #include "ftdi_interface.h"
 
 /**
    Initialises a new ftdi_context structure and configures all the parameters required for 
-   a correct USB communication.
+   a correct USB communication. The first FT2232H device found is opened.
+   <br>Program execution is aborted if no device can be opened: services that must keep running 
+   should use ftdi_open_device instead.
    
    @return pointer to initialised ftdi_context
 */
 struct ftdi_context *ftdi_open (void)
 {
-   int ret;
    struct ftdi_context *ftdi;
+   
+   if ((ftdi = ftdi_open_device (NULL)) == NULL)
+      exit (EXIT_FAILURE);
+   
+   return ftdi;
+}
+
+/**
+   Initialises a new ftdi_context structure on the FT2232H device chosen by selector, and configures 
+   all the parameters required for a correct USB communication.
+   <br>Selector formats:
+   - NULL or "": first device found
+   - "i:index": device index, in enumeration order (see ftdi_find_devices)
+   - "s:serial": device serial number
+   - "p:bus-port.port...": USB bus and port path, e.g. "p:1-4.2"
+   
+   Any of them may be followed by "@A" or "@B" to choose the MPSSE channel (interface A by default), 
+   e.g. "s:FT1234@B" or just "@B".
+   <br>Every context has its own libusb context, so devices (and the two channels of the same device) 
+   opened with this function can be driven by different threads at the same time.
+   
+   @param selector device selector string (or NULL)
+   
+   @return pointer to initialised ftdi_context (NULL if no device matches selector, or it cannot be opened)
+*/
+struct ftdi_context *ftdi_open_device (const char *selector)
+{
+   int i, ret;
+   char device[FTDI_STRING_LENGTH];
+   enum ftdi_interface interface;
+   struct ftdi_context *ftdi;
+   struct ftdi_device_list *list, *curr;
    struct ftdi_version_info version;
+   
+   if (ftdi_selector_split (selector, device, FTDI_STRING_LENGTH, &interface) < 0)
+   {
+      fprintf (stderr, "ERROR: Invalid channel in device selector '%s'\n", selector);
+      return NULL;
+   }
 
    /* print libftdi info */
    version = ftdi_get_library_version ();
@@ -27,33 +68,52 @@ struct ftdi_context *ftdi_open (void)
    if ((ftdi = ftdi_new ()) == NULL)
    {
       fprintf (stderr, "ERROR: failed to initialise ftdi structure\n");
-      exit (EXIT_FAILURE);
+      return NULL;
    }
    
-   /* set Interface A */
-   if ((ret = ftdi_set_interface (ftdi, INTERFACE_A)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set interface: %d (%s)\n", ret);
+   /* set selected interface (channel) */
+   if ((ret = ftdi_set_interface (ftdi, interface)) < 0)
+      return ftdi_open_error (ftdi, "ERROR: Unable to set interface: %d (%s)\n", ret);
+   
+   /* look for the selected ft2232h */
+   if ((ret = ftdi_usb_find_all (ftdi, &list, FTDI_VID, FTDI_PID)) < 0)
+      return ftdi_open_error (ftdi, "ERROR: Unable to enumerate ftdi devices: %d (%s)\n", ret);
+   
+   for (curr = list, i = 0; curr != NULL; curr = curr->next, i++)
+   {
+      if (ftdi_device_match (ftdi, curr->dev, i, device))
+         break;
+   }
+   
+   if (curr == NULL)
+   {
+      fprintf (stderr, "ERROR: No ftdi device matches '%s' (%d found)\n", selector ? selector : "", i);
+      ftdi_list_free (&list);
+      ftdi_free (ftdi);
+      return NULL;
+   }
    
    /* open USB connection and connect to ft2232h */
-   if ((ret = ftdi_usb_open (ftdi, 0x0403, 0x6010)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to open ftdi device: %d (%s)\n", ret);
+   ret = ftdi_usb_open_dev (ftdi, curr->dev);
+   ftdi_list_free (&list);
+   if (ret < 0)
+      return ftdi_open_error (ftdi, "ERROR: Unable to open ftdi device: %d (%s)\n", ret);
    
    /* reset usb parameters */
    if ((ret = ftdi_usb_reset (ftdi)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to reset ftdi device: %d (%s)\n", ret);
+      return ftdi_open_error (ftdi, "ERROR: Unable to reset ftdi device: %d (%s)\n", ret);
    
-   /* not needed (yet?) */
-   /* set write chunk size */
-   /*if ((ret = ftdi_write_data_set_chunksize (ftdi, 65536)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set write chunk size: %d (%s)\n", ret);*/
+   /* set write chunk size: large bulk transfers keep the bus busy */
+   if ((ret = ftdi_write_data_set_chunksize (ftdi, FTDI_USB_CHUNK_LENGTH)) < 0)
+      return ftdi_open_error (ftdi, "ERROR: Unable to set write chunk size: %d (%s)\n", ret);
    
    /* set read chunk size */
-   /*if ((ret = ftdi_read_data_set_chunksize (ftdi, 65536)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set read chunk size: %d (%s)\n", ret);*/
+   if ((ret = ftdi_read_data_set_chunksize (ftdi, FTDI_USB_CHUNK_LENGTH)) < 0)
+      return ftdi_open_error (ftdi, "ERROR: Unable to set read chunk size: %d (%s)\n", ret);
    
    /* set latency timer: this allows us to retrieve data from device faster */
    if ((ret = ftdi_set_latency_timer (ftdi, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set latency timer: %d (%s)\n", ret);
+      return ftdi_open_error (ftdi, "ERROR: Unable to set latency timer: %d (%s)\n", ret);
    
    /* AN_114 note */
    usleep (50000);
@@ -62,26 +122,237 @@ struct ftdi_context *ftdi_open (void)
 }
 
 /**
-   Closes USB communication with FTDI device and de-allocates ftdi_context structure.
+   Auxiliary function used by ftdi_open_device to give up opening a device. Prints information about 
+   the error and de-allocates ftdi_context structure.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param error_string string containing error information
+   @param error_code error code value
+   
+   @return NULL
+*/
+struct ftdi_context *ftdi_open_error (struct ftdi_context *ftdi, char *error_string, int error_code)
+{
+   fprintf (stderr, error_string, error_code, ftdi_get_error_string (ftdi));
+   
+   ftdi_free (ftdi);
+   
+   return NULL;
+}
+
+/**
+   Opens both MPSSE channels (interface A and B) of the FT2232H device chosen by selector, as two 
+   independent contexts. Each channel has its own USB handle, command queue and SPI context, and can be 
+   driven by its own thread (see also ftdi_pool).
+   
+   @param selector device selector string (or NULL), see ftdi_open_device, without channel suffix
+   @param channel_a pointer to store interface A context in
+   @param channel_b pointer to store interface B context in
+   
+   @retval <0 if no device matches selector
+   @retval >0 on success
+*/
+int ftdi_open_channels (const char *selector, struct ftdi_context **channel_a, struct ftdi_context **channel_b)
+{
+   char device[FTDI_STRING_LENGTH];
+   
+   snprintf (device, FTDI_STRING_LENGTH, "%s@A", selector ? selector : "");
+   if ((*channel_a = ftdi_open_device (device)) == NULL)
+      return -1;
+   
+   snprintf (device, FTDI_STRING_LENGTH, "%s@B", selector ? selector : "");
+   if ((*channel_b = ftdi_open_device (device)) == NULL)
+   {
+      ftdi_close (*channel_a);
+      *channel_a = NULL;
+      return -1;
+   }
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by ftdi_open_device to split a selector into device selector and 
+   channel suffix ("@A" or "@B").
+   
+   @param selector device selector string (or NULL)
+   @param device string to store device selector in (without channel suffix)
+   @param size size of device string
+   @param interface pointer to store channel in (INTERFACE_A if there is no suffix)
+   
+   @retval <0 if channel suffix is not valid
+   @retval >0 on success
+*/
+int ftdi_selector_split (const char *selector, char *device, int size, enum ftdi_interface *interface)
+{
+   const char *suffix;
+   int length;
+   
+   *interface = INTERFACE_A;
+   
+   if (selector == NULL)
+   {
+      device[0] = '\0';
+      return 1;
+   }
+   
+   /* serial numbers may contain '@' too: only the last one starts a suffix */
+   length = strlen (selector);
+   if ((suffix = strrchr (selector, '@')) != NULL)
+   {
+      length = suffix - selector;
+      
+      if (strcmp (suffix, "@A") == 0 || strcmp (suffix, "@a") == 0)
+         *interface = INTERFACE_A;
+      else if (strcmp (suffix, "@B") == 0 || strcmp (suffix, "@b") == 0)
+         *interface = INTERFACE_B;
+      else
+         return -1;
+   }
+   
+   snprintf (device, size, "%.*s", length, selector);
+   
+   return 1;
+}
+
+/**
+   Lists all FT2232H devices connected, in enumeration order (the order used by "i:" selectors).
+   
+   @param devices array to store device information in
+   @param max size of devices array
+   
+   @retval <0 if devices cannot be enumerated
+   @retval >=0 number of devices found (only the first max are stored)
+*/
+int ftdi_find_devices (struct ftdi_device_info *devices, int max)
+{
+   int i, ret;
+   struct ftdi_context *ftdi;
+   struct ftdi_device_list *list, *curr;
+   
+   if ((ftdi = ftdi_new ()) == NULL)
+   {
+      fprintf (stderr, "ERROR: failed to initialise ftdi structure\n");
+      return -1;
+   }
+   
+   if ((ret = ftdi_usb_find_all (ftdi, &list, FTDI_VID, FTDI_PID)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to enumerate ftdi devices: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      ftdi_free (ftdi);
+      return ret;
+   }
+   
+   for (curr = list, i = 0; curr != NULL; curr = curr->next, i++)
+   {
+      if (i >= max)
+         continue;
+      
+      devices[i].index = i;
+      devices[i].bus = libusb_get_bus_number (curr->dev);
+      ftdi_device_path (curr->dev, devices[i].path, FTDI_PATH_LENGTH);
+      
+      /* strings are unavailable if device is in use by another driver */
+      if (ftdi_usb_get_strings (ftdi, curr->dev, NULL, 0, devices[i].description, FTDI_STRING_LENGTH, 
+                                devices[i].serial, FTDI_STRING_LENGTH) < 0)
+      {
+         devices[i].description[0] = '\0';
+         devices[i].serial[0] = '\0';
+      }
+   }
+   
+   ftdi_list_free (&list);
+   ftdi_free (ftdi);
+   
+   return i;
+}
+
+/**
+   Auxiliary function used by ftdi_open_device to check if a device matches selector.
+   
+   @param ftdi pointer to struct ftdi_context (used to read device strings)
+   @param dev pointer to libusb device
+   @param index device index, in enumeration order
+   @param selector device selector string (or NULL), see ftdi_open_device
+   
+   @retval 1 if device matches
+   @retval 0 otherwise
+*/
+int ftdi_device_match (struct ftdi_context *ftdi, struct libusb_device *dev, int index, const char *selector)
+{
+   char str[FTDI_STRING_LENGTH];
+   
+   if (selector == NULL || selector[0] == '\0')
+      return index == 0;
+   
+   if (strncmp (selector, "i:", 2) == 0)
+      return index == atoi (selector + 2);
+   
+   if (strncmp (selector, "s:", 2) == 0)
+      return ftdi_usb_get_strings (ftdi, dev, NULL, 0, NULL, 0, str, FTDI_STRING_LENGTH) >= 0 && 
+             strcmp (str, selector + 2) == 0;
+   
+   if (strncmp (selector, "p:", 2) == 0)
+      return ftdi_device_path (dev, str, FTDI_STRING_LENGTH) > 0 && strcmp (str, selector + 2) == 0;
+   
+   if (index == 0)
+      fprintf (stderr, "WARNING: Invalid device selector '%s'\n", selector);
+   
+   return 0;
+}
+
+/**
+   Builds the USB bus and port path of a device, e.g. "1-4.2" (bus 1, port 4 of root hub, port 2 of 
+   the hub connected to it).
+   
+   @param dev pointer to libusb device
+   @param path string to store path in
+   @param size size of path string
+   
+   @retval <=0 if port numbers are not available
+   @retval >0 on success (number of ports in path)
+*/
+int ftdi_device_path (struct libusb_device *dev, char *path, int size)
+{
+   uint8_t ports[FTDI_MAX_PORT_DEPTH];
+   int i, count, length;
+   
+   count = libusb_get_port_numbers (dev, ports, FTDI_MAX_PORT_DEPTH);
+   
+   length = snprintf (path, size, "%d", libusb_get_bus_number (dev));
+   for (i = 0; i < count && length < size; i++)
+      length += snprintf (path + length, size - length, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+   
+   return count;
+}
+
+/**
+   Closes USB communication with FTDI device and de-allocates ftdi_context structure. 
+   The structure is de-allocated even if the connection cannot be closed cleanly.
    
    @param ftdi pointer to struct ftdi_context
+   
+   @retval <0 if USB connection cannot be closed
+   @retval >0 on success
 */
-void ftdi_close (struct ftdi_context *ftdi)
+int ftdi_close (struct ftdi_context *ftdi)
 {
    int ret;
    
    /* close usb connection */
    if ((ret = ftdi_usb_close (ftdi)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to close ftdi device: %d (%s)\n", ret);
+      fprintf (stderr, "ERROR: Unable to close ftdi device: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
    
    ftdi_free (ftdi);
    
-   return;
+   return (ret < 0) ? ret : 1;
 }
 
 /**
    Auxiliary function used to abort program execution if a communication error is received. 
    Prints information about the error.
+   <br>Not used by the library anymore (communication errors are returned to the caller, see 
+   spi_error), left for programs that prefer to give up on the first error.
    
    @param ftdi pointer to struct ftdi_context
    @param error_string string containing error information
@@ -99,6 +370,7 @@ void ftdi_exit (struct ftdi_context *ftdi, char *error_string, int error_code)
    Writes data (command) to FTDI device, then checks if the device has received a bad command or not.
    
    @param ftdi pointer to struct ftdi_context
+   @param stats pointer to struct ftdi_stats to be updated (can be NULL)
    @param data byte array (to read written data from)
    @param size size of data array
    
@@ -106,87 +378,492 @@ void ftdi_exit (struct ftdi_context *ftdi, char *error_string, int error_code)
    @retval <0 if communication error
    @retval >0 if success (number of bytes written). 
 */
-int ftdi_write_data_and_check (struct ftdi_context *ftdi, byte *data, int size)
+int ftdi_write_data_and_check (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size)
 {
-   int ret, written_offset;
+   int ret, written_offset, length, attempts;
    byte buf[2];
    
    if ((ret = ftdi_write_data (ftdi, data, size)) < 0)
+   {
+      if (stats != NULL)
+         stats->errors++;
       return ret;
+   }
    
    /* save written offset */
    written_offset = ret;
    
-   /* read two bytes */
-   if ((ret = ftdi_read_data (ftdi, buf, 2)) < 0)
+   /* read two bytes: reply may not be available yet, and left unread it would be taken as SPI data later */
+   for (length = 0, attempts = 0; length < 2 && attempts < FTDI_CHECK_ATTEMPTS; )
+   {
+      ret = ftdi_read_data (ftdi, buf + length, 2 - length);
+      attempts++;      /* a failed read is a USB transaction too */
+      if (ret < 0)
+         break;
+      length += ret;
+   }
+   
+   if (stats != NULL)
+   {
+      stats->transactions += 1 + attempts;
+      stats->bytes_out += written_offset;
+      stats->bytes_in += length;
+      stats->retries += (attempts > 1) ? attempts - 1 : 0;
+      stats->check_reads[(length == 2) ? attempts - 1 : FTDI_STATS_CHECK_READS - 1]++;
+      if (ret < 0)
+         stats->errors++;
+   }
+   
+   if (ret < 0)
       return ret;
    
    /* check if ftdi received an invalid command */
-   if (buf[0] == FTDI_BAD_COMMAND)
+   if (length == 2 && buf[0] == FTDI_BAD_COMMAND)
    {
       printf ("WARNING: Device received an invalid command: 0x%X\n", buf[1]);
+      if (stats != NULL)
+      {
+         stats->bad_commands++;
+         ftdi_trace_event (stats, FTDI_TRACE_CHECK, attempts, 0, 0);
+      }
       return 0;
    }
    
+   if (stats != NULL)
+      ftdi_trace_event (stats, FTDI_TRACE_CHECK, attempts, written_offset, 0);
+   
    return written_offset;    /* returns written data offset */
 }
 
 /**
    Reads data from FTDI device or waits if data is not available yet.
+   <br>Data is read with a single asynchronous transfer, so that libusb keeps the bulk pipe busy
+   until all data has been received.
 
    @param ftdi pointer to struct ftdi_context
+   @param stats pointer to struct ftdi_stats to be updated (can be NULL)
    @param data byte array (to write read data to)
    @param size size of data array
    
    @retval <0 if communication error
    @retval >0 if success (number of bytes read). 
 */
-int ftdi_read_data_and_wait (struct ftdi_context *ftdi, byte *data, int size)
+int ftdi_read_data_and_wait (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size)
 {
    int ret;
+   struct ftdi_async async;
    
-   int curr_size = size;
-
-   while (curr_size > 0)
-   {
-      if ((ret = ftdi_read_data (ftdi, data, curr_size)) < 0)
-         return ret;
-
-      data += ret;
-      curr_size -= ret;
-   }
+   ftdi_async_begin (&async, ftdi, stats);
+   ftdi_async_read (&async, data, size);
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return ret;
 
    return size;
 }
 
 /**
    Writes data to FTDI device or waits if data cannot be written yet.
+   <br>Data is split in FTDI_USB_CHUNK_LENGTH transfers, up to FTDI_ASYNC_DEPTH of them in flight.
 
    @param ftdi pointer to struct ftdi_context
+   @param stats pointer to struct ftdi_stats to be updated (can be NULL)
    @param data byte array (to read written data from)
    @param size size of data array
    
    @retval <0 if communication error
    @retval >0 if success (number of bytes written). 
 */
-int ftdi_write_data_and_wait (struct ftdi_context *ftdi, byte *data, int size)
+int ftdi_write_data_and_wait (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size)
 {
-   int ret;
+   int ret, curr_size, chunk_size;
+   struct ftdi_async async;
+   
+   ftdi_async_begin (&async, ftdi, stats);
+   
+   curr_size = size;
    
-   int curr_size = size;
-
    while (curr_size > 0)
    {
-      if ((ret = ftdi_write_data (ftdi, data, curr_size)) < 0)
-         return ret;
+      chunk_size = (curr_size > FTDI_USB_CHUNK_LENGTH) ? FTDI_USB_CHUNK_LENGTH : curr_size;
+      
+      if (ftdi_async_write (&async, data, chunk_size) < 0)
+         break;
+      
+      data += chunk_size;
+      curr_size -= chunk_size;
+   }
+
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return ret;
 
-      data += ret;
-      curr_size -= ret;
+   return size;
+}
+
+/**
+   Initialises an asynchronous transfer pipeline.
+   
+   @param async pointer to struct ftdi_async
+   @param ftdi pointer to struct ftdi_context
+   @param stats pointer to struct ftdi_stats to be updated by the pipeline (can be NULL)
+*/
+void ftdi_async_begin (struct ftdi_async *async, struct ftdi_context *ftdi, struct ftdi_stats *stats)
+{
+   async->ftdi = ftdi;
+   async->write_head = 0;
+   async->write_count = 0;
+   async->read = NULL;
+   async->error = 0;
+   async->stats = stats;
+   
+   return;
+}
+
+/**
+   Submits a write transfer without waiting for it to complete. If FTDI_ASYNC_DEPTH transfers are 
+   already in flight, waits for the oldest one first.
+   
+   @param async pointer to struct ftdi_async
+   @param data byte array (to read written data from), must stay valid until ftdi_async_end
+   @param size size of data array
+   
+   @retval <0 if communication error
+   @retval >0 if success (number of bytes submitted). 
+*/
+int ftdi_async_write (struct ftdi_async *async, byte *data, int size)
+{
+   struct ftdi_transfer_control *tc;
+   int ret;
+   
+   if (async->error < 0)
+      return async->error;
+   
+   /* pipeline is full, wait for oldest transfer */
+   if (async->write_count == FTDI_ASYNC_DEPTH && (ret = ftdi_async_wait_write (async)) < 0)
+      return ret;
+   
+   if ((tc = ftdi_write_data_submit (async->ftdi, data, size)) == NULL)
+   {
+      if (async->stats != NULL)
+         async->stats->errors++;
+      return (async->error = -1);
+   }
+   
+   async->writes[(async->write_head + async->write_count) % FTDI_ASYNC_DEPTH] = tc;
+   async->write_count++;
+   
+   if (async->stats != NULL)
+   {
+      async->stats->transactions++;
+      async->stats->bytes_out += size;
+      ftdi_trace_event (async->stats, FTDI_TRACE_WRITE, size, 0, 0);
    }
+   
+   return size;
+}
 
+/**
+   Submits a read transfer without waiting for it to complete. Since only one read transfer per 
+   ftdi_context can be in flight, waits for the previous one first.
+   
+   @param async pointer to struct ftdi_async
+   @param data byte array (to write read data to), must stay valid until ftdi_async_end
+   @param size size of data array
+   
+   @retval <0 if communication error
+   @retval >0 if success (number of bytes submitted). 
+*/
+int ftdi_async_read (struct ftdi_async *async, byte *data, int size)
+{
+   int ret;
+   
+   if (async->error < 0)
+      return async->error;
+   
+   if ((ret = ftdi_async_wait_read (async)) < 0)
+      return ret;
+   
+   if ((async->read = ftdi_read_data_submit (async->ftdi, data, size)) == NULL)
+   {
+      if (async->stats != NULL)
+         async->stats->errors++;
+      return (async->error = -1);
+   }
+   
+   if (async->stats != NULL)
+   {
+      async->stats->transactions++;
+      ftdi_trace_event (async->stats, FTDI_TRACE_READ, size, 0, 0);
+   }
+   
    return size;
 }
 
+/**
+   Waits for the oldest write transfer in flight to complete.
+   
+   @param async pointer to struct ftdi_async
+   
+   @retval <0 if communication error
+   @retval >=0 if success (number of bytes written, 0 if no transfer was in flight). 
+*/
+int ftdi_async_wait_write (struct ftdi_async *async)
+{
+   int ret, size;
+   double start = 0;
+   
+   if (async->write_count == 0)
+      return 0;
+   
+   if (async->stats != NULL)
+      start = ftdi_monotonic_time ();
+   
+   size = async->writes[async->write_head]->size;
+   ret = ftdi_transfer_data_done (async->writes[async->write_head]);
+   
+   async->write_head = (async->write_head + 1) % FTDI_ASYNC_DEPTH;
+   async->write_count--;
+   
+   if (ret < 0 && async->error == 0)
+      async->error = ret;
+   
+   if (async->stats != NULL)
+      ftdi_stats_wait (async->stats, FTDI_TRACE_WRITE_DONE, size, ret, ftdi_monotonic_time () - start);
+   
+   return ret;
+}
+
+/**
+   Waits for the read transfer in flight to complete.
+   
+   @param async pointer to struct ftdi_async
+   
+   @retval <0 if communication error
+   @retval >=0 if success (number of bytes read, 0 if no transfer was in flight). 
+*/
+int ftdi_async_wait_read (struct ftdi_async *async)
+{
+   int ret, size;
+   double start = 0;
+   
+   if (async->read == NULL)
+      return 0;
+   
+   if (async->stats != NULL)
+      start = ftdi_monotonic_time ();
+   
+   size = async->read->size;
+   ret = ftdi_transfer_data_done (async->read);
+   async->read = NULL;
+   
+   if (ret < 0 && async->error == 0)
+      async->error = ret;
+   
+   if (async->stats != NULL)
+      ftdi_stats_wait (async->stats, FTDI_TRACE_READ_DONE, size, ret, ftdi_monotonic_time () - start);
+   
+   return ret;
+}
+
+/**
+   Waits for all transfers in flight to complete.
+   
+   @param async pointer to struct ftdi_async
+   
+   @retval <0 if a communication error occurred on any transfer
+   @retval >0 if success
+*/
+int ftdi_async_end (struct ftdi_async *async)
+{
+   while (async->write_count > 0)
+      ftdi_async_wait_write (async);
+   
+   ftdi_async_wait_read (async);
+   
+   if (async->error < 0)
+      return async->error;
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by ftdi_async_wait_write and ftdi_async_wait_read: accounts for a completed transfer.
+   
+   @param stats pointer to struct ftdi_stats
+   @param event FTDI_TRACE_WRITE_DONE or FTDI_TRACE_READ_DONE
+   @param size size of the transfer
+   @param result value returned by ftdi_transfer_data_done
+   @param duration time blocked waiting for completion (in seconds)
+*/
+void ftdi_stats_wait (struct ftdi_stats *stats, dword event, int size, int result, double duration)
+{
+   if (event == FTDI_TRACE_READ_DONE)
+   {
+      stats->read_wait_time += duration;
+      if (result > 0)
+         stats->bytes_in += result;
+   }
+   else
+      stats->write_wait_time += duration;
+   
+   if (result < 0)
+      stats->errors++;
+   
+   ftdi_trace_event (stats, event, size, result, duration);
+   
+   return;
+}
+
+/**
+   Clears all counters. The trace ring, if any, is kept enabled but emptied.
+   
+   @param stats pointer to struct ftdi_stats
+*/
+void ftdi_stats_reset (struct ftdi_stats *stats)
+{
+   struct ftdi_trace trace = stats->trace;
+   
+   memset (stats, 0, sizeof (struct ftdi_stats));
+   
+   if (trace.records != NULL)
+      ftdi_trace_enable (stats, trace.records, trace.length);
+   
+   return;
+}
+
+/**
+   Prints counters in a human readable form.
+   
+   @param stats pointer to struct ftdi_stats
+   @param fp output stream
+*/
+void ftdi_stats_print (struct ftdi_stats *stats, FILE *fp)
+{
+   int i;
+   
+   fprintf (fp, "STATS: %llu USB transactions, %llu bytes out, %llu bytes in (%.1f bytes per transaction)\n", 
+            (unsigned long long)stats->transactions, (unsigned long long)stats->bytes_out, (unsigned long long)stats->bytes_in, 
+            stats->transactions ? (double)(stats->bytes_out + stats->bytes_in) / stats->transactions : 0.0);
+   fprintf (fp, "STATS: blocked %.3f s on writes, %.3f s on reads, %.3f s on host I/O\n", 
+            stats->write_wait_time, stats->read_wait_time, stats->file_time);
+   fprintf (fp, "STATS: %llu retries, %llu bad commands, %llu errors\n", 
+            (unsigned long long)stats->retries, (unsigned long long)stats->bad_commands, (unsigned long long)stats->errors);
+   fprintf (fp, "STATS: reads per bad command check:");
+   for (i = 0; i < FTDI_STATS_CHECK_READS - 1; i++)
+      fprintf (fp, " %d:%llu", i + 1, (unsigned long long)stats->check_reads[i]);
+   fprintf (fp, " none:%llu\n", (unsigned long long)stats->check_reads[FTDI_STATS_CHECK_READS - 1]);
+   
+   return;
+}
+
+/**
+   Starts recording USB transfers in a trace ring.
+   
+   @param stats pointer to struct ftdi_stats
+   @param records ring buffer, owned by the caller and valid until ftdi_trace_disable is called
+   @param length number of records in the ring
+*/
+void ftdi_trace_enable (struct ftdi_stats *stats, struct ftdi_trace_record *records, dword length)
+{
+   stats->trace.records = (length > 0) ? records : NULL;
+   stats->trace.length = length;
+   stats->trace.count = 0;
+   stats->trace.start = ftdi_monotonic_time ();
+   
+   return;
+}
+
+/**
+   Stops recording USB transfers. The ring buffer can be freed afterwards.
+   
+   @param stats pointer to struct ftdi_stats
+*/
+void ftdi_trace_disable (struct ftdi_stats *stats)
+{
+   stats->trace.records = NULL;
+   stats->trace.length = 0;
+   
+   return;
+}
+
+/**
+   Adds a record to the trace ring (nothing is done if tracing is disabled).
+   
+   @param stats pointer to struct ftdi_stats
+   @param event FTDI_TRACE_* event
+   @param size size of the transfer
+   @param result return value of the transfer
+   @param duration time blocked (in seconds)
+*/
+void ftdi_trace_event (struct ftdi_stats *stats, dword event, int size, int result, double duration)
+{
+   struct ftdi_trace_record *record;
+   
+   if (stats->trace.records == NULL)
+      return;
+   
+   record = &stats->trace.records[stats->trace.count++ % stats->trace.length];
+   record->time = (qword)((ftdi_monotonic_time () - stats->trace.start) * 1e9);
+   record->event = event;
+   record->size = (dword)size;
+   record->result = result;
+   record->duration = (dword)(duration * 1e9);
+   
+   return;
+}
+
+/**
+   Writes the trace ring to a binary file, oldest record first.
+   <br>The file starts with four dwords (FTDI_TRACE_MAGIC, FTDI_TRACE_VERSION, size of a record, 
+   number of records), followed by the records (struct ftdi_trace_record, host byte order).
+   
+   @param stats pointer to struct ftdi_stats
+   @param fp output stream (opened in binary mode)
+   
+   @return number of records written (0 if tracing is disabled, or on write error)
+*/
+qword ftdi_trace_export (struct ftdi_stats *stats, FILE *fp)
+{
+   struct ftdi_trace *trace = &stats->trace;
+   dword header[4];
+   qword first, count, i;
+   
+   if (trace->records == NULL)
+      return 0;
+   
+   /* once the ring has wrapped around, the oldest record is the next one to be overwritten */
+   count = (trace->count < trace->length) ? trace->count : trace->length;
+   first = trace->count - count;
+   
+   header[0] = FTDI_TRACE_MAGIC;
+   header[1] = FTDI_TRACE_VERSION;
+   header[2] = sizeof (struct ftdi_trace_record);
+   header[3] = (dword)count;
+   
+   if (fwrite (header, sizeof (header), 1, fp) != 1)
+      return 0;
+   
+   for (i = first; i < trace->count; i++)
+      if (fwrite (&trace->records[i % trace->length], sizeof (struct ftdi_trace_record), 1, fp) != 1)
+         return 0;
+   
+   return count;
+}
+
+/**
+   Auxiliary function used to measure elapsed time.
+   
+   @return value of a monotonic clock (in seconds)
+*/
+double ftdi_monotonic_time (void)
+{
+   struct timespec ts;
+   
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /**
    Reads FTDI modem status to check if transmitter buffer is empty.
    
@@ -202,8 +879,11 @@ int ftdi_tx_buf_empty (struct ftdi_context *ftdi, word *status)
    int ret;
    word temp_status;
    
-   if ((ret = ftdi_poll_modem_status (ftdi, &temp_status) < 0))
-      ftdi_exit (ftdi, "ERROR: Unable to poll modem status: %d (%s)\n", ret);
+   if ((ret = ftdi_poll_modem_status (ftdi, &temp_status)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to poll modem status: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      return ret;
+   }
    
    if (status != NULL)
       *status = temp_status;
@@ -226,8 +906,11 @@ int ftdi_tx_error (struct ftdi_context *ftdi, word *status)
    int ret;
    word temp_status;
 
-   if ((ret = ftdi_poll_modem_status (ftdi, &temp_status) < 0))
-      ftdi_exit (ftdi, "ERROR: Unable to poll modem status: %d (%s)\n", ret);
+   if ((ret = ftdi_poll_modem_status (ftdi, &temp_status)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to poll modem status: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      return ret;
+   }
    
    if (status != NULL)
       *status = temp_status;
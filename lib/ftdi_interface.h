@@ -1,4 +1,5 @@
 #define FTDI_BAD_COMMAND 0xFA    /**< FTDI device returns 0xFA if a bad command is received */
+#define FTDI_CHECK_ATTEMPTS 8    /**< reads made by ftdi_write_data_and_check before assuming no reply is coming */
 
 /**< Auxiliary macro used to print debug information when program is compiled with DEBUG symbol defined */
 #ifdef DEBUG
@@ -27,20 +28,145 @@
 #define RCVR 0x0080     /**< Error in Receiver FIFO */
 /**@} */
 
+/** 
+   @defgroup ASYNC_GRP Asynchronous transfers
+   @{ 
+*/
+#define FTDI_USB_CHUNK_LENGTH 65536    /**< size of a single libusb bulk transfer */
+#define FTDI_ASYNC_DEPTH      4        /**< maximum number of write transfers in flight */
+/**@} */
+
+/** 
+   @defgroup STATS_GRP Statistics and tracing
+   @{ 
+*/
+#define FTDI_STATS_CHECK_READS (FTDI_CHECK_ATTEMPTS + 1)  /**< buckets of the ftdi_write_data_and_check histogram (last one: no reply) */
+#define FTDI_TRACE_MAGIC       0x52545446                 /**< "FTTR", first word of an exported trace */
+#define FTDI_TRACE_VERSION     1                          /**< version of the exported trace format */
+
+#define FTDI_TRACE_WRITE       1     /**< write transfer submitted */
+#define FTDI_TRACE_WRITE_DONE  2     /**< write transfer completed */
+#define FTDI_TRACE_READ        3     /**< read transfer submitted */
+#define FTDI_TRACE_READ_DONE   4     /**< read transfer completed */
+#define FTDI_TRACE_CHECK       5     /**< bad command check: size is the number of reads, result 0 if a bad command was reported */
+#define FTDI_TRACE_FILE        6     /**< host side I/O of a streaming function (file, callback) */
+/**@} */
+
+/** 
+   @defgroup DEVICE_GRP Device selection
+   @{ 
+*/
+#define FTDI_VID 0x0403                /**< FTDI vendor ID */
+#define FTDI_PID 0x6010                /**< FT2232H product ID */
+#define FTDI_STRING_LENGTH 128         /**< maximum length of device strings (description, serial) */
+#define FTDI_PATH_LENGTH 32            /**< maximum length of a USB bus and port path */
+#define FTDI_MAX_PORT_DEPTH 7          /**< maximum number of ports in a USB path (USB 3.0 spec.) */
+/**@} */
+
 #ifndef FTDI_LIB_TYPES_DEFINED
 typedef uint8_t  byte;  /**< 8-bit unsigned integer type */
 typedef uint16_t word;  /**< 16-bit unsigned integer type */
 typedef uint32_t dword; /**< 32-bit unsigned integer type */
+typedef uint64_t qword; /**< 64-bit unsigned integer type */
 #define FTDI_LIB_TYPES_DEFINED
 #endif
 
+/* Asynchronous transfer pipeline: up to FTDI_ASYNC_DEPTH write transfers and one read transfer 
+   (libftdi allows only one read per context) are kept in flight, so the USB bus is not left idle 
+   between a submission and its completion. Buffers passed to ftdi_async_write and ftdi_async_read 
+   must stay valid until ftdi_async_end returns. */
+struct ftdi_async
+{
+   struct ftdi_context *ftdi;
+   
+   struct ftdi_transfer_control *writes[FTDI_ASYNC_DEPTH];    /**< write transfers in flight (ring buffer) */
+   int write_head;                                            /**< oldest write transfer in flight */
+   int write_count;                                           /**< number of write transfers in flight */
+   
+   struct ftdi_transfer_control *read;                        /**< read transfer in flight */
+   
+   int error;                                                 /**< first error occurred (0 if none) */
+   
+   struct ftdi_stats *stats;                                  /**< counters updated by the pipeline (may be NULL) */
+};
+
+/* Binary trace record, exported as is by ftdi_trace_export (host byte order). */
+struct ftdi_trace_record
+{
+   qword time;          /**< nanoseconds since the trace was enabled */
+   dword event;         /**< FTDI_TRACE_* event */
+   dword size;          /**< bytes of the transfer */
+   int32_t result;      /**< return value (0 on submissions) */
+   dword duration;      /**< nanoseconds blocked waiting for completion */
+};
+
+/* Optional trace ring: once full, the oldest records are overwritten. The buffer is owned by the caller. */
+struct ftdi_trace
+{
+   struct ftdi_trace_record *records;    /**< ring buffer (NULL if tracing is disabled) */
+   dword length;                         /**< number of records in the ring */
+   qword count;                          /**< records written since the trace was enabled */
+   double start;                         /**< monotonic time at which the trace was enabled */
+};
+
+/* Counters of the USB traffic of a context. They are always updated (a few additions per transfer), 
+   so a slow job can be told USB-bound (many transactions, time blocked in reads and writes), 
+   device-bound (few large transactions, time blocked in reads) or disk-bound (file time). */
+struct ftdi_stats
+{
+   qword transactions;                          /**< USB transfers submitted (reads and writes) */
+   qword bytes_out;                             /**< bytes written, MPSSE commands included */
+   qword bytes_in;                              /**< bytes read */
+   qword retries;                               /**< extra reads made by ftdi_write_data_and_check */
+   qword bad_commands;                          /**< bad command replies (0xFA) */
+   qword errors;                                /**< failed transfers */
+   double write_wait_time;                      /**< seconds blocked waiting for write transfers */
+   double read_wait_time;                       /**< seconds blocked waiting for read transfers */
+   double file_time;                            /**< seconds spent in host side I/O by streaming functions */
+   qword check_reads[FTDI_STATS_CHECK_READS];   /**< histogram of reads needed by ftdi_write_data_and_check */
+   struct ftdi_trace trace;                     /**< optional trace ring */
+};
+
+/* Information about a connected FT2232H, see ftdi_find_devices */
+struct ftdi_device_info
+{
+   int index;                                   /**< enumeration index ("i:" selector) */
+   int bus;                                     /**< USB bus number */
+   char path[FTDI_PATH_LENGTH];                 /**< USB bus and port path ("p:" selector) */
+   char serial[FTDI_STRING_LENGTH];             /**< serial number ("s:" selector) */
+   char description[FTDI_STRING_LENGTH];        /**< product description */
+};
+
 struct ftdi_context *ftdi_open (void);
-void ftdi_close (struct ftdi_context *ftdi);
+struct ftdi_context *ftdi_open_device (const char *selector);
+struct ftdi_context *ftdi_open_error (struct ftdi_context *ftdi, char *error_string, int error_code);
+int ftdi_open_channels (const char *selector, struct ftdi_context **channel_a, struct ftdi_context **channel_b);
+int ftdi_selector_split (const char *selector, char *device, int size, enum ftdi_interface *interface);
+int ftdi_find_devices (struct ftdi_device_info *devices, int max);
+int ftdi_device_match (struct ftdi_context *ftdi, struct libusb_device *dev, int index, const char *selector);
+int ftdi_device_path (struct libusb_device *dev, char *path, int size);
+int ftdi_close (struct ftdi_context *ftdi);
 void ftdi_exit (struct ftdi_context *ftdi, char *error_string, int error_code);
 
-int ftdi_write_data_and_check (struct ftdi_context *ftdi, byte *data, int size);
-int ftdi_read_data_and_wait (struct ftdi_context *ftdi, byte *data, int size);
-int ftdi_write_data_and_wait (struct ftdi_context *ftdi, byte *data, int size);
+int ftdi_write_data_and_check (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size);
+int ftdi_read_data_and_wait (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size);
+int ftdi_write_data_and_wait (struct ftdi_context *ftdi, struct ftdi_stats *stats, byte *data, int size);
+
+void ftdi_async_begin (struct ftdi_async *async, struct ftdi_context *ftdi, struct ftdi_stats *stats);
+int ftdi_async_write (struct ftdi_async *async, byte *data, int size);
+int ftdi_async_read (struct ftdi_async *async, byte *data, int size);
+int ftdi_async_wait_write (struct ftdi_async *async);
+int ftdi_async_wait_read (struct ftdi_async *async);
+int ftdi_async_end (struct ftdi_async *async);
+
+void ftdi_stats_wait (struct ftdi_stats *stats, dword event, int size, int result, double duration);
+void ftdi_stats_reset (struct ftdi_stats *stats);
+void ftdi_stats_print (struct ftdi_stats *stats, FILE *fp);
+void ftdi_trace_enable (struct ftdi_stats *stats, struct ftdi_trace_record *records, dword length);
+void ftdi_trace_disable (struct ftdi_stats *stats);
+void ftdi_trace_event (struct ftdi_stats *stats, dword event, int size, int result, double duration);
+qword ftdi_trace_export (struct ftdi_stats *stats, FILE *fp);
+double ftdi_monotonic_time (void);
 
 int ftdi_tx_buf_empty (struct ftdi_context *ftdi, word *status);
 int ftdi_tx_error (struct ftdi_context *ftdi, word *status);
\ No newline at end of file
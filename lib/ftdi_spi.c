@@ -1,8 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
-#include <libftdi1\ftdi.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <libftdi1/ftdi.h>
 
 #include "ftdi_interface.h"
 #include "ftdi_spi.h"
@@ -21,7 +29,7 @@
    @param read_lsb_first read lsb first
    @param loopback_on internal loopback on
    
-   @return pointer to initialised spi_context structure  
+   @return pointer to initialised spi_context structure (NULL if FTDI device cannot be configured)
 */
 struct spi_context *spi_init (struct ftdi_context *ftdi,
                              int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on)
@@ -32,7 +40,11 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
    struct spi_context *spi;
 
    /* allocate structure */
-   spi = (struct spi_context *)malloc (sizeof (struct spi_context));
+   if ((spi = (struct spi_context *)malloc (sizeof (struct spi_context))) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate SPI structure!\n");
+      return NULL;
+   }
    
    /* init SPI structure */
    spi->CPOL = clock_idle & 1;
@@ -43,23 +55,45 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
    spi->WRITE_LSB_FIRST = write_lsb_first & 1;
    spi->READ_LSB_FIRST = read_lsb_first & 1;
    spi->LOOPBACK_ON = loopback_on & 1;
+   spi->GPIOL1_WAIT = 0;
+   
+   /* commands are sent out immediately until spi_queue_begin is called */
+   spi->queue.enabled = 0;
+   spi->queue.length = 0;
+   spi->queue.read_count = 0;
+   spi->queue.read_length = 0;
+   
+   /* pins state is unknown until set */
+   spi->low_bits.sent = 0;
+   spi->low_bits.pending = -1;
+   spi->high_bits.sent = 0;
+   spi->high_bits.pending = -1;
+   
+   /* counters start from zero, tracing is disabled */
+   memset (&spi->stats, 0, sizeof (struct ftdi_stats));
+   
+   /* no communication error so far */
+   spi->error.code = 0;
+   spi->error.message[0] = '\0';
+   spi->error.count = 0;
+   spi->error.recoveries = 0;
 
    /* purge all buffers */
    if ((ret = ftdi_usb_purge_buffers (ftdi)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to purge buffers: %d (%s)\n", ret);
+      return spi_init_error (ftdi, spi, "ERROR: Unable to purge buffers: %d (%s)\n", ret);
 
    /* reset bitmode */
    if ((ret = ftdi_set_bitmode (ftdi, 0x00, BITMODE_RESET)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to reset bitmode: %d (%s)\n", ret);
+      return spi_init_error (ftdi, spi, "ERROR: Unable to reset bitmode: %d (%s)\n", ret);
    
    /* set MPSSE bitmode: GPIO not used, set to output */
    if ((ret = ftdi_set_bitmode (ftdi, 0x00, BITMODE_MPSSE)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set MPSSE bitmode: %d (%s)\n", ret);
+      return spi_init_error (ftdi, spi, "ERROR: Unable to set MPSSE bitmode: %d (%s)\n", ret);
 
-   /* synchronize MPSSE interface by sending a bad command */
+   /* synchronize MPSSE interface by sending a bad command (its expected reply is not counted in stats) */
    buf[0] = 0xAA;
-   if ((ret = ftdi_write_data_and_check (ftdi, buf, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to synchronize mpsse interface: %d (%s)\n", ret);
+   if ((ret = ftdi_write_data_and_check (ftdi, NULL, buf, 1)) < 0)
+      return spi_init_error (ftdi, spi, "ERROR: Unable to synchronize mpsse interface: %d (%s)\n", ret);
    else if (ret == 0)
       printf ("FTDI: MPSSE interface synchronized using 0xAA command\n");
    
@@ -68,7 +102,7 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
    buf[1] = DIS_ADAPTIVE;                          /* ensure adaptive clocking is disabled */
    buf[2] = DIS_3_PHASE;                           /* ensure three-phase data clock is disabled */
    if ((ret = ftdi_write_data (ftdi, buf, 3)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to tune clock signal: %d (%s)\n", ret);
+      return spi_init_error (ftdi, spi, "ERROR: Unable to tune clock signal: %d (%s)\n", ret);
    
    printf ("FTDI: Clock divide by 5: ");
    spi->CDIV5 ? printf ("enabled\n") : printf ("disabled\n");
@@ -77,7 +111,7 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
    buf[1] = GETBYTE (spi->CDIV, 0); 
    buf[2] = GETBYTE (spi->CDIV, 1);
    if ((ret = ftdi_write_data (ftdi, buf, 3)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set clock divisor: %d (%s)\n", ret);
+      return spi_init_error (ftdi, spi, "ERROR: Unable to set clock divisor: %d (%s)\n", ret);
 
    spi_print_clk_frequency (spi);
 
@@ -89,14 +123,14 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
       /* enable internal loopback */
       buf[0] = LOOPBACK_START;
       if ((ret = ftdi_write_data (ftdi, buf, 1)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to enable loopback: %d (%s)\n", ret);
+         return spi_init_error (ftdi, spi, "ERROR: Unable to enable loopback: %d (%s)\n", ret);
    }
    else
    {
       /* disable internal loopback */
       buf[0] = LOOPBACK_END;
       if ((ret = ftdi_write_data (ftdi, buf, 1)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to disable loopback: %d (%s)\n", ret);
+         return spi_init_error (ftdi, spi, "ERROR: Unable to disable loopback: %d (%s)\n", ret);
    }
    printf ("FTDI: SPI loopback: ");
    spi->LOOPBACK_ON ? printf ("enabled\n") : printf ("disabled\n");
@@ -107,8 +141,9 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
            CS;
    io = 0x0B;                                     /* GPIOL[3-0]: DC, CS: O, DI: I, DO: O, SK: O */
    
-   ftdi_set_bits_low (ftdi, spi, 0xFF, level, io);
-   ftdi_set_bits_high (ftdi, spi, 0xFF, 0xFF, 0xFF);    /* high bits set to high, as outputs, by default */
+   if (ftdi_set_bits_low (ftdi, spi, 0xFF, level, io) < 0 ||
+       ftdi_set_bits_high (ftdi, spi, 0xFF, 0xFF, 0xFF) < 0)    /* high bits set to high, as outputs, by default */
+      return spi_init_error (ftdi, spi, "ERROR: Unable to set port direction: %d (%s)\n", spi->error.code);
    
    printf ("FTDI: Clock idle level: %d, MOSI idle level: %d\n", spi->CPOL, spi->MOSI_IDLE);
          
@@ -120,365 +155,1675 @@ struct spi_context *spi_init (struct ftdi_context *ftdi,
    return spi;
 }
 
-/** 
-   Opens SPI connection by setting CS# line low. Also, sets MOSI and SCLK lines to their respective idle levels. 
+/**
+   Auxiliary function used by spi_init to give up configuring FTDI device. Prints information about 
+   the error and de-allocates spi_context structure.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
+   @param error_string string containing error information
+   @param error_code error code value
+   
+   @return NULL
 */
-void spi_open (struct ftdi_context *ftdi, struct spi_context *spi)
+struct spi_context *spi_init_error (struct ftdi_context *ftdi, struct spi_context *spi, char *error_string, int error_code)
 {
-   byte level;
+   fprintf (stderr, error_string, error_code, ftdi_get_error_string (ftdi));
    
-   level = (spi->MOSI_IDLE ? MOSI : 0);       /* set MOSI idle value, CS=0 */
-   if (!spi->CPHA)                            /* set clock idle polarity */
-      level |= (spi->CPOL  ? SCLK : 0);       /* AN_108: clock out on -ve (mode 0) requires SCLK=0, clock out on +ve (mode 2) requires SCLK=1 */
-   else                                       /* workaround to get SPI mode 1, 3 working (invert clock polarity before writing data) */
-      level |= (!spi->CPOL ? SCLK : 0);       /* AN_108: clock out on +ve (mode 2) requires SCLK=1, clock out on -ve (mode 3) requires SCLK=0 */      
-      
-   ftdi_set_bits_low (ftdi, spi, CS|SCLK|MOSI, level, CS|SCLK|MOSI);
-
-   DEBUG_PRINT ("DEBUG: [SPI] Asserting CS#\n");
+   free (spi);
    
-   return;
+   return NULL;
 }
 
-/** 
-   Closes SPI connection by setting CS# line high. Also, sets MOSI and SCLK lines to their respective idle levels. 
+/**
+   Changes SCLK frequency of an SPI context, e.g. to leave the slow clock required while a slave device 
+   is being identified. The fastest frequency not above the requested one is chosen (see 
+   spi_plan_divisor) and only the clock commands which actually change are sent, in-band: commands 
+   queued before are clocked at the previous frequency.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
+   @param frequency maximum SCLK frequency, in Hz
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval <0 if frequency is below the slowest SCLK (slowest SCLK is set)
+   @retval >0 on success
 */
-void spi_close (struct ftdi_context *ftdi, struct spi_context *spi)
+int spi_set_frequency (struct ftdi_context *ftdi, struct spi_context *spi, double frequency)
 {
-   byte level;
-
-   level = (spi->CPOL      ? SCLK : 0) | 
-           (spi->MOSI_IDLE ? MOSI : 0) |
-           CS;                              /* set port idle values */
-           
-   ftdi_set_bits_low (ftdi, spi, CS|SCLK|MOSI, level, CS|SCLK|MOSI);
+   word divisor;
+   int divide_by_5, planned, ret;
    
-   DEBUG_PRINT ("DEBUG: [SPI] De-asserting CS#\n\n");
+   planned = spi_plan_divisor (frequency, &divisor, &divide_by_5);
    
-   return;
+   if ((ret = spi_reconfigure (ftdi, spi, spi->CPOL, spi->CPHA, divisor, divide_by_5, spi->MOSI_IDLE, 
+                               spi->WRITE_LSB_FIRST, spi->READ_LSB_FIRST, spi->LOOPBACK_ON)) < 0)
+      return ret;
+   
+   if (ret > 0)
+      spi_print_clk_frequency (spi);
+   
+   return planned;
 }
 
 /**
-   Sends data read from the file pointed by fp via SPI on FTDI device.
+   Computes the clock divisor giving the fastest SCLK frequency not above the requested one. 
+   Divide by 5 is enabled only for frequencies that cannot be reached otherwise (below 
+   SPI_BASE_CLOCK / (2 * 65536), about 458 Hz), since it makes frequency steps coarser.
+   <br>Three-phase and adaptive clocking are left disabled: the former adds half a clock period of 
+   data hold time and the latter waits for RTCK, neither of which suits SPI slaves.
    
-   @param ftdi pointer to struct ftdi_context
-   @param spi pointer to struct spi_context
-   @param fp pointer to FILE
-   @param size size of data to write
+   @param frequency maximum SCLK frequency, in Hz
+   @param divisor pointer to store clock divisor in
+   @param divide_by_5 pointer to store divide by 5 enable bit in
    
-   @retval <0 if EOF reached before sending out all data
+   @retval <0 if frequency is below the slowest SCLK (slowest divisor is returned)
    @retval >0 on success
 */
-int spi_write_from_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size)
+int spi_plan_divisor (double frequency, word *divisor, int *divide_by_5)
 {
-   byte buf[3];
-   byte file_buf[MAX_SPI_BUF_LENGTH];
-   unsigned int buf_size;
-   int ret;
+   double cdiv;
    
-   if (size > MAX_SPI_BUF_LENGTH)
-      buf_size = MAX_SPI_BUF_LENGTH;
-   else
-      buf_size = size; 
+   *divisor = SPI_MAX_DIVISOR;
+   *divide_by_5 = 1;
    
-   while (size > 0 && fread (file_buf, sizeof (byte), buf_size, fp) == buf_size)
-   {     
-      /* build header */
-      buf[0] = MPSSE_DO_WRITE | (spi->WRITE_LSB_FIRST ? MPSSE_LSB : 0);
-      /* set spi mode according to AN_108 */
-      if (SPIMODE (spi) == 0 || SPIMODE (spi) == 3)      /* mode 0 or mode 3 (clock out on -ve) */
-         buf[0] |= MPSSE_WRITE_NEG;
-      buf[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
-      buf[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
-      
-      /* write out header */
-      if ((ret = ftdi_write_data_and_wait (ftdi, buf, 3)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
-      /* write out spi data */
-      if ((ret = ftdi_write_data_and_wait (ftdi, file_buf, buf_size)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
-      
-      size -= buf_size;
-      
-      if (size > MAX_SPI_BUF_LENGTH)
-         buf_size = MAX_SPI_BUF_LENGTH;
-      else
-         buf_size = size;
+   if (frequency <= 0)
+      return -1;
+   
+   /* SCLK = base / ((1 + CDIV) * 2) <= frequency */
+   cdiv = ceil (SPI_BASE_CLOCK / (2 * frequency)) - 1;
+   if (cdiv <= SPI_MAX_DIVISOR)
+   {
+      *divisor = (cdiv > 0) ? (word)cdiv : 0;
+      *divide_by_5 = 0;
+      return 1;
    }
    
-   if (feof (fp))
+   cdiv = ceil (SPI_BASE_CLOCK_5 / (2 * frequency)) - 1;
+   if (cdiv <= SPI_MAX_DIVISOR)
    {
-      printf ("WARNING: Cannot read file, end-of-file reached before sending out all data!\n");
-      printf ("   Remaining size: %d bytes\n", size);
-      return -1;
+      *divisor = (word)cdiv;
+      return 1;
    }
    
-   return 1;
+   return -1;
 }
 
-
-/** 
-   Reads data via SPI from FTDI device and saves them in the file pointed by fp. 
+/**
+   Changes the parameters of an SPI context already initialised by spi_init, e.g. when a device kept 
+   open by a worker pool is handed to the next job. Only the MPSSE commands for the settings which 
+   actually changed are sent, in a single USB write (or appended to the queue, if enabled), and no 
+   settle delay is needed: FTDI device is already in MPSSE mode and the pins it drives are known.
+   <br>Must be called with CS# high (outside spi_open/spi_close).
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
-   @param fp pointer to FILE
-   @param size size of data to read
    
-   @retval <0 if a write error occurred before reading in all data
+   @param clock_idle clock idle level (also known as clock polarity, CPOL)
+   @param clock_phase clock phase (CPHA)
+   @param clock_divisor clock divisor value
+   @param clock_divide_by_5 enable clock divide by 5
+   @param mosi_idle MOSI idle level
+   @param write_lsb_first write lsb first
+   @param read_lsb_first read lsb first
+   @param loopback_on internal loopback on
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval 0 if nothing changed (no command sent)
    @retval >0 on success
 */
-int spi_read_to_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size)
+int spi_reconfigure (struct ftdi_context *ftdi, struct spi_context *spi,
+                     int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on)
 {
-   byte buf[3];
-   byte file_buf[MAX_SPI_BUF_LENGTH];
-   unsigned int buf_size;
-   int ret;
+   byte buf[10];
+   int length;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
    
-   while (size > 0)
+   length = 0;
+   
+   if (spi->CDIV5 != (clock_divide_by_5 & 1))
    {
-      if (size > MAX_SPI_BUF_LENGTH)
-         buf_size = MAX_SPI_BUF_LENGTH;
-      else
-         buf_size = size;
-      
-      buf[0] = MPSSE_DO_READ | (spi->READ_LSB_FIRST ? MPSSE_LSB : 0);
-      /* set spi mode according to AN_108 */
-      if (SPIMODE (spi) == 1 || SPIMODE (spi) == 2)      /* mode 1 or mode 2 (clock out on +ve) */
-         buf[0] |= MPSSE_READ_NEG;
-      buf[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
-      buf[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
-      
-      /* write out spi data */
-      if ((ret = ftdi_write_data_and_wait (ftdi, buf, 3)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
-
-      /* read data */
-      if ((ret = ftdi_read_data_and_wait (ftdi, file_buf, buf_size)) < 0)
-            ftdi_exit (ftdi, "ERROR: Unable to read SPI data: %d (%s)\n", ret);
-      
-      /* write read data to file */
-      if (fwrite (file_buf, sizeof (byte), buf_size, fp) != buf_size)
-      {
-         fprintf (stderr, "ERROR: Unable to write file!\n");
-         printf ("   Remaining size: %d bytes\n", size);
-         return -1;
-      }
+      spi->CDIV5 = clock_divide_by_5 & 1;
+      buf[length++] = spi->CDIV5 ? EN_DIV_5 : DIS_DIV_5;
+   }
+   
+   if (spi->CDIV != clock_divisor)
+   {
+      spi->CDIV = clock_divisor;
+      buf[length++] = TCK_DIVISOR;
+      buf[length++] = GETBYTE (spi->CDIV, 0);
+      buf[length++] = GETBYTE (spi->CDIV, 1);
+   }
+   
+   if (spi->LOOPBACK_ON != (loopback_on & 1))
+   {
+      spi->LOOPBACK_ON = loopback_on & 1;
+      buf[length++] = spi->LOOPBACK_ON ? LOOPBACK_START : LOOPBACK_END;
+   }
+   
+   /* idle levels are the only pin states that depend on SPI mode */
+   if (spi->CPOL != (clock_idle & 1) || spi->MOSI_IDLE != (mosi_idle & 1))
+   {
+      spi->CPOL = clock_idle & 1;
+      spi->MOSI_IDLE = mosi_idle & 1;
       
-      size -= buf_size;
+      spi->low_bits.level = (spi->low_bits.level & ~(SCLK|MOSI)) | 
+                            (spi->CPOL      ? SCLK : 0) | 
+                            (spi->MOSI_IDLE ? MOSI : 0);
+      buf[length++] = SET_BITS_LOW;
+      buf[length++] = spi->low_bits.level;
+      buf[length++] = spi->low_bits.io;
    }
- 
-   return 1;
+   
+   /* clock phase and bit order only select the opcodes of data commands */
+   spi->CPHA = clock_phase & 1;
+   spi->WRITE_LSB_FIRST = write_lsb_first & 1;
+   spi->READ_LSB_FIRST = read_lsb_first & 1;
+   
+   DEBUG_PRINT ("DEBUG: [SPI] Reconfigured to mode %d with %d bytes of MPSSE commands\n", SPIMODE (spi), length);
+   
+   if (length == 0)
+      return 0;
+   
+   return spi_queue_write (ftdi, spi, buf, length);
 }
 
-/**
-   Sends data via SPI on FTDI device.
+/** 
+   Opens SPI connection by setting CS# line low. Also, sets MOSI and SCLK lines to their respective idle levels. 
+   <br>If a communication error is pending, FTDI device is recovered first (see spi_recover), so that 
+   every transaction starts from a known state.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
-   @param data byte array with data to write
-   @param size size of data to write
+   
+   @retval SPI_USB_ERROR if FTDI device cannot be recovered, or CS# cannot be asserted
+   @retval >0 on success
 */
-
-void spi_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+int spi_open (struct ftdi_context *ftdi, struct spi_context *spi)
 {
-   byte buf[3];
-   byte *curr_data;
-   int buf_size, rem_size;
-   int ret;
+   byte level;
    
-   rem_size = size;
-   curr_data = data;
+   if (spi->error.code != 0 && spi_recover (ftdi, spi) < 0)
+      return SPI_USB_ERROR;
    
-   while (rem_size > 0)
-   {
-      if (rem_size > MAX_SPI_BUF_LENGTH)
-         buf_size = MAX_SPI_BUF_LENGTH;
-      else
-         buf_size = rem_size;
-      
-      /* build header */
-      buf[0] = MPSSE_DO_WRITE | (spi->WRITE_LSB_FIRST ? MPSSE_LSB : 0);
-      /* set spi mode according to AN_108 */
-      if (SPIMODE (spi) == 0 || SPIMODE (spi) == 3)      /* mode 0 or mode 3 (clock out on -ve) */
-         buf[0] |= MPSSE_WRITE_NEG;
-      buf[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
-      buf[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
+   level = (spi->MOSI_IDLE ? MOSI : 0);       /* set MOSI idle value, CS=0 */
+   if (!spi->CPHA)                            /* set clock idle polarity */
+      level |= (spi->CPOL  ? SCLK : 0);       /* AN_108: clock out on -ve (mode 0) requires SCLK=0, clock out on +ve (mode 2) requires SCLK=1 */
+   else                                       /* workaround to get SPI mode 1, 3 working (invert clock polarity before writing data) */
+      level |= (!spi->CPOL ? SCLK : 0);       /* AN_108: clock out on +ve (mode 2) requires SCLK=1, clock out on -ve (mode 3) requires SCLK=0 */      
       
-      /* write out header */
-      if ((ret = ftdi_write_data_and_wait (ftdi, buf, 3)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
-      /* write out spi data */
-      if ((ret = ftdi_write_data_and_wait (ftdi, curr_data, buf_size)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
-           
-      rem_size -= buf_size;
-      curr_data += buf_size;
-   }
+   if (ftdi_set_bits_low (ftdi, spi, CS|SCLK|MOSI, level, CS|SCLK|MOSI) < 0)
+      return SPI_USB_ERROR;
+
+   DEBUG_PRINT ("DEBUG: [SPI] Asserting CS#\n");
    
-#ifdef DEBUG
-   int i;
-   DEBUG_PRINT ("DEBUG: [SPI] Sending ");
-   for (i = 0; i < size; i++)
-      DEBUG_PRINT ("%.2X ", data[i]);
-   DEBUG_PRINT ("\n");
-#endif
-  
-   return;
+   return 1;
 }
 
-/**
-   Reads data via SPI from FTDI device.
+/** 
+   Closes SPI connection by setting CS# line high. Also, sets MOSI and SCLK lines to their respective idle levels. 
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
-   @param data byte array to store data in
-   @param size size of data to read
+   
+   @retval SPI_USB_ERROR if a communication error is pending
+   @retval >0 on success
 */
-void spi_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+int spi_close (struct ftdi_context *ftdi, struct spi_context *spi)
 {
-   byte buf[3];
-   byte *curr_data;
-   int buf_size, rem_size;
-   int ret;
-   
-   rem_size = size;
-   curr_data = data;
-   
-   while (rem_size > 0)
-   {
-      if (rem_size > MAX_SPI_BUF_LENGTH)
-         buf_size = MAX_SPI_BUF_LENGTH;
-      else
-         buf_size = rem_size;
-      
-      buf[0] = MPSSE_DO_READ | (spi->READ_LSB_FIRST ? MPSSE_LSB : 0);
-      /* set spi mode according to AN_108 */
-      if (SPIMODE (spi) == 1 || SPIMODE (spi) == 2)      /* mode 1 or mode 2 (clock out on +ve) */
-         buf[0] |= MPSSE_READ_NEG;
-      buf[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
-      buf[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
-      
-      /* write out spi data */
-      if ((ret = ftdi_write_data_and_wait (ftdi, buf, 3)) < 0)
-         ftdi_exit (ftdi, "ERROR: Unable to send SPI data: %d (%s)\n", ret);
+   byte level;
 
-      /* read data */
-      if ((ret = ftdi_read_data_and_wait (ftdi, curr_data, buf_size)) < 0)
-            ftdi_exit (ftdi, "ERROR: Unable to read SPI data: %d (%s)\n", ret);
-         
-      rem_size -= buf_size;
-      curr_data += buf_size;
-   }
+   level = (spi->CPOL      ? SCLK : 0) | 
+           (spi->MOSI_IDLE ? MOSI : 0) |
+           CS;                              /* set port idle values */
+           
+   if (ftdi_set_bits_low (ftdi, spi, CS|SCLK|MOSI, level, CS|SCLK|MOSI) < 0)
+      return SPI_USB_ERROR;
    
-#ifdef DEBUG
-   int i;
-   DEBUG_PRINT ("DEBUG: [SPI] Receiving ");
-   for (i = 0; i < size; i++)
-      DEBUG_PRINT ("%.2X ", data[i]);
-   DEBUG_PRINT ("\n");
-#endif
- 
-   return;
+   DEBUG_PRINT ("DEBUG: [SPI] De-asserting CS#\n\n");
+
+   return 1;
 }
 
 /**
-   Prints selected SPI clock frequency to the terminal screen.
+   Records a communication error in spi_context and prints information about it. Only the first error 
+   is latched: until spi_recover is called, spi_* functions return SPI_USB_ERROR straight away, so 
+   that a sequence of calls can be checked once at its end. Pending queued commands are dropped, 
+   since FTDI device state is unknown.
    
+   @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
+   @param message failed operation
+   @param code libftdi error code
+   
+   @return SPI_USB_ERROR
 */
-void spi_print_clk_frequency (struct spi_context *spi)
+int spi_error (struct ftdi_context *ftdi, struct spi_context *spi, const char *message, int code)
 {
-   double clock_frequency;
-   char prefix = '\0';
-
-   clock_frequency = spi_frequency (spi);
+   fprintf (stderr, "ERROR: %s: %d (%s)\n", message, code, ftdi_get_error_string (ftdi));
    
-   /* normalise using engineering notation */
-   if      (clock_frequency >= 1e6) { clock_frequency /= 1e6; prefix = 'M'; }
-   else if (clock_frequency >= 1e3) { clock_frequency /= 1e3; prefix = 'k'; }
+   spi->error.count++;
    
-   printf ("FTDI: Clock frequency set to %.3f ", clock_frequency);
+   if (spi->error.code == 0)
+   {
+      spi->error.code = (code < 0) ? code : -1;
+      snprintf (spi->error.message, SPI_ERROR_LENGTH, "%s", message);
+   }
    
-   prefix ? printf ("%cHz\n", prefix) : printf ("Hz\n");
+   spi->queue.length = 0;
+   spi->queue.read_count = 0;
+   spi->queue.read_length = 0;
+   spi->low_bits.pending = -1;
+   spi->high_bits.pending = -1;
    
-   return;
+   return SPI_USB_ERROR;
 }
 
 /**
-   Calculates selected SPI clock frequency.
+   Brings FTDI device back to a known state after a communication error: purges USB buffers, 
+   synchronizes MPSSE interface again using 0xAA command, restores clock and loopback settings and 
+   sets CS# high, with all other pins at their last level. The pending error is cleared on success.
+   <br>Called automatically by spi_open.
    
+   @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
    
-   @return clock frequency
+   @retval SPI_USB_ERROR if FTDI device still does not respond (error stays pending)
+   @retval >0 on success (or if no error was pending)
 */
-double spi_frequency (struct spi_context *spi)
+int spi_recover (struct ftdi_context *ftdi, struct spi_context *spi)
 {
-   double clock_frequency;
+   int ret;
+   byte buf[14];
    
-   if (spi->CDIV5)
-      clock_frequency = 12e6 / ((1 + (double)spi->CDIV) * 2);
-   else
-      clock_frequency = 60e6 / ((1 + (double)spi->CDIV) * 2);
+   if (spi->error.code == 0)
+      return 1;
    
-   return clock_frequency;
+   printf ("FTDI: Recovering from error: %s\n", spi->error.message);
+   
+   if ((ret = ftdi_usb_purge_buffers (ftdi)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to purge buffers: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      return SPI_USB_ERROR;
+   }
+   
+   /* synchronize MPSSE interface by sending a bad command: a valid echo means no stale data is left */
+   buf[0] = 0xAA;
+   if ((ret = ftdi_write_data_and_check (ftdi, NULL, buf, 1)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to synchronize mpsse interface: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      return SPI_USB_ERROR;
+   }
+   
+   /* CS# high, SCLK and MOSI idle */
+   spi->low_bits.level = (spi->low_bits.level & ~(CS|SCLK|MOSI)) | 
+                         (spi->CPOL      ? SCLK : 0) | 
+                         (spi->MOSI_IDLE ? MOSI : 0) | 
+                         CS;
+   
+   /* restore clock, loopback and pins state, as left by spi_init and ftdi_set_bits_* */
+   buf[0] = spi->CDIV5 ? EN_DIV_5 : DIS_DIV_5;
+   buf[1] = DIS_ADAPTIVE;
+   buf[2] = DIS_3_PHASE;
+   buf[3] = TCK_DIVISOR;
+   buf[4] = GETBYTE (spi->CDIV, 0);
+   buf[5] = GETBYTE (spi->CDIV, 1);
+   buf[6] = spi->LOOPBACK_ON ? LOOPBACK_START : LOOPBACK_END;
+   buf[7] = SET_BITS_LOW;
+   buf[8] = spi->low_bits.level;
+   buf[9] = spi->low_bits.io;
+   buf[10] = SET_BITS_HIGH;
+   buf[11] = spi->high_bits.level;
+   buf[12] = spi->high_bits.io;
+   if ((ret = ftdi_write_data_and_wait (ftdi, &spi->stats, buf, 13)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to restore MPSSE settings: %d (%s)\n", ret, ftdi_get_error_string (ftdi));
+      return SPI_USB_ERROR;
+   }
+   
+   spi->error.code = 0;
+   spi->error.recoveries++;
+   
+   return 1;
 }
 
 /**
-   Calculates selected SPI clock period.
+   Returns the pending communication error of an SPI context, if any.
    
    @param spi pointer to struct spi_context
+   @param message pointer to store the description of the failed operation in (may be NULL)
    
-   @return clock period
+   @return libftdi error code of the pending error (0 if none)
 */
-double spi_clk_period (struct spi_context *spi)
+int spi_last_error (struct spi_context *spi, const char **message)
 {
-   double clock_period;
-   
-   clock_period = 1.0 / spi_frequency (spi);
+   if (message != NULL)
+      *message = spi->error.message;
    
-   return clock_period;
+   return spi->error.code;
 }
 
 /**
-   Sets level and i/o state of low bits in FTDI device. Only selected pins in mask will be modified.
-   <br>Note that in SPI mode the four least significant bits controls SCLK, MOSI, MISO and CS lines 
-   and should not be changed via this function unless particular initialisation are required.
-   
+   Declares whether GPIOL1 is wired to MISO. If so, GPIOL1 is set as input and slave devices that signal
+   busy state on MISO (e.g. SD cards) can be waited for by FTDI device itself (see spi_wait_gpiol1),
+   without polling from host side.
+
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
-   @param mask bit mask (set to 1 the pins whose level or i/o must be modified)
-   @param level pins level (0 = low, 1 = high)
-   @param io pins i/o (0 = output, 1 = input)
+   @param enable 1 if GPIOL1 is wired to MISO, 0 otherwise
+   
+   @retval SPI_USB_ERROR if a communication error is pending
+   @retval >0 on success
 */
-void ftdi_set_bits_low (struct ftdi_context *ftdi, struct spi_context *spi, 
-                                      byte mask, byte level, byte io)
+int spi_set_gpiol1_wait (struct ftdi_context *ftdi, struct spi_context *spi, int enable)
 {
-   byte buf[3];
-   int ret;
+   spi->GPIOL1_WAIT = enable & 1;
 
-   spi->low_bits.level |= (mask & level);     /* sets to 1 selected bits */
-   spi->low_bits.level &= (~mask | level);    /* sets to 0 selected bits */
-   spi->low_bits.io |= (mask & io);           /* sets to 1 selected bits */
-   spi->low_bits.io &= (~mask | io);          /* sets to 0 selected bits */
-   
-   /* set bits state */
-   buf[0] = SET_BITS_LOW;
-   buf[1] = spi->low_bits.level;
-   buf[2] = spi->low_bits.io;
-   
-   if ((ret = ftdi_write_data (ftdi, buf, 3)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set low bits: %d (%s)\n", ret);
+   if (spi->GPIOL1_WAIT)
+      return ftdi_set_bits_low (ftdi, spi, GPIOL1, 0, 0);    /* GPIOL1: I */
+
+   return 1;
+}
+
+/**
+   Clocks SCLK until GPIOL1 reaches the given level (MPSSE "wait on I/O" commands). Command is queued if
+   the queue is enabled, so that any command following it is executed by FTDI device as soon as the
+   level is reached.
+   <br>FTDI device waits indefinitely: a slave device that never reaches the level makes the next
+   USB transfer time out.
+
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param level GPIOL1 level to wait for
+   
+   @retval SPI_USB_ERROR if a communication error is pending
+   @retval >0 on success
+*/
+int spi_wait_gpiol1 (struct ftdi_context *ftdi, struct spi_context *spi, int level)
+{
+   byte buf[1];
+
+   buf[0] = level ? CLK_WAIT_HIGH : CLK_WAIT_LOW;
+
+   return spi_queue_write (ftdi, spi, buf, 1);
+}
+
+/**
+   Sends data read from the file pointed by fp via SPI on FTDI device.
+   <br>File is read ahead by SPI_PREFETCH_DEPTH chunks (see spi_write_from_file_prefetch).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param fp pointer to FILE
+   @param size size of data to write
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if EOF reached before sending out all data
+   @retval >0 on success
+*/
+int spi_write_from_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size)
+{
+   return spi_write_from_file_prefetch (ftdi, spi, fp, size, SPI_PREFETCH_DEPTH, NULL);
+}
+
+/**
+   Sends data read from the file pointed by fp via SPI on FTDI device, reading the file in a separate 
+   thread.
+   <br>A producer thread keeps up to depth chunks of MAX_SPI_BUF_LENGTH bytes loaded, while up to 
+   SPI_PREFETCH_IN_FLIGHT of them are being written out to FTDI device, so that disk latency and 
+   USB latency overlap instead of adding up.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param fp pointer to FILE
+   @param size size of data to write
+   @param depth number of chunk buffers (SPI_PREFETCH_IN_FLIGHT + 1 to SPI_PREFETCH_MAX_DEPTH)
+   @param stall_time if not NULL, set to the time (in seconds) USB writes waited for the file to be read
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if EOF reached before sending out all data, or buffers could not be allocated
+   @retval >0 on success
+*/
+int spi_write_from_file_prefetch (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size, int depth,
+                                  double *stall_time)
+{
+   struct spi_prefetch pf;
+   struct ftdi_async async;
+   pthread_t thread;
+   byte *slot;
+   int length, in_flight, ret;
+   double start;
+   
+   if (depth < SPI_PREFETCH_IN_FLIGHT + 1)
+      depth = SPI_PREFETCH_IN_FLIGHT + 1;
+   else if (depth > SPI_PREFETCH_MAX_DEPTH)
+      depth = SPI_PREFETCH_MAX_DEPTH;
+   
+   if (stall_time != NULL)
+      *stall_time = 0;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   if (size <= 0)
+      return 1;
+   
+   /* every slot holds a command header followed by up to MAX_SPI_BUF_LENGTH bytes of file data */
+   if ((pf.slots = (byte *)malloc ((size_t)depth * (3 + MAX_SPI_BUF_LENGTH))) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate prefetch buffers!\n");
+      return -1;
+   }
+   
+   pf.fp = fp;
+   pf.remaining = size;
+   pf.depth = depth;
+   pf.produced = 0;
+   pf.consumed = 0;
+   pf.released = 0;
+   pf.done = 0;
+   pf.stop = 0;
+   
+   /* keep commands in order: send out anything still queued */
+   if (spi_queue_flush (ftdi, spi) < 0)
+   {
+      free (pf.slots);
+      return SPI_USB_ERROR;
+   }
+   
+   pthread_mutex_init (&pf.lock, NULL);
+   pthread_cond_init (&pf.filled, NULL);
+   pthread_cond_init (&pf.emptied, NULL);
+   
+   if (pthread_create (&thread, NULL, spi_prefetch_thread, &pf) != 0)
+   {
+      fprintf (stderr, "ERROR: Unable to start prefetch thread!\n");
+      pthread_mutex_destroy (&pf.lock);
+      pthread_cond_destroy (&pf.filled);
+      pthread_cond_destroy (&pf.emptied);
+      free (pf.slots);
+      return -1;
+   }
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   in_flight = 0;
+   
+   while (1)
+   {
+      /* wait for next chunk */
+      pthread_mutex_lock (&pf.lock);
+      if (pf.consumed == pf.produced && !pf.done)
+      {
+         start = ftdi_monotonic_time ();
+         while (pf.consumed == pf.produced && !pf.done)
+            pthread_cond_wait (&pf.filled, &pf.lock);
+         start = ftdi_monotonic_time () - start;
+         spi->stats.file_time += start;
+         ftdi_trace_event (&spi->stats, FTDI_TRACE_FILE, 0, 0, start);
+         if (stall_time != NULL)
+            *stall_time += start;
+      }
+      if (pf.consumed == pf.produced)
+      {
+         pthread_mutex_unlock (&pf.lock);
+         break;
+      }
+      slot = pf.slots + (size_t)(pf.consumed % depth) * (3 + MAX_SPI_BUF_LENGTH);
+      length = pf.lengths[pf.consumed % depth];
+      pf.consumed++;
+      pthread_mutex_unlock (&pf.lock);
+      
+      /* build header in front of data */
+      slot[HEADER_0] = MPSSE_DO_WRITE | (spi->WRITE_LSB_FIRST ? MPSSE_LSB : 0);
+      /* set spi mode according to AN_108 */
+      if (SPIMODE (spi) == 0 || SPIMODE (spi) == 3)      /* mode 0 or mode 3 (clock out on -ve) */
+         slot[HEADER_0] |= MPSSE_WRITE_NEG;
+      slot[HEADER_1] = GETBYTE (length - 1, 0);         /* length (low byte) */
+      slot[HEADER_2] = GETBYTE (length - 1, 1);         /* length (high byte) */
+      
+      if (ftdi_async_write (&async, slot, 3 + length) < 0)
+         break;
+      
+      /* give back the oldest slot to the producer once it is on the wire */
+      if (++in_flight == SPI_PREFETCH_IN_FLIGHT)
+      {
+         if (ftdi_async_wait_write (&async) < 0)
+            break;
+         in_flight--;
+         
+         pthread_mutex_lock (&pf.lock);
+         pf.released++;
+         pthread_cond_signal (&pf.emptied);
+         pthread_mutex_unlock (&pf.lock);
+      }
+   }
+   
+   ret = ftdi_async_end (&async);
+   
+   /* stop producer (it may be waiting for a free slot after a communication error) */
+   pthread_mutex_lock (&pf.lock);
+   pf.stop = 1;
+   pthread_cond_signal (&pf.emptied);
+   pthread_mutex_unlock (&pf.lock);
+   pthread_join (thread, NULL);
+   
+   pthread_mutex_destroy (&pf.lock);
+   pthread_cond_destroy (&pf.filled);
+   pthread_cond_destroy (&pf.emptied);
+   free (pf.slots);
+   
+   if (ret < 0)
+      return spi_error (ftdi, spi, "Unable to send SPI data", ret);
+   
+   DEBUG_PRINT ("DEBUG: [SPI] File prefetch stalled for %.3f s\n", (stall_time != NULL) ? *stall_time : 0.0);
+   
+   if (pf.remaining > 0)
+   {
+      printf ("WARNING: Cannot read file, end-of-file reached before sending out all data!\n");
+      printf ("   Remaining size: %d bytes\n", pf.remaining);
+      return -1;
+   }
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by spi_write_from_file_prefetch: producer thread, reads the file into free 
+   slots until all data has been read, end-of-file is reached or the consumer stops it.
+   
+   @param arg pointer to struct spi_prefetch
+   
+   @return NULL
+*/
+void *spi_prefetch_thread (void *arg)
+{
+   struct spi_prefetch *pf = (struct spi_prefetch *)arg;
+   byte *slot;
+   int size, length;
+   
+   while (1)
+   {
+      /* wait for a free slot */
+      pthread_mutex_lock (&pf->lock);
+      while (pf->produced - pf->released == pf->depth && !pf->stop)
+         pthread_cond_wait (&pf->emptied, &pf->lock);
+      if (pf->stop || pf->remaining == 0)
+      {
+         pf->done = 1;
+         pthread_cond_signal (&pf->filled);
+         pthread_mutex_unlock (&pf->lock);
+         break;
+      }
+      slot = pf->slots + (size_t)(pf->produced % pf->depth) * (3 + MAX_SPI_BUF_LENGTH);
+      size = (pf->remaining > MAX_SPI_BUF_LENGTH) ? MAX_SPI_BUF_LENGTH : pf->remaining;
+      pthread_mutex_unlock (&pf->lock);
+      
+      /* read outside the lock, while the consumer is writing out previous chunks */
+      length = fread (slot + DATA, sizeof (byte), size, pf->fp);
+      
+      pthread_mutex_lock (&pf->lock);
+      if (length > 0)
+      {
+         pf->lengths[pf->produced % pf->depth] = length;
+         pf->remaining -= length;
+         pf->produced++;
+      }
+      /* end-of-file or read error */
+      if (length < size)
+         pf->stop = 1;
+      pthread_cond_signal (&pf->filled);
+      pthread_mutex_unlock (&pf->lock);
+   }
+   
+   return NULL;
+}
+
+/** 
+   Reads data via SPI from FTDI device and saves them in the file pointed by fp. 
+   <br>Data is streamed through a ring buffer (see spi_read_stream): writing to file overlaps with 
+   reading the next segment.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param fp pointer to FILE
+   @param size size of data to read
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if a write error occurred before reading in all data
+   @retval >0 on success
+*/
+int spi_read_to_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size)
+{
+   struct spi_file_stream stream;
+   byte *ring;
+   int ret;
+   
+   if (size <= 0)
+      return 1;
+   
+   if ((ring = (byte *)malloc (SPI_STREAM_RING_LENGTH)) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate stream buffer!\n");
+      return -1;
+   }
+   
+   stream.fp = fp;
+   stream.remaining = size;
+   
+   /* stream is stopped by callback only on write errors */
+   ret = spi_read_stream (ftdi, spi, ring, SPI_STREAM_RING_LENGTH, size, spi_read_to_file_cb, &stream);
+   
+   free (ring);
+   
+   if (ret == SPI_USB_ERROR)
+      return ret;
+   
+   return (ret > 0) ? 1 : -1;
+}
+
+/**
+   Auxiliary function used by spi_read_to_file: writes a completed segment to file.
+   
+   @param data segment data
+   @param size segment size
+   @param user pointer to struct spi_file_stream
+   
+   @retval 0 to continue streaming
+   @retval 1 if a write error occurred
+*/
+int spi_read_to_file_cb (byte *data, int size, void *user)
+{
+   struct spi_file_stream *stream = (struct spi_file_stream *)user;
+   
+   if (fwrite (data, sizeof (byte), size, stream->fp) != (size_t)size)
+   {
+      fprintf (stderr, "ERROR: Unable to write file!\n");
+      printf ("   Remaining size: %d bytes\n", stream->remaining);
+      return 1;
+   }
+   
+   stream->remaining -= size;
+   
+   return 0;
+}
+
+/** 
+   Reads data via SPI from FTDI device and saves them in the file at path, without going through stdio.
+   <br>The file is preallocated and memory-mapped, and spi_read_stream places every segment directly 
+   at its offset in the mapping. Write-back to disk is started in background every 
+   SPI_MSYNC_BATCH_LENGTH bytes, while the next segments are being read.
+   <br>On Windows (no mmap), data is written to the file through stdio instead, see spi_read_to_file.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param path path of the file to create (or overwrite)
+   @param size size of data to read
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if the file could not be created or mapped
+   @retval >0 on success
+*/
+int spi_read_to_mapped_file (struct ftdi_context *ftdi, struct spi_context *spi, const char *path, qword size)
+{
+#ifdef _WIN32
+   FILE *fp;
+   int ret;
+   
+   if ((fp = fopen (path, "wb")) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to open file!\n");
+      return -1;
+   }
+   
+   ret = spi_read_to_file (ftdi, spi, fp, (int)size);
+   
+   if (fclose (fp) != 0 && ret > 0)
+      ret = -1;
+   
+   return ret;
+#else
+   struct spi_mapped_stream stream;
+   int fd, ret;
+   
+   if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to open file!\n");
+      return -1;
+   }
+   
+   if (size == 0)
+   {
+      close (fd);
+      return 1;
+   }
+   
+   /* reserve disk space now, so that page faults do not allocate blocks while reading (fall back to 
+      a sparse file if the file system does not support preallocation) */
+   if (posix_fallocate (fd, 0, size) != 0 && ftruncate (fd, size) < 0)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate file!\n");
+      close (fd);
+      return -1;
+   }
+   
+   if ((stream.map = (byte *)mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      fprintf (stderr, "ERROR: Unable to map file!\n");
+      close (fd);
+      return -1;
+   }
+   
+   stream.done = 0;
+   stream.synced = 0;
+   
+   ret = spi_read_stream (ftdi, spi, stream.map, size, size, spi_read_to_mapped_file_cb, &stream);
+   
+   /* start write-back of the last batch, munmap does not wait for it */
+   msync (stream.map + stream.synced, size - stream.synced, MS_ASYNC);
+   
+   munmap (stream.map, size);
+   close (fd);
+   
+   if (ret == SPI_USB_ERROR)
+      return ret;
+   
+   return (ret > 0) ? 1 : -1;
+#endif
+}
+
+/**
+   Auxiliary function used by spi_read_to_mapped_file: starts write-back of completed batches.
+   
+   @param data segment data (inside the mapping)
+   @param size segment size
+   @param user pointer to struct spi_mapped_stream
+   
+   @retval 0 to continue streaming
+*/
+int spi_read_to_mapped_file_cb (byte *data, int size, void *user)
+{
+   struct spi_mapped_stream *stream = (struct spi_mapped_stream *)user;
+   
+   stream->done = (data - stream->map) + size;
+   
+#ifndef _WIN32
+   /* batches start at multiples of the segment size, hence page-aligned */
+   if (stream->done - stream->synced >= SPI_MSYNC_BATCH_LENGTH)
+   {
+      msync (stream->map + stream->synced, stream->done - stream->synced, MS_ASYNC);
+      stream->synced = stream->done;
+   }
+#endif
+   
+   return 0;
+}
+
+/**
+   Reads a (possibly unbounded) stream of data via SPI from FTDI device into a caller-owned ring buffer.
+   <br>The ring buffer is split in segments of up to MAX_SPI_BUF_LENGTH bytes. Each segment is the 
+   destination of an asynchronous libftdi read: libftdi receives USB packets in its own read buffer and 
+   copies their payload (without FTDI status bytes) into the segment, this library adds no copy of its own. 
+   The read command of the next segment is always queued on FTDI device before the 
+   current one completes, and callback is called with each completed segment while the next one is 
+   being read, so SPI clock keeps running as long as callback returns in time. 
+   <br>Segments are placed one after the other, wrapping around to the start of the ring when the next 
+   one does not fit: if ring_size equals total, every byte lands at its own offset in the ring. A segment 
+   handed to callback stays valid until the ring wraps around over it.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param ring ring buffer (at least 2 bytes, or total bytes)
+   @param ring_size size of ring buffer
+   @param total number of bytes to read (0 to read until callback stops the stream)
+   @param callback function called with every completed segment
+   @param user user data passed to callback
+   
+   @retval SPI_USB_ERROR on communication error (segments read so far have been handed to callback)
+   @retval 0 if stream was stopped by callback
+   @retval >0 if all data was read
+*/
+int spi_read_stream (struct ftdi_context *ftdi, struct spi_context *spi, byte *ring, qword ring_size, qword total,
+                     spi_stream_callback callback, void *user)
+{
+   byte buf[FTDI_ASYNC_DEPTH + 1][3];
+   byte *header, *curr_data, *prev_data;
+   qword requested, offset;
+   int seg_size, buf_size, prev_size, n;
+   int ret, stop;
+   struct ftdi_async async;
+   
+   /* at least two segments: one being read, one being handed to callback */
+   if (ring_size / 2 > MAX_SPI_BUF_LENGTH)
+      seg_size = MAX_SPI_BUF_LENGTH;
+   else
+      seg_size = (int)(ring_size / 2);
+   
+   /* a 1-byte ring is a single segment, enough if the whole stream fits in it */
+   if (seg_size <= 0 && total != 0 && total <= ring_size)
+      seg_size = (int)ring_size;
+   if (seg_size <= 0)
+      return -1;
+   
+   /* keep commands in order: send out anything still queued */
+   if (spi_queue_flush (ftdi, spi) < 0)
+      return SPI_USB_ERROR;
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   requested = 0;
+   offset = 0;
+   prev_data = NULL;
+   prev_size = 0;
+   stop = 0;
+   n = 0;
+   
+   while (!stop && (total == 0 || requested < total))
+   {
+      if (total != 0 && total - requested < (qword)seg_size)
+         buf_size = (int)(total - requested);
+      else
+         buf_size = seg_size;
+      
+      if (offset + buf_size > ring_size)
+         offset = 0;
+      curr_data = ring + offset;
+      offset += buf_size;
+      
+      /* headers of transfers still in flight must not be overwritten */
+      header = buf[n++ % (FTDI_ASYNC_DEPTH + 1)];
+      
+      header[0] = MPSSE_DO_READ | (spi->READ_LSB_FIRST ? MPSSE_LSB : 0);
+      /* set spi mode according to AN_108 */
+      if (SPIMODE (spi) == 1 || SPIMODE (spi) == 2)      /* mode 1 or mode 2 (clock out on +ve) */
+         header[0] |= MPSSE_READ_NEG;
+      header[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
+      header[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
+      
+      /* queue next command before waiting for the previous segment, so that SPI clock keeps running */
+      ftdi_async_write (&async, header, 3);
+      
+      if (ftdi_async_wait_read (&async) < 0)
+         break;
+      
+      ftdi_async_read (&async, curr_data, buf_size);
+      
+      /* hand previous segment to caller while this one is being read */
+      if (prev_size > 0 && spi_stream_deliver (spi, callback, prev_data, prev_size, user) != 0)
+         stop = 1;
+      
+      prev_data = curr_data;
+      prev_size = buf_size;
+      requested += buf_size;
+   }
+   
+   /* last segment is valid only if every transfer succeeded */
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to read SPI data", ret);
+   
+   if (!stop && prev_size > 0 && spi_stream_deliver (spi, callback, prev_data, prev_size, user) != 0)
+      stop = 1;
+   
+   DEBUG_PRINT ("DEBUG: [SPI] Streamed %llu bytes\n", (unsigned long long)requested);
+   
+   if (stop)
+      return 0;
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by spi_read_stream: hands a segment to the callback, accounting for the 
+   time it takes as host side I/O.
+   
+   @param spi pointer to struct spi_context
+   @param callback function called with the segment
+   @param data segment data
+   @param size segment size
+   @param user user data passed to callback
+   
+   @return value returned by callback
+*/
+int spi_stream_deliver (struct spi_context *spi, spi_stream_callback callback, byte *data, int size, void *user)
+{
+   double start;
+   int ret;
+   
+   start = ftdi_monotonic_time ();
+   ret = callback (data, size, user);
+   start = ftdi_monotonic_time () - start;
+   
+   spi->stats.file_time += start;
+   ftdi_trace_event (&spi->stats, FTDI_TRACE_FILE, size, ret, start);
+   
+   return ret;
+}
+
+/**
+   Sends data via SPI on FTDI device.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param data byte array with data to write
+   @param size size of data to write
+   
+   @retval SPI_USB_ERROR on communication error (or if one is pending)
+   @retval >0 on success
+*/
+int spi_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+{
+   byte buf[FTDI_ASYNC_DEPTH + 1][3];
+   byte *header, *curr_data;
+   int buf_size, rem_size, n;
+   int ret;
+   struct ftdi_async async;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   rem_size = size;
+   curr_data = data;
+   n = 0;
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   while (rem_size > 0)
+   {
+      if (rem_size > MAX_SPI_BUF_LENGTH)
+         buf_size = MAX_SPI_BUF_LENGTH;
+      else
+         buf_size = rem_size;
+      
+      /* headers of transfers still in flight must not be overwritten */
+      header = buf[n++ % (FTDI_ASYNC_DEPTH + 1)];
+      
+      /* build header */
+      header[0] = MPSSE_DO_WRITE | (spi->WRITE_LSB_FIRST ? MPSSE_LSB : 0);
+      /* set spi mode according to AN_108 */
+      if (SPIMODE (spi) == 0 || SPIMODE (spi) == 3)      /* mode 0 or mode 3 (clock out on -ve) */
+         header[0] |= MPSSE_WRITE_NEG;
+      header[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
+      header[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
+      
+      if (spi->queue.enabled)
+      {
+         /* queue header and spi data */
+         if (spi_queue_write (ftdi, spi, header, 3) < 0 ||
+             spi_queue_write (ftdi, spi, curr_data, buf_size) < 0)
+            break;
+      }
+      else
+      {
+         /* submit header and spi data, without waiting for previous chunks to complete */
+         ftdi_async_write (&async, header, 3);
+         ftdi_async_write (&async, curr_data, buf_size);
+      }
+           
+      rem_size -= buf_size;
+      curr_data += buf_size;
+   }
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to send SPI data", ret);
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+#ifdef DEBUG
+   int i;
+   DEBUG_PRINT ("DEBUG: [SPI] Sending ");
+   for (i = 0; i < size; i++)
+      DEBUG_PRINT ("%.2X ", data[i]);
+   DEBUG_PRINT ("\n");
+#endif
+  
+   return 1;
+}
+
+/**
+   Reads data via SPI from FTDI device.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param data byte array to store data in
+   @param size size of data to read
+   
+   @retval SPI_USB_ERROR on communication error (or if one is pending)
+   @retval >0 on success
+*/
+int spi_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+{
+   byte buf[FTDI_ASYNC_DEPTH + 1][3];
+   byte *header, *curr_data;
+   int buf_size, max_size, rem_size, n;
+   int ret;
+   struct ftdi_async async;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   rem_size = size;
+   curr_data = data;
+   n = 0;
+   
+   /* queued reads must fit in FTDI internal buffer */
+   max_size = spi->queue.enabled ? MAX_INTERNAL_BUF_LENGTH : MAX_SPI_BUF_LENGTH;
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   while (rem_size > 0)
+   {
+      if (rem_size > max_size)
+         buf_size = max_size;
+      else
+         buf_size = rem_size;
+      
+      /* headers of transfers still in flight must not be overwritten */
+      header = buf[n++ % (FTDI_ASYNC_DEPTH + 1)];
+      
+      header[0] = MPSSE_DO_READ | (spi->READ_LSB_FIRST ? MPSSE_LSB : 0);
+      /* set spi mode according to AN_108 */
+      if (SPIMODE (spi) == 1 || SPIMODE (spi) == 2)      /* mode 1 or mode 2 (clock out on +ve) */
+         header[0] |= MPSSE_READ_NEG;
+      header[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
+      header[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
+      
+      if (spi->queue.enabled)
+      {
+         /* queue header and read-back destination */
+         if (spi_queue_reserve (ftdi, spi, buf_size) < 0 ||
+             spi_queue_write (ftdi, spi, header, 3) < 0 ||
+             spi_queue_read (ftdi, spi, curr_data, buf_size) < 0)
+            break;
+      }
+      else
+      {
+         /* submit header, then read data: the header of chunk N+1 reaches FTDI device 
+            while chunk N is still being read back */
+         ftdi_async_write (&async, header, 3);
+         ftdi_async_read (&async, curr_data, buf_size);
+      }
+         
+      rem_size -= buf_size;
+      curr_data += buf_size;
+   }
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to read SPI data", ret);
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+#ifdef DEBUG
+   int i;
+   if (spi->queue.enabled)
+      DEBUG_PRINT ("DEBUG: [SPI] Queued receiving of %d bytes\n", size);
+   else
+   {
+      DEBUG_PRINT ("DEBUG: [SPI] Receiving ");
+      for (i = 0; i < size; i++)
+         DEBUG_PRINT ("%.2X ", data[i]);
+      DEBUG_PRINT ("\n");
+   }
+#endif
+ 
+   return 1;
+}
+
+/**
+   Sends cmd, then reads the status register it returns until (status & mask) == value. Slave 
+   device must output the status register continuously while CS# is held low (e.g. RDSR of SPI flash 
+   memories).
+   <br>Status register is read in bursts lasting about SPI_POLL_INTERVAL seconds each, and the next burst 
+   is already queued in FTDI device while the previous one is being checked, so that SCLK never stops 
+   and only one USB round trip is needed per burst, rather than one per status byte.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param cmd read status command
+   @param mask bits of status register to check
+   @param value expected value of the masked bits
+   @param timeout maximum time to wait, in seconds
+   @param status pointer to store the first matching status byte in (or the last one, on timeout), may be NULL
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 on timeout
+   @retval >0 on success
+*/
+int spi_poll_status (struct ftdi_context *ftdi, struct spi_context *spi, byte cmd, byte mask, byte value, 
+                     double timeout, byte *status)
+{
+   byte burst[2][SPI_POLL_MAX_BURST_LENGTH];
+   byte header[3], last;
+   int i, length, curr, found, ret;
+   double start;
+   struct ftdi_async async;
+   
+   /* bytes clocked out in SPI_POLL_INTERVAL: two bursts must fit in FTDI internal buffer */
+   length = (int)(spi_frequency (spi) / 8 * SPI_POLL_INTERVAL);
+   if (length < 1)
+      length = 1;
+   if (length > SPI_POLL_MAX_BURST_LENGTH)
+      length = SPI_POLL_MAX_BURST_LENGTH;
+   
+   if (spi_open (ftdi, spi) < 0 || spi_write (ftdi, spi, &cmd, 1) < 0 || spi_queue_flush (ftdi, spi) < 0)
+      return SPI_USB_ERROR;
+   
+   header[0] = MPSSE_DO_READ | (spi->READ_LSB_FIRST ? MPSSE_LSB : 0);
+   /* set spi mode according to AN_108 */
+   if (SPIMODE (spi) == 1 || SPIMODE (spi) == 2)      /* mode 1 or mode 2 (clock out on +ve) */
+      header[0] |= MPSSE_READ_NEG;
+   header[1] = GETBYTE (length - 1, 0);              /* length (low byte) */
+   header[2] = GETBYTE (length - 1, 1);              /* length (high byte) */
+   
+   /* one burst is always queued in FTDI device beyond the one being read back */
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   ftdi_async_write (&async, header, 3);
+   ftdi_async_write (&async, header, 3);
+   ftdi_async_read (&async, burst[0], length);
+   
+   curr = 0;
+   found = 0;
+   last = 0;
+   start = ftdi_monotonic_time ();
+   
+   while (!found)
+   {
+      if (ftdi_async_wait_read (&async) < 0)
+         break;
+      
+      for (i = 0; i < length && !found; i++)
+      {
+         last = burst[curr][i];
+         found = ((last & mask) == value);
+      }
+      
+      if (found || ftdi_monotonic_time () - start > timeout)
+         break;
+      
+      /* queue one more burst, then read back the one already queued in FTDI device: SCLK keeps 
+         running while the host waits */
+      ftdi_async_write (&async, header, 3);
+      ftdi_async_read (&async, burst[!curr], length);
+      
+      curr = !curr;
+   }
+   
+   /* no read is in flight any more: read back the burst still queued into the one just checked */
+   ftdi_async_read (&async, burst[curr], length);
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to poll SPI status", ret);
+   
+   if (spi_close (ftdi, spi) < 0)
+      return SPI_USB_ERROR;
+   
+   DEBUG_PRINT ("DEBUG: [SPI] Polled status 0x%.2X (%d bytes per burst, %s)\n", last, length, found ? "ready" : "timeout");
+   
+   if (status != NULL)
+      *status = last;
+   
+   return found ? 1 : -1;
+}
+
+/**
+   Sends and receives data at the same time (full-duplex) via SPI on FTDI device.
+   <br>Data is sent in chunks, using asynchronous transfers: the command of chunk N+1 is written out 
+   while the data of chunk N is read back, so that FTDI device is never left idle waiting for the host.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param tx byte array with data to write
+   @param rx byte array to store read data in (can be the same as tx)
+   @param size size of data to transfer
+   
+   @retval SPI_USB_ERROR on communication error (or if one is pending)
+   @retval >0 on success
+*/
+int spi_transfer (struct ftdi_context *ftdi, struct spi_context *spi, byte *tx, byte *rx, int size)
+{
+   byte buf[FTDI_ASYNC_DEPTH + 1][3];
+   byte *header, *curr_tx, *curr_rx;
+   int buf_size, max_size, rem_size, n;
+   int ret;
+   struct ftdi_async async;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+#ifdef DEBUG
+   int i;
+   DEBUG_PRINT ("DEBUG: [SPI] Sending ");
+   for (i = 0; i < size; i++)
+      DEBUG_PRINT ("%.2X ", tx[i]);
+   DEBUG_PRINT ("\n");
+#endif
+   
+   /* queued reads must fit in FTDI internal buffer */
+   max_size = spi->queue.enabled ? MAX_INTERNAL_BUF_LENGTH : MAX_SPI_BUF_LENGTH;
+   
+   rem_size = size;
+   curr_tx = tx;
+   curr_rx = rx;
+   n = 0;
+   
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   while (rem_size > 0)
+   {
+      if (rem_size > max_size)
+         buf_size = max_size;
+      else
+         buf_size = rem_size;
+      
+      /* headers of transfers still in flight must not be overwritten */
+      header = buf[n++ % (FTDI_ASYNC_DEPTH + 1)];
+      
+      /* build header */
+      header[0] = MPSSE_DO_WRITE | MPSSE_DO_READ | (spi->WRITE_LSB_FIRST ? MPSSE_LSB : 0);
+      /* set spi mode according to AN_108 */
+      if (SPIMODE (spi) == 0 || SPIMODE (spi) == 3)      /* mode 0 or mode 3 (clock out on -ve, read on +ve) */
+         header[0] |= MPSSE_WRITE_NEG;
+      else                                               /* mode 1 or mode 2 (clock out on +ve, read on -ve) */
+         header[0] |= MPSSE_READ_NEG;
+      header[1] = GETBYTE (buf_size - 1, 0);         /* length (low byte) */
+      header[2] = GETBYTE (buf_size - 1, 1);         /* length (high byte) */
+      
+      if (spi->queue.enabled)
+      {
+         if (spi_queue_reserve (ftdi, spi, buf_size) < 0 ||
+             spi_queue_write (ftdi, spi, header, 3) < 0 ||
+             spi_queue_write (ftdi, spi, curr_tx, buf_size) < 0 ||
+             spi_queue_read (ftdi, spi, curr_rx, buf_size) < 0)
+            break;
+      }
+      else
+      {
+         /* submit header and data, then read back data: replies are drained while 
+            the next chunk is being written out */
+         ftdi_async_write (&async, header, 3);
+         ftdi_async_write (&async, curr_tx, buf_size);
+         ftdi_async_read (&async, curr_rx, buf_size);
+      }
+      
+      rem_size -= buf_size;
+      curr_tx += buf_size;
+      curr_rx += buf_size;
+   }
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to transfer SPI data", ret);
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+#ifdef DEBUG
+   if (!spi->queue.enabled)
+   {
+      DEBUG_PRINT ("DEBUG: [SPI] Receiving ");
+      for (i = 0; i < size; i++)
+         DEBUG_PRINT ("%.2X ", rx[i]);
+      DEBUG_PRINT ("\n");
+   }
+#endif
+   
+   return 1;
+}
+
+/**
+   Enables the deferred command queue. From now on, spi_* and ftdi_set_bits_* functions append their
+   MPSSE commands to a buffer instead of writing them out, and spi_read only records where read data 
+   must be stored. Read data is available only after spi_queue_flush or spi_queue_end is called.
+   <br>This allows a whole transaction (e.g. spi_open, spi_write, spi_read, spi_close) to cost a single
+   USB round-trip.
+   
+   @param spi pointer to struct spi_context
+*/
+void spi_queue_begin (struct spi_context *spi)
+{
+   spi->queue.enabled = 1;
+   
+   return;
+}
+
+/**
+   Writes out all queued commands in a single USB transaction, then reads back data and stores it 
+   in the destinations recorded by spi_read. The queue stays enabled.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending (queued commands are dropped)
+   @retval >0 on success
+*/
+int spi_queue_flush (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   struct spi_queue *queue = &spi->queue;
+   struct ftdi_async async;
+   int i, ret;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   /* ask FTDI device to send back read data as soon as possible */
+   if (queue->read_count > 0)
+      queue->buf[queue->length++] = SEND_IMMEDIATE;
+   
+   /* write out commands and read back data, letting libusb overlap both */
+   ftdi_async_begin (&async, ftdi, &spi->stats);
+   
+   if (queue->length > 0)
+      ftdi_async_write (&async, queue->buf, queue->length);
+   
+   for (i = 0; i < queue->read_count; i++)
+      ftdi_async_read (&async, queue->reads[i].data, queue->reads[i].size);
+   
+   queue->length = 0;
+   spi->low_bits.pending = -1;
+   spi->high_bits.pending = -1;
+   
+   if ((ret = ftdi_async_end (&async)) < 0)
+      return spi_error (ftdi, spi, "Unable to transfer MPSSE commands", ret);
+   
+#ifdef DEBUG
+   int j;
+   for (i = 0; i < queue->read_count; i++)
+   {
+      DEBUG_PRINT ("DEBUG: [SPI] Receiving ");
+      for (j = 0; j < queue->reads[i].size; j++)
+         DEBUG_PRINT ("%.2X ", queue->reads[i].data[j]);
+      DEBUG_PRINT ("\n");
+   }
+#endif
+   
+   queue->read_count = 0;
+   queue->read_length = 0;
+   
+   return 1;
+}
+
+/**
+   Flushes the deferred command queue and disables it: commands are sent out immediately again.
+   <br>The queue is disabled even if flushing fails.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval >0 on success
+*/
+int spi_queue_end (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   int ret;
+   
+   ret = spi_queue_flush (ftdi, spi);
+   spi->queue.enabled = 0;
+   
+   return ret;
+}
+
+/**
+   Moves queued commands to buf instead of writing them out, so that the caller can submit them later
+   (e.g. through struct ftdi_async, keeping several transactions in flight). SEND_IMMEDIATE is appended
+   if data is to be read back, read-back destinations are dropped: the caller must read back
+   *read_length bytes itself. The queue stays enabled.
+   <br>Commands must not have been spilled out since the queue was last flushed, i.e. they must fit
+   in MAX_QUEUE_BUF_LENGTH.
+   
+   @param spi pointer to struct spi_context
+   @param buf byte array to store commands in
+   @param size size of buf
+   @param read_length pointer to store the length of data to read back in
+   
+   @retval SPI_USB_ERROR if a communication error is pending
+   @retval <0 if commands do not fit in buf (queue is left untouched)
+   @retval >=0 length of commands
+*/
+int spi_queue_detach (struct spi_context *spi, byte *buf, int size, int *read_length)
+{
+   struct spi_queue *queue = &spi->queue;
+   int length;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   length = queue->length + (queue->read_count > 0 ? 1 : 0);
+   if (length > size)
+      return -1;
+   
+   memcpy (buf, queue->buf, queue->length);
+   if (queue->read_count > 0)
+      buf[queue->length] = SEND_IMMEDIATE;
+   
+   *read_length = queue->read_length;
+   
+   queue->length = 0;
+   queue->read_count = 0;
+   queue->read_length = 0;
+   spi->low_bits.pending = -1;
+   spi->high_bits.pending = -1;
+   
+   return length;
+}
+
+/**
+   Auxiliary function used to write out queued commands without reading back any data, 
+   e.g. when the command buffer is full. Pending read-back destinations are kept until the next flush.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval >0 on success
+*/
+int spi_queue_spill (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   struct spi_queue *queue = &spi->queue;
+   int ret;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   if (queue->length == 0)
+      return 1;
+   
+   if ((ret = ftdi_write_data_and_wait (ftdi, &spi->stats, queue->buf, queue->length)) < 0)
+      return spi_error (ftdi, spi, "Unable to send MPSSE commands", ret);
+   
+   queue->length = 0;
+   spi->low_bits.pending = -1;
+   spi->high_bits.pending = -1;
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used to make room for a command which will return size bytes: flushes the queue
+   if pending read-back would exceed FTDI internal buffer. Has no effect if the queue is disabled.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param size number of bytes the next command will return
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval >0 on success
+*/
+int spi_queue_reserve (struct ftdi_context *ftdi, struct spi_context *spi, int size)
+{
+   struct spi_queue *queue = &spi->queue;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   if (!queue->enabled)
+      return 1;
+   
+   if (queue->read_count >= MAX_QUEUE_READS || queue->read_length + size > MAX_INTERNAL_BUF_LENGTH)
+      return spi_queue_flush (ftdi, spi);
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used to send MPSSE commands: appends data to the command queue if enabled, 
+   otherwise writes it out immediately.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param data byte array with commands (and payload) to write
+   @param size size of data
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval >0 on success
+*/
+int spi_queue_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+{
+   struct spi_queue *queue = &spi->queue;
+   int ret;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   /* commands queued before this one cannot be changed anymore (see ftdi_set_bits) */
+   spi->low_bits.pending = -1;
+   spi->high_bits.pending = -1;
+   
+   if (queue->enabled)
+   {
+      /* make room, one byte is always reserved for SEND_IMMEDIATE */
+      if (queue->length + size >= MAX_QUEUE_BUF_LENGTH && spi_queue_spill (ftdi, spi) < 0)
+         return SPI_USB_ERROR;
+      
+      if (size < MAX_QUEUE_BUF_LENGTH)
+      {
+         memcpy (queue->buf + queue->length, data, size);
+         queue->length += size;
+         return 1;
+      }
+      /* else: data does not fit in the queue at all, queue is empty now and data can be written out */
+   }
+   
+   if ((ret = ftdi_write_data_and_wait (ftdi, &spi->stats, data, size)) < 0)
+      return spi_error (ftdi, spi, "Unable to send MPSSE commands", ret);
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used to receive the data returned by the last sent (or queued) command: 
+   records data as read-back destination if the queue is enabled, otherwise reads it immediately. 
+   spi_queue_reserve must be called before queuing the command.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param data byte array to store data in
+   @param size size of data to read
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval >0 on success
+*/
+int spi_queue_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size)
+{
+   struct spi_queue *queue = &spi->queue;
+   int ret;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   if (queue->enabled)
+   {
+      queue->reads[queue->read_count].data = data;
+      queue->reads[queue->read_count].size = size;
+      queue->read_count++;
+      queue->read_length += size;
+      return 1;
+   }
+   
+   if ((ret = ftdi_read_data_and_wait (ftdi, &spi->stats, data, size)) < 0)
+      return spi_error (ftdi, spi, "Unable to read SPI data", ret);
+   
+   return 1;
+}
+
+/**
+   Prints selected SPI clock frequency to the terminal screen.
+   
+   @param spi pointer to struct spi_context
+*/
+void spi_print_clk_frequency (struct spi_context *spi)
+{
+   double clock_frequency;
+   char prefix = '\0';
+
+   clock_frequency = spi_frequency (spi);
+   
+   /* normalise using engineering notation */
+   if      (clock_frequency >= 1e6) { clock_frequency /= 1e6; prefix = 'M'; }
+   else if (clock_frequency >= 1e3) { clock_frequency /= 1e3; prefix = 'k'; }
+   
+   printf ("FTDI: Clock frequency set to %.3f ", clock_frequency);
+   
+   prefix ? printf ("%cHz\n", prefix) : printf ("Hz\n");
    
    return;
 }
 
+/**
+   Calculates selected SPI clock frequency.
+   
+   @param spi pointer to struct spi_context
+   
+   @return clock frequency
+*/
+double spi_frequency (struct spi_context *spi)
+{
+   double clock_frequency;
+   
+   if (spi->CDIV5)
+      clock_frequency = SPI_BASE_CLOCK_5 / ((1 + (double)spi->CDIV) * 2);
+   else
+      clock_frequency = SPI_BASE_CLOCK / ((1 + (double)spi->CDIV) * 2);
+   
+   return clock_frequency;
+}
+
+/**
+   Calculates selected SPI clock period.
+   
+   @param spi pointer to struct spi_context
+   
+   @return clock period
+*/
+double spi_clk_period (struct spi_context *spi)
+{
+   double clock_period;
+   
+   clock_period = 1.0 / spi_frequency (spi);
+   
+   return clock_period;
+}
+
+/**
+   Sets level and i/o state of low bits in FTDI device. Only selected pins in mask will be modified.
+   <br>Note that in SPI mode the four least significant bits controls SCLK, MOSI, MISO and CS lines 
+   and should not be changed via this function unless particular initialisation are required.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param mask bit mask (set to 1 the pins whose level or i/o must be modified)
+   @param level pins level (0 = low, 1 = high)
+   @param io pins i/o (0 = output, 1 = input)
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending (state is recorded anyway)
+   @retval >0 on success
+*/
+int ftdi_set_bits_low (struct ftdi_context *ftdi, struct spi_context *spi, 
+                                      byte mask, byte level, byte io)
+{
+   return ftdi_set_bits (ftdi, spi, &spi->low_bits, SET_BITS_LOW, mask, level, io);
+}
+
 /**
    Sets level and i/o state of high bits in FTDI device. Only selected pins in mask will be modified.
    
@@ -487,27 +1832,159 @@ void ftdi_set_bits_low (struct ftdi_context *ftdi, struct spi_context *spi,
    @param mask bit mask (set to 1 the pins whose level or i/o must be modified)
    @param level pins level (0 = low, 1 = high)
    @param io pins i/o (0 = output, 1 = input)
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending (state is recorded anyway)
+   @retval >0 on success
 */
-void ftdi_set_bits_high (struct ftdi_context *ftdi, struct spi_context *spi, 
+int ftdi_set_bits_high (struct ftdi_context *ftdi, struct spi_context *spi, 
                                        byte mask, byte level, byte io)
 {
-   byte buf[3];
-   int ret;
+   return ftdi_set_bits (ftdi, spi, &spi->high_bits, SET_BITS_HIGH, mask, level, io);
+}
 
-   spi->high_bits.level |= (mask & level);     /* sets to 1 selected bits */
-   spi->high_bits.level &= (~mask | level);    /* sets to 0 selected bits */
-   spi->high_bits.io |= (mask & io);           /* sets to 1 selected bits */
-   spi->high_bits.io &= (~mask | io);          /* sets to 0 selected bits */
+/**
+   Auxiliary function used by ftdi_set_bits_low and ftdi_set_bits_high: updates the shadow state of 
+   a port and sends it only if needed.
+   <br>Nothing is sent if no pin changes. If the queue is enabled and the last queued command is a 
+   SET_BITS command for the same port, that command is updated in place, provided no pin it changes 
+   is changed again: every edge reaches the pins, pins 
+   that change in successive calls just change at the same time. Use ftdi_bits_waveform to emit 
+   pin sequences with a defined timing.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param bits pointer to the shadow state of the port (spi->low_bits or spi->high_bits)
+   @param command SET_BITS_LOW or SET_BITS_HIGH
+   @param mask bit mask (set to 1 the pins whose level or i/o must be modified)
+   @param level pins level (0 = low, 1 = high)
+   @param io pins i/o (0 = output, 1 = input)
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending (state is recorded anyway)
+   @retval >0 on success
+*/
+int ftdi_set_bits (struct ftdi_context *ftdi, struct spi_context *spi, struct bits *bits, byte command, 
+                   byte mask, byte level, byte io)
+{
+   struct spi_queue *queue = &spi->queue;
+   byte buf[3], old_level, old_io, changed;
+   int length, ret;
+   
+   old_level = bits->level;
+   old_io = bits->io;
+   
+   bits->level |= (mask & level);     /* sets to 1 selected bits */
+   bits->level &= (~mask | level);    /* sets to 0 selected bits */
+   bits->io |= (mask & io);           /* sets to 1 selected bits */
+   bits->io &= (~mask | io);          /* sets to 0 selected bits */
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   changed = (old_level ^ bits->level) | (old_io ^ bits->io);
+   
+   /* FTDI device already has this state */
+   if (bits->sent && changed == 0)
+      return 1;
+   
+   /* merge with the pending command */
+   if (queue->enabled && bits->pending >= 0 && (bits->changed & changed) == 0)
+   {
+      queue->buf[bits->pending + 1] = bits->level;
+      queue->buf[bits->pending + 2] = bits->io;
+      bits->changed |= changed;
+      return 1;
+   }
    
    /* set bits state */
-   buf[0] = SET_BITS_HIGH;
-   buf[1] = spi->high_bits.level;
-   buf[2] = spi->high_bits.io;
+   buf[0] = command;
+   buf[1] = bits->level;
+   buf[2] = bits->io;
+   
+   length = queue->length;
+   
+   if ((ret = spi_queue_write (ftdi, spi, buf, 3)) < 0)
+      return ret;
+   
+   bits->sent = 1;
+   
+   /* the command can be merged with until anything else is queued */
+   if (queue->enabled && queue->length == length + 3)
+   {
+      bits->pending = length;
+      bits->changed = changed;
+   }
+   
+   return 1;
+}
 
-   if ((ret = ftdi_write_data (ftdi, buf, 3)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to set high bits: %d (%s)\n", ret);
+/**
+   Emits a sequence of pin states on a port in a single USB write (or appends it to the queue, if 
+   enabled). Only selected pins in mask are driven by levels, i/o direction is left unchanged. Each 
+   state is held for repeat MPSSE commands: a SET_BITS command lasts about 50 ns at 60 MHz 
+   (implementation dependent), so waveforms are meant for reset pulses, chip-select sequences 
+   and slow bit-banged protocols, not for precise timing.
    
-   return;
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param high 1 for high bits (ACBUS), 0 for low bits (ADBUS)
+   @param mask bit mask (set to 1 the pins driven by levels)
+   @param levels array of pin levels, one per state
+   @param count number of states
+   @param repeat number of commands each state is held for (at least 1)
+   
+   @retval SPI_USB_ERROR on communication error, or if one is pending
+   @retval <0 if command buffer cannot be allocated
+   @retval >0 on success
+*/
+int ftdi_bits_waveform (struct ftdi_context *ftdi, struct spi_context *spi, int high, byte mask, byte *levels, 
+                        int count, int repeat)
+{
+   struct bits *bits;
+   byte *buf, command;
+   int i, j, length, ret;
+   
+   if (spi->error.code != 0)
+      return SPI_USB_ERROR;
+   
+   if (count <= 0)
+      return 1;
+   
+   if (repeat < 1)
+      repeat = 1;
+   
+   bits = high ? &spi->high_bits : &spi->low_bits;
+   command = high ? SET_BITS_HIGH : SET_BITS_LOW;
+   
+   if ((buf = (byte *)malloc ((size_t)count * repeat * 3)) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate waveform buffer!\n");
+      return -1;
+   }
+   
+   length = 0;
+   for (i = 0; i < count; i++)
+   {
+      bits->level = (bits->level & ~mask) | (levels[i] & mask);
+      
+      for (j = 0; j < repeat; j++)
+      {
+         buf[length++] = command;
+         buf[length++] = bits->level;
+         buf[length++] = bits->io;
+      }
+   }
+   
+   ret = spi_queue_write (ftdi, spi, buf, length);
+   free (buf);
+   
+   if (ret < 0)
+      return ret;
+   
+   bits->sent = 1;
+   
+   DEBUG_PRINT ("DEBUG: [SPI] Waveform of %d states (%d bytes)\n", count, length);
+   
+   return 1;
 }
 
 /**
@@ -516,20 +1993,21 @@ void ftdi_set_bits_high (struct ftdi_context *ftdi, struct spi_context *spi,
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
 
-   @return level of low bits
+   @return level of low bits (last level set, if a communication error occurs)
 */
 byte ftdi_get_bits_low (struct ftdi_context *ftdi, struct spi_context *spi)
 {
    byte buf, level;
-   int ret;
    
    /* get bits state */
    buf = GET_BITS_LOW;
    
-   if ((ret = ftdi_write_data (ftdi, &buf, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to request low bits level: %d (%s)\n", ret);
-   if ((ret = ftdi_read_data (ftdi, &level, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to get low bits level: %d (%s)\n", ret);
+   /* level is needed now */
+   if (spi_queue_reserve (ftdi, spi, 1) < 0 ||
+       spi_queue_write (ftdi, spi, &buf, 1) < 0 ||
+       spi_queue_read (ftdi, spi, &level, 1) < 0 ||
+       (spi->queue.enabled && spi_queue_flush (ftdi, spi) < 0))
+      return spi->low_bits.level;
    
    spi->low_bits.level = level;
      
@@ -542,20 +2020,21 @@ byte ftdi_get_bits_low (struct ftdi_context *ftdi, struct spi_context *spi)
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
 
-   @return level of high bits
+   @return level of high bits (last level set, if a communication error occurs)
 */
 byte ftdi_get_bits_high (struct ftdi_context *ftdi, struct spi_context *spi)
 {
    byte buf, level;
-   int ret;
    
    /* get bits state */
    buf = GET_BITS_HIGH;
    
-   if ((ret = ftdi_write_data (ftdi, &buf, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to request high bits level: %d (%s)\n", ret);
-   if ((ret = ftdi_read_data (ftdi, &level, 1)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to get high bits level: %d (%s)\n", ret);
+   /* level is needed now */
+   if (spi_queue_reserve (ftdi, spi, 1) < 0 ||
+       spi_queue_write (ftdi, spi, &buf, 1) < 0 ||
+       spi_queue_read (ftdi, spi, &level, 1) < 0 ||
+       (spi->queue.enabled && spi_queue_flush (ftdi, spi) < 0))
+      return spi->high_bits.level;
    
    spi->high_bits.level = level;
      
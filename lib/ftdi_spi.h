@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 /** 
    @defgroup MPSSE_PINS_GRP MPSSE pins bitmasks
    @{ 
@@ -6,6 +8,7 @@
 #define MOSI   0x02     /**< Master Out Slave In */
 #define MISO   0x04     /**< Master In Slave Out */
 #define CS     0x08     /**< Chip Select */
+#define GPIOL1 0x20     /**< General Purpose I/O Low 1: input sampled by MPSSE "wait on I/O" commands */
 /**@} */
 
 /**
@@ -14,6 +17,32 @@
 */
 #define MAX_INTERNAL_BUF_LENGTH 4096
 #define MAX_SPI_BUF_LENGTH 65536
+#define MAX_QUEUE_BUF_LENGTH 65536     /**< size of the deferred command buffer */
+#define MAX_QUEUE_READS 128            /**< maximum number of pending read-back destinations */
+#define SPI_STREAM_RING_LENGTH (2 * MAX_SPI_BUF_LENGTH)   /**< ring buffer used by spi_read_to_file */
+#define SPI_MSYNC_BATCH_LENGTH (64 * MAX_SPI_BUF_LENGTH)  /**< write-back batch used by spi_read_to_mapped_file */
+#define SPI_PREFETCH_DEPTH 4           /**< default number of chunks read ahead by spi_write_from_file */
+#define SPI_PREFETCH_MAX_DEPTH 64      /**< maximum number of chunks read ahead */
+#define SPI_PREFETCH_IN_FLIGHT 2       /**< chunks being written out while the next ones are read from file */
+#define SPI_POLL_MAX_BURST_LENGTH (MAX_INTERNAL_BUF_LENGTH / 2)   /**< maximum length of a status polling burst */
+#define SPI_POLL_INTERVAL 125e-6       /**< duration of a status polling burst (one USB microframe), in seconds */
+/**@} */
+
+/**
+   @defgroup SPI_CLOCK_GRP
+   @{ 
+*/
+#define SPI_BASE_CLOCK   60e6          /**< MPSSE clock with divide by 5 disabled, SCLK = SPI_BASE_CLOCK / ((1 + CDIV) * 2) */
+#define SPI_BASE_CLOCK_5 12e6          /**< MPSSE clock with divide by 5 enabled */
+#define SPI_MAX_DIVISOR  0xFFFF        /**< largest clock divisor */
+/**@} */
+
+/**
+   @defgroup SPI_ERROR_GRP
+   @{ 
+*/
+#define SPI_USB_ERROR -16              /**< returned when communication with FTDI device fails (details in spi->error) */
+#define SPI_ERROR_LENGTH 128           /**< maximum length of an error description */
 /**@} */
 
 /**
@@ -42,6 +71,7 @@
 typedef uint8_t  byte;  /**< 8-bit unsigned integer type */
 typedef uint16_t word;  /**< 16-bit unsigned integer type */
 typedef uint32_t dword; /**< 32-bit unsigned integer type */
+typedef uint64_t qword; /**< 64-bit unsigned integer type */
 #define FTDI_LIB_TYPES_DEFINED
 #endif
 
@@ -58,10 +88,90 @@ CDIV5: 0 if SCLK frequency is not divided by 5, 1 if SCLK if divided by 5
 CDIV: SCLK divisor
 */
 
+/* Shadow state of a port: level and io are what FTDI device has been told (or will be, once the 
+   queue is flushed), so that unchanged pins are not sent again. */
 struct bits
 {
    byte level;
    byte io;
+   int sent;                        /**< level and io have been sent to FTDI device at least once */
+   int pending;                     /**< queue offset of the last SET_BITS command, while it can still be merged with (-1 otherwise) */
+   byte changed;                    /**< pins changed by that command */
+};
+
+struct spi_read_slot
+{
+   byte *data;                      /**< destination of read-back bytes */
+   int size;                        /**< number of bytes to read back */
+};
+
+/* Deferred MPSSE command queue: while enabled, commands are appended to buf instead of being
+   written out one by one, and read-back destinations are recorded in reads. spi_queue_flush
+   writes out the whole buffer in a single USB transaction, then scatters the read-back bytes.
+   Pending read-back is kept within MAX_INTERNAL_BUF_LENGTH so that FTDI device never stalls
+   waiting for the host to empty its transmit buffer. */
+struct spi_queue
+{
+   int enabled;                     /**< queue enable bit */
+   
+   byte buf[MAX_QUEUE_BUF_LENGTH];  /**< pending commands */
+   int length;                      /**< length of pending commands */
+   
+   struct spi_read_slot reads[MAX_QUEUE_READS];   /**< pending read-back destinations */
+   int read_count;                  /**< number of pending read-back destinations */
+   int read_length;                 /**< total length of pending read-back */
+};
+
+/* Streaming read callback: called with every completed segment of the ring buffer, in order, 
+   while the next segment is being read. Returning non-zero stops the stream. */
+typedef int (*spi_stream_callback) (byte *data, int size, void *user);
+
+struct spi_file_stream
+{
+   FILE *fp;                        /**< destination file */
+   int remaining;                   /**< bytes not yet written to file */
+};
+
+/* File prefetcher: the producer thread fills slots (produced), the consumer writes them out (consumed) 
+   and gives them back once the USB transfer has completed (released). Counters only grow, 
+   slot index is counter % depth. */
+struct spi_prefetch
+{
+   FILE *fp;                        /**< source file */
+   int remaining;                   /**< bytes not yet read from file */
+   
+   byte *slots;                     /**< depth slots of (3 + MAX_SPI_BUF_LENGTH) bytes: header + data */
+   int lengths[SPI_PREFETCH_MAX_DEPTH];   /**< data length of each slot */
+   int depth;                       /**< number of slots */
+   
+   int produced;                    /**< chunks read from file */
+   int consumed;                    /**< chunks submitted to FTDI device */
+   int released;                    /**< chunks written out to FTDI device */
+   
+   int done;                        /**< producer has finished */
+   int stop;                        /**< producer must stop (end-of-file or error) */
+   
+   pthread_mutex_t lock;
+   pthread_cond_t filled;           /**< signalled when a slot is filled or producer finishes */
+   pthread_cond_t emptied;          /**< signalled when a slot is released or producer must stop */
+};
+
+struct spi_mapped_stream
+{
+   byte *map;                       /**< file mapping */
+   qword done;                      /**< bytes read into the mapping */
+   qword synced;                    /**< bytes whose write-back has been started */
+};
+
+/* Last communication error of a context. The first error is latched: until spi_recover is called 
+   (spi_open does it automatically), spi_* functions return SPI_USB_ERROR without touching FTDI device, 
+   so that a failed sequence of calls can be checked once, at its end. */
+struct spi_error
+{
+   int code;                        /**< libftdi error code of the pending error (0 if none) */
+   char message[SPI_ERROR_LENGTH];  /**< failed operation */
+   int count;                       /**< errors occurred since spi_init */
+   int recoveries;                  /**< successful recoveries since spi_init */
 };
 
 struct spi_context
@@ -78,28 +188,76 @@ struct spi_context
    
    int LOOPBACK_ON;                 /**< Internal Loopback enable bit */
    
+   int GPIOL1_WAIT;                 /**< GPIOL1 is wired to MISO: busy lines are waited for by FTDI device */
+   
    /* port levels, i/o direction */
    struct bits low_bits;
    struct bits high_bits;
+   
+   /* deferred command queue */
+   struct spi_queue queue;
+   
+   /* last communication error */
+   struct spi_error error;
+   
+   /* USB traffic counters and trace */
+   struct ftdi_stats stats;
 };
 
 
 struct spi_context *spi_init (struct ftdi_context *ftdi,
                              int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on);
+struct spi_context *spi_init_error (struct ftdi_context *ftdi, struct spi_context *spi, char *error_string, int error_code);
+int spi_set_frequency (struct ftdi_context *ftdi, struct spi_context *spi, double frequency);
+int spi_plan_divisor (double frequency, word *divisor, int *divide_by_5);
+int spi_reconfigure (struct ftdi_context *ftdi, struct spi_context *spi,
+                     int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on);
+
+int spi_open (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_close (struct ftdi_context *ftdi, struct spi_context *spi);
 
-void spi_open (struct ftdi_context *ftdi, struct spi_context *spi);
-void spi_close (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_error (struct ftdi_context *ftdi, struct spi_context *spi, const char *message, int code);
+int spi_recover (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_last_error (struct spi_context *spi, const char **message);
 
-void spi_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
-void spi_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
+int spi_set_gpiol1_wait (struct ftdi_context *ftdi, struct spi_context *spi, int enable);
+int spi_wait_gpiol1 (struct ftdi_context *ftdi, struct spi_context *spi, int level);
+
+int spi_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
+int spi_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
+int spi_transfer (struct ftdi_context *ftdi, struct spi_context *spi, byte *tx, byte *rx, int size);
+int spi_poll_status (struct ftdi_context *ftdi, struct spi_context *spi, byte cmd, byte mask, byte value, 
+                     double timeout, byte *status);
 int spi_write_from_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size);
+int spi_write_from_file_prefetch (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size, int depth,
+                                  double *stall_time);
+void *spi_prefetch_thread (void *arg);
 int spi_read_to_file (struct ftdi_context *ftdi, struct spi_context *spi, FILE *fp, int size);
+int spi_read_to_file_cb (byte *data, int size, void *user);
+int spi_read_to_mapped_file (struct ftdi_context *ftdi, struct spi_context *spi, const char *path, qword size);
+int spi_read_to_mapped_file_cb (byte *data, int size, void *user);
+int spi_read_stream (struct ftdi_context *ftdi, struct spi_context *spi, byte *ring, qword ring_size, qword total,
+                     spi_stream_callback callback, void *user);
+int spi_stream_deliver (struct spi_context *spi, spi_stream_callback callback, byte *data, int size, void *user);
+
+void spi_queue_begin (struct spi_context *spi);
+int spi_queue_flush (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_queue_end (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_queue_detach (struct spi_context *spi, byte *buf, int size, int *read_length);
+int spi_queue_spill (struct ftdi_context *ftdi, struct spi_context *spi);
+int spi_queue_reserve (struct ftdi_context *ftdi, struct spi_context *spi, int size);
+int spi_queue_write (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
+int spi_queue_read (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int size);
 
 void spi_print_clk_frequency (struct spi_context *spi);
 double spi_frequency (struct spi_context *spi);
 double spi_clk_period (struct spi_context *spi);
 
-void ftdi_set_bits_low (struct ftdi_context *ftdi, struct spi_context *spi, byte mask, byte level, byte io);
-void ftdi_set_bits_high (struct ftdi_context *ftdi, struct spi_context *spi, byte mask, byte level, byte io);
+int ftdi_set_bits_low (struct ftdi_context *ftdi, struct spi_context *spi, byte mask, byte level, byte io);
+int ftdi_set_bits_high (struct ftdi_context *ftdi, struct spi_context *spi, byte mask, byte level, byte io);
+int ftdi_set_bits (struct ftdi_context *ftdi, struct spi_context *spi, struct bits *bits, byte command, 
+                   byte mask, byte level, byte io);
+int ftdi_bits_waveform (struct ftdi_context *ftdi, struct spi_context *spi, int high, byte mask, byte *levels, 
+                        int count, int repeat);
 byte ftdi_get_bits_low (struct ftdi_context *ftdi, struct spi_context *spi);
 byte ftdi_get_bits_high (struct ftdi_context *ftdi, struct spi_context *spi);
\ No newline at end of file
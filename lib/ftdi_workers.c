@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libftdi1/ftdi.h>
+
+#include "ftdi_interface.h"
+#include "ftdi_spi.h"
+#include "ftdi_workers.h"
+
+/**
+   Initialises a worker pool, one worker per device. Both channels of a device can be driven by the 
+   same pool, as two workers (e.g. "s:FT1234@A" and "s:FT1234@B").
+   
+   @param pool pointer to struct ftdi_pool
+   @param selectors array of device selectors (see ftdi_open_device), or NULL to use all connected devices
+   @param count number of selectors (ignored if selectors is NULL)
+   
+   @retval <0 if devices cannot be enumerated
+   @retval >=0 number of workers (at most FTDI_MAX_WORKERS)
+*/
+int ftdi_pool_init (struct ftdi_pool *pool, const char **selectors, int count)
+{
+   struct ftdi_device_info devices[FTDI_MAX_WORKERS];
+   int i;
+   
+   memset (pool, 0, sizeof (struct ftdi_pool));
+   
+   if (selectors == NULL)
+   {
+      if ((count = ftdi_find_devices (devices, FTDI_MAX_WORKERS)) < 0)
+         return count;
+   }
+   
+   if (count > FTDI_MAX_WORKERS)
+   {
+      printf ("WARNING: Only the first %d of %d devices are used\n", FTDI_MAX_WORKERS, count);
+      count = FTDI_MAX_WORKERS;
+   }
+   
+   for (i = 0; i < count; i++)
+   {
+      pool->workers[i].pool = pool;
+      pool->workers[i].index = i;
+      
+      /* bus/port path identifies the same device, even if devices are plugged in or out meanwhile */
+      if (selectors != NULL)
+         snprintf (pool->workers[i].selector, FTDI_STRING_LENGTH, "%s", selectors[i]);
+      else if (strchr (devices[i].path, '-') != NULL)
+         snprintf (pool->workers[i].selector, FTDI_STRING_LENGTH, "p:%s", devices[i].path);
+      else
+         snprintf (pool->workers[i].selector, FTDI_STRING_LENGTH, "i:%d", devices[i].index);
+   }
+   pool->count = count;
+   
+   pthread_mutex_init (&pool->lock, NULL);
+   pthread_cond_init (&pool->finished, NULL);
+   
+   return count;
+}
+
+/**
+   Runs job on all devices of the pool at the same time, then waits for all of them to finish. 
+   While waiting, report is called every interval seconds (and once more at the end).
+   <br>Devices left open by a previous run are used as they are: jobs should get their SPI context 
+   from ftdi_worker_spi, which only sends the settings that changed since the previous job.
+   
+   @param pool pointer to struct ftdi_pool
+   @param job function run by every worker
+   @param report function called to report progress (or NULL)
+   @param user user data passed to job and report
+   @param interval interval between progress reports, in seconds
+   
+   @retval <0 if worker threads cannot be started
+   @retval >=0 number of workers whose job has failed
+*/
+int ftdi_pool_run (struct ftdi_pool *pool, ftdi_job job, ftdi_pool_report report, void *user, double interval)
+{
+   struct timespec deadline;
+   int i, started, failed;
+   
+   pool->job = job;
+   pool->user = user;
+   pool->running = pool->count;
+   
+   for (started = 0; started < pool->count; started++)
+   {
+      pool->workers[started].done = 0;
+      pool->workers[started].total = 0;
+      pool->workers[started].finished = 0;
+      pool->workers[started].result = 0;
+      pool->workers[started].error[0] = '\0';
+      
+      /* counters of a device kept open cover the current run only */
+      if (pool->workers[started].spi != NULL)
+         ftdi_stats_reset (&pool->workers[started].spi->stats);
+      
+      if (pthread_create (&pool->workers[started].thread, NULL, ftdi_pool_thread, &pool->workers[started]) != 0)
+      {
+         fprintf (stderr, "ERROR: Unable to start worker thread!\n");
+         break;
+      }
+   }
+   
+   /* workers that have not been started will never finish */
+   pthread_mutex_lock (&pool->lock);
+   pool->running -= pool->count - started;
+   
+   while (pool->running > 0)
+   {
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += (time_t)interval;
+      deadline.tv_nsec += (long)((interval - (time_t)interval) * 1e9);
+      if (deadline.tv_nsec >= 1000000000L)
+      {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+      }
+      
+      /* report progress without holding the lock, workers would be stalled */
+      if (pthread_cond_timedwait (&pool->finished, &pool->lock, &deadline) != 0 && report != NULL)
+      {
+         pthread_mutex_unlock (&pool->lock);
+         report (pool, user);
+         pthread_mutex_lock (&pool->lock);
+      }
+   }
+   pthread_mutex_unlock (&pool->lock);
+   
+   for (i = 0; i < started; i++)
+      pthread_join (pool->workers[i].thread, NULL);
+   
+   if (report != NULL)
+      report (pool, user);
+   
+   if (started < pool->count)
+      return -1;
+   
+   failed = 0;
+   for (i = 0; i < pool->count; i++)
+   {
+      if (pool->workers[i].result <= 0)
+         failed++;
+   }
+   
+   return failed;
+}
+
+/**
+   De-allocates resources held by a worker pool and closes its devices.
+   
+   @param pool pointer to struct ftdi_pool
+*/
+void ftdi_pool_destroy (struct ftdi_pool *pool)
+{
+   int i;
+   
+   for (i = 0; i < pool->count; i++)
+      ftdi_worker_release (&pool->workers[i]);
+   
+   pthread_cond_destroy (&pool->finished);
+   pthread_mutex_destroy (&pool->lock);
+   
+   return;
+}
+
+/**
+   Worker thread: opens the worker device (unless a previous run left it open), then runs the pool 
+   job on it. The device is closed if the job leaves a communication error that cannot be recovered 
+   from, so that it is reconnected by the next run.
+   
+   @param arg pointer to struct ftdi_worker
+   
+   @return NULL
+*/
+void *ftdi_pool_thread (void *arg)
+{
+   struct ftdi_worker *worker = (struct ftdi_worker *)arg;
+   struct ftdi_pool *pool = worker->pool;
+   int result;
+   
+   if (worker->ftdi == NULL && (worker->ftdi = ftdi_open_device (worker->selector)) == NULL)
+   {
+      ftdi_worker_error (worker, "No device matches \'%s\'", worker->selector);
+      result = -1;
+   }
+   else
+   {
+      result = pool->job (worker, pool->user);
+      
+      if (worker->spi != NULL && spi_recover (worker->ftdi, worker->spi) < 0)
+         ftdi_worker_release (worker);
+   }
+   
+   pthread_mutex_lock (&pool->lock);
+   worker->result = result;
+   worker->finished = 1;
+   pool->running--;
+   pthread_cond_signal (&pool->finished);
+   pthread_mutex_unlock (&pool->lock);
+   
+   return NULL;
+}
+
+/**
+   Sums up the progress of all workers.
+   
+   @param pool pointer to struct ftdi_pool
+   @param done pointer to store the sum of job progress in
+   @param total pointer to store the sum of job sizes in
+*/
+void ftdi_pool_progress (struct ftdi_pool *pool, qword *done, qword *total)
+{
+   int i;
+   
+   *done = 0;
+   *total = 0;
+   
+   pthread_mutex_lock (&pool->lock);
+   for (i = 0; i < pool->count; i++)
+   {
+      *done += pool->workers[i].done;
+      *total += pool->workers[i].total;
+   }
+   pthread_mutex_unlock (&pool->lock);
+   
+   return;
+}
+
+/**
+   Ready-made report function: prints overall progress, then the result and the USB counters of 
+   every worker once all of them have finished.
+   
+   @param pool pointer to struct ftdi_pool
+   @param user user data (not used)
+*/
+void ftdi_pool_print_report (struct ftdi_pool *pool, void *user)
+{
+   struct ftdi_stats *stats;
+   qword done, total;
+   int i;
+   
+   (void)user;
+   
+   ftdi_pool_progress (pool, &done, &total);
+   
+   pthread_mutex_lock (&pool->lock);
+   printf ("INFO: %d of %d devices running, %.1f%% done\n", pool->running, pool->count, 
+           (total > 0) ? 100.0 * done / total : 0.0);
+   
+   if (pool->running == 0)
+   {
+      for (i = 0; i < pool->count; i++)
+      {
+         printf ("INFO: Device %d (%s): %s%s%s\n", i, pool->workers[i].selector, 
+                 (pool->workers[i].result > 0) ? "OK" : "FAILED", 
+                 pool->workers[i].error[0] ? ", " : "", pool->workers[i].error);
+         
+         /* where the time went: USB round trips, device (SPI clock) or host I/O */
+         if (pool->workers[i].spi != NULL)
+         {
+            stats = &pool->workers[i].spi->stats;
+            printf ("INFO: Device %d: %llu USB transactions, %.1f kB out, %.1f kB in, blocked %.3f s on writes, "
+                    "%.3f s on reads, %.3f s on host I/O, %llu errors\n", i, (unsigned long long)stats->transactions, 
+                    stats->bytes_out / 1e3, stats->bytes_in / 1e3, stats->write_wait_time, stats->read_wait_time, 
+                    stats->file_time, (unsigned long long)stats->errors);
+         }
+      }
+   }
+   pthread_mutex_unlock (&pool->lock);
+   
+   return;
+}
+
+/**
+   Returns the SPI context of a worker, configured with the given parameters (see spi_init). Called 
+   by jobs. The first call on a device initialises it with spi_init, later ones (in the same job or 
+   in the following runs) only change the settings that differ, see spi_reconfigure.
+   
+   @param worker pointer to struct ftdi_worker
+   
+   @param clock_idle clock idle level (also known as clock polarity, CPOL)
+   @param clock_phase clock phase (CPHA)
+   @param clock_divisor clock divisor value
+   @param clock_divide_by_5 enable clock divide by 5
+   @param mosi_idle MOSI idle level
+   @param write_lsb_first write lsb first
+   @param read_lsb_first read lsb first
+   @param loopback_on internal loopback on
+   
+   @return pointer to SPI context (NULL if FTDI device cannot be configured)
+*/
+struct spi_context *ftdi_worker_spi (struct ftdi_worker *worker,
+                                     int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on)
+{
+   if (worker->spi == NULL)
+   {
+      worker->spi = spi_init (worker->ftdi, clock_idle, clock_phase, clock_divisor, clock_divide_by_5, mosi_idle, 
+                              write_lsb_first, read_lsb_first, loopback_on);
+      return worker->spi;
+   }
+   
+   /* a failed job may have left an error pending: recover before reconfiguring */
+   if (spi_recover (worker->ftdi, worker->spi) < 0 ||
+       spi_reconfigure (worker->ftdi, worker->spi, clock_idle, clock_phase, clock_divisor, clock_divide_by_5, mosi_idle, 
+                        write_lsb_first, read_lsb_first, loopback_on) < 0)
+      return NULL;
+   
+   return worker->spi;
+}
+
+/**
+   Closes the device of a worker and de-allocates its SPI context. The device is opened again by 
+   the next run.
+   
+   @param worker pointer to struct ftdi_worker
+*/
+void ftdi_worker_release (struct ftdi_worker *worker)
+{
+   if (worker->spi != NULL)
+   {
+      spi_free (worker->spi);
+      worker->spi = NULL;
+   }
+   
+   if (worker->ftdi != NULL)
+   {
+      ftdi_close (worker->ftdi);
+      worker->ftdi = NULL;
+   }
+   
+   return;
+}
+
+/**
+   Updates worker progress. Called by jobs.
+   
+   @param worker pointer to struct ftdi_worker
+   @param done job progress
+   @param total job size
+*/
+void ftdi_worker_progress (struct ftdi_worker *worker, qword done, qword total)
+{
+   pthread_mutex_lock (&worker->pool->lock);
+   worker->done = done;
+   worker->total = total;
+   pthread_mutex_unlock (&worker->pool->lock);
+   
+   return;
+}
+
+/**
+   Records an error message for a worker. Called by jobs, the last message is kept.
+   
+   @param worker pointer to struct ftdi_worker
+   @param format printf-like format string
+*/
+void ftdi_worker_error (struct ftdi_worker *worker, const char *format, ...)
+{
+   va_list args;
+   
+   pthread_mutex_lock (&worker->pool->lock);
+   va_start (args, format);
+   vsnprintf (worker->error, FTDI_ERROR_LENGTH, format, args);
+   va_end (args);
+   pthread_mutex_unlock (&worker->pool->lock);
+   
+   return;
+}
@@ -0,0 +1,66 @@
+#include <pthread.h>
+
+/** 
+   @defgroup WORKERS_GRP Worker pool
+   @{ 
+*/
+#define FTDI_MAX_WORKERS 16            /**< maximum number of devices driven by a pool */
+#define FTDI_ERROR_LENGTH 256          /**< maximum length of a worker error message */
+#define FTDI_REPORT_INTERVAL 0.5       /**< default interval between progress reports, in seconds */
+/**@} */
+
+struct ftdi_worker;
+struct ftdi_pool;
+
+/* Job run by every worker on its own device: returns >0 on success. Jobs report progress with 
+   ftdi_worker_progress and failures with ftdi_worker_error. */
+typedef int (*ftdi_job) (struct ftdi_worker *worker, void *user);
+
+/* Called by ftdi_pool_run in the calling thread, periodically and once all workers have finished */
+typedef void (*ftdi_pool_report) (struct ftdi_pool *pool, void *user);
+
+struct ftdi_worker
+{
+   struct ftdi_pool *pool;                /**< pool the worker belongs to */
+   int index;                             /**< worker index in pool */
+   char selector[FTDI_STRING_LENGTH];     /**< device selector, see ftdi_open_device */
+   struct ftdi_context *ftdi;             /**< device context, kept open across ftdi_pool_run calls */
+   struct spi_context *spi;               /**< SPI context, see ftdi_worker_spi (NULL until first used) */
+   pthread_t thread;
+   
+   qword done;                            /**< job progress (units chosen by job) */
+   qword total;                           /**< job size (units chosen by job) */
+   int finished;                          /**< job has returned */
+   int result;                            /**< job return value (<0 if device could not be opened) */
+   char error[FTDI_ERROR_LENGTH];         /**< last error reported by job */
+};
+
+/* Runs the same job on several devices at once, one thread and one ftdi_context per device. 
+   Devices are opened by the first job and stay open until ftdi_pool_destroy, so that short jobs 
+   do not pay for USB reset and MPSSE initialisation every time. 
+   Worker progress, results and errors are protected by lock. */
+struct ftdi_pool
+{
+   struct ftdi_worker workers[FTDI_MAX_WORKERS];
+   int count;                             /**< number of workers */
+   int running;                           /**< workers whose job has not returned yet */
+   
+   ftdi_job job;
+   void *user;                            /**< user data passed to job and report functions */
+   
+   pthread_mutex_t lock;
+   pthread_cond_t finished;               /**< signalled when a worker finishes */
+};
+
+int ftdi_pool_init (struct ftdi_pool *pool, const char **selectors, int count);
+int ftdi_pool_run (struct ftdi_pool *pool, ftdi_job job, ftdi_pool_report report, void *user, double interval);
+void ftdi_pool_destroy (struct ftdi_pool *pool);
+void *ftdi_pool_thread (void *arg);
+void ftdi_pool_progress (struct ftdi_pool *pool, qword *done, qword *total);
+void ftdi_pool_print_report (struct ftdi_pool *pool, void *user);
+
+struct spi_context *ftdi_worker_spi (struct ftdi_worker *worker,
+                                     int clock_idle, int clock_phase, word clock_divisor, int clock_divide_by_5, int mosi_idle, int write_lsb_first, int read_lsb_first, int loopback_on);
+void ftdi_worker_release (struct ftdi_worker *worker);
+void ftdi_worker_progress (struct ftdi_worker *worker, qword done, qword total);
+void ftdi_worker_error (struct ftdi_worker *worker, const char *format, ...);
@@ -10,18 +10,26 @@
 #include "sd_spi.h"
 
 /**
-   Initialises SD card to work in SPI mode.
+   Initialises SD card to work in SPI mode. SCLK is lowered to SD_INIT_FREQUENCY if faster, 
+   see sd_set_transfer_speed to speed it up again once the card is initialised.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval >0 on success
 */
-void sd_init (struct ftdi_context *ftdi, struct spi_context *spi)
+int sd_init (struct ftdi_context *ftdi, struct spi_context *spi)
 { 
    byte buf[3];
-   int ret;
+   
+   /* card identification mode: 400 kHz at most */
+   if (spi_frequency (spi) > SD_INIT_FREQUENCY && spi_set_frequency (ftdi, spi, SD_INIT_FREQUENCY) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
    
    /* ensure CS#, MOSI is held high */
-   ftdi_set_bits_low (ftdi, spi, MOSI|CS, MOSI|CS, MOSI|CS);
+   if (ftdi_set_bits_low (ftdi, spi, MOSI|CS, MOSI|CS, MOSI|CS) < 0)
+      return SPI_USB_ERROR;
 
    /* wait at least 1ms to let vdd to reach vdd_min level */
    usleep (1000);
@@ -30,10 +38,8 @@ void sd_init (struct ftdi_context *ftdi, struct spi_context *spi)
    buf[0] = CLK_BYTES;
    buf[1] = 10-1;    /* 10*8=80 clock cycles */
    buf[2] = 0;
-   if ((ret = ftdi_write_data (ftdi, buf, 3)) < 0)
-      ftdi_exit (ftdi, "ERROR: Unable to init SD card: %d (%s)\n", ret);
-  
-   return;
+   
+   return spi_queue_write (ftdi, spi, buf, 3);
 }
 
 /**
@@ -42,8 +48,13 @@ void sd_init (struct ftdi_context *ftdi, struct spi_context *spi)
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
    @param timeout maximum waiting time in seconds
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if no response has been received
+   @retval 0 if card response is not valid
+   @retval >0 on success
 */
-void sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout)
+int sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout)
 {
    byte r1;
    int ret;
@@ -58,23 +69,15 @@ void sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout)
       
       time (&end);
    }
-   while (difftime (end, start) < timeout && (ret <= 0 || r1 != IN_IDLE_STATE));
+   while (difftime (end, start) < timeout && ret != SPI_USB_ERROR && (ret <= 0 || r1 != IN_IDLE_STATE));
    
    /* if not in idle state or an error occured */
-   if (ret <= 0) 
-   {
-      /* terminate program */
-      if (ret < 0)
+   if (ret == 0)
+      fprintf (stderr, "ERROR: Unexpected SD card response: 0x%.2X\n", r1);
+   else if (ret < 0)
       fprintf (stderr, "ERROR: Unable to receive a valid response from SD card\n");
-      else
-         fprintf (stderr, "ERROR: Unexpected SD card response: 0x%.2X\n", r1);
-      
-      spi_free (spi);
-      ftdi_free (ftdi);
-      exit (EXIT_FAILURE);
-   }
 
-   return;
+   return ret;
 }
 
 
@@ -85,6 +88,8 @@ void sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout)
    @param spi pointer to struct spi_context
    @param timeout maximum waiting time in seconds
    
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if card is unknown
    @retval 0 if card is a MMC ver. 3
    @retval 1 if card is a SD ver. 1
    @retval 2 if card is a SD ver. 2 (byte address)
@@ -100,7 +105,8 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
    time_t start, end; 
 
    /* send CMD8 (SEND_IF_COND) command to recognize sd card version */
-   ret = sd_send_command (ftdi, spi, buf, CMD8, 0x000001AA);
+   if ((ret = sd_send_command (ftdi, spi, buf, CMD8, 0x000001AA)) == SPI_USB_ERROR)
+      return ret;
 
    /* split response packet */
    interpret_r7_response (buf, &r1, &ocr);
@@ -124,6 +130,8 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
          /* SD version 1 */
          return 1;
       }
+      else if (ret == SPI_USB_ERROR)
+         return ret;
       /* else */
       
       start = time_sync ();
@@ -140,6 +148,8 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
          /* MMC version 3 */
          return 0;
       }
+      else if (ret == SPI_USB_ERROR)
+         return ret;
    } 
    else if (ocr == 0x000001AA)
    {  
@@ -159,7 +169,8 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
          /* SD version 2 */
          
          /* read ocr register */
-         sd_send_command (ftdi, spi, buf, CMD58, 0x00000000);
+         if ((ret = sd_send_command (ftdi, spi, buf, CMD58, 0x00000000)) == SPI_USB_ERROR)
+            return ret;
 
          /* split response packet */
          interpret_r7_response (buf, &r1, &ocr);
@@ -169,7 +180,8 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
             /* byte address */
             
             /* force block size to 512 bytes to work with FAT file system */
-            sd_send_command (ftdi, spi, &r1, CMD16, 0x00000200);
+            if ((ret = sd_send_command (ftdi, spi, &r1, CMD16, 0x00000200)) == SPI_USB_ERROR)
+               return ret;
 
             return 3;
          }
@@ -179,14 +191,15 @@ int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeou
             return 2;
          }
       }
+      else if (ret == SPI_USB_ERROR)
+         return ret;
    }
    /* else (if ocr != 0x000001AA) */
    
-   /* unknown card, terminate */
+   /* unknown card */
    fprintf (stderr, "ERROR: Unknown SD card\n");
-   spi_free (spi);
-   ftdi_free (ftdi);
-   exit (EXIT_FAILURE);
+   
+   return -1;
 }
 
 
@@ -286,22 +299,7 @@ int sd_get_cid (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_ci
       printf ("%.2X", buf[i]);
    printf ("\n");
    
-   memcpy (cid->raw, buf, 16);
-   
-   /* write structure */
-   cid->MID    = get_bits (buf, 16, 120, 8);
-   cid->OID[0] = get_bits (buf, 16, 112, 8);
-   cid->OID[1] = get_bits (buf, 16, 104, 8);
-   cid->OID[2] = '\0';
-   cid->PNM[0] = get_bits (buf, 16, 96, 8);
-   cid->PNM[1] = get_bits (buf, 16, 80, 8);
-   cid->PNM[2] = get_bits (buf, 16, 72, 8);
-   cid->PNM[3] = get_bits (buf, 16, 64, 8);
-   cid->PNM[4] = '\0';
-   cid->PRV    = get_bits (buf, 16, 56, 8);
-   cid->PSN    = get_bits (buf, 16, 24, 32);
-   cid->MDT    = get_bits (buf, 16, 8, 12);
-   cid->CRC    = get_bits (buf, 16, 1, 7);
+   sd_parse_cid (buf, cid);
    
    return 1;
 }
@@ -348,44 +346,41 @@ int sd_get_csd (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_cs
       printf ("%.2X", buf[i]);
    printf ("\n");
    
-   memcpy (csd->raw, buf, 16);
-   
-   csd->CSD_STRUCTURE      = get_bits (buf, 16, 126, 2);
-   csd->TAAC               = get_bits (buf, 16, 112, 8);
-   csd->NSAC               = get_bits (buf, 16, 104, 8);
-   csd->TRAN_SPEED         = get_bits (buf, 16, 96, 8);
-   csd->CCC                = get_bits (buf, 16, 84, 12);
-   csd->READ_BL_LEN        = get_bits (buf, 16, 80, 4);
-   csd->READ_BL_PARTIAL    = get_bits (buf, 16, 79, 1);
-   csd->WRITE_BLK_MISALIGN = get_bits (buf, 16, 78, 1);
-   csd->READ_BLK_MISALIGN  = get_bits (buf, 16, 77, 1);
-   csd->DSR_IMP            = get_bits (buf, 16, 76, 1);
-   if (csd->CSD_STRUCTURE == 0)
+   sd_parse_csd (buf, csd);
+   
+   return 1;
+}
+
+/**
+   Raises SCLK to the maximum data transfer rate of the card (TRAN_SPEED field of CSD register), 
+   once it has left the identification mode (see sd_recognize). SCLK is capped at SD_MAX_FREQUENCY, 
+   the fastest the card accepts in default speed mode.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param csd pointer to struct sd_csd, as read by sd_get_csd
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval 0 if TRAN_SPEED is not valid (SCLK is left unchanged)
+   @retval >0 on success
+*/
+int sd_set_transfer_speed (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_csd *csd)
+{
+   double frequency;
+   
+   frequency = sd_csd_transfer_speed_hz (*csd);
+   
+   if (frequency <= 0)
    {
-      csd->C_SIZE          = get_bits (buf, 16, 62, 12);
-      csd->VDD_R_CURR_MIN  = get_bits (buf, 16, 59, 3);
-      csd->VDD_R_CURR_MAX  = get_bits (buf, 16, 56, 3);
-      csd->VDD_W_CURR_MIN  = get_bits (buf, 16, 53, 3);
-      csd->VDD_W_CURR_MAX  = get_bits (buf, 16, 50, 3);
-      csd->C_SIZE_MULT     = get_bits (buf, 16, 47, 3);
+      fprintf (stderr, "WARNING: Invalid TRAN_SPEED in CSD: 0x%.2X\n", csd->TRAN_SPEED);
+      return 0;
    }
-   else
-   {
-      csd->C_SIZE          = get_bits (buf, 16, 48, 22);
-   }
-   csd->ERASE_BLK_EN       = get_bits (buf, 16, 46, 1);
-   csd->SECTOR_SIZE        = get_bits (buf, 16, 39, 7);
-   csd->WP_GRP_SIZE        = get_bits (buf, 16, 32, 7);
-   csd->WP_GRP_ENABLE      = get_bits (buf, 16, 31, 1);
-   csd->R2W_FACTOR         = get_bits (buf, 16, 26, 3);
-   csd->WRITE_BL_LEN       = get_bits (buf, 16, 22, 4);
-   csd->WRITE_BL_PARTIAL   = get_bits (buf, 16, 21, 1);
-   csd->FILE_FORMAT_GRP    = get_bits (buf, 16, 15, 1);
-   csd->COPY               = get_bits (buf, 16, 14, 1);
-   csd->PERM_WRITE_PROTECT = get_bits (buf, 16, 13, 1);
-   csd->TMP_WRITE_PROTECT  = get_bits (buf, 16, 12, 1);
-   csd->FILE_FORMAT        = get_bits (buf, 16, 11, 2);
-   csd->CRC                = get_bits (buf, 16, 1, 7);
+   
+   if (frequency > SD_MAX_FREQUENCY)
+      frequency = SD_MAX_FREQUENCY;
+   
+   if (spi_set_frequency (ftdi, spi, frequency) == SPI_USB_ERROR)
+      return SPI_USB_ERROR;
    
    return 1;
 }
@@ -543,6 +538,7 @@ void sd_cid_manufacturer (struct sd_cid cid, char *man)
 
 /**
    Sends a command to the SD card.
+   <br>Before the command is sent, card is given at most SD_READY_TIMEOUT seconds to release MISO.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
@@ -550,35 +546,57 @@ void sd_cid_manufacturer (struct sd_cid cid, char *man)
    @param cmd command to send
    @param arg argument value
    
-   @retval <0 if no response has been received
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if card is not ready or no response has been received
    @retval 0 if card response is not valid
    @retval >0 on success
 */
 int sd_send_command (struct ftdi_context *ftdi, struct spi_context *spi, byte *response, byte cmd, dword arg)
 {
-   byte pkt[6], temp;
-   int i, count, timeout, processing;
+   byte pkt[6 + 1 + 5], rx[6 + 1 + 5], temp;
+   int i, j, count, skip, timeout, processing;
+   double start;
    
-   /* wait for card to be ready to receive a new command */
-   do
-      spi_read (ftdi, spi, &temp, 1);
-   while (temp != 0xFF);
+   /* wait for card to be ready to receive a new command (CMD12 is sent while card is still 
+      transmitting data, so there is no idle state to wait for) */
+   if (cmd != CMD12)
+   {
+      start = ftdi_monotonic_time ();
+      do
+      {
+         if (spi_read (ftdi, spi, &temp, 1) < 0)
+            return SPI_USB_ERROR;
+         
+         if (temp != 0xFF && ftdi_monotonic_time () - start > SD_READY_TIMEOUT)
+         {
+            fprintf (stderr, "ERROR: SD card not ready for CMD%d\n", cmd - 0x40);
+            return -1;
+         }
+      }
+      while (temp != 0xFF);
+   }
 
    /* prepare sd packet */
    if (GETBIT (cmd, 7) == 1)
       printf ("WARNING: Command 0x%.2X has first bit set to 1!\n", cmd);
    
+   count = (cmd == CMD8 || cmd == CMD58) ? 5 : 1;     /* CMD8 and CMD58 returns a R7/R3 response, which is 5 bytes long */
+   skip = (cmd == CMD12) ? 1 : 0;                     /* CMD12 is followed by a stuff byte, which must be discarded */
+   
    pkt[0] = cmd;
    pkt[1] = GETBYTE (arg, 3);
    pkt[2] = GETBYTE (arg, 2);
    pkt[3] = GETBYTE (arg, 1);
    pkt[4] = GETBYTE (arg, 0);   
    pkt[5] = (crc_7 (pkt, 5) << 1) | 0x01;    /* crc must be left shifted and first bit must be 1 */
+   memset (pkt + 6, 0xFF, skip + count);     /* MOSI must be held high while response is read */
    
    
    DEBUG_PRINT ("DEBUG: Sending command CMD%d ", cmd - 0x40);
-   /* send packet */
-   spi_write (ftdi, spi, pkt, 6);
+   /* send packet and read the first count bytes of response at the same time (full-duplex): 
+      card responds after at least one byte, so nothing beyond the response is ever read */
+   if (spi_transfer (ftdi, spi, pkt, rx, 6 + skip + count) < 0)
+      return SPI_USB_ERROR;
    
    DEBUG_PRINT ("DEBUG: Sending command ");
    for (i = 0; i < 6; i++)
@@ -586,16 +604,21 @@ int sd_send_command (struct ftdi_context *ftdi, struct spi_context *spi, byte *r
    DEBUG_PRINT ("\nDEBUG: Command response");
    
    /* read response */
-   ftdi_set_bits_low (ftdi, spi, MOSI, MOSI, MOSI);   /* ensure MOSI is held high during read */
+   if (ftdi_set_bits_low (ftdi, spi, MOSI, MOSI, MOSI) < 0)   /* ensure MOSI is held high during read */
+      return SPI_USB_ERROR;
    
    timeout = 0;
    i = 0;
+   j = 6 + skip;
    processing = 1;
-   count = (cmd == CMD8 || cmd == CMD58) ? 5 : 1;     /* CMD8 and CMD58 returns a R7/R3 response, which is 5 bytes long */
    
    do
    {
-      spi_read (ftdi, spi, response + i, 1);
+      /* use bytes already received during packet transfer first */
+      if (j < 6 + skip + count)
+         response[i] = rx[j++];
+      else if (spi_read (ftdi, spi, response + i, 1) < 0)
+         return SPI_USB_ERROR;
       DEBUG_PRINT (" 0x%.2X", response[i]);
       
       /* if no data has been received */
@@ -625,12 +648,16 @@ int sd_send_command (struct ftdi_context *ftdi, struct spi_context *spi, byte *r
 
 /**
    Reads data from SD card.
+   <br>CRC-16 is computed while data is being received: small blocks are read back together with 
+   their CRC in a single USB round-trip, larger ones are streamed and checked segment by segment.
    
    @param ftdi pointer to struct ftdi_context
    @param spi pointer to struct spi_context
    @param data byte array to store data in
    @param count size of data to read
    
+   @retval SPI_USB_ERROR on communication error
+   @retval SD_CRC_ERROR if CRC of received data is incorrect
    @retval <0 if no response has been received
    @retval 0 if response token is not valid (either is an error token or response token is invalid)
    @retval >0 on success
@@ -638,6 +665,7 @@ int sd_send_command (struct ftdi_context *ftdi, struct spi_context *spi, byte *r
 int sd_read_data (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int count)
 {
    byte token, crc[2];
+   word data_crc;
    int timeout, processing, i;
    
    timeout = 0;
@@ -647,7 +675,8 @@ int sd_read_data (struct ftdi_context *ftdi, struct spi_context *spi, byte *data
    /* read data/error token */
    do
    {
-      spi_read (ftdi, spi, &token, 1);
+      if (spi_read (ftdi, spi, &token, 1) < 0)
+         return SPI_USB_ERROR;
       DEBUG_PRINT (" 0x%.2X", token);
       
       /* if no data has been received */
@@ -670,25 +699,461 @@ int sd_read_data (struct ftdi_context *ftdi, struct spi_context *spi, byte *data
       return 0;
    }
    
-   /* read actual data */
-   spi_read (ftdi, spi, data, count);
+   data_crc = crc_16_init ();
+   
+   if (count > SD_CRC_STREAM_LENGTH)
+   {
+      /* read actual data, updating crc as each segment lands */
+      if (spi_read_stream (ftdi, spi, data, count, count, sd_crc_16_stream_cb, &data_crc) < 0 ||
+          spi_read (ftdi, spi, crc, 2) < 0)
+         return SPI_USB_ERROR;
+   }
+   else
+   {
+      /* read actual data and crc at once */
+      spi_queue_begin (spi);
+      spi_read (ftdi, spi, data, count);
+      spi_read (ftdi, spi, crc, 2);
+      if (spi_queue_end (ftdi, spi) < 0)
+         return SPI_USB_ERROR;
+      
+      data_crc = crc_16_update (data_crc, data, count);
+   }
+   
    for (i = 0; i < count; i++)
       DEBUG_PRINT (" 0x%.2X", data[i]);
-   
-   /* read crc */
-   spi_read (ftdi, spi, crc, 2);
-   DEBUG_PRINT (" 0x%.2X 0x%.2X\n\n", crc[1], crc[2]);
+   DEBUG_PRINT (" 0x%.2X 0x%.2X\n\n", crc[0], crc[1]);
    
    /* check block using crc */
-   if (crc_16 (data, count) != get_bits (crc, 2, 0, 16))
+   if (crc_16_final (data_crc) != (crc[0] << 8 | crc[1]))
    {
-      fprintf (stderr, "ERROR: CRC in data block is incorrect!\n");
-      return 0;
+      DEBUG_PRINT ("DEBUG: CRC in data block is incorrect!\n");
+      return SD_CRC_ERROR;
    }
 
    return 1;
 }
 
+/**
+   Auxiliary function used by sd_read_data: updates CRC-16 with a segment of a streamed data block.
+   
+   @param data segment data
+   @param size segment size
+   @param user pointer to current CRC-16 value (word)
+   
+   @retval 0 to continue streaming
+*/
+int sd_crc_16_stream_cb (byte *data, int size, void *user)
+{
+   word *crc = (word *)user;
+   
+   *crc = crc_16_update (*crc, data, size);
+   
+   return 0;
+}
+
+/**
+   Reads a single data block (SD_BLOCK_LENGTH bytes) from SD card (CMD17).
+   <br>If the block CRC is incorrect, hook is called and the block is read again as long as it returns 
+   a non-zero value. The hook receives the block number, the number of attempts made so far and user, 
+   see sd_crc_hook_retry. With no hook (NULL), CRC errors are returned to the caller straight away.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param sd_version SD card version, as returned by sd_recognize
+   @param block block number
+   @param data byte array to store data in (SD_BLOCK_LENGTH bytes)
+   @param hook function called on CRC errors (or NULL)
+   @param user pointer passed to hook
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval SD_CRC_ERROR if CRC of received data is incorrect (and no more retries are allowed)
+   @retval <0 if no response has been received
+   @retval 0 if card response or data token is not valid
+   @retval >0 on success
+*/
+int sd_read_block (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, byte *data,
+                   sd_crc_hook hook, void *user)
+{
+   return sd_read_block_retry (ftdi, spi, sd_version, block, data, hook, user, 0);
+}
+
+/**
+   Auxiliary function used by sd_read_block and sd_read_blocks: reads a single data block, calling 
+   the CRC hook on failures. 
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param sd_version SD card version, as returned by sd_recognize
+   @param block block number
+   @param data byte array to store data in (SD_BLOCK_LENGTH bytes)
+   @param hook function called on CRC errors (or NULL)
+   @param user pointer passed to hook
+   @param attempt number of attempts already made to read this block
+   
+   @return same as sd_read_block
+*/
+int sd_read_block_retry (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, byte *data,
+                         sd_crc_hook hook, void *user, int attempt)
+{
+   byte r1;
+   int ret;
+   
+   do
+   {
+      attempt++;
+      
+      if ((ret = sd_send_command (ftdi, spi, &r1, CMD17, sd_block_address (sd_version, block))) <= 0)
+         return ret;
+      
+      ret = sd_read_data (ftdi, spi, data, SD_BLOCK_LENGTH);
+   } 
+   while (ret == SD_CRC_ERROR && hook != NULL && hook (ftdi, spi, block, attempt, user));
+   
+   return ret;
+}
+
+/**
+   Reads count consecutive data blocks from SD card (CMD18, then CMD12).
+   <br>Data is streamed in large bulk reads: data tokens are searched for inside each received 
+   segment, block payloads are copied to data with CRCs stripped and checked, while the next 
+   segment is being read. Blocks received with an incorrect CRC are read again one by one, if hook 
+   allows it (see sd_read_block).
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param sd_version SD card version, as returned by sd_recognize
+   @param block first block number
+   @param count number of blocks to read
+   @param data byte array to store data in (count * SD_BLOCK_LENGTH bytes)
+   @param hook function called on CRC errors (or NULL)
+   @param user pointer passed to hook
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval SD_CRC_ERROR if CRC of a block is incorrect (and no more retries are allowed)
+   @retval <0 if no response has been received
+   @retval 0 if card response or a data token is not valid
+   @retval >0 on success
+*/
+int sd_read_blocks (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, int count, 
+                    byte *data, sd_crc_hook hook, void *user)
+{
+   struct sd_block_reader reader;
+   byte *ring;
+   byte r1;
+   int i, window, ret;
+   
+   if (count <= 0)
+      return 1;
+   
+   /* no larger than needed, so that little data is clocked out past the last block */
+   window = (SD_BLOCK_LENGTH + 3 + SD_READ_GAP_LENGTH) * count;
+   if (window > MAX_SPI_BUF_LENGTH)
+      window = MAX_SPI_BUF_LENGTH;
+   
+   if ((ring = (byte *)malloc (2 * window)) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate read buffer!\n");
+      return -1;
+   }
+   
+   if ((ret = sd_send_command (ftdi, spi, &r1, CMD18, sd_block_address (sd_version, block))) <= 0)
+   {
+      free (ring);
+      return ret;
+   }
+   
+   reader.data = data;
+   reader.count = count;
+   reader.done = 0;
+   reader.pos = -1;
+   reader.idle = 0;
+   reader.status = 1;
+   reader.bad_count = 0;
+   
+   /* stream until all blocks have been parsed (or an error occurs) */
+   ret = spi_read_stream (ftdi, spi, ring, 2 * window, 0, sd_read_blocks_cb, &reader);
+   free (ring);
+   
+   if (ret == SPI_USB_ERROR)
+      return ret;
+   
+   /* stop transmission */
+   if ((ret = sd_send_command (ftdi, spi, &r1, CMD12, 0x00000000)) == SPI_USB_ERROR)
+      return ret;
+   
+   DEBUG_PRINT ("DEBUG: Received %d of %d blocks, %d with CRC errors (CMD12: %d)\n", reader.done, count, reader.bad_count, ret);
+   
+   if (reader.status <= 0)
+      return reader.status;
+   
+   /* read again blocks received with incorrect CRC */
+   for (i = 0; i < reader.bad_count; i++)
+   {
+      if (hook == NULL || !hook (ftdi, spi, block + reader.bad[i], 1, user))
+         return SD_CRC_ERROR;
+      
+      if ((ret = sd_read_block_retry (ftdi, spi, sd_version, block + reader.bad[i], 
+                                      data + reader.bad[i] * SD_BLOCK_LENGTH, hook, user, 1)) <= 0)
+         return ret;
+   }
+   
+   return 1;
+}
+
+/**
+   Auxiliary function used by sd_read_blocks: parses a received segment. Looks for data tokens, 
+   copies block payloads and checks their CRC.
+   
+   @param data segment data
+   @param size segment size
+   @param user pointer to struct sd_block_reader
+   
+   @retval 0 to continue streaming
+   @retval 1 when all blocks have been received or an error occurred
+*/
+int sd_read_blocks_cb (byte *data, int size, void *user)
+{
+   struct sd_block_reader *reader = (struct sd_block_reader *)user;
+   byte *dest;
+   int i, n;
+   
+   i = 0;
+   
+   while (i < size)
+   {
+      if (reader->pos < 0)
+      {
+         /* waiting for data token */
+         if (data[i] == 0xFF)
+         {
+            if (++reader->idle > SD_READ_TOKEN_TIMEOUT)
+            {
+               reader->status = -1;
+               return 1;
+            }
+         }
+         else if (data[i] == 0xFE)
+         {
+            reader->pos = 0;
+            reader->crc = crc_16_init ();
+         }
+         else
+         {
+            /* error token or invalid data token (reported by sd_is_token_valid) */
+            sd_is_token_valid (data[i]);
+            reader->status = 0;
+            return 1;
+         }
+         i++;
+      }
+      else if (reader->pos < SD_BLOCK_LENGTH)
+      {
+         /* block payload */
+         n = size - i;
+         if (n > SD_BLOCK_LENGTH - reader->pos)
+            n = SD_BLOCK_LENGTH - reader->pos;
+         
+         dest = reader->data + reader->done * SD_BLOCK_LENGTH + reader->pos;
+         memcpy (dest, data + i, n);
+         reader->crc = crc_16_update (reader->crc, dest, n);
+         
+         reader->pos += n;
+         i += n;
+      }
+      else
+      {
+         /* block crc, most significant byte first */
+         reader->rx_crc = (reader->pos == SD_BLOCK_LENGTH) ? data[i] << 8 : reader->rx_crc | data[i];
+         reader->pos++;
+         i++;
+         
+         if (reader->pos == SD_BLOCK_LENGTH + 2)
+         {
+            if (crc_16_final (reader->crc) != reader->rx_crc)
+            {
+               if (reader->bad_count == SD_READ_MAX_BAD_BLOCKS)
+               {
+                  reader->status = SD_CRC_ERROR;
+                  return 1;
+               }
+               reader->bad[reader->bad_count++] = reader->done;
+            }
+            
+            reader->done++;
+            reader->pos = -1;
+            reader->idle = 0;
+            
+            if (reader->done == reader->count)
+               return 1;
+         }
+      }
+   }
+   
+   return 0;
+}
+
+/**
+   Writes count consecutive data blocks (SD_BLOCK_LENGTH bytes each) to SD card (ACMD23 + CMD25).
+   <br>The number of blocks is announced with ACMD23 first, so that the card can pre-erase them. Every 
+   block is then queued (start token, payload, CRC and read-back of its data response), followed by 
+   a wait for the end of the busy state (see sd_wait_busy): if GPIOL1 is wired to MISO, the next block 
+   is already queued in FTDI device while the card is programming the current one, and all blocks 
+   are written in a few USB transfers.
+   <br>Data responses are checked once all blocks have been sent, blocks following a rejected one may 
+   have been discarded by the card and must be written again.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param sd_version SD card version, as returned by sd_recognize
+   @param block number of the first block
+   @param count number of blocks to write
+   @param data byte array of data to write (count * SD_BLOCK_LENGTH bytes)
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if no response has been received or card did not leave the busy state
+   @retval 0 if card response is not valid or a block has been rejected
+   @retval >0 on success
+*/
+int sd_write_blocks (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, int count, 
+                     byte *data)
+{
+   byte pkt[1 + SD_BLOCK_LENGTH + 2], *resp, r1, temp;
+   word crc;
+   int i, ret, status;
+   
+   if (count <= 0)
+      return 1;
+   
+   if ((resp = (byte *)malloc (count)) == NULL)
+   {
+      fprintf (stderr, "ERROR: Unable to allocate data response buffer!\n");
+      return -1;
+   }
+   
+   /* pre-erase hint, SD cards only: failure is not fatal, blocks are just erased while being written */
+   if (sd_version != 0)
+   {
+      if ((ret = sd_send_command (ftdi, spi, &r1, CMD55, 0x00000000)) > 0)
+         ret = sd_send_command (ftdi, spi, &r1, ACMD23, count & 0x007FFFFF);
+      DEBUG_PRINT ("DEBUG: ACMD23 response: %d (pre-erase %s)\n", ret, (ret > 0) ? "enabled" : "disabled");
+   }
+   
+   if ((ret = sd_send_command (ftdi, spi, &r1, CMD25, sd_block_address (sd_version, block))) <= 0)
+   {
+      free (resp);
+      return ret;
+   }
+   
+   spi_queue_begin (spi);
+   
+   status = 1;
+   for (i = 0; i < count && status > 0; i++)
+   {
+      crc = crc_16 (data + i * SD_BLOCK_LENGTH, SD_BLOCK_LENGTH);
+      
+      pkt[0] = START_BLOCK_MULTI;
+      memcpy (pkt + 1, data + i * SD_BLOCK_LENGTH, SD_BLOCK_LENGTH);
+      pkt[1 + SD_BLOCK_LENGTH] = GETBYTE (crc, 1);
+      pkt[2 + SD_BLOCK_LENGTH] = GETBYTE (crc, 0);
+      
+      if (spi_write (ftdi, spi, pkt, sizeof (pkt)) < 0 ||
+          spi_read (ftdi, spi, resp + i, 1) < 0)        /* data response follows CRC straight away */
+         status = SPI_USB_ERROR;
+      else
+         status = sd_wait_busy (ftdi, spi);
+   }
+   
+   /* stop transmission: card goes busy after one stuff byte */
+   pkt[0] = STOP_TRAN;
+   if (spi_write (ftdi, spi, pkt, 1) < 0 || spi_read (ftdi, spi, &temp, 1) < 0)
+      status = SPI_USB_ERROR;
+   else if ((ret = sd_wait_busy (ftdi, spi)) < 0 && status != SPI_USB_ERROR)
+      status = ret;
+   
+   if (spi_queue_end (ftdi, spi) < 0)
+      status = SPI_USB_ERROR;
+   
+   DEBUG_PRINT ("DEBUG: Sent %d of %d blocks (status: %d)\n", i, count, status);
+   
+   /* check data responses */
+   for (i = 0; i < count && status > 0; i++)
+   {
+      if ((resp[i] & DATA_RESP_MASK) != DATA_ACCEPTED)
+      {
+         fprintf (stderr, "WARNING: Block %u rejected by SD card, data response 0x%.2X (%s)\n", block + i, resp[i], 
+                  ((resp[i] & DATA_RESP_MASK) == DATA_CRC_ERR)   ? "CRC error" :
+                  ((resp[i] & DATA_RESP_MASK) == DATA_WRITE_ERR) ? "write error" : "invalid response");
+         status = 0;
+      }
+   }
+   
+   free (resp);
+   
+   return status;
+}
+
+/**
+   Waits for SD card to leave the busy state (MISO held low) after a block has been written.
+   <br>If GPIOL1 is wired to MISO (see spi_set_gpiol1_wait), the wait is queued as an MPSSE "wait on I/O" 
+   command and commands queued after it are executed by FTDI device as soon as the card is ready. 
+   Otherwise, the queue is flushed and MISO is polled from host side, SD_WRITE_POLL_LENGTH bytes at a time, 
+   for at most SD_WRITE_TIMEOUT seconds.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   
+   @retval SPI_USB_ERROR on communication error
+   @retval <0 if card is still busy after SD_WRITE_TIMEOUT seconds
+   @retval >0 on success (or when the wait has been queued)
+*/
+int sd_wait_busy (struct ftdi_context *ftdi, struct spi_context *spi)
+{
+   byte buf[SD_WRITE_POLL_LENGTH];
+   double start;
+   
+   if (spi->GPIOL1_WAIT)
+      return spi_wait_gpiol1 (ftdi, spi, 1);
+   
+   start = ftdi_monotonic_time ();
+   do
+   {
+      /* card releases MISO (0xFF) once programming has finished, extra bytes are ignored */
+      if (spi_read (ftdi, spi, buf, SD_WRITE_POLL_LENGTH) < 0 || spi_queue_flush (ftdi, spi) < 0)
+         return SPI_USB_ERROR;
+      
+      if (buf[SD_WRITE_POLL_LENGTH - 1] == 0xFF)
+         return 1;
+   }
+   while (ftdi_monotonic_time () - start < SD_WRITE_TIMEOUT);
+   
+   return -1;
+}
+
+/**
+   Ready-made CRC hook for sd_read_block and sd_read_blocks: reports the error and allows up to 
+   SD_CRC_RETRIES attempts per block.
+   
+   @param ftdi pointer to struct ftdi_context
+   @param spi pointer to struct spi_context
+   @param block block number
+   @param attempt number of attempts made so far
+   @param user unused
+   
+   @retval 1 to read the block again
+   @retval 0 to give up
+*/
+int sd_crc_hook_retry (struct ftdi_context *ftdi, struct spi_context *spi, dword block, int attempt, void *user)
+{
+   (void)ftdi;
+   (void)spi;
+   (void)user;
+   
+   fprintf (stderr, "WARNING: CRC error in block %u (attempt %d of %d)\n", block, attempt, SD_CRC_RETRIES);
+   
+   return attempt < SD_CRC_RETRIES;
+}
+
 /**
    Auxiliary function used by sd_read_data to check if either the response token is 
    an error token or is invalid.
@@ -768,6 +1233,229 @@ void interpret_r7_response (byte *response, byte *r1, dword *ocr)
    return;
 }
 
+/**
+   CRC-7 lookup table (G(x)=x^7+x^3+1): crc7_table[(crc << 1) ^ byte] is the CRC-7 after shifting in byte.
+*/
+const byte crc7_table[256] =
+{
+   0x00, 0x09, 0x12, 0x1B, 0x24, 0x2D, 0x36, 0x3F, 0x48, 0x41, 0x5A, 0x53, 0x6C, 0x65, 0x7E, 0x77,
+   0x19, 0x10, 0x0B, 0x02, 0x3D, 0x34, 0x2F, 0x26, 0x51, 0x58, 0x43, 0x4A, 0x75, 0x7C, 0x67, 0x6E,
+   0x32, 0x3B, 0x20, 0x29, 0x16, 0x1F, 0x04, 0x0D, 0x7A, 0x73, 0x68, 0x61, 0x5E, 0x57, 0x4C, 0x45,
+   0x2B, 0x22, 0x39, 0x30, 0x0F, 0x06, 0x1D, 0x14, 0x63, 0x6A, 0x71, 0x78, 0x47, 0x4E, 0x55, 0x5C,
+   0x64, 0x6D, 0x76, 0x7F, 0x40, 0x49, 0x52, 0x5B, 0x2C, 0x25, 0x3E, 0x37, 0x08, 0x01, 0x1A, 0x13,
+   0x7D, 0x74, 0x6F, 0x66, 0x59, 0x50, 0x4B, 0x42, 0x35, 0x3C, 0x27, 0x2E, 0x11, 0x18, 0x03, 0x0A,
+   0x56, 0x5F, 0x44, 0x4D, 0x72, 0x7B, 0x60, 0x69, 0x1E, 0x17, 0x0C, 0x05, 0x3A, 0x33, 0x28, 0x21,
+   0x4F, 0x46, 0x5D, 0x54, 0x6B, 0x62, 0x79, 0x70, 0x07, 0x0E, 0x15, 0x1C, 0x23, 0x2A, 0x31, 0x38,
+   0x41, 0x48, 0x53, 0x5A, 0x65, 0x6C, 0x77, 0x7E, 0x09, 0x00, 0x1B, 0x12, 0x2D, 0x24, 0x3F, 0x36,
+   0x58, 0x51, 0x4A, 0x43, 0x7C, 0x75, 0x6E, 0x67, 0x10, 0x19, 0x02, 0x0B, 0x34, 0x3D, 0x26, 0x2F,
+   0x73, 0x7A, 0x61, 0x68, 0x57, 0x5E, 0x45, 0x4C, 0x3B, 0x32, 0x29, 0x20, 0x1F, 0x16, 0x0D, 0x04,
+   0x6A, 0x63, 0x78, 0x71, 0x4E, 0x47, 0x5C, 0x55, 0x22, 0x2B, 0x30, 0x39, 0x06, 0x0F, 0x14, 0x1D,
+   0x25, 0x2C, 0x37, 0x3E, 0x01, 0x08, 0x13, 0x1A, 0x6D, 0x64, 0x7F, 0x76, 0x49, 0x40, 0x5B, 0x52,
+   0x3C, 0x35, 0x2E, 0x27, 0x18, 0x11, 0x0A, 0x03, 0x74, 0x7D, 0x66, 0x6F, 0x50, 0x59, 0x42, 0x4B,
+   0x17, 0x1E, 0x05, 0x0C, 0x33, 0x3A, 0x21, 0x28, 0x5F, 0x56, 0x4D, 0x44, 0x7B, 0x72, 0x69, 0x60,
+   0x0E, 0x07, 0x1C, 0x15, 0x2A, 0x23, 0x38, 0x31, 0x46, 0x4F, 0x54, 0x5D, 0x62, 0x6B, 0x70, 0x79
+};
+
+/**
+   CRC-16 lookup tables (G(x)=x^16+x^12+x^5+1) for slice-by-8 calculation: crc16_table[k][byte] is 
+   the CRC-16 of byte followed by k zero bytes.
+*/
+const word crc16_table[8][256] =
+{
+   {
+      0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7, 0x8108, 0x9129, 0xA14A, 0xB16B,
+      0xC18C, 0xD1AD, 0xE1CE, 0xF1EF, 0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+      0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE, 0x2462, 0x3443, 0x0420, 0x1401,
+      0x64E6, 0x74C7, 0x44A4, 0x5485, 0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+      0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4, 0xB75B, 0xA77A, 0x9719, 0x8738,
+      0xF7DF, 0xE7FE, 0xD79D, 0xC7BC, 0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+      0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B, 0x5AF5, 0x4AD4, 0x7AB7, 0x6A96,
+      0x1A71, 0x0A50, 0x3A33, 0x2A12, 0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+      0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41, 0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD,
+      0xAD2A, 0xBD0B, 0x8D68, 0x9D49, 0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+      0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78, 0x9188, 0x81A9, 0xB1CA, 0xA1EB,
+      0xD10C, 0xC12D, 0xF14E, 0xE16F, 0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+      0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E, 0x02B1, 0x1290, 0x22F3, 0x32D2,
+      0x4235, 0x5214, 0x6277, 0x7256, 0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+      0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405, 0xA7DB, 0xB7FA, 0x8799, 0x97B8,
+      0xE75F, 0xF77E, 0xC71D, 0xD73C, 0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+      0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB, 0x5844, 0x4865, 0x7806, 0x6827,
+      0x18C0, 0x08E1, 0x3882, 0x28A3, 0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+      0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92, 0xFD2E, 0xED0F, 0xDD6C, 0xCD4D,
+      0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9, 0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+      0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8, 0x6E17, 0x7E36, 0x4E55, 0x5E74,
+      0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+   },
+   {
+      0x0000, 0x3331, 0x6662, 0x5553, 0xCCC4, 0xFFF5, 0xAAA6, 0x9997, 0x89A9, 0xBA98, 0xEFCB, 0xDCFA,
+      0x456D, 0x765C, 0x230F, 0x103E, 0x0373, 0x3042, 0x6511, 0x5620, 0xCFB7, 0xFC86, 0xA9D5, 0x9AE4,
+      0x8ADA, 0xB9EB, 0xECB8, 0xDF89, 0x461E, 0x752F, 0x207C, 0x134D, 0x06E6, 0x35D7, 0x6084, 0x53B5,
+      0xCA22, 0xF913, 0xAC40, 0x9F71, 0x8F4F, 0xBC7E, 0xE92D, 0xDA1C, 0x438B, 0x70BA, 0x25E9, 0x16D8,
+      0x0595, 0x36A4, 0x63F7, 0x50C6, 0xC951, 0xFA60, 0xAF33, 0x9C02, 0x8C3C, 0xBF0D, 0xEA5E, 0xD96F,
+      0x40F8, 0x73C9, 0x269A, 0x15AB, 0x0DCC, 0x3EFD, 0x6BAE, 0x589F, 0xC108, 0xF239, 0xA76A, 0x945B,
+      0x8465, 0xB754, 0xE207, 0xD136, 0x48A1, 0x7B90, 0x2EC3, 0x1DF2, 0x0EBF, 0x3D8E, 0x68DD, 0x5BEC,
+      0xC27B, 0xF14A, 0xA419, 0x9728, 0x8716, 0xB427, 0xE174, 0xD245, 0x4BD2, 0x78E3, 0x2DB0, 0x1E81,
+      0x0B2A, 0x381B, 0x6D48, 0x5E79, 0xC7EE, 0xF4DF, 0xA18C, 0x92BD, 0x8283, 0xB1B2, 0xE4E1, 0xD7D0,
+      0x4E47, 0x7D76, 0x2825, 0x1B14, 0x0859, 0x3B68, 0x6E3B, 0x5D0A, 0xC49D, 0xF7AC, 0xA2FF, 0x91CE,
+      0x81F0, 0xB2C1, 0xE792, 0xD4A3, 0x4D34, 0x7E05, 0x2B56, 0x1867, 0x1B98, 0x28A9, 0x7DFA, 0x4ECB,
+      0xD75C, 0xE46D, 0xB13E, 0x820F, 0x9231, 0xA100, 0xF453, 0xC762, 0x5EF5, 0x6DC4, 0x3897, 0x0BA6,
+      0x18EB, 0x2BDA, 0x7E89, 0x4DB8, 0xD42F, 0xE71E, 0xB24D, 0x817C, 0x9142, 0xA273, 0xF720, 0xC411,
+      0x5D86, 0x6EB7, 0x3BE4, 0x08D5, 0x1D7E, 0x2E4F, 0x7B1C, 0x482D, 0xD1BA, 0xE28B, 0xB7D8, 0x84E9,
+      0x94D7, 0xA7E6, 0xF2B5, 0xC184, 0x5813, 0x6B22, 0x3E71, 0x0D40, 0x1E0D, 0x2D3C, 0x786F, 0x4B5E,
+      0xD2C9, 0xE1F8, 0xB4AB, 0x879A, 0x97A4, 0xA495, 0xF1C6, 0xC2F7, 0x5B60, 0x6851, 0x3D02, 0x0E33,
+      0x1654, 0x2565, 0x7036, 0x4307, 0xDA90, 0xE9A1, 0xBCF2, 0x8FC3, 0x9FFD, 0xACCC, 0xF99F, 0xCAAE,
+      0x5339, 0x6008, 0x355B, 0x066A, 0x1527, 0x2616, 0x7345, 0x4074, 0xD9E3, 0xEAD2, 0xBF81, 0x8CB0,
+      0x9C8E, 0xAFBF, 0xFAEC, 0xC9DD, 0x504A, 0x637B, 0x3628, 0x0519, 0x10B2, 0x2383, 0x76D0, 0x45E1,
+      0xDC76, 0xEF47, 0xBA14, 0x8925, 0x991B, 0xAA2A, 0xFF79, 0xCC48, 0x55DF, 0x66EE, 0x33BD, 0x008C,
+      0x13C1, 0x20F0, 0x75A3, 0x4692, 0xDF05, 0xEC34, 0xB967, 0x8A56, 0x9A68, 0xA959, 0xFC0A, 0xCF3B,
+      0x56AC, 0x659D, 0x30CE, 0x03FF
+   },
+   {
+      0x0000, 0x3730, 0x6E60, 0x5950, 0xDCC0, 0xEBF0, 0xB2A0, 0x8590, 0xA9A1, 0x9E91, 0xC7C1, 0xF0F1,
+      0x7561, 0x4251, 0x1B01, 0x2C31, 0x4363, 0x7453, 0x2D03, 0x1A33, 0x9FA3, 0xA893, 0xF1C3, 0xC6F3,
+      0xEAC2, 0xDDF2, 0x84A2, 0xB392, 0x3602, 0x0132, 0x5862, 0x6F52, 0x86C6, 0xB1F6, 0xE8A6, 0xDF96,
+      0x5A06, 0x6D36, 0x3466, 0x0356, 0x2F67, 0x1857, 0x4107, 0x7637, 0xF3A7, 0xC497, 0x9DC7, 0xAAF7,
+      0xC5A5, 0xF295, 0xABC5, 0x9CF5, 0x1965, 0x2E55, 0x7705, 0x4035, 0x6C04, 0x5B34, 0x0264, 0x3554,
+      0xB0C4, 0x87F4, 0xDEA4, 0xE994, 0x1DAD, 0x2A9D, 0x73CD, 0x44FD, 0xC16D, 0xF65D, 0xAF0D, 0x983D,
+      0xB40C, 0x833C, 0xDA6C, 0xED5C, 0x68CC, 0x5FFC, 0x06AC, 0x319C, 0x5ECE, 0x69FE, 0x30AE, 0x079E,
+      0x820E, 0xB53E, 0xEC6E, 0xDB5E, 0xF76F, 0xC05F, 0x990F, 0xAE3F, 0x2BAF, 0x1C9F, 0x45CF, 0x72FF,
+      0x9B6B, 0xAC5B, 0xF50B, 0xC23B, 0x47AB, 0x709B, 0x29CB, 0x1EFB, 0x32CA, 0x05FA, 0x5CAA, 0x6B9A,
+      0xEE0A, 0xD93A, 0x806A, 0xB75A, 0xD808, 0xEF38, 0xB668, 0x8158, 0x04C8, 0x33F8, 0x6AA8, 0x5D98,
+      0x71A9, 0x4699, 0x1FC9, 0x28F9, 0xAD69, 0x9A59, 0xC309, 0xF439, 0x3B5A, 0x0C6A, 0x553A, 0x620A,
+      0xE79A, 0xD0AA, 0x89FA, 0xBECA, 0x92FB, 0xA5CB, 0xFC9B, 0xCBAB, 0x4E3B, 0x790B, 0x205B, 0x176B,
+      0x7839, 0x4F09, 0x1659, 0x2169, 0xA4F9, 0x93C9, 0xCA99, 0xFDA9, 0xD198, 0xE6A8, 0xBFF8, 0x88C8,
+      0x0D58, 0x3A68, 0x6338, 0x5408, 0xBD9C, 0x8AAC, 0xD3FC, 0xE4CC, 0x615C, 0x566C, 0x0F3C, 0x380C,
+      0x143D, 0x230D, 0x7A5D, 0x4D6D, 0xC8FD, 0xFFCD, 0xA69D, 0x91AD, 0xFEFF, 0xC9CF, 0x909F, 0xA7AF,
+      0x223F, 0x150F, 0x4C5F, 0x7B6F, 0x575E, 0x606E, 0x393E, 0x0E0E, 0x8B9E, 0xBCAE, 0xE5FE, 0xD2CE,
+      0x26F7, 0x11C7, 0x4897, 0x7FA7, 0xFA37, 0xCD07, 0x9457, 0xA367, 0x8F56, 0xB866, 0xE136, 0xD606,
+      0x5396, 0x64A6, 0x3DF6, 0x0AC6, 0x6594, 0x52A4, 0x0BF4, 0x3CC4, 0xB954, 0x8E64, 0xD734, 0xE004,
+      0xCC35, 0xFB05, 0xA255, 0x9565, 0x10F5, 0x27C5, 0x7E95, 0x49A5, 0xA031, 0x9701, 0xCE51, 0xF961,
+      0x7CF1, 0x4BC1, 0x1291, 0x25A1, 0x0990, 0x3EA0, 0x67F0, 0x50C0, 0xD550, 0xE260, 0xBB30, 0x8C00,
+      0xE352, 0xD462, 0x8D32, 0xBA02, 0x3F92, 0x08A2, 0x51F2, 0x66C2, 0x4AF3, 0x7DC3, 0x2493, 0x13A3,
+      0x9633, 0xA103, 0xF853, 0xCF63
+   },
+   {
+      0x0000, 0x76B4, 0xED68, 0x9BDC, 0xCAF1, 0xBC45, 0x2799, 0x512D, 0x85C3, 0xF377, 0x68AB, 0x1E1F,
+      0x4F32, 0x3986, 0xA25A, 0xD4EE, 0x1BA7, 0x6D13, 0xF6CF, 0x807B, 0xD156, 0xA7E2, 0x3C3E, 0x4A8A,
+      0x9E64, 0xE8D0, 0x730C, 0x05B8, 0x5495, 0x2221, 0xB9FD, 0xCF49, 0x374E, 0x41FA, 0xDA26, 0xAC92,
+      0xFDBF, 0x8B0B, 0x10D7, 0x6663, 0xB28D, 0xC439, 0x5FE5, 0x2951, 0x787C, 0x0EC8, 0x9514, 0xE3A0,
+      0x2CE9, 0x5A5D, 0xC181, 0xB735, 0xE618, 0x90AC, 0x0B70, 0x7DC4, 0xA92A, 0xDF9E, 0x4442, 0x32F6,
+      0x63DB, 0x156F, 0x8EB3, 0xF807, 0x6E9C, 0x1828, 0x83F4, 0xF540, 0xA46D, 0xD2D9, 0x4905, 0x3FB1,
+      0xEB5F, 0x9DEB, 0x0637, 0x7083, 0x21AE, 0x571A, 0xCCC6, 0xBA72, 0x753B, 0x038F, 0x9853, 0xEEE7,
+      0xBFCA, 0xC97E, 0x52A2, 0x2416, 0xF0F8, 0x864C, 0x1D90, 0x6B24, 0x3A09, 0x4CBD, 0xD761, 0xA1D5,
+      0x59D2, 0x2F66, 0xB4BA, 0xC20E, 0x9323, 0xE597, 0x7E4B, 0x08FF, 0xDC11, 0xAAA5, 0x3179, 0x47CD,
+      0x16E0, 0x6054, 0xFB88, 0x8D3C, 0x4275, 0x34C1, 0xAF1D, 0xD9A9, 0x8884, 0xFE30, 0x65EC, 0x1358,
+      0xC7B6, 0xB102, 0x2ADE, 0x5C6A, 0x0D47, 0x7BF3, 0xE02F, 0x969B, 0xDD38, 0xAB8C, 0x3050, 0x46E4,
+      0x17C9, 0x617D, 0xFAA1, 0x8C15, 0x58FB, 0x2E4F, 0xB593, 0xC327, 0x920A, 0xE4BE, 0x7F62, 0x09D6,
+      0xC69F, 0xB02B, 0x2BF7, 0x5D43, 0x0C6E, 0x7ADA, 0xE106, 0x97B2, 0x435C, 0x35E8, 0xAE34, 0xD880,
+      0x89AD, 0xFF19, 0x64C5, 0x1271, 0xEA76, 0x9CC2, 0x071E, 0x71AA, 0x2087, 0x5633, 0xCDEF, 0xBB5B,
+      0x6FB5, 0x1901, 0x82DD, 0xF469, 0xA544, 0xD3F0, 0x482C, 0x3E98, 0xF1D1, 0x8765, 0x1CB9, 0x6A0D,
+      0x3B20, 0x4D94, 0xD648, 0xA0FC, 0x7412, 0x02A6, 0x997A, 0xEFCE, 0xBEE3, 0xC857, 0x538B, 0x253F,
+      0xB3A4, 0xC510, 0x5ECC, 0x2878, 0x7955, 0x0FE1, 0x943D, 0xE289, 0x3667, 0x40D3, 0xDB0F, 0xADBB,
+      0xFC96, 0x8A22, 0x11FE, 0x674A, 0xA803, 0xDEB7, 0x456B, 0x33DF, 0x62F2, 0x1446, 0x8F9A, 0xF92E,
+      0x2DC0, 0x5B74, 0xC0A8, 0xB61C, 0xE731, 0x9185, 0x0A59, 0x7CED, 0x84EA, 0xF25E, 0x6982, 0x1F36,
+      0x4E1B, 0x38AF, 0xA373, 0xD5C7, 0x0129, 0x779D, 0xEC41, 0x9AF5, 0xCBD8, 0xBD6C, 0x26B0, 0x5004,
+      0x9F4D, 0xE9F9, 0x7225, 0x0491, 0x55BC, 0x2308, 0xB8D4, 0xCE60, 0x1A8E, 0x6C3A, 0xF7E6, 0x8152,
+      0xD07F, 0xA6CB, 0x3D17, 0x4BA3
+   },
+   {
+      0x0000, 0xAA51, 0x4483, 0xEED2, 0x8906, 0x2357, 0xCD85, 0x67D4, 0x022D, 0xA87C, 0x46AE, 0xECFF,
+      0x8B2B, 0x217A, 0xCFA8, 0x65F9, 0x045A, 0xAE0B, 0x40D9, 0xEA88, 0x8D5C, 0x270D, 0xC9DF, 0x638E,
+      0x0677, 0xAC26, 0x42F4, 0xE8A5, 0x8F71, 0x2520, 0xCBF2, 0x61A3, 0x08B4, 0xA2E5, 0x4C37, 0xE666,
+      0x81B2, 0x2BE3, 0xC531, 0x6F60, 0x0A99, 0xA0C8, 0x4E1A, 0xE44B, 0x839F, 0x29CE, 0xC71C, 0x6D4D,
+      0x0CEE, 0xA6BF, 0x486D, 0xE23C, 0x85E8, 0x2FB9, 0xC16B, 0x6B3A, 0x0EC3, 0xA492, 0x4A40, 0xE011,
+      0x87C5, 0x2D94, 0xC346, 0x6917, 0x1168, 0xBB39, 0x55EB, 0xFFBA, 0x986E, 0x323F, 0xDCED, 0x76BC,
+      0x1345, 0xB914, 0x57C6, 0xFD97, 0x9A43, 0x3012, 0xDEC0, 0x7491, 0x1532, 0xBF63, 0x51B1, 0xFBE0,
+      0x9C34, 0x3665, 0xD8B7, 0x72E6, 0x171F, 0xBD4E, 0x539C, 0xF9CD, 0x9E19, 0x3448, 0xDA9A, 0x70CB,
+      0x19DC, 0xB38D, 0x5D5F, 0xF70E, 0x90DA, 0x3A8B, 0xD459, 0x7E08, 0x1BF1, 0xB1A0, 0x5F72, 0xF523,
+      0x92F7, 0x38A6, 0xD674, 0x7C25, 0x1D86, 0xB7D7, 0x5905, 0xF354, 0x9480, 0x3ED1, 0xD003, 0x7A52,
+      0x1FAB, 0xB5FA, 0x5B28, 0xF179, 0x96AD, 0x3CFC, 0xD22E, 0x787F, 0x22D0, 0x8881, 0x6653, 0xCC02,
+      0xABD6, 0x0187, 0xEF55, 0x4504, 0x20FD, 0x8AAC, 0x647E, 0xCE2F, 0xA9FB, 0x03AA, 0xED78, 0x4729,
+      0x268A, 0x8CDB, 0x6209, 0xC858, 0xAF8C, 0x05DD, 0xEB0F, 0x415E, 0x24A7, 0x8EF6, 0x6024, 0xCA75,
+      0xADA1, 0x07F0, 0xE922, 0x4373, 0x2A64, 0x8035, 0x6EE7, 0xC4B6, 0xA362, 0x0933, 0xE7E1, 0x4DB0,
+      0x2849, 0x8218, 0x6CCA, 0xC69B, 0xA14F, 0x0B1E, 0xE5CC, 0x4F9D, 0x2E3E, 0x846F, 0x6ABD, 0xC0EC,
+      0xA738, 0x0D69, 0xE3BB, 0x49EA, 0x2C13, 0x8642, 0x6890, 0xC2C1, 0xA515, 0x0F44, 0xE196, 0x4BC7,
+      0x33B8, 0x99E9, 0x773B, 0xDD6A, 0xBABE, 0x10EF, 0xFE3D, 0x546C, 0x3195, 0x9BC4, 0x7516, 0xDF47,
+      0xB893, 0x12C2, 0xFC10, 0x5641, 0x37E2, 0x9DB3, 0x7361, 0xD930, 0xBEE4, 0x14B5, 0xFA67, 0x5036,
+      0x35CF, 0x9F9E, 0x714C, 0xDB1D, 0xBCC9, 0x1698, 0xF84A, 0x521B, 0x3B0C, 0x915D, 0x7F8F, 0xD5DE,
+      0xB20A, 0x185B, 0xF689, 0x5CD8, 0x3921, 0x9370, 0x7DA2, 0xD7F3, 0xB027, 0x1A76, 0xF4A4, 0x5EF5,
+      0x3F56, 0x9507, 0x7BD5, 0xD184, 0xB650, 0x1C01, 0xF2D3, 0x5882, 0x3D7B, 0x972A, 0x79F8, 0xD3A9,
+      0xB47D, 0x1E2C, 0xF0FE, 0x5AAF
+   },
+   {
+      0x0000, 0x45A0, 0x8B40, 0xCEE0, 0x06A1, 0x4301, 0x8DE1, 0xC841, 0x0D42, 0x48E2, 0x8602, 0xC3A2,
+      0x0BE3, 0x4E43, 0x80A3, 0xC503, 0x1A84, 0x5F24, 0x91C4, 0xD464, 0x1C25, 0x5985, 0x9765, 0xD2C5,
+      0x17C6, 0x5266, 0x9C86, 0xD926, 0x1167, 0x54C7, 0x9A27, 0xDF87, 0x3508, 0x70A8, 0xBE48, 0xFBE8,
+      0x33A9, 0x7609, 0xB8E9, 0xFD49, 0x384A, 0x7DEA, 0xB30A, 0xF6AA, 0x3EEB, 0x7B4B, 0xB5AB, 0xF00B,
+      0x2F8C, 0x6A2C, 0xA4CC, 0xE16C, 0x292D, 0x6C8D, 0xA26D, 0xE7CD, 0x22CE, 0x676E, 0xA98E, 0xEC2E,
+      0x246F, 0x61CF, 0xAF2F, 0xEA8F, 0x6A10, 0x2FB0, 0xE150, 0xA4F0, 0x6CB1, 0x2911, 0xE7F1, 0xA251,
+      0x6752, 0x22F2, 0xEC12, 0xA9B2, 0x61F3, 0x2453, 0xEAB3, 0xAF13, 0x7094, 0x3534, 0xFBD4, 0xBE74,
+      0x7635, 0x3395, 0xFD75, 0xB8D5, 0x7DD6, 0x3876, 0xF696, 0xB336, 0x7B77, 0x3ED7, 0xF037, 0xB597,
+      0x5F18, 0x1AB8, 0xD458, 0x91F8, 0x59B9, 0x1C19, 0xD2F9, 0x9759, 0x525A, 0x17FA, 0xD91A, 0x9CBA,
+      0x54FB, 0x115B, 0xDFBB, 0x9A1B, 0x459C, 0x003C, 0xCEDC, 0x8B7C, 0x433D, 0x069D, 0xC87D, 0x8DDD,
+      0x48DE, 0x0D7E, 0xC39E, 0x863E, 0x4E7F, 0x0BDF, 0xC53F, 0x809F, 0xD420, 0x9180, 0x5F60, 0x1AC0,
+      0xD281, 0x9721, 0x59C1, 0x1C61, 0xD962, 0x9CC2, 0x5222, 0x1782, 0xDFC3, 0x9A63, 0x5483, 0x1123,
+      0xCEA4, 0x8B04, 0x45E4, 0x0044, 0xC805, 0x8DA5, 0x4345, 0x06E5, 0xC3E6, 0x8646, 0x48A6, 0x0D06,
+      0xC547, 0x80E7, 0x4E07, 0x0BA7, 0xE128, 0xA488, 0x6A68, 0x2FC8, 0xE789, 0xA229, 0x6CC9, 0x2969,
+      0xEC6A, 0xA9CA, 0x672A, 0x228A, 0xEACB, 0xAF6B, 0x618B, 0x242B, 0xFBAC, 0xBE0C, 0x70EC, 0x354C,
+      0xFD0D, 0xB8AD, 0x764D, 0x33ED, 0xF6EE, 0xB34E, 0x7DAE, 0x380E, 0xF04F, 0xB5EF, 0x7B0F, 0x3EAF,
+      0xBE30, 0xFB90, 0x3570, 0x70D0, 0xB891, 0xFD31, 0x33D1, 0x7671, 0xB372, 0xF6D2, 0x3832, 0x7D92,
+      0xB5D3, 0xF073, 0x3E93, 0x7B33, 0xA4B4, 0xE114, 0x2FF4, 0x6A54, 0xA215, 0xE7B5, 0x2955, 0x6CF5,
+      0xA9F6, 0xEC56, 0x22B6, 0x6716, 0xAF57, 0xEAF7, 0x2417, 0x61B7, 0x8B38, 0xCE98, 0x0078, 0x45D8,
+      0x8D99, 0xC839, 0x06D9, 0x4379, 0x867A, 0xC3DA, 0x0D3A, 0x489A, 0x80DB, 0xC57B, 0x0B9B, 0x4E3B,
+      0x91BC, 0xD41C, 0x1AFC, 0x5F5C, 0x971D, 0xD2BD, 0x1C5D, 0x59FD, 0x9CFE, 0xD95E, 0x17BE, 0x521E,
+      0x9A5F, 0xDFFF, 0x111F, 0x54BF
+   },
+   {
+      0x0000, 0xB861, 0x60E3, 0xD882, 0xC1C6, 0x79A7, 0xA125, 0x1944, 0x93AD, 0x2BCC, 0xF34E, 0x4B2F,
+      0x526B, 0xEA0A, 0x3288, 0x8AE9, 0x377B, 0x8F1A, 0x5798, 0xEFF9, 0xF6BD, 0x4EDC, 0x965E, 0x2E3F,
+      0xA4D6, 0x1CB7, 0xC435, 0x7C54, 0x6510, 0xDD71, 0x05F3, 0xBD92, 0x6EF6, 0xD697, 0x0E15, 0xB674,
+      0xAF30, 0x1751, 0xCFD3, 0x77B2, 0xFD5B, 0x453A, 0x9DB8, 0x25D9, 0x3C9D, 0x84FC, 0x5C7E, 0xE41F,
+      0x598D, 0xE1EC, 0x396E, 0x810F, 0x984B, 0x202A, 0xF8A8, 0x40C9, 0xCA20, 0x7241, 0xAAC3, 0x12A2,
+      0x0BE6, 0xB387, 0x6B05, 0xD364, 0xDDEC, 0x658D, 0xBD0F, 0x056E, 0x1C2A, 0xA44B, 0x7CC9, 0xC4A8,
+      0x4E41, 0xF620, 0x2EA2, 0x96C3, 0x8F87, 0x37E6, 0xEF64, 0x5705, 0xEA97, 0x52F6, 0x8A74, 0x3215,
+      0x2B51, 0x9330, 0x4BB2, 0xF3D3, 0x793A, 0xC15B, 0x19D9, 0xA1B8, 0xB8FC, 0x009D, 0xD81F, 0x607E,
+      0xB31A, 0x0B7B, 0xD3F9, 0x6B98, 0x72DC, 0xCABD, 0x123F, 0xAA5E, 0x20B7, 0x98D6, 0x4054, 0xF835,
+      0xE171, 0x5910, 0x8192, 0x39F3, 0x8461, 0x3C00, 0xE482, 0x5CE3, 0x45A7, 0xFDC6, 0x2544, 0x9D25,
+      0x17CC, 0xAFAD, 0x772F, 0xCF4E, 0xD60A, 0x6E6B, 0xB6E9, 0x0E88, 0xABF9, 0x1398, 0xCB1A, 0x737B,
+      0x6A3F, 0xD25E, 0x0ADC, 0xB2BD, 0x3854, 0x8035, 0x58B7, 0xE0D6, 0xF992, 0x41F3, 0x9971, 0x2110,
+      0x9C82, 0x24E3, 0xFC61, 0x4400, 0x5D44, 0xE525, 0x3DA7, 0x85C6, 0x0F2F, 0xB74E, 0x6FCC, 0xD7AD,
+      0xCEE9, 0x7688, 0xAE0A, 0x166B, 0xC50F, 0x7D6E, 0xA5EC, 0x1D8D, 0x04C9, 0xBCA8, 0x642A, 0xDC4B,
+      0x56A2, 0xEEC3, 0x3641, 0x8E20, 0x9764, 0x2F05, 0xF787, 0x4FE6, 0xF274, 0x4A15, 0x9297, 0x2AF6,
+      0x33B2, 0x8BD3, 0x5351, 0xEB30, 0x61D9, 0xD9B8, 0x013A, 0xB95B, 0xA01F, 0x187E, 0xC0FC, 0x789D,
+      0x7615, 0xCE74, 0x16F6, 0xAE97, 0xB7D3, 0x0FB2, 0xD730, 0x6F51, 0xE5B8, 0x5DD9, 0x855B, 0x3D3A,
+      0x247E, 0x9C1F, 0x449D, 0xFCFC, 0x416E, 0xF90F, 0x218D, 0x99EC, 0x80A8, 0x38C9, 0xE04B, 0x582A,
+      0xD2C3, 0x6AA2, 0xB220, 0x0A41, 0x1305, 0xAB64, 0x73E6, 0xCB87, 0x18E3, 0xA082, 0x7800, 0xC061,
+      0xD925, 0x6144, 0xB9C6, 0x01A7, 0x8B4E, 0x332F, 0xEBAD, 0x53CC, 0x4A88, 0xF2E9, 0x2A6B, 0x920A,
+      0x2F98, 0x97F9, 0x4F7B, 0xF71A, 0xEE5E, 0x563F, 0x8EBD, 0x36DC, 0xBC35, 0x0454, 0xDCD6, 0x64B7,
+      0x7DF3, 0xC592, 0x1D10, 0xA571
+   },
+   {
+      0x0000, 0x47D3, 0x8FA6, 0xC875, 0x0F6D, 0x48BE, 0x80CB, 0xC718, 0x1EDA, 0x5909, 0x917C, 0xD6AF,
+      0x11B7, 0x5664, 0x9E11, 0xD9C2, 0x3DB4, 0x7A67, 0xB212, 0xF5C1, 0x32D9, 0x750A, 0xBD7F, 0xFAAC,
+      0x236E, 0x64BD, 0xACC8, 0xEB1B, 0x2C03, 0x6BD0, 0xA3A5, 0xE476, 0x7B68, 0x3CBB, 0xF4CE, 0xB31D,
+      0x7405, 0x33D6, 0xFBA3, 0xBC70, 0x65B2, 0x2261, 0xEA14, 0xADC7, 0x6ADF, 0x2D0C, 0xE579, 0xA2AA,
+      0x46DC, 0x010F, 0xC97A, 0x8EA9, 0x49B1, 0x0E62, 0xC617, 0x81C4, 0x5806, 0x1FD5, 0xD7A0, 0x9073,
+      0x576B, 0x10B8, 0xD8CD, 0x9F1E, 0xF6D0, 0xB103, 0x7976, 0x3EA5, 0xF9BD, 0xBE6E, 0x761B, 0x31C8,
+      0xE80A, 0xAFD9, 0x67AC, 0x207F, 0xE767, 0xA0B4, 0x68C1, 0x2F12, 0xCB64, 0x8CB7, 0x44C2, 0x0311,
+      0xC409, 0x83DA, 0x4BAF, 0x0C7C, 0xD5BE, 0x926D, 0x5A18, 0x1DCB, 0xDAD3, 0x9D00, 0x5575, 0x12A6,
+      0x8DB8, 0xCA6B, 0x021E, 0x45CD, 0x82D5, 0xC506, 0x0D73, 0x4AA0, 0x9362, 0xD4B1, 0x1CC4, 0x5B17,
+      0x9C0F, 0xDBDC, 0x13A9, 0x547A, 0xB00C, 0xF7DF, 0x3FAA, 0x7879, 0xBF61, 0xF8B2, 0x30C7, 0x7714,
+      0xAED6, 0xE905, 0x2170, 0x66A3, 0xA1BB, 0xE668, 0x2E1D, 0x69CE, 0xFD81, 0xBA52, 0x7227, 0x35F4,
+      0xF2EC, 0xB53F, 0x7D4A, 0x3A99, 0xE35B, 0xA488, 0x6CFD, 0x2B2E, 0xEC36, 0xABE5, 0x6390, 0x2443,
+      0xC035, 0x87E6, 0x4F93, 0x0840, 0xCF58, 0x888B, 0x40FE, 0x072D, 0xDEEF, 0x993C, 0x5149, 0x169A,
+      0xD182, 0x9651, 0x5E24, 0x19F7, 0x86E9, 0xC13A, 0x094F, 0x4E9C, 0x8984, 0xCE57, 0x0622, 0x41F1,
+      0x9833, 0xDFE0, 0x1795, 0x5046, 0x975E, 0xD08D, 0x18F8, 0x5F2B, 0xBB5D, 0xFC8E, 0x34FB, 0x7328,
+      0xB430, 0xF3E3, 0x3B96, 0x7C45, 0xA587, 0xE254, 0x2A21, 0x6DF2, 0xAAEA, 0xED39, 0x254C, 0x629F,
+      0x0B51, 0x4C82, 0x84F7, 0xC324, 0x043C, 0x43EF, 0x8B9A, 0xCC49, 0x158B, 0x5258, 0x9A2D, 0xDDFE,
+      0x1AE6, 0x5D35, 0x9540, 0xD293, 0x36E5, 0x7136, 0xB943, 0xFE90, 0x3988, 0x7E5B, 0xB62E, 0xF1FD,
+      0x283F, 0x6FEC, 0xA799, 0xE04A, 0x2752, 0x6081, 0xA8F4, 0xEF27, 0x7039, 0x37EA, 0xFF9F, 0xB84C,
+      0x7F54, 0x3887, 0xF0F2, 0xB721, 0x6EE3, 0x2930, 0xE145, 0xA696, 0x618E, 0x265D, 0xEE28, 0xA9FB,
+      0x4D8D, 0x0A5E, 0xC22B, 0x85F8, 0x42E0, 0x0533, 0xCD46, 0x8A95, 0x5357, 0x1484, 0xDCF1, 0x9B22,
+      0x5C3A, 0x1BE9, 0xD39C, 0x944F
+   }
+};
+
 /** 
    Calculates CRC-7 used by SD card to check if received commands are correct.
    
@@ -778,9 +1466,48 @@ void interpret_r7_response (byte *response, byte *r1, dword *ocr)
 */
 byte crc_7 (byte *data, int count)
 {
-   /* G(x)=x^7+x^3+1*/
-   const dword poly = (1 << 7) + (1 << 3) + 1;
-   return (byte)crc (data, count, poly);
+   return crc_7_final (crc_7_update (crc_7_init (), data, count));
+}
+
+/**
+   Returns the initial value of an incremental CRC-7 calculation.
+   
+   @return initial CRC-7 value
+*/
+byte crc_7_init (void)
+{
+   return 0x00;
+}
+
+/**
+   Updates an incremental CRC-7 calculation with more data.
+   
+   @param crc current CRC-7 value
+   @param data byte array
+   @param count size of data
+   
+   @return updated CRC-7 value
+*/
+byte crc_7_update (byte crc, byte *data, int count)
+{
+   int i;
+   
+   for (i = 0; i < count; i++)
+      crc = crc7_table[(byte)(crc << 1) ^ data[i]];
+   
+   return crc;
+}
+
+/**
+   Completes an incremental CRC-7 calculation.
+   
+   @param crc current CRC-7 value
+   
+   @return calculated CRC-7 byte
+*/
+byte crc_7_final (byte crc)
+{
+   return crc & 0x7F;
 }
 
 /** 
@@ -793,14 +1520,67 @@ byte crc_7 (byte *data, int count)
 */
 word crc_16 (byte *data, int count)
 {
-   /* G(x)=x^16+x^12+x^5+1 */
-   const dword poly = (1 << 16) + (1 << 12) + (1 << 5) + 1;
-   return (word)crc (data, count, poly);
+   return crc_16_final (crc_16_update (crc_16_init (), data, count));
 }
 
 /**
-   Auxiliary function used to calculate a non-specified CRC using a custom polynomial.
-   Polynomial must not exceed 32-bit value.
+   Returns the initial value of an incremental CRC-16 calculation.
+   
+   @return initial CRC-16 value
+*/
+word crc_16_init (void)
+{
+   return 0x0000;
+}
+
+/**
+   Updates an incremental CRC-16 calculation with more data. 
+   <br>Data is processed 8 bytes at a time (slice-by-8), then one byte at a time.
+   
+   @param crc current CRC-16 value
+   @param data byte array
+   @param count size of data
+   
+   @return updated CRC-16 value
+*/
+word crc_16_update (word crc, byte *data, int count)
+{
+   while (count >= 8)
+   {
+      crc = crc16_table[7][(crc >> 8) ^ data[0]] ^ 
+            crc16_table[6][(crc & 0xFF) ^ data[1]] ^
+            crc16_table[5][data[2]] ^
+            crc16_table[4][data[3]] ^
+            crc16_table[3][data[4]] ^
+            crc16_table[2][data[5]] ^
+            crc16_table[1][data[6]] ^
+            crc16_table[0][data[7]];
+      
+      data += 8;
+      count -= 8;
+   }
+   
+   while (count-- > 0)
+      crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data++];
+   
+   return crc;
+}
+
+/**
+   Completes an incremental CRC-16 calculation.
+   
+   @param crc current CRC-16 value
+   
+   @return calculated CRC-16 word
+*/
+word crc_16_final (word crc)
+{
+   return crc;
+}
+
+/**
+   Auxiliary function used to calculate a non-specified CRC using a custom polynomial (bit by bit, 
+   most significant bit first). Polynomial must not exceed 32-bit value.
    
    @param data byte array
    @param count size of data
@@ -811,124 +1591,192 @@ word crc_16 (byte *data, int count)
 dword crc (byte *data, int count, dword poly)
 {
    const int BITS_DWORD = 8 * sizeof (dword);
-   const int bits = count * 8 * sizeof (byte);
    
-   int i, count_dword;              /* other */
-   int start_bit, cur_length;       /* data preparation */
-   int digits;                      /* division */
-   
-   dword *array;
-   dword crc;
+   int i, bit, degree;
+   dword mask, crc;
    
    /* get maximum power of 2 in polynomial */
-   i = BITS_DWORD - 1;
-   while (GETBIT (poly, i) == 0)
-      i--;
-
-   const int POLY_BITS = i + 1;
-   const int TOTAL_BITS = bits + i;
-
-   /* prepare dword array for M(x) * x^k */  
-   count_dword = TOTAL_BITS / BITS_DWORD;
-   if (TOTAL_BITS % BITS_DWORD)
-      count_dword += 1;
-
-   array = (dword *)malloc (sizeof (dword) * count_dword);    
-   memset (array, 0, sizeof (dword) * count_dword);           /* init to 0 */
+   degree = BITS_DWORD - 1;
+   while (degree > 0 && ((poly >> degree) & 1) == 0)
+      degree--;
+   
+   if (degree == 0)
+      return 0;
    
-   /* copy bytes in dword array */
-   start_bit = 0;
-   i = count_dword - 1;
-   while (start_bit < bits)
+   mask = ((dword)1 << degree) - 1;
+   poly &= mask;
+   
+   /* shift message through the register: M(x) * x^k mod G(x) */
+   crc = 0;
+   for (i = 0; i < count; i++)
    {
-      if ((cur_length = (bits - start_bit)) >= BITS_DWORD)
-         cur_length = BITS_DWORD;
-
-      array[i] = get_bits (data, count, start_bit, cur_length);
-      start_bit += cur_length;
-      i--;
+      for (bit = 7; bit >= 0; bit--)
+      {
+         if (((crc >> (degree - 1)) & 1) ^ ((data[i] >> bit) & 1))
+            crc = ((crc << 1) & mask) ^ poly;
+         else
+            crc = (crc << 1) & mask;
+      }
    }
+   
+   return crc;
+}
 
-   /* do M(x) * x^k */
-   for (i = 0; i < (POLY_BITS - 1); i++)
-      l_shift (array, count_dword);
+/**
+   Decodes a raw CID register into a sd_cid structure.
+   
+   @param raw CID register (16 bytes, as sent by the card)
+   @param cid pointer to struct sd_cid
+*/
+void sd_parse_cid (byte *raw, struct sd_cid *cid)
+{
+   struct sd_register reg;
    
-   /* prepare for division */
+   sd_register_load (&reg, raw);
+   memcpy (cid->raw, raw, 16);
    
-   /* align polynomial */
-   while (GETBIT (poly, (BITS_DWORD - 1)) == 0)
-      poly <<= 1;
+   cid->MID    = sd_field (&reg, CID_MID);
+   cid->OID[0] = sd_field (&reg, CID_OID_0);
+   cid->OID[1] = sd_field (&reg, CID_OID_1);
+   cid->OID[2] = '\0';
+   cid->PNM[0] = sd_field (&reg, CID_PNM_0);
+   cid->PNM[1] = sd_field (&reg, CID_PNM_1);
+   cid->PNM[2] = sd_field (&reg, CID_PNM_2);
+   cid->PNM[3] = sd_field (&reg, CID_PNM_3);
+   cid->PNM[4] = sd_field (&reg, CID_PNM_4);
+   cid->PNM[5] = '\0';
+   cid->PRV    = sd_field (&reg, CID_PRV);
+   cid->PSN    = sd_field (&reg, CID_PSN);
+   cid->MDT    = sd_field (&reg, CID_MDT);
+   cid->CRC    = sd_field (&reg, CID_CRC);
+   
+   return;
+}
 
+/**
+   Decodes a raw CSD register (version 1.0 or 2.0) into a sd_csd structure.
    
-   /* init to number of total bits in dword representation */
-   digits = BITS_DWORD * count_dword;                
-   do 
+   @param raw CSD register (16 bytes, as sent by the card)
+   @param csd pointer to struct sd_csd
+*/
+void sd_parse_csd (byte *raw, struct sd_csd *csd)
+{
+   struct sd_register reg;
+   
+   sd_register_load (&reg, raw);
+   memcpy (csd->raw, raw, 16);
+   
+   csd->CSD_STRUCTURE      = sd_field (&reg, CSD_CSD_STRUCTURE);
+   csd->TAAC               = sd_field (&reg, CSD_TAAC);
+   csd->NSAC               = sd_field (&reg, CSD_NSAC);
+   csd->TRAN_SPEED         = sd_field (&reg, CSD_TRAN_SPEED);
+   csd->CCC                = sd_field (&reg, CSD_CCC);
+   csd->READ_BL_LEN        = sd_field (&reg, CSD_READ_BL_LEN);
+   csd->READ_BL_PARTIAL    = sd_field (&reg, CSD_READ_BL_PARTIAL);
+   csd->WRITE_BLK_MISALIGN = sd_field (&reg, CSD_WRITE_BLK_MISALIGN);
+   csd->READ_BLK_MISALIGN  = sd_field (&reg, CSD_READ_BLK_MISALIGN);
+   csd->DSR_IMP            = sd_field (&reg, CSD_DSR_IMP);
+   if (csd->CSD_STRUCTURE == 0)
    {
-      /* subtract polynomial if possible */
-      if (GETBIT (array[0], (BITS_DWORD - 1)) != 0)
-         array[0] ^= poly;
-      
-      /* align number */
-      l_shift (array, count_dword);
-      digits--;
-   } while (digits >= POLY_BITS);               /* exit if message cannot not be divided anymore */
-  
-   crc = array[0] >> (BITS_DWORD - (POLY_BITS - 1));
-   free (array);
+      csd->C_SIZE          = sd_field (&reg, CSD_V1_C_SIZE);
+      csd->VDD_R_CURR_MIN  = sd_field (&reg, CSD_V1_VDD_R_CURR_MIN);
+      csd->VDD_R_CURR_MAX  = sd_field (&reg, CSD_V1_VDD_R_CURR_MAX);
+      csd->VDD_W_CURR_MIN  = sd_field (&reg, CSD_V1_VDD_W_CURR_MIN);
+      csd->VDD_W_CURR_MAX  = sd_field (&reg, CSD_V1_VDD_W_CURR_MAX);
+      csd->C_SIZE_MULT     = sd_field (&reg, CSD_V1_C_SIZE_MULT);
+   }
+   else
+   {
+      csd->C_SIZE          = sd_field (&reg, CSD_V2_C_SIZE);
+   }
+   csd->ERASE_BLK_EN       = sd_field (&reg, CSD_ERASE_BLK_EN);
+   csd->SECTOR_SIZE        = sd_field (&reg, CSD_SECTOR_SIZE);
+   csd->WP_GRP_SIZE        = sd_field (&reg, CSD_WP_GRP_SIZE);
+   csd->WP_GRP_ENABLE      = sd_field (&reg, CSD_WP_GRP_ENABLE);
+   csd->R2W_FACTOR         = sd_field (&reg, CSD_R2W_FACTOR);
+   csd->WRITE_BL_LEN       = sd_field (&reg, CSD_WRITE_BL_LEN);
+   csd->WRITE_BL_PARTIAL   = sd_field (&reg, CSD_WRITE_BL_PARTIAL);
+   csd->FILE_FORMAT_GRP    = sd_field (&reg, CSD_FILE_FORMAT_GRP);
+   csd->COPY               = sd_field (&reg, CSD_COPY);
+   csd->PERM_WRITE_PROTECT = sd_field (&reg, CSD_PERM_WRITE_PROTECT);
+   csd->TMP_WRITE_PROTECT  = sd_field (&reg, CSD_TMP_WRITE_PROTECT);
+   csd->FILE_FORMAT        = sd_field (&reg, CSD_FILE_FORMAT);
+   csd->CRC                = sd_field (&reg, CSD_CRC);
    
-   return crc;
+   return;
 }
 
 /**
-   Auxiliary function used by crc to left shift by one position an array of bytes.
+   Loads a 128-bit register (CID, CSD), sent most significant byte first, into two 64-bit words.
    
-   @param data byte array
-   @param count size of data
+   @param reg pointer to struct sd_register
+   @param raw register (16 bytes)
 */
-void l_shift (dword *data, int count)
+void sd_register_load (struct sd_register *reg, byte *raw)
 {
    int i;
    
-   /* bitwise right shift array of 1 position */
-   for (i = 0; i < count - 1; i++)
+   reg->hi = 0;
+   reg->lo = 0;
+   
+   for (i = 0; i < 8; i++)
    {
-      data[i] <<= 1;
-      data[i] |= (data[i + 1] >> ((8 * sizeof (dword)) - 1));
+      reg->hi = (reg->hi << 8) | raw[i];
+      reg->lo = (reg->lo << 8) | raw[i + 8];
    }
    
-   data[count - 1] <<= 1;
-   
    return;
 }
 
 /**
-   Auxiliary function used by sd_get_cid and sd_get_csd to retrieve data from an array of bytes 
-   starting from any bit inside the array.
+   Retrieves a field (at most 32 bits long) from a 128-bit register loaded by sd_register_load.
+   
+   @param reg pointer to struct sd_register
+   @param start_bit starting bit (bit 0 is the least significant bit of the register)
+   @param length length in bit of data to be retrieved
+
+   @return retrieved data
+*/
+dword sd_register_bits (struct sd_register *reg, int start_bit, int length)
+{
+   qword bits;
+   
+   if (start_bit >= 64)
+      bits = reg->hi >> (start_bit - 64);
+   else if (start_bit == 0)
+      bits = reg->lo;
+   else
+      bits = (reg->lo >> start_bit) | (reg->hi << (64 - start_bit));    /* field may span both words */
+   
+   return (dword)(bits & (((qword)1 << length) - 1));
+}
+
+/**
+   Auxiliary function used to retrieve data (at most 32 bits long) from an array of bytes, 
+   starting from any bit inside the array. Array is sent most significant byte first.
    
    @param data byte array
    @param size size of data
-   @param start_bit starting bit
+   @param start_bit starting bit (bit 0 is the least significant bit of the last byte)
    @param length length in bit of data to be retrieved
 
    @return retrieved data
 */
 dword get_bits (byte *data, int size, int start_bit, int length)
 {
-   int i, bit, last_bit, bit_in_dword, bit_in_byte;
-   dword res = 0x00000000;
-
-   last_bit = start_bit + length;
-
-   bit_in_dword = 0;
-   for (bit = start_bit; bit < last_bit; bit++)
-   {
-      i = (size - 1) - bit / (8 * sizeof (byte));
-      bit_in_byte = bit % (8 * sizeof (byte));
-      
-      SETBIT (res, bit_in_dword, GETBIT (data[i], bit_in_byte));
-
-      bit_in_dword++;
-   }
+   int i, first, last;
+   qword bits;
    
-   return res;
-}
\ No newline at end of file
+   if (length <= 0)
+      return 0;
+   
+   /* bytes holding the field, most significant first */
+   first = (size - 1) - (start_bit + length - 1) / 8;
+   last = (size - 1) - start_bit / 8;
+   
+   bits = 0;
+   for (i = first; i <= last; i++)
+      bits = (bits << 8) | data[i];
+   
+   return (dword)((bits >> (start_bit % 8)) & (((qword)1 << length) - 1));
+}
@@ -25,6 +25,45 @@
 #define CMD58   (0x40+58)   /* READ_OCR */
 /**@} */
 
+/**
+   @defgroup DEF_SD_DATA Data blocks
+   @{
+*/
+#define SD_BLOCK_LENGTH      512       /* data block length */
+#define SD_CRC_ERROR         -2        /* returned when CRC of a data block is incorrect */
+#define SD_CRC_RETRIES       3         /* attempts allowed by sd_crc_hook_retry */
+#define SD_CRC_STREAM_LENGTH 4096      /* blocks larger than this are checked while being streamed */
+#define SD_READ_GAP_LENGTH   8         /* expected 0xFF bytes between blocks of a multiple block read */
+#define SD_READ_TOKEN_TIMEOUT (1 << 20)   /* maximum 0xFF bytes before a data token */
+#define SD_READ_MAX_BAD_BLOCKS 64      /* maximum blocks with CRC errors in a multiple block read */
+#define SD_WRITE_POLL_LENGTH 64        /* bytes read at a time while polling busy state from host side */
+#define SD_WRITE_TIMEOUT     0.5       /* maximum busy time after a block has been written, in seconds */
+#define SD_READY_TIMEOUT     0.5       /* maximum time waited for card to be ready before a command, in seconds */
+#define SD_INIT_FREQUENCY    400e3     /* maximum SCLK frequency until card is initialised, in Hz */
+#define SD_MAX_FREQUENCY     25e6      /* maximum SCLK frequency of default speed mode, in Hz */
+
+/* block address for CMD17/CMD18/CMD24/CMD25: byte address unless card is SD ver. 2 (block address) */
+#define sd_block_address(sd_version, block)    (((sd_version) == 3) ? (block) : (block) * SD_BLOCK_LENGTH)
+/**@} */
+
+/* Called when a data block is received with an incorrect CRC, returns non-zero to retry */
+typedef int (*sd_crc_hook) (struct ftdi_context *ftdi, struct spi_context *spi, dword block, int attempt, void *user);
+
+/* Multiple block read parser state, see sd_read_blocks_cb */
+struct sd_block_reader
+{
+   byte *data;                            /* destination of block payloads */
+   int count;                             /* number of blocks to read */
+   int done;                              /* number of blocks received */
+   int pos;                               /* position in current block (payload + crc), -1 if waiting for token */
+   int idle;                              /* 0xFF bytes received while waiting for token */
+   word crc;                              /* crc of current block payload */
+   word rx_crc;                           /* received crc of current block */
+   int status;                            /* 1 if no error, otherwise sd_read_blocks return value */
+   int bad[SD_READ_MAX_BAD_BLOCKS];       /* blocks (relative to first) received with incorrect crc */
+   int bad_count;
+};
+
 /* Registers data structure */
 
 /**
@@ -53,6 +92,18 @@
 #define TOK_RSVD      0xE0  /* reserved, must be 0 */
 /**@} */
 
+/**
+   @defgroup DEF_SD_DATARESP Data tokens and data response structure
+   @{
+*/
+#define START_BLOCK_MULTI 0xFC  /* Start token of a multiple block write */
+#define STOP_TRAN         0xFD  /* Stop token of a multiple block write */
+#define DATA_RESP_MASK    0x1F  /* Data response status bits */
+#define DATA_ACCEPTED     0x05  /* Data accepted */
+#define DATA_CRC_ERR      0x0B  /* Data rejected due to a CRC error */
+#define DATA_WRITE_ERR    0x0D  /* Data rejected due to a write error */
+/**@} */
+
 /**
    @defgroup DEF_SD_OCR OCR register structure
    @{
@@ -63,6 +114,69 @@
 #define CARD_BUSY        0x80000000 /* Card power up status bit (busy) */
 /**@} */
 
+/**
+   @defgroup DEF_SD_CID_FIELDS CID register fields (start bit, length), see sd_field
+   @{
+*/
+#define CID_MID                  120, 8    /* Manufacturer ID */
+#define CID_OID_0                112, 8    /* OEM/Application ID (first character) */
+#define CID_OID_1                104, 8    /* OEM/Application ID (second character) */
+#define CID_PNM_0                 96, 8    /* Product name (first character) */
+#define CID_PNM_1                 88, 8
+#define CID_PNM_2                 80, 8
+#define CID_PNM_3                 72, 8
+#define CID_PNM_4                 64, 8
+#define CID_PRV                   56, 8    /* Product revision */
+#define CID_PSN                   24, 32   /* Product serial number */
+#define CID_MDT                    8, 12   /* Manufacturing date */
+#define CID_CRC                    1, 7    /* CRC7 checksum */
+/**@} */
+
+/**
+   @defgroup DEF_SD_CSD_FIELDS CSD register fields (start bit, length), see sd_field
+   @{
+*/
+#define CSD_CSD_STRUCTURE        126, 2
+#define CSD_TAAC                 112, 8
+#define CSD_NSAC                 104, 8
+#define CSD_TRAN_SPEED            96, 8
+#define CSD_CCC                   84, 12
+#define CSD_READ_BL_LEN           80, 4
+#define CSD_READ_BL_PARTIAL       79, 1
+#define CSD_WRITE_BLK_MISALIGN    78, 1
+#define CSD_READ_BLK_MISALIGN     77, 1
+#define CSD_DSR_IMP               76, 1
+#define CSD_V1_C_SIZE             62, 12   /* CSD version 1.0 only */
+#define CSD_V1_VDD_R_CURR_MIN     59, 3
+#define CSD_V1_VDD_R_CURR_MAX     56, 3
+#define CSD_V1_VDD_W_CURR_MIN     53, 3
+#define CSD_V1_VDD_W_CURR_MAX     50, 3
+#define CSD_V1_C_SIZE_MULT        47, 3
+#define CSD_V2_C_SIZE             48, 22   /* CSD version 2.0 only */
+#define CSD_ERASE_BLK_EN          46, 1
+#define CSD_SECTOR_SIZE           39, 7
+#define CSD_WP_GRP_SIZE           32, 7
+#define CSD_WP_GRP_ENABLE         31, 1
+#define CSD_R2W_FACTOR            26, 3
+#define CSD_WRITE_BL_LEN          22, 4
+#define CSD_WRITE_BL_PARTIAL      21, 1
+#define CSD_FILE_FORMAT_GRP       15, 1
+#define CSD_COPY                  14, 1
+#define CSD_PERM_WRITE_PROTECT    13, 1
+#define CSD_TMP_WRITE_PROTECT     12, 1
+#define CSD_FILE_FORMAT           10, 2
+#define CSD_CRC                    1, 7
+/**@} */
+
+/* Retrieves field (one of CID_* or CSD_*) from a register loaded by sd_register_load */
+#define sd_field(reg, field)     sd_register_bits (reg, field)
+
+/* 128-bit register: bits 127..64 in hi, bits 63..0 in lo */
+struct sd_register
+{
+   qword hi;
+   qword lo;
+};
 
 struct sd_cid
 {
@@ -143,7 +257,8 @@ static const char   taac_timeunit[3]   = {'n', 'u', 'm'};
 static const double tran_timevalue[16] = {0, 1.0, 1.2, 1.3, 1.5, 2.0, 2.5, 3.0, 3.5, 4.0, 4.5, 5.0, 5.5, 6.0, 7.0, 8.0};
 static const int    tran_timemult[4]   = {100, 1, 10, 100};
 #define sd_csd_transfer_speed_unit(csd)        ((((csd).TRAN_SPEED & 0b00000111) == 0) ? 'k' : 'M')
-#define sd_csd_transfer_speed_value(csd)       (tran_timevalue[((csd).TRAN_SPEED & 0b000111000) >> 3] * tran_timemult[((csd).TRAN_SPEED & 0b00000111) & 0x03])
+#define sd_csd_transfer_speed_value(csd)       (tran_timevalue[((csd).TRAN_SPEED & 0b01111000) >> 3] * tran_timemult[((csd).TRAN_SPEED & 0b00000111) & 0x03])
+#define sd_csd_transfer_speed_hz(csd)          (sd_csd_transfer_speed_value (csd) * ((sd_csd_transfer_speed_unit (csd) == 'k') ? 1e3 : 1e6))
 
 #define sd_csd_read_block_length(csd)          (((csd).READ_BL_LEN > 8 && (csd).READ_BL_LEN < 12) ? (1 << (csd).READ_BL_LEN) : 0)
 #define sd_csd_write_block_length(csd)         (((csd).WRITE_BL_LEN > 8 && (csd).WRITE_BL_LEN < 12) ? (1 << (csd).WRITE_BL_LEN) : 0)
@@ -172,14 +287,15 @@ static const char file_type[5][128] = { "Hard disk-like file system with partiti
 #define sd_csd_file_format(csd)                (((csd).FILE_FORMAT_GRP == 0) ? file_type[(csd).FILE_FORMAT] : file_type[4])
 /**@} */
 
-void sd_init (struct ftdi_context *ftdi, struct spi_context *spi);
-void sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout);
+int sd_init (struct ftdi_context *ftdi, struct spi_context *spi);
+int sd_reset (struct ftdi_context *ftdi, struct spi_context *spi, int timeout);
 int sd_recognize (struct ftdi_context *ftdi, struct spi_context *spi, int timeout);
 time_t time_sync (void);
 
 int sd_get_ocr (struct ftdi_context *ftdi, struct spi_context *spi, dword *ocr);
 int sd_get_cid (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_cid *cid);
 int sd_get_csd (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_csd *csd);
+int sd_set_transfer_speed (struct ftdi_context *ftdi, struct spi_context *spi, struct sd_csd *csd);
 void sd_print_ocr_info (dword ocr);
 void sd_print_cid_info (struct sd_cid cid);
 void sd_print_csd_info (struct sd_csd csd);
@@ -187,15 +303,39 @@ void sd_cid_manufacturer (struct sd_cid cid, char *man);
 
 int sd_send_command (struct ftdi_context *ftdi, struct spi_context *spi, byte *response, byte cmd, dword arg);
 int sd_read_data (struct ftdi_context *ftdi, struct spi_context *spi, byte *data, int count);
+int sd_crc_16_stream_cb (byte *data, int size, void *user);
+int sd_read_block (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, byte *data,
+                   sd_crc_hook hook, void *user);
+int sd_read_block_retry (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, byte *data,
+                         sd_crc_hook hook, void *user, int attempt);
+int sd_read_blocks (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, int count, 
+                    byte *data, sd_crc_hook hook, void *user);
+int sd_read_blocks_cb (byte *data, int size, void *user);
+int sd_write_blocks (struct ftdi_context *ftdi, struct spi_context *spi, int sd_version, dword block, int count, 
+                     byte *data);
+int sd_wait_busy (struct ftdi_context *ftdi, struct spi_context *spi);
+int sd_crc_hook_retry (struct ftdi_context *ftdi, struct spi_context *spi, dword block, int attempt, void *user);
 
 int sd_is_r1_valid (byte r1);
 int sd_is_token_valid (byte r1);
 void interpret_r7_response (byte *response, byte *r1, dword *ocr);
 
 /* Auxiliary functions */
+extern const byte crc7_table[256];
+extern const word crc16_table[8][256];
+
 byte crc_7 (byte *data, int count);
+byte crc_7_init (void);
+byte crc_7_update (byte crc, byte *data, int count);
+byte crc_7_final (byte crc);
 word crc_16 (byte *data, int count);
+word crc_16_init (void);
+word crc_16_update (word crc, byte *data, int count);
+word crc_16_final (word crc);
 dword crc (byte *data, int count, dword poly);
-void l_shift (dword *data, int count);
 
+void sd_parse_cid (byte *raw, struct sd_cid *cid);
+void sd_parse_csd (byte *raw, struct sd_csd *csd);
+void sd_register_load (struct sd_register *reg, byte *raw);
+dword sd_register_bits (struct sd_register *reg, int start_bit, int length);
 dword get_bits (byte *data, int size, int start_bit, int length);
\ No newline at end of file